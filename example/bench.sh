@@ -0,0 +1,153 @@
+#!/bin/bash
+# Benchmark matrix: iozone and fileop against the NAS directory directly
+# and through cachefs mounted over it, with every cachefs block size and
+# cache size below.  Reads are measured twice per mount: cold (empty
+# cache) and warm (second pass).  Results go to a report of
+# whitespace-separated rows followed by a comparison table.
+#
+# usage: ./bench.sh [report]   (default bench-report.txt; run "make bench" to
+#                              build cachefs, iozone and fileop first)
+# Settings come from the environment:
+#   NASDIR      the NAS to measure (default nasdir, may be an NFS mount)
+#   NAS_EMU     cachefs --nas-* options emulating a slow NAS over a local
+#               NASDIR, e.g. "--nas-latency=read:2000,meta:500 --nas-bandwidth=102400".
+#               The direct rows are then the local disk, so the report
+#               compares warm against cold instead of against the NAS.
+#   FILE_MB     iozone file size (default 64)
+#   RECORDS_KB  iozone record sizes (default "4 128")
+#   BLOCKS      cachefs block sizes (default "4096 65536")
+#   CACHES_MB   cachefs cache sizes (default "128 512").  Keep them above
+#               FILE_MB: block eviction is not implemented yet, so a full
+#               cache stalls the writer.
+#   FILEOP_F    fileop force factor, F^3 files per run (default 5)
+# Mounts on mountdir, keeps its cache in benchcache and its output in
+# bench-mount.log.  cachefs runs from a scratch directory, so its
+# cachefs.log does not overwrite the one in example/.
+
+set -e
+cd "$(dirname "$0")"
+HERE=$(pwd)
+REPORT=${1:-bench-report.txt}
+NASDIR=${NASDIR:-nasdir}
+FILE_MB=${FILE_MB:-64}
+RECORDS_KB=${RECORDS_KB:-4 128}
+BLOCKS=${BLOCKS:-4096 65536}
+CACHES_MB=${CACHES_MB:-128 512}
+FILEOP_F=${FILEOP_F:-5}
+IOZONE=iozone3_487/src/current/iozone
+FILEOP=iozone3_487/src/current/fileop
+
+for tool in ../src/cachefs $IOZONE $FILEOP; do
+  [ -x "$tool" ] || { echo "$tool is missing, run make bench" >&2; exit 1; }
+done
+mkdir -p "$NASDIR" mountdir benchcache
+NASPATH=$(cd "$NASDIR" && pwd)
+RESULTS=$(mktemp)
+FILEOPS=$(mktemp)
+SCRATCH=$(mktemp -d)
+MOUNTED=0
+trap '[ $MOUNTED = 1 ] && fusermount -u mountdir; rm -rf "$RESULTS" "$FILEOPS" "$FILEOPS.header" "$SCRATCH"' EXIT
+
+# mount blockBytes cacheMB: cachefs over NASDIR with an empty cache.
+# direct_io keeps the kernel page cache out of the numbers.
+mount_cachefs() {
+  rm -rf benchcache && mkdir benchcache
+  (cd "$SCRATCH" && "$HERE/../src/cachefs" $NAS_EMU -o direct_io $(( $2 * 1024 )) "$1" \
+     "$NASPATH" "$HERE/mountdir" "$HERE/benchcache") >> bench-mount.log 2>&1
+  MOUNTED=1
+}
+
+unmount_cachefs() {
+  fusermount -u mountdir
+  MOUNTED=0
+}
+
+# iozone label tests recordKB dir: one iozone run on dir/bench.iozone,
+# printed as "label write rewrite read reread random_read random_write"
+# (KB/s, "-" for tests not run)
+iozone_row() {
+  local label=$1 tests=$2 rec=$3 file=$4/bench.iozone
+  $IOZONE $tests -r "${rec}k" -s "${FILE_MB}m" -f "$file" -w |
+    awk -v label="$label" -v tests="$tests" -v kb=$((FILE_MB * 1024)) -v rec="$rec" '
+      $1 == kb && $2 == rec {
+        n = 3
+        w = rw = r = rr = rnd = rndw = "-"
+        if (tests ~ /-i 0/) { w = $(n++); rw = $(n++) }
+        if (tests ~ /-i 1/) { r = $(n++); rr = $(n++) }
+        if (tests ~ /-i 2/) { rnd = $(n++); rndw = $(n++) }
+        print label, w, rw, r, rr, rnd, rndw
+      }'
+}
+
+# fileop label dir: the F^3 files metadata test, one row of ops/sec
+# (its column names go to $FILEOPS.header)
+fileop_row() {
+  mkdir -p "$2/bench.fileop"
+  $FILEOP -f "$FILEOP_F" -e -d "$2/bench.fileop" |
+    awk -v label="$1" -v header="$FILEOPS.header" '
+      $1 == "." { $1 = "# target block cache_mb"; print > header }
+      $1 == "A" { $1 = label; $2 = ""; print }' | sed 's/  */ /g'
+  rm -rf "$2/bench.fileop"
+}
+
+# the matrix for one target: write the file, then read it cold and warm.
+# target block cacheMB dir, with cachefs remounted (cache emptied) before
+# the cold pass so it has to come from the NAS
+run_matrix() {
+  local target=$1 block=$2 cache=$3 dir=$4
+  for rec in $RECORDS_KB; do
+    echo "$target block=$block cache=${cache}MB record=${rec}KB" >&2
+    iozone_row "$target $block $cache $rec write" "-i 0" "$rec" "$dir" >> "$RESULTS"
+    if [ "$target" = cachefs ]; then
+      unmount_cachefs
+      mount_cachefs "$block" "$cache"
+    fi
+    iozone_row "$target $block $cache $rec cold" "-i 1 -i 2" "$rec" "$dir" >> "$RESULTS"
+    iozone_row "$target $block $cache $rec warm" "-i 1 -i 2" "$rec" "$dir" >> "$RESULTS"
+  done
+  rm -f "$dir/bench.iozone"
+  fileop_row "$target $block $cache" "$dir" >> "$FILEOPS"
+}
+
+run_matrix nas - - "$NASDIR"
+for block in $BLOCKS; do
+  for cache in $CACHES_MB; do
+    mount_cachefs "$block" "$cache"
+    run_matrix cachefs "$block" "$cache" mountdir
+    unmount_cachefs
+  done
+done
+
+{
+  echo "# cachefs benchmark $(date -u +%Y-%m-%dT%H:%M:%SZ) on $(uname -sr)"
+  echo "# nas=$NASDIR emulation=${NAS_EMU:-none} file=${FILE_MB}MB fileop_force=$FILEOP_F"
+  echo
+  echo "# iozone, KB/s"
+  echo "# target block cache_mb record_kb phase write rewrite read reread random_read random_write"
+  cat "$RESULTS"
+  echo
+  echo "# fileop, operations/s"
+  cat "$FILEOPS.header" "$FILEOPS"
+  echo
+  if [ -z "$NAS_EMU" ]; then
+    echo "# cachefs against the NAS (same record size and phase): read and random_read speedup"
+  else
+    echo "# cachefs warm against cold (the NAS is emulated): read and random_read speedup"
+  fi
+  echo "# block cache_mb record_kb phase read_x random_read_x"
+  awk -v emu="$NAS_EMU" '
+    function ratio(a, b) { return (a == "-" || b == "-" || b == 0) ? "-" : sprintf("%.2f", a / b) }
+    $1 == "nas" { nasRead[$4, $5] = $8; nasRand[$4, $5] = $10 }
+    $1 == "cachefs" && $5 == "cold" { coldRead[$2, $3, $4] = $8; coldRand[$2, $3, $4] = $10 }
+    $1 == "cachefs" && $5 != "write" { rows[++n] = $0 }
+    END {
+      for (i = 1; i <= n; i++) {
+        split(rows[i], f, " ")
+        if (emu == "")
+          print f[2], f[3], f[4], f[5], ratio(f[8], nasRead[f[4], f[5]]), ratio(f[10], nasRand[f[4], f[5]])
+        else if (f[5] == "warm")
+          print f[2], f[3], f[4], f[5], ratio(f[8], coldRead[f[2], f[3], f[4]]), ratio(f[10], coldRand[f[2], f[3], f[4]])
+      }
+    }' "$RESULTS"
+} > "$REPORT"
+echo "report written to $REPORT" >&2
@@ -0,0 +1,58 @@
+#!/bin/bash
+# Read throughput against the number of FUSE worker threads.  The mount
+# uses the low-level API (--lowlevel=1), whose reads are served by
+# --ll-workers threads, and is remounted for each worker count.  The same
+# number of readers, one per file, streams through the mount every time,
+# so the aggregate should keep rising with the workers until the cache
+# device saturates.
+#
+# usage: ./scaling.sh [fileMB] [workers ...]   (default: 64 1 2 4 8 16)
+# Mounts cachefs over the local nasdir and cachedir (make first) and
+# unmounts when done.  cachefs runs in a scratch directory so its
+# cachefs.log does not replace the one kept in example/.
+
+set -e
+cd "$(dirname "$0")"
+HERE=$(pwd)
+SIZE_MB=${1:-64}
+shift || true
+WORKERS=${*:-1 2 4 8 16}
+READERS=0
+for n in $WORKERS; do
+  [ "$n" -gt "$READERS" ] && READERS=$n
+done
+
+mkdir -p nasdir mountdir cachedir
+for i in $(seq 1 "$READERS"); do
+  [ -f nasdir/scaling.$i ] || dd if=/dev/urandom of=nasdir/scaling.$i bs=1M count="$SIZE_MB" status=none
+done
+SCRATCH=$(mktemp -d)
+trap 'fusermount -u mountdir 2>/dev/null || true; rm -rf "$SCRATCH"' EXIT
+
+# room for every file in the cache; direct_io so every read reaches a
+# worker instead of being answered from the kernel page cache
+mount_workers() {
+  (cd "$SCRATCH" && "$HERE/../src/cachefs" --lowlevel=1 --ll-workers="$1" -o direct_io \
+     $(( (READERS*SIZE_MB + 64) * 1024 )) 4096 "$HERE/nasdir" "$HERE/mountdir" "$HERE/cachedir")
+}
+
+# prints the seconds the readers take to read their files
+read_files() {
+  local start end
+  start=$(date +%s.%N)
+  for i in $(seq 1 "$READERS"); do
+    dd if=mountdir/scaling.$i of=/dev/null bs=128k status=none &
+  done
+  wait
+  end=$(date +%s.%N)
+  echo "$end - $start" | bc
+}
+
+printf "%8s %8s %10s\n" workers readers MB/s
+for w in $WORKERS; do
+  mount_workers "$w"
+  read_files > /dev/null # fills the cache on the first mount, warms descriptors after
+  secs=$(read_files)
+  fusermount -u mountdir
+  printf "%8d %8d %10.1f\n" "$w" "$READERS" "$(echo "$READERS * $SIZE_MB / $secs" | bc -l)"
+done
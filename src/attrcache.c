@@ -0,0 +1,142 @@
+/*
+  In-memory attribute cache for cachefs getattr.  See attrcache.h.
+
+  A pathTable (chained buckets behind striped mutexes) so concurrent
+  getattrs on different paths don't contend.
+*/
+#define _GNU_SOURCE // clock_gettime
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "attrcache.h"
+#include "pathtable.h"
+
+#define ATTR_BUCKETS 16384
+#define ATTR_STRIPES 64
+
+struct attrEntry {
+  struct pathEntry entry;
+  struct stat statbuf;
+  int retstat;      // 0 or -ENOENT
+  uint64_t expires; // monotonic ms
+};
+
+static struct pathTable attrTable;
+static unsigned attrTtl = 0, attrNegativeTtl = 0;
+
+static uint64_t attr_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void attr_cache_init(unsigned ttlMs, unsigned negativeTtlMs, size_t maxEntries) {
+  if (path_table_init(&attrTable, ATTR_BUCKETS, ATTR_STRIPES, maxEntries) != 0)
+    return; // stays off
+  attrTtl = ttlMs;
+  attrNegativeTtl = negativeTtlMs;
+}
+
+int attr_cache_lookup(const char *path, struct stat *statbuf) {
+  int found = 0;
+
+  if (attrTtl == 0 && attrNegativeTtl == 0)
+    return 0;
+
+  size_t bucket = path_table_bucket(&attrTable, path);
+  uint64_t now = attr_now_ms();
+
+  path_table_lock(&attrTable, bucket);
+  struct pathEntry **link = path_table_find(&attrTable, bucket, path);
+  struct attrEntry *entry = (struct attrEntry *)*link;
+  if (entry && entry->expires <= now) {
+    path_table_unlink(&attrTable, link);
+  } else if (entry && entry->retstat == 0) {
+    *statbuf = entry->statbuf;
+    found = 1;
+  } else if (entry) {
+    found = entry->retstat;
+  }
+  path_table_unlock(&attrTable, bucket);
+
+  return found;
+}
+
+void attr_cache_store(const char *path, const struct stat *statbuf, int retstat) {
+  unsigned ttl = retstat == 0 ? attrTtl : attrNegativeTtl;
+
+  // only ENOENT is worth remembering, other errors may well go away
+  if (ttl == 0 || (retstat != 0 && retstat != -ENOENT))
+    return;
+
+  size_t bucket = path_table_bucket(&attrTable, path);
+  uint64_t now = attr_now_ms();
+
+  path_table_lock(&attrTable, bucket);
+  struct attrEntry *entry = NULL;
+  for (struct pathEntry **link = &attrTable.buckets[bucket]; *link;) {
+    struct attrEntry *cur = (struct attrEntry *)*link;
+    if (strcmp(cur->entry.path, path) == 0) {
+      entry = cur;
+      link = &cur->entry.next;
+    } else if (cur->expires <= now) {
+      // prune as we go, this is what keeps the table bounded
+      path_table_unlink(&attrTable, link);
+    } else {
+      link = &cur->entry.next;
+    }
+  }
+
+  if (entry == NULL)
+    entry = (struct attrEntry *)path_table_insert(&attrTable, bucket, path, sizeof(*entry));
+  if (entry) {
+    if (retstat == 0)
+      entry->statbuf = *statbuf;
+    entry->retstat = retstat;
+    entry->expires = now + ttl;
+  }
+  path_table_unlock(&attrTable, bucket);
+}
+
+void attr_cache_invalidate(const char *path) {
+  path_table_remove(&attrTable, path);
+}
+
+void attr_cache_invalidate_entry(const char *path) {
+  char parent[PATH_MAX];
+
+  attr_cache_invalidate(path);
+
+  strncpy(parent, path, PATH_MAX - 1);
+  parent[PATH_MAX - 1] = '\0';
+  char *slash = strrchr(parent, '/');
+  if (slash == NULL)
+    return;
+  if (slash == parent)
+    slash[1] = '\0'; // parent is the root
+  else
+    *slash = '\0';
+  attr_cache_invalidate(parent);
+}
+
+void attr_cache_invalidate_tree(const char *path) {
+  path_table_remove_tree(&attrTable, path);
+}
+
+void attr_cache_foreach(void (*visit)(const char *path, const struct stat *statbuf, void *arg), void *arg) {
+  if (attrTable.buckets == NULL)
+    return;
+
+  for (size_t bucket = 0; bucket < ATTR_BUCKETS; bucket++) {
+    path_table_lock(&attrTable, bucket);
+    for (struct pathEntry *cur = attrTable.buckets[bucket]; cur; cur = cur->next) {
+      struct attrEntry *entry = (struct attrEntry *)cur;
+      if (entry->retstat == 0)
+        visit(cur->path, &entry->statbuf, arg);
+    }
+    path_table_unlock(&attrTable, bucket);
+  }
+}
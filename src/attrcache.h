@@ -0,0 +1,33 @@
+/*
+  In-memory attribute cache for cachefs getattr.
+
+  Keyed by the path fuse hands us.  Positive entries hold the NAS
+  lstat result for ttl ms, negative entries remember an ENOENT for
+  negativeTtl ms.  Anything we change locally is invalidated by the
+  operation that changed it.
+*/
+
+#ifndef _ATTRCACHE_H_
+#define _ATTRCACHE_H_
+
+#include <sys/stat.h>
+
+// ttl 0 turns the positive cache off, negativeTtl 0 the negative one
+void attr_cache_init(unsigned ttlMs, unsigned negativeTtlMs, size_t maxEntries);
+
+// 1 = hit (statbuf filled), -ENOENT = negative hit, 0 = miss
+int attr_cache_lookup(const char *path, struct stat *statbuf);
+// remember an lstat result: retstat 0 with statbuf, or -ENOENT
+void attr_cache_store(const char *path, const struct stat *statbuf, int retstat);
+
+void attr_cache_invalidate(const char *path);
+// path itself and its parent directory (whose mtime/nlink just changed)
+void attr_cache_invalidate_entry(const char *path);
+// everything at or below path, for renames of directories
+void attr_cache_invalidate_tree(const char *path);
+
+// walk the positive entries still in the table (expired or not), e.g.
+// to persist them at unmount
+void attr_cache_foreach(void (*visit)(const char *path, const struct stat *statbuf, void *arg), void *arg);
+
+#endif
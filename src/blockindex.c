@@ -0,0 +1,153 @@
+/*
+  In-memory block index for cachefs.  See blockindex.h.
+
+  A hash table of files, each with a bitmap of cached blocks.  Readers
+  walk bucket chains and test bits with acquire loads inside an epoch.
+  Writers hold blockWriteLock: bits are set and cleared in place with
+  atomic or/and, a bitmap that has to grow is copied and swapped in,
+  and files are unlinked from their chain before being retired.
+*/
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockindex.h"
+#include "epoch.h"
+#include "pathtable.h"
+
+#define BLOCK_BUCKETS 65536
+
+struct blockMap {
+  size_t words;
+  uint64_t bits[];
+};
+
+struct blockFile {
+  char *name;
+  struct blockMap *map;
+  struct blockFile *next;
+};
+
+static struct blockFile *blockBuckets[BLOCK_BUCKETS];
+static pthread_mutex_t blockWriteLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t blockSize = 4096;
+
+static size_t block_hash(const char *name) {
+  return path_hash(name) % BLOCK_BUCKETS;
+}
+
+static struct blockFile *block_find(const char *name) {
+  struct blockFile *file = __atomic_load_n(&blockBuckets[block_hash(name)], __ATOMIC_ACQUIRE);
+  while (file && strcmp(file->name, name) != 0)
+    file = __atomic_load_n(&file->next, __ATOMIC_ACQUIRE);
+  return file;
+}
+
+static void block_file_release(void *ptr) {
+  struct blockFile *file = ptr;
+  free(file->name);
+  free(file->map);
+  free(file);
+}
+
+// with blockWriteLock held: unlink file from the chain at link
+static void block_unlink(struct blockFile **link, struct blockFile *file) {
+  __atomic_store_n(link, file->next, __ATOMIC_RELEASE);
+  epoch_retire(file, block_file_release);
+}
+
+void block_index_init(size_t size) {
+  if (size)
+    blockSize = size;
+}
+
+int block_index_present(const char *name, off_t offset, size_t size) {
+  uint64_t first = offset / blockSize;
+  uint64_t last = size ? (offset + size - 1) / blockSize : first;
+  int present = 0;
+
+  epoch_enter();
+  struct blockFile *file = block_find(name);
+  if (file) {
+    struct blockMap *map = __atomic_load_n(&file->map, __ATOMIC_ACQUIRE);
+    present = map && last / 64 < map->words;
+    for (uint64_t block = first; present && block <= last; block++)
+      present = (__atomic_load_n(&map->bits[block / 64], __ATOMIC_ACQUIRE) >> (block % 64)) & 1;
+  }
+  epoch_exit();
+
+  return present;
+}
+
+void block_index_add(const char *name, off_t offset, size_t size) {
+  uint64_t first = offset / blockSize;
+  uint64_t last = size ? (offset + size - 1) / blockSize : first;
+
+  pthread_mutex_lock(&blockWriteLock);
+  struct blockFile *file = block_find(name);
+  if (file == NULL) {
+    size_t bucket = block_hash(name);
+    file = calloc(1, sizeof(*file));
+    file->name = strdup(name);
+    file->next = blockBuckets[bucket];
+    __atomic_store_n(&blockBuckets[bucket], file, __ATOMIC_RELEASE);
+  }
+
+  struct blockMap *map = file->map;
+  if (map == NULL || last / 64 >= map->words) {
+    size_t words = map ? map->words : 1;
+    while (words <= last / 64)
+      words *= 2;
+    struct blockMap *grown = calloc(1, sizeof(*grown) + words * sizeof(uint64_t));
+    grown->words = words;
+    if (map)
+      memcpy(grown->bits, map->bits, map->words * sizeof(uint64_t));
+    __atomic_store_n(&file->map, grown, __ATOMIC_RELEASE);
+    if (map)
+      epoch_retire(map, free);
+    map = grown;
+  }
+
+  for (uint64_t block = first; block <= last; block++)
+    __atomic_fetch_or(&map->bits[block / 64], 1ULL << (block % 64), __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&blockWriteLock);
+}
+
+void block_index_remove(const char *name, off_t offset, size_t size) {
+  uint64_t first = offset / blockSize;
+  uint64_t last = size ? (offset + size - 1) / blockSize : first;
+
+  pthread_mutex_lock(&blockWriteLock);
+  struct blockFile *file = block_find(name);
+  struct blockMap *map = file ? file->map : NULL;
+  for (uint64_t block = first; map && block <= last && block / 64 < map->words; block++)
+    __atomic_fetch_and(&map->bits[block / 64], ~(1ULL << (block % 64)), __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&blockWriteLock);
+}
+
+void block_index_drop(const char *name) {
+  pthread_mutex_lock(&blockWriteLock);
+  for (struct blockFile **link = &blockBuckets[block_hash(name)]; *link; link = &(*link)->next)
+    if (strcmp((*link)->name, name) == 0) {
+      block_unlink(link, *link);
+      break;
+    }
+  pthread_mutex_unlock(&blockWriteLock);
+}
+
+void block_index_drop_prefix(const char *prefix) {
+  size_t len = strlen(prefix);
+
+  pthread_mutex_lock(&blockWriteLock);
+  for (size_t bucket = 0; bucket < BLOCK_BUCKETS; bucket++) {
+    struct blockFile **link = &blockBuckets[bucket];
+    while (*link) {
+      if (strncmp((*link)->name, prefix, len) == 0)
+        block_unlink(link, *link);
+      else
+        link = &(*link)->next;
+    }
+  }
+  pthread_mutex_unlock(&blockWriteLock);
+}
@@ -0,0 +1,32 @@
+/*
+  In-memory index of the blocks held in the cache, for cfs_read.
+
+  The metadata database stays the record of what is cached; this is a
+  copy of the blocks we have seen there or written since mount, kept so
+  that a read of fully cached blocks needs no database query and no
+  lock.  Readers never block; writers (fills, block and file drops)
+  serialize among themselves and publish with atomic stores, and
+  replaced memory is reclaimed through epoch.h.
+
+  Files are keyed by cache file name.  A block must only be added once
+  its data is in the cache file and must be removed before the data
+  goes away.
+*/
+
+#ifndef _BLOCKINDEX_H_
+#define _BLOCKINDEX_H_
+
+#include <sys/types.h>
+
+void block_index_init(size_t blockSize);
+
+// 1 = every block covering [offset, offset+size) of name is cached
+int block_index_present(const char *name, off_t offset, size_t size);
+
+void block_index_add(const char *name, off_t offset, size_t size);
+void block_index_remove(const char *name, off_t offset, size_t size);
+// forget name entirely, or every name starting with prefix
+void block_index_drop(const char *name);
+void block_index_drop_prefix(const char *prefix);
+
+#endif
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <fuse.h>
 
@@ -6,8 +7,25 @@ size_t block_size;
 
 struct dualFileHandle
 {
-  uint64_t nasFH;
+  uint64_t nasFH;//NO_NAS_FH until a read-only handle first misses the cache
+  int nasFlags;//flags for opening nasFH
   uint64_t cacheFH;
+  struct gatherBuffer *gather;//small writes waiting to go to the NAS, NULL if not gathering
+  pthread_mutex_t streamLock;//writes on one handle may run concurrently
+  off_t streamNext;//where the current run of sequential writes continues
+  size_t streamBytes;//length of that run, for streaming write detection
+  int bypassed;//a write skipped the cache, record the NAS mtime at release
+  struct openFile *openFile;//keeps the cache file from being dropped under us, see openfile.h
+};
+
+#define NO_NAS_FH ((uint64_t)-1)
+
+//Which written blocks are admitted to the cache
+enum writePolicy
+{
+  WRITE_ALLOCATE,//every written block (the default)
+  WRITE_NO_ALLOCATE,//none, cached copies of written blocks are dropped
+  WRITE_ALLOCATE_IF_CACHED//only blocks that are already cached, updated in place
 };
 
 struct fuse_file_info openCacheFile;
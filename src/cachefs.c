@@ -18,8 +18,9 @@
   This might be called a no-op filesystem:  it doesn't impose
   filesystem semantics on top of any other existing structure.  It
   simply reports the requests that come in, and passes them to an
-  underlying filesystem.  The information is saved in a logfile named
-  cfsfs.log, in the directory from which you run cfsfs.
+  underlying filesystem.  The information is saved in a binary logfile
+  named cachefs.log, in the directory from which you run cachefs; print
+  it with tools/logdump.
 
   Refernces:
   pathToFileName - https://stackoverflow.com/questions/5457608/how-to-remove-the-character-at-a-given-index-from-a-string-in-c "Fabio Cabral"
@@ -49,10 +50,31 @@
 
 #include <time.h>
 #include "log.h"
+#include "attrcache.h"
+#include "blockindex.h"
+#include "control.h"
 #include "cacheHelp.h"
+#include "cachefs.h"
+#include "dircache.h"
+#include "fdcache.h"
+#include "gather.h"
+#include "journal.h"
+#include "latency.h"
 #include "metadata/meta.h"
+#include "nasemu.h"
+#include "openfile.h"
+#include "pin.h"
+#include "rangelock.h"
+#include "revalidate.h"
+#include "slowlog.h"
+#include "stats.h"
+#include "trace.h"
+#include "traceformat.h"
+#include "virtual.h"
+#include "warmup.h"
 
 sqlite3 *metaDataBase;
+struct cfs_state *cfs_global_state;
 
 //  All the paths I see are relative to the root of the mounted
 //  filesystem.  In order to get to the underlying filesystem, I need to
@@ -77,7 +99,8 @@ static void cfs_fullCachePath(char cachePath[PATH_MAX], const char *path) {
           CFS_DATA->cachedir, path, cachePath);
 }
 
-static void cfs_pathToFileName(char pathFileName[PATH_MAX], const char *path) {
+//Cache files live flat in the cache directory: drop every '/' but the leading one
+static void cfs_flattenPath(char pathFileName[PATH_MAX], const char *path) {
   strcpy(pathFileName, path);
 
   char *src, *dst;
@@ -87,11 +110,53 @@ static void cfs_pathToFileName(char pathFileName[PATH_MAX], const char *path) {
     if (*dst != '/' || src == pathFileName) dst++;
   }
   *dst = '\0';
+}
+
+static void cfs_pathToFileName(char pathFileName[PATH_MAX], const char *path) {
+  cfs_flattenPath(pathFileName, path);
 
   log_msg("    cfs_pathToFileName: path = \"%s\", fileName = \"%s\"\n",
           path, pathFileName);
 }
 
+//Every name an open file goes by.  The low-level frontend keeps these in
+//its inode table (inode.c calls this under its lock, hence no logging)
+//so file operations need not rebuild them on every request.
+void cfs_nameFile(const char *path, char nasPath[PATH_MAX], char cacheName[PATH_MAX], char cachePath[PATH_MAX]) {
+  snprintf(nasPath, PATH_MAX, "%s%s", CFS_DATA->nasdir, path);
+  cfs_flattenPath(cacheName, path);
+  snprintf(cachePath, PATH_MAX, "%s%s", CFS_DATA->cachedir, cacheName);
+}
+
+void cfs_fileNames(struct cfs_fileNames *names, const char *path) {
+  strcpy(names->path, path);
+  cfs_nameFile(path, names->nasPath, names->cacheName, names->cachePath);
+  log_msg("    cfs_fileNames: path = \"%s\", nasPath = \"%s\", cachePath = \"%s\"\n",
+          path, names->nasPath, names->cachePath);
+}
+
+//Directory part of path ("/" for entries in the root)
+static void cfs_parentPath(char parent[PATH_MAX], const char *path) {
+  strcpy(parent, path);
+
+  char *slash = strrchr(parent, '/');
+  if (slash == parent || slash == NULL)
+    strcpy(parent, "/");
+  else
+    *slash = '\0';
+}
+
+//A name was created in or removed from its parent directory: drop what the
+//attribute and directory caches know about the name and the parent
+static void cfs_invalidateEntry(const char *path) {
+  char parent[PATH_MAX];
+
+  attr_cache_invalidate_entry(path);
+  revalidate_invalidate(path);
+  cfs_parentPath(parent, path);
+  dir_cache_invalidate(parent);
+}
+
 ///////////////////////////////////////////////////////////
 //
 // Prototypes for all these functions, and the C-style comments,
@@ -104,19 +169,78 @@ static void cfs_pathToFileName(char pathFileName[PATH_MAX], const char *path) {
  * mount option is given.
  */
 int cfs_getNASattr(const char *path, struct stat *statbuf) {
+  if (virtual_path(path))
+    return virtual_getattr(path, statbuf);
+  LATENCY_OP(LAT_GETATTR, path);
+
   int retstat = 0;
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_getNASattr(path=\"%s\", statbuf=0x%08x)\n", path, statbuf);
   cfs_fullNasPath(nasPath, path);
+  gather_flush_path(path);//size and mtime have to include writes still being gathered
 
-  retstat = log_syscall("lstat", lstat(nasPath, statbuf), 0);
+  uint64_t phaseStart = latency_phase_begin();
+  retstat = log_syscall("lstat", NAS_EMU(NAS_META, lstat(nasPath, statbuf)), 0);
+  latency_phase_end(LAT_NAS_IO, phaseStart);
 
   log_stat(statbuf);
 
   return retstat;
 }
 
+//Can we tell path does not exist without asking the NAS?  It doesn't if
+//its parent is known to be missing, or if a fresh listing of the parent
+//does not have it.
+static int cfs_knownMissing(const char *path) {
+  char parent[PATH_MAX];
+  struct stat parentStat;
+
+  if (strcmp(path, "/") == 0)
+    return 0;
+  cfs_parentPath(parent, path);
+  if (attr_cache_lookup(parent, &parentStat) == -ENOENT)
+    return 1;
+
+  return dir_cache_lookup(parent, strrchr(path, '/') + 1) == 0;
+}
+
+/** getattr entry point: served from the attribute cache when we can,
+ *  cfs_getNASattr otherwise.  Internal users that need the NAS's view
+ *  right now (cfs_open revalidation) keep calling cfs_getNASattr.
+ */
+int cfs_getattr(const char *path, struct stat *statbuf) {
+  if (virtual_path(path))
+    return virtual_getattr(path, statbuf);
+  LATENCY_OP(LAT_GETATTR, path);
+
+  int retstat = attr_cache_lookup(path, statbuf);
+
+  if (retstat == 1) {
+    log_msg("\ncfs_getattr(path=\"%s\") attribute cache hit\n", path);
+    return 0;
+  }
+  if (retstat < 0) {
+    log_msg("\ncfs_getattr(path=\"%s\") negative attribute cache hit\n", path);
+    return retstat;
+  }
+  if (cfs_knownMissing(path)) {
+    log_msg("\ncfs_getattr(path=\"%s\") missing from cached parent\n", path);
+    attr_cache_store(path, NULL, -ENOENT);//next probe stays in memory
+    return -ENOENT;
+  }
+
+  retstat = cfs_getNASattr(path, statbuf);
+  attr_cache_store(path, statbuf, retstat);
+  if (retstat == -ENOENT) {
+    char parent[PATH_MAX];
+    cfs_parentPath(parent, path);
+    dir_cache_note_missing(parent);//probes tend to come in runs, answer the next ones from the listing
+  }
+
+  return retstat;
+}
+
 int cfs_getCacheattr(const char *path, struct stat *statbuf) {
   int retstat = 0;
   char cacheFileName[PATH_MAX], cachePath[PATH_MAX];
@@ -152,6 +276,7 @@ char* formatdate(char* str, time_t val)
 // less than the size passed to cfs_readlink()
 // cfs_readlink() code by Bernardo F Costa (thanks!)
 int cfs_readlink(const char *path, char *link, size_t size) {
+  LATENCY_OP(LAT_READLINK, path);
   int retstat;
   char nasPath[PATH_MAX];
 
@@ -159,7 +284,7 @@ int cfs_readlink(const char *path, char *link, size_t size) {
           size);
   cfs_fullNasPath(nasPath, path);
 
-  retstat = log_syscall("readlink", readlink(nasPath, link, size - 1), 0);
+  retstat = log_syscall("readlink", NAS_EMU(NAS_META, readlink(nasPath, link, size - 1)), 0);
   if (retstat >= 0) {
     link[retstat] = '\0';
     retstat = 0;
@@ -176,6 +301,10 @@ int cfs_readlink(const char *path, char *link, size_t size) {
  */
 // shouldn't that comment be "if" there is no.... ?
 int cfs_mknod(const char *path, mode_t mode, dev_t dev) {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_MKNOD, path);
+
   int retstat;
   char nasPath[PATH_MAX];
 
@@ -189,29 +318,42 @@ int cfs_mknod(const char *path, mode_t mode, dev_t dev) {
   // that.
   if (S_ISREG(mode)) {
     retstat =
-        log_syscall("open", open(nasPath, O_CREAT | O_EXCL | O_WRONLY, mode), 0);
+        log_syscall("open", NAS_EMU(NAS_META, open(nasPath, O_CREAT | O_EXCL | O_WRONLY, mode)), 0);
     if (retstat >= 0)
       retstat = log_syscall("close", close(retstat), 0);
   } else if (S_ISFIFO(mode))
-    retstat = log_syscall("mkfifo", mkfifo(nasPath, mode), 0);
+    retstat = log_syscall("mkfifo", NAS_EMU(NAS_META, mkfifo(nasPath, mode)), 0);
   else
-    retstat = log_syscall("mknod", mknod(nasPath, mode, dev), 0);
+    retstat = log_syscall("mknod", NAS_EMU(NAS_META, mknod(nasPath, mode, dev)), 0);
+
+  cfs_invalidateEntry(path);
 
   return retstat;
 }
 
 /** Create a directory */
 int cfs_mkdir(const char *path, mode_t mode) {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_MKDIR, path);
+
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_mkdir(path=\"%s\", mode=0%3o)\n", path, mode);
   cfs_fullNasPath(nasPath, path);
 
-  return log_syscall("mkdir", mkdir(nasPath, mode), 0);
+  int retstat = log_syscall("mkdir", NAS_EMU(NAS_META, mkdir(nasPath, mode)), 0);
+  cfs_invalidateEntry(path);
+
+  return retstat;
 }
 
 /** Remove a file */
 int cfs_unlink(const char *path) {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_UNLINK, path);
+
   char nasPath[PATH_MAX];
   char cacheFileName[PATH_MAX];
   char cachePath[PATH_MAX];
@@ -221,19 +363,45 @@ int cfs_unlink(const char *path) {
   cfs_fullNasPath(nasPath, path);
   log_msg("cfs_unlink(nasPath=\"%s\", cachePath=\"%s\")\n", nasPath, cachePath);
 
-  delete_file(metaDataBase, cacheFileName);//remove file from metadata file
+  gather_flush_path(path);
+  int checkpoint = journal_checkpoint();//journal records are by path, don't let a replay resurrect this file's writes
+  if (checkpoint < 0)
+    return checkpoint;
+
+  struct openFile *openFile = open_file_lock(cacheFileName);//not while a cfs_open is checking or creating the copy
+  block_index_drop(cacheFileName);
+  delete_file(get_thread_db(), cacheFileName);//remove file from metadata file
   log_syscall("Cache unlink", unlink(cachePath), 0);
-  return log_syscall("NAS unlink", unlink(nasPath), 0);
+  if(openFile)
+    open_file_unlock(openFile);
+  int retstat = log_syscall("NAS unlink", NAS_EMU(NAS_META, unlink(nasPath)), 0);
+  if (retstat == 0 && pin_remove(path) == 0)
+    delete_pin(get_thread_db(), path);
+  cfs_invalidateEntry(path);
+  fd_cache_invalidate(cachePath);
+  fd_cache_invalidate(nasPath);
+
+  return retstat;
 }
 
 /** Remove a directory */
 int cfs_rmdir(const char *path) {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_RMDIR, path);
+
   char nasPath[PATH_MAX];
 
   log_msg("cfs_rmdir(path=\"%s\")\n", path);
   cfs_fullNasPath(nasPath, path);
 
-  return log_syscall("rmdir", rmdir(nasPath), 0);
+  int retstat = log_syscall("rmdir", NAS_EMU(NAS_META, rmdir(nasPath)), 0);
+  if (retstat == 0 && pin_remove(path) == 0)
+    delete_pin(get_thread_db(), path);
+  cfs_invalidateEntry(path);
+  dir_cache_invalidate_tree(path);
+
+  return retstat;
 }
 
 /** Create a symbolic link */
@@ -242,6 +410,10 @@ int cfs_rmdir(const char *path) {
 // while the 'link' is the link itself.  So we need to leave the path
 // unaltered, but insert the link into the mounted directory.
 int cfs_symlink(const char *path, const char *link) {
+  if (virtual_path(link))
+    return -EPERM;
+  LATENCY_OP(LAT_SYMLINK, link);
+
   char nasLink[PATH_MAX];
   char cacheFileName[PATH_MAX], cachePath[PATH_MAX];
   char cacheLinkName[PATH_MAX], cacheLinkPath[PATH_MAX];
@@ -255,12 +427,22 @@ int cfs_symlink(const char *path, const char *link) {
   cfs_fullCachePath(cacheLinkPath, cacheLinkName);
 
   log_syscall("Cache symlink", symlink(cachePath, cacheLinkPath), 0);
-  return log_syscall("NAS symlink", symlink(path, nasLink), 0);
+  int retstat = log_syscall("NAS symlink", NAS_EMU(NAS_META, symlink(path, nasLink)), 0);
+  cfs_invalidateEntry(link);
+
+  return retstat;
 }
 
+// pins follow renames, see the Pins section below
+static void cfs_movePin(const char *from, const char *to, uint64_t bytes);
+
 /** Rename a file */
 // both path and newpath are fs-relative
 int cfs_rename(const char *path, const char *newpath) {
+  if (virtual_path(path) || virtual_path(newpath))
+    return -EPERM;
+  LATENCY_OP(LAT_RENAME, path);
+
   char nasPath[PATH_MAX], nasNewPath[PATH_MAX];
   char cacheFileName[PATH_MAX], cachePath[PATH_MAX];
   char cacheNewName[PATH_MAX], cacheNewPath[PATH_MAX];
@@ -275,12 +457,42 @@ int cfs_rename(const char *path, const char *newpath) {
   cfs_fullCachePath(cachePath, cacheFileName);
   cfs_fullCachePath(cacheNewPath, cacheNewName);
 
-  log_syscall("Cache rename", rename(cachePath, cacheNewPath), 0);
-  return log_syscall("NAS rename", rename(nasPath, nasNewPath), 0);
+  gather_flush_path(path);
+  int checkpoint = journal_checkpoint();//journal records are by path, they would replay to the old name
+  if (checkpoint < 0)
+    return checkpoint;
+  block_index_drop_prefix(cacheFileName);//flattened names, so a plain prefix match catches the tree
+  block_index_drop_prefix(cacheNewName);
+  if(log_syscall("Cache rename", rename(cachePath, cacheNewPath), 0) == 0)
+    open_file_rename(cacheFileName, cacheNewName);//handles on it keep it from being dropped under its new name
+  int retstat = log_syscall("NAS rename", NAS_EMU(NAS_META, rename(nasPath, nasNewPath)), 0);
+  if(retstat == 0)
+  {
+    gather_rename(path, newpath);//handles still open keep gathering, now under the new name
+    pin_rename(path, newpath, cfs_movePin);
+  }
+  attr_cache_invalidate_tree(path);//may be a directory, everything under it moved too
+  attr_cache_invalidate_tree(newpath);
+  dir_cache_invalidate_tree(path);
+  dir_cache_invalidate_tree(newpath);
+  revalidate_invalidate_tree(path);
+  revalidate_invalidate_tree(newpath);
+  fd_cache_invalidate_tree(nasPath);
+  fd_cache_invalidate_tree(nasNewPath);
+  fd_cache_invalidate(cachePath);//only this cache file moved, the flattened ones of anything below keep their names
+  fd_cache_invalidate(cacheNewPath);
+  cfs_invalidateEntry(path);
+  cfs_invalidateEntry(newpath);
+
+  return retstat;
 }
 
 /** Create a hard link to a file */
 int cfs_link(const char *path, const char *newpath) {
+  if (virtual_path(path) || virtual_path(newpath))
+    return -EPERM;
+  LATENCY_OP(LAT_LINK, path);
+
   char nasPath[PATH_MAX], nasLinkPath[PATH_MAX];
   char cacheFileName[PATH_MAX], cacheLinkName[PATH_MAX];
   char cachePath[PATH_MAX], cacheLinkPath[PATH_MAX];
@@ -297,33 +509,56 @@ int cfs_link(const char *path, const char *newpath) {
   log_msg("\ncfs_link(path=\"%s\", newpath=\"%s\")\nCache link: \"%s\"\n", path, newpath, cacheLinkPath);
 
   log_syscall("Cache link", link(cachePath, cacheLinkPath), 0);
-  return log_syscall("NAS link", link(nasPath, nasLinkPath), 0);
+  int retstat = log_syscall("NAS link", NAS_EMU(NAS_META, link(nasPath, nasLinkPath)), 0);
+  attr_cache_invalidate(path);//st_nlink went up
+  cfs_invalidateEntry(newpath);
+
+  return retstat;
 }
 
 /** Change the permission bits of a file */
 int cfs_chmod(const char *path, mode_t mode) {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_CHMOD, path);
+
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_chmod(nasPath=\"%s\", mode=0%03o)\n", path, mode);
   cfs_fullNasPath(nasPath, path);
 
-  return log_syscall("chmod", chmod(nasPath, mode), 0);
+  int retstat = log_syscall("chmod", NAS_EMU(NAS_META, chmod(nasPath, mode)), 0);
+  attr_cache_invalidate(path);
+
+  return retstat;
 }
 
 /** Change the owner and group of a file */
 int cfs_chown(const char *path, uid_t uid, gid_t gid)
 
 {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_CHOWN, path);
+
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
   cfs_fullNasPath(nasPath, path);
 
-  return log_syscall("chown", chown(nasPath, uid, gid), 0);
+  int retstat = log_syscall("chown", NAS_EMU(NAS_META, chown(nasPath, uid, gid)), 0);
+  attr_cache_invalidate(path);
+
+  return retstat;
 }
 
 /** Change the size of a file */
 int cfs_truncate(const char *path, off_t newsize) {
+  if (virtual_path(path))
+    return 0;//"> /.cachefs/stats" truncates before it writes
+  LATENCY_OP(LAT_TRUNCATE, path);
+  latency_set_range(newsize, 0);
+
   char nasPath[PATH_MAX];
   char cacheFileName[PATH_MAX];
   char cachePath[PATH_MAX];
@@ -332,13 +567,26 @@ int cfs_truncate(const char *path, off_t newsize) {
   log_msg("\ncfs_truncate(path=\"%s\", cachePath=\"%s\", newsize=%lld)\n", path, cachePath, newsize);
   cfs_fullNasPath(nasPath, path);
 
+  gather_flush_path(path);
+  int checkpoint = journal_checkpoint();//a replayed older write must not land after the truncate
+  if (checkpoint < 0)
+    return checkpoint;
+  block_index_drop(cacheFileName);//blocks past newsize read back as zeros now, let the database answer
   log_syscall("Cache truncate", truncate(cachePath, newsize),0);
-  return log_syscall("NAS truncate", truncate(nasPath, newsize), 0);
+  int retstat = log_syscall("NAS truncate", NAS_EMU(NAS_META, truncate(nasPath, newsize)), 0);
+  attr_cache_invalidate(path);
+  revalidate_invalidate(path);
+
+  return retstat;
 }
 
 /** Change the access and/or modification times of a file */
 /* note -- I'll want to change this as soon as 2.6 is in debian testing */
 int cfs_utime(const char *path, struct utimbuf *ubuf) {
+  if (virtual_path(path))
+    return 0;
+  LATENCY_OP(LAT_UTIME, path);
+
   char nasPath[PATH_MAX];
   char cacheFileName[PATH_MAX];
   char cachePath[PATH_MAX];
@@ -350,7 +598,11 @@ int cfs_utime(const char *path, struct utimbuf *ubuf) {
   log_msg("\ncfs_utime(path=\"%s\", CachePath=\"%s\", ubuf=0x%08x)\n", path, cachePath, ubuf);
   
   log_syscall("Cache utime", utime(cachePath, ubuf), 0);
-  return log_syscall("NAS utime", utime(nasPath, ubuf), 0);
+  int retstat = log_syscall("NAS utime", NAS_EMU(NAS_META, utime(nasPath, ubuf)), 0);
+  attr_cache_invalidate(path);
+  revalidate_invalidate(path);
+
+  return retstat;
 }
 
 
@@ -380,6 +632,34 @@ int cfs_mkCacheNod(const char *cachePath, mode_t mode, dev_t dev)
   return retstat;
 }
 
+//The NAS file is gone: forget our cached copy of it, unless handles
+//still have it open (the next open after them tries again)
+static void cfs_dropCacheFile(const char *path)
+{
+  char cacheFileName[PATH_MAX], cachePath[PATH_MAX];
+
+  revalidate_invalidate(path);
+  cfs_pathToFileName(cacheFileName, path);
+  cfs_fullCachePath(cachePath, cacheFileName);
+  struct openFile *openFile = open_file_lock(cacheFileName);
+  if(openFile == NULL || open_file_busy(openFile))
+  {
+    if(openFile)
+      open_file_unlock(openFile);
+    return;
+  }
+  fd_cache_invalidate(cachePath);
+  block_index_drop(cacheFileName);
+  if(is_file_in_cache(get_thread_db(), cacheFileName))
+  {
+    log_msg("\nCache file not present in NAS, deleting cache file...\n");
+    stats_inc(STAT_INVALIDATIONS);
+    delete_file(get_thread_db(), cacheFileName);//remove file from metadata file
+    log_syscall("Cache unlink", unlink(cachePath), 0);
+  }
+  open_file_unlock(openFile);
+}
+
 /** File open operation
  *
  * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
@@ -391,16 +671,25 @@ int cfs_mkCacheNod(const char *cachePath, mode_t mode, dev_t dev)
  * Changed in version 2.2
  */
 int cfs_open(const char *path, struct fuse_file_info *fi) {
+  struct cfs_fileNames names;
+  cfs_fileNames(&names, path);
+  return cfs_openNamed(&names, fi);
+}
+
+//The same, for a caller that already has the file's names
+int cfs_openNamed(struct cfs_fileNames *names, struct fuse_file_info *fi) {
+  const char *path = names->path;
+  if (virtual_path(path))
+    return virtual_open(path, fi);
+  LATENCY_OP(LAT_OPEN, path);
+
   int retstat = 0;
-  int nasFileDescriptor;
+  int nasFileDescriptor = -1;
+  int nasFlags = fi->flags;
   int cacheFileDescriptor;
-  char nasPath[PATH_MAX];
-  char cachePath[PATH_MAX];
-  char cacheFileName[PATH_MAX];
-
-  cfs_fullNasPath(nasPath, path);
-  cfs_pathToFileName(cacheFileName, path);//convert path into the name of the file in our cache by removing "\"
-  cfs_fullCachePath(cachePath, cacheFileName);
+  char *nasPath = names->nasPath;
+  char *cachePath = names->cachePath;
+  char *cacheFileName = names->cacheName;//the name of the file in our cache, path without its inner "/"
 
   log_msg("\ncfs_open(path=\"%s\", fi=0x%08x)\n, flags= %d", path, fi, fi->flags);
   log_msg("\ncfs_open(flag bitwise: %d)\n", fi->flags & 0x3);
@@ -411,47 +700,80 @@ int cfs_open(const char *path, struct fuse_file_info *fi) {
   //00- RD 01-WOnly 10-RW
   if((fi->flags & 0x3) == 1)//if write only, chang to read write
   {
-    int switchedFlag = fi->flags;
-    switchedFlag = switchedFlag & 8589934588;
-    switchedFlag = switchedFlag | 2;
-    nasFileDescriptor = log_syscall("NAS open", open(nasPath, switchedFlag), 0);
+    nasFlags = nasFlags & 8589934588;
+    nasFlags = nasFlags | 2;
   }
-  else
+  //Read-only handles open the NAS file lazily on their first cache miss
+  //(cfs_nasFH), so a fully cached file is served without touching the NAS.
+  //Writers always need it, and gather holds on to the descriptor.
+  if((fi->flags & O_ACCMODE) != O_RDONLY)
   {
-    nasFileDescriptor = log_syscall("NAS open", open(nasPath, fi->flags), 0);//
+    uint64_t phaseStart = latency_phase_begin();
+    nasFileDescriptor = log_syscall("NAS open", NAS_EMU(NAS_OPEN, open(nasPath, nasFlags)), 0);
+    latency_phase_end(LAT_NAS_IO, phaseStart);
+    if(nasFileDescriptor < 0)
+    {
+      if(nasFileDescriptor == -ENOENT)
+        cfs_dropCacheFile(path);
+      return nasFileDescriptor;
+    }
   }
 
-
   bool presentInCache = false;
-  presentInCache = is_file_in_cache(metaDataBase, cacheFileName);
+  struct stat nasFileInfo;
 
-  if(nasFileDescriptor < 0)//file was not present on remote server,if in local, delete 
+  //nobody drops or recreates the cached copy until this handle holds it
+  struct openFile *openFile = open_file_lock(cacheFileName);
+  if(openFile == NULL)
   {
-    if(presentInCache)
-    {
-      log_msg("\nCache file not present in NAS, deleting cache file...\n");
-      delete_file(metaDataBase, cacheFileName);//remove file from metadata file
-      log_syscall("Cache unlink", unlink(cachePath), 0);
-      presentInCache = false;
-    }    
-    return nasFileDescriptor;
+    if(nasFileDescriptor >= 0)
+      close(nasFileDescriptor);
+    return -ENOMEM;
   }
-  
 
-  struct stat nasFileInfo;
-  cfs_getNASattr(path, &nasFileInfo);
+  bool trusted = revalidate_fresh(path, &nasFileInfo);
+  if(trusted)//checked recently enough for the revalidation mode, see revalidate.h
+  {
+    log_msg("\nCache copy validated recently, skipping revalidation\n");
+    presentInCache = true;
+  }
+  else
+  {
+    stats_inc(STAT_REVALIDATIONS);
+    //the lstat doubles as the existence check a NAS open used to be
+    int nasStatus = cfs_getNASattr(path, &nasFileInfo);
+    attr_cache_store(path, &nasFileInfo, nasStatus);//open revalidates, so refresh the attribute cache too
+    if(nasStatus < 0)//file was not present on remote server,if in local, delete
+    {
+      open_file_unlock(openFile);
+      if(nasStatus == -ENOENT)
+        cfs_dropCacheFile(path);
+      if(nasFileDescriptor >= 0)
+        close(nasFileDescriptor);
+      return nasStatus;
+    }
+    fd_cache_revalidate(nasPath, &nasFileInfo);//a kept descriptor may be for a file since replaced
+    uint64_t phaseStart = latency_phase_begin();
+    presentInCache = is_file_in_cache(get_thread_db(), cacheFileName);
+    latency_phase_end(LAT_METADATA, phaseStart);
+    revalidate_mark(path, &nasFileInfo);//cache copy is brought up to date below
+  }
 
-  if(presentInCache)//check up to dateness 
+  if(presentInCache && !trusted)//check up to dateness 
   {
     struct stat cacheFileInfo;
     cfs_getCacheattr(path, &cacheFileInfo);
     char nasDate[36], cacheDate[36];
     log_msg("\nNAS mtime: %s | Cache mtime: %s\n", formatdate(nasDate, nasFileInfo.st_mtime), formatdate(cacheDate, cacheFileInfo.st_mtime));
-    if(cacheFileInfo.st_mtime < nasFileInfo.st_mtime)
+    if(cacheFileInfo.st_mtime < nasFileInfo.st_mtime &&
+       get_nas_mtime(get_thread_db(), cacheFileName) < nasFileInfo.st_mtime)//our own cache-bypassing writes recorded where they left the NAS
     {
       log_msg("\nCache file is behind NAS, deleting cache file...\n");
-      delete_file(metaDataBase, cacheFileName);//remove file from metadata file
+      stats_inc(STAT_INVALIDATIONS);
+      block_index_drop(cacheFileName);
+      delete_file(get_thread_db(), cacheFileName);//remove file from metadata file
       log_syscall("Cache unlink", unlink(cachePath), 0);
+      fd_cache_invalidate(cachePath);
       presentInCache = false;
     }
   }
@@ -459,44 +781,92 @@ int cfs_open(const char *path, struct fuse_file_info *fi) {
   if(!presentInCache)//create a new file in the cache dir
   {
     log_msg("\nFile is not present yet in cache. Making node and inserting into database...\n");
-    create_file(metaDataBase, cacheFileName, nasFileInfo.st_size);
+    block_index_drop(cacheFileName);//nothing of an earlier copy is in the new cache file
+    uint64_t phaseStart = latency_phase_begin();
+    create_file(get_thread_db(), cacheFileName, nasFileInfo.st_size);
+    latency_phase_end(LAT_METADATA, phaseStart);
     cfs_mkCacheNod(cachePath, nasFileInfo.st_mode, nasFileInfo.st_dev);
+    if(nasFileDescriptor < 0)//every read will miss, and open should report permission errors
+    {
+      phaseStart = latency_phase_begin();
+      nasFileDescriptor = fd_cache_open(nasPath, nasFlags);
+      latency_phase_end(LAT_NAS_IO, phaseStart);
+      log_retstat("NAS open", nasFileDescriptor);
+      if(nasFileDescriptor < 0)
+      {
+        open_file_unlock(openFile);
+        return nasFileDescriptor;
+      }
+    }
   }
-  cacheFileDescriptor = log_syscall("Cache open", open(cachePath, O_RDWR), 0);
+  cacheFileDescriptor = fd_cache_open(cachePath, O_RDWR);//shared with other handles on the file, see fdcache.h
+  log_retstat("Cache open", cacheFileDescriptor);
+  if(cacheFileDescriptor >= 0)
+    open_file_get(openFile);
+  open_file_unlock(openFile);
 
   // if the open call succeeds, my retstat is the file descriptor,
   // else it's -errno.  I'm making sure that in that case the saved
   // file descriptor is exactly -1.
-  if (nasFileDescriptor < 0)
-    retstat = log_error("Open in NAS Directory.");
-  if (cacheFileDescriptor < 0)
-    retstat = log_error("Open in Cache Directory.");
+  if (cacheFileDescriptor < 0) {
+    retstat = cacheFileDescriptor;
+    revalidate_invalidate(path);//check properly next time
+  }
 
   //Set respective file handles for both the fuse_file_infos
   struct dualFileHandle *dualFH;
   dualFH = malloc(sizeof(struct dualFileHandle));
-  dualFH->nasFH = nasFileDescriptor;
+  dualFH->nasFH = nasFileDescriptor < 0 ? NO_NAS_FH : (uint64_t)nasFileDescriptor;
+  dualFH->nasFlags = nasFlags;
   dualFH->cacheFH = cacheFileDescriptor;
+  dualFH->gather = NULL;
+  pthread_mutex_init(&dualFH->streamLock, NULL);
+  dualFH->streamNext = 0;
+  dualFH->streamBytes = 0;
+  dualFH->bypassed = 0;
+  dualFH->openFile = cacheFileDescriptor >= 0 ? openFile : NULL;
+  if((fi->flags & O_ACCMODE) != O_RDONLY)
+  {
+    dualFH->gather = gather_open(path, nasFileDescriptor, dualFH->openFile ? open_file_staged(dualFH->openFile) : NULL);
+  }
   fi->fh = (uint64_t)dualFH;
   log_fi(fi);
 
   return retstat;
 }
 
+//NAS descriptor of an open file, opened on first use for read-only handles
+//(see cfs_open).  Returns the descriptor or -errno.
+static int cfs_nasFH(const char *nasPath, struct dualFileHandle *dualFH)
+{
+  if(dualFH->nasFH != NO_NAS_FH)
+    return (int)dualFH->nasFH;
+
+  int nasFileDescriptor = fd_cache_open(nasPath, dualFH->nasFlags);
+  log_retstat("NAS lazy open", nasFileDescriptor);
+  if(nasFileDescriptor < 0)
+    return nasFileDescriptor;
+  //two readers on the same handle may race here, the loser gives its reference back
+  if(!__sync_bool_compare_and_swap(&dualFH->nasFH, NO_NAS_FH, (uint64_t)nasFileDescriptor))
+  {
+    fd_cache_close(nasFileDescriptor);
+    nasFileDescriptor = (int)dualFH->nasFH;
+  }
+  return nasFileDescriptor;
+}
+
 //Specifically write to cache
 //Need for reads so that future reads can be from cache
 //Also called by cfs_write when the file is in cache, has same function
 int cfs_cacheWrite(char *cacheFileName, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
   int retstat;
-  char cachePath[PATH_MAX];
-  cfs_fullCachePath(cachePath, cacheFileName);
 
   struct dualFileHandle *dualFH;
   dualFH = (struct dualFileHandle *)fi->fh;
   log_msg(
-      "\ncfs_cacheWrite(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x, cacheFileHandle = 0x % 016llx)\n",
-      cachePath, buf, size, offset, fi, dualFH->cacheFH);
+      "\ncfs_cacheWrite(file=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x, cacheFileHandle = 0x % 016llx)\n",
+      cacheFileName, buf, size, offset, fi, dualFH->cacheFH);
 
   log_fi(fi); 
 
@@ -508,18 +878,29 @@ int cfs_cacheWrite(char *cacheFileName, char *buf, size_t size, off_t offset, st
     offsetArray[block_index] = offset+(block_index*block_size);
   }
 
+  uint64_t phaseStart = latency_phase_begin();
   while(get_cache_used_size() >= cache_size*1024)//create space in cache through LRU evictions
   {
     log_msg("\nCache is full, evicting blocks...\n");
     char* evictionFileNames[number_blocks];
     size_t evictedOffsets[number_blocks];
-    //evict_blocks(metaDataBase, number_blocks, (char**)&evictionFileNames, (size_t*)&evictedOffsets); Uncomment when implemented 
+    //evict_blocks(get_thread_db(), number_blocks, (char**)&evictionFileNames, (size_t*)&evictedOffsets); Uncomment when implemented 
   }
+  latency_phase_end(LAT_EVICT, phaseStart);
 
-  write_blks(metaDataBase, cacheFileName, number_blocks, (size_t *)&offsetArray);
+  phaseStart = latency_phase_begin();
+  write_blks(get_thread_db(), cacheFileName, number_blocks, (size_t *)&offsetArray);
+  latency_phase_end(LAT_METADATA, phaseStart);
   //------------End of Metadata Adjustments for Write--------------// 
 
-  return log_syscall("Cache pwrite", pwrite(dualFH->cacheFH, buf, size, offset), 0);
+  phaseStart = latency_phase_begin();
+  retstat = log_syscall("Cache pwrite", pwrite(dualFH->cacheFH, buf, size, offset), 0);
+  latency_phase_end(LAT_CACHE_IO, phaseStart);
+  if(retstat == size)//only now can a lock-free reader be sent to the cache for these blocks
+  {
+    block_index_add(cacheFileName, offset, size);
+  }
+  return retstat;
 }
 
 /** Read data from an open file
@@ -541,8 +922,28 @@ int cfs_cacheWrite(char *cacheFileName, char *buf, size_t size, off_t offset, st
 int cfs_read(const char *path, char *buf, size_t size, off_t offset,
             struct fuse_file_info *fi)
 {
+  struct cfs_fileNames names;
+  cfs_fileNames(&names, path);
+  return cfs_readNamed(&names, buf, size, offset, fi);
+}
+
+//The same, for a caller that already has the file's names
+int cfs_readNamed(struct cfs_fileNames *names, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+  const char *path = names->path;
+  if (virtual_path(path))
+    return virtual_read(buf, size, offset, fi);
+  LATENCY_OP(LAT_READ_HIT, path);
+  latency_set_range(offset, size);
+
   int retstat = 0;
 
+  struct dualFileHandle *dualFH;
+  dualFH = (struct dualFileHandle *)fi->fh;
+
+  gather_flush_file(path, dualFH->openFile ? open_file_staged(dualFH->openFile) : NULL);//read-your-writes for data still being gathered on any handle
+
   //Set lower and upper offsets as well as aligned size for the file in cache
   //Need to be in whole block increments (ie % = zero) for block tracking purposes (either have entire block or do not)
   off_t lowerOffset = alignLowerOffset(offset);
@@ -563,21 +964,43 @@ int cfs_read(const char *path, char *buf, size_t size, off_t offset,
     offsetArray[cnt] = lowerOffset+(block_size*cnt);
   }
 
-  char cacheFileName[PATH_MAX];
-  cfs_pathToFileName(cacheFileName, path);
-  bool cacheDataHit = false;
-  int dataCheck = are_blocks_in_cache(metaDataBase, cacheFileName, number_blocks, (size_t *)&offsetArray, (int *)&cacheBlockHitYN); 
-  if(dataCheck < 0)
+  char *cacheFileName = names->cacheName;
+  //Fully cached ranges are answered from the in-memory block index, without the database or the range lock
+  bool cacheDataHit = block_index_present(cacheFileName, lowerOffset, alignedSize);
+  //Otherwise ask the database: hits share the range with other readers; a fill takes it alone, then looks again in case another reader filled it meanwhile
+  bool exclusive = false;
+  bool locked = !cacheDataHit;
+  if(locked)
   {
-    log_error("Error in are_blocks_in_cache");
-  } 
-  else
+    range_lock(path, lowerOffset, alignedSize, exclusive);
+  }
+  while(locked)
   {
-    cacheDataHit = dataCheck;
+    uint64_t phaseStart = latency_phase_begin();
+    int dataCheck = are_blocks_in_cache(get_thread_db(), cacheFileName, number_blocks, (size_t *)&offsetArray, (int *)&cacheBlockHitYN); 
+    latency_phase_end(LAT_METADATA, phaseStart);
+    if(dataCheck < 0)
+    {
+      log_error("Error in are_blocks_in_cache");
+    } 
+    else
+    {
+      cacheDataHit = dataCheck;
+    }
+    if(cacheDataHit)
+    {
+      block_index_add(cacheFileName, lowerOffset, alignedSize);//cached before this mount, or filled by another reader
+      break;
+    }
+    if(exclusive)
+    {
+      break;
+    }
+    range_unlock(path, lowerOffset, alignedSize);
+    exclusive = true;
+    range_lock(path, lowerOffset, alignedSize, exclusive);
   }
 
-  struct dualFileHandle *dualFH;
-  dualFH = (struct dualFileHandle *)fi->fh;
   log_msg(
       "\ncfs_read original(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x, nasFH = 0x % 016llx, cacheFH = 0x % 016llx)\n",
       path, buf, size, offset, fi, dualFH->nasFH, dualFH->cacheFH);
@@ -591,28 +1014,183 @@ int cfs_read(const char *path, char *buf, size_t size, off_t offset,
 
   if(cacheDataHit)//have all necessary data in cache, read only from cache
   {
+    uint64_t phaseStart = latency_phase_begin();
     retstat = log_syscall("Data hit:cache pread", pread(dualFH->cacheFH, cacheBuf, alignedSize, lowerOffset), 0);//do the possibly enlarged read from the NAS
+    latency_phase_end(LAT_CACHE_IO, phaseStart);
+    stats_inc(STAT_HITS);
+    latency_set_blocks(number_blocks, 0);
+    trace_access(path, TRACE_READ, offset, size, TRACE_HIT);
+    stats_add(STAT_CACHE_BYTES, retstat > 0 ? retstat : 0);
   }
   else//go block by block, reading from nas and writing to cache for non present, reading from cache for present 
   {
+    size_t blocksHit = 0;
+    warmup_foreground_begin();//a warm-up backs off while we wait on the NAS
     for(int block_index = 0; block_index < number_blocks; block_index++)
     {
       if(cacheBlockHitYN[block_index])//specific block is in cache, read from there
       {
-        retstat = retstat + pread(dualFH->cacheFH, cacheBuf+(block_index*block_size), block_size, lowerOffset+(block_index*block_size));
+        uint64_t phaseStart = latency_phase_begin();
+        ssize_t cacheBytes = pread(dualFH->cacheFH, cacheBuf+(block_index*block_size), block_size, lowerOffset+(block_index*block_size));
+        latency_phase_end(LAT_CACHE_IO, phaseStart);
+        retstat = retstat + cacheBytes;
+        stats_add(STAT_CACHE_BYTES, cacheBytes > 0 ? cacheBytes : 0);
+        blocksHit++;
       }
       else//specific block is not in cache, read from nas and write to cache for future reads
       {
-        retstat = retstat + pread(dualFH->nasFH, cacheBuf+(block_index*block_size), block_size, lowerOffset+(block_index*block_size)); 
+        uint64_t phaseStart = latency_phase_begin();
+        int nasFileDescriptor = cfs_nasFH(names->nasPath, dualFH);
+        if(nasFileDescriptor < 0)
+        {
+          latency_phase_end(LAT_NAS_IO, phaseStart);
+          warmup_foreground_end();
+          range_unlock(path, lowerOffset, alignedSize);
+          free((void*)cacheBuf);
+          return nasFileDescriptor;
+        }
+        ssize_t nasBytes = NAS_EMU(NAS_READ, pread(nasFileDescriptor, cacheBuf+(block_index*block_size), block_size, lowerOffset+(block_index*block_size))); 
+        latency_phase_end(LAT_NAS_IO, phaseStart);
+        retstat = retstat + nasBytes;
+        stats_add(STAT_NAS_BYTES, nasBytes > 0 ? nasBytes : 0);
+        phaseStart = latency_phase_begin();
         cfs_cacheWrite(cacheFileName, cacheBuf+(block_index*block_size), block_size, lowerOffset+(block_index*block_size), fi);
+        latency_phase_end(LAT_FILL, phaseStart);
+        stats_inc(STAT_FILLS);
       }
     }
+    warmup_foreground_end();
+    stats_inc(blocksHit ? STAT_PARTIAL_HITS : STAT_MISSES);
+    latency_set_op(blocksHit ? LAT_READ_PARTIAL : LAT_READ_MISS);
+    latency_set_blocks(blocksHit, number_blocks-blocksHit);
+    trace_access(path, TRACE_READ, offset, size, blocksHit ? TRACE_PARTIAL : TRACE_MISS);
+  }
+  if(locked)
+  {
+    range_unlock(path, lowerOffset, alignedSize);
   }
   memcpy(buf, cacheBuf+offset-lowerOffset, size);//write to buffer the requested data (offset-lowerOffset will bump up cacheBuf to where the real data starts)
   free((void*)cacheBuf);
   return retstat;
 }
 
+//Fill one block of a write's staging buffer with the bytes around the written range
+//Comes from the cache when the block is already there, otherwise from the NAS,
+//whose short read decides where EOF is (another handle or client may have moved
+//it since we opened); anything past EOF is zero so the cache copy matches what a
+//read would return.  Returns the bytes found or -errno.
+static ssize_t cfs_fillEdgeBlock(char *cacheFileName, struct dualFileHandle *dualFH, char *blockBuf, off_t blockOffset)
+{
+  ssize_t haveBytes = 0;
+  memset(blockBuf, 0, block_size);
+
+  uint64_t phaseStart = latency_phase_begin();
+  int cached = is_blk_in_cache(get_thread_db(), cacheFileName, blockOffset);
+  latency_phase_end(LAT_METADATA, phaseStart);
+
+  if(cached == 1)
+  {
+    phaseStart = latency_phase_begin();
+    haveBytes = log_syscall("Edge block: cache pread", pread(dualFH->cacheFH, blockBuf, block_size, blockOffset), 0);
+    latency_phase_end(LAT_CACHE_IO, phaseStart);
+  }
+  else
+  {
+    gather_flush(dualFH->gather);//the rest of this block may still be staged
+    phaseStart = latency_phase_begin();
+    haveBytes = log_syscall("Edge block: NAS pread", NAS_EMU(NAS_READ, pread(dualFH->nasFH, blockBuf, block_size, blockOffset)), 0);
+    latency_phase_end(LAT_NAS_IO, phaseStart);
+  }
+  log_msg("\ncfs_fillEdgeBlock(file=\"%s\", blockOffset=%lld, bytes=%d)\n", cacheFileName, blockOffset, haveBytes);
+  return haveBytes;
+}
+
+//Decide how a write is admitted to the cache: the configured write policy,
+//unless this handle is streaming a long sequential write (backups, log
+//shipping), which would otherwise push the hot read set out of the cache
+static enum writePolicy cfs_writeAdmission(struct dualFileHandle *dualFH, off_t offset, size_t size)
+{
+  pthread_mutex_lock(&dualFH->streamLock);
+  if(offset == dualFH->streamNext)
+  {
+    dualFH->streamBytes += size;
+  }
+  else
+  {
+    dualFH->streamBytes = size;
+  }
+  dualFH->streamNext = offset+size;
+  size_t streamBytes = dualFH->streamBytes;
+  pthread_mutex_unlock(&dualFH->streamLock);
+
+  size_t threshold = CFS_DATA->streamthreshold*1024;
+  if(threshold && streamBytes >= threshold)
+  {
+    log_msg("\nStreaming write (%lu sequential bytes), bypassing cache\n", streamBytes);
+    return WRITE_NO_ALLOCATE;
+  }
+  return CFS_DATA->writepolicy;
+}
+
+//Cache side of a write that must not allocate new cache blocks.  Blocks
+//already in the cache are either updated in place (WRITE_ALLOCATE_IF_CACHED)
+//or dropped (WRITE_NO_ALLOCATE) so they can never be read back stale.
+static void cfs_writeNoAllocate(char *cacheFileName, const char *buf, size_t size, off_t offset,
+                                off_t lowerOffset, size_t alignedSize, enum writePolicy policy,
+                                struct fuse_file_info *fi)
+{
+  struct dualFileHandle *dualFH;
+  dualFH = (struct dualFileHandle *)fi->fh;
+
+  size_t number_blocks = alignedSize/block_size;
+  size_t offsetArray[number_blocks];
+  int cacheBlockHitYN[number_blocks];
+  for(int block_index = 0; block_index < number_blocks; block_index++)
+  {
+    offsetArray[block_index] = lowerOffset+(block_index*block_size);
+  }
+  if(are_blocks_in_cache(get_thread_db(), cacheFileName, number_blocks, (size_t *)&offsetArray, (int *)&cacheBlockHitYN) < 0)
+  {
+    log_error("Error in are_blocks_in_cache");
+    return;
+  }
+
+  char* blockBuf = malloc(block_size*sizeof(char));
+  for(int block_index = 0; block_index < number_blocks; block_index++)
+  {
+    if(cacheBlockHitYN[block_index] != 1)
+    {
+      continue;
+    }
+    off_t blockOffset = offsetArray[block_index];
+    if(policy == WRITE_NO_ALLOCATE)
+    {
+      block_index_remove(cacheFileName, blockOffset, block_size);
+      stats_inc(STAT_INVALIDATIONS);
+      delete_block(get_thread_db(), cacheFileName, blockOffset);
+      continue;
+    }
+    //Overlay the written bytes on the cached block and write it back
+    off_t from = offset > blockOffset ? offset : blockOffset;
+    off_t to = offset+size < blockOffset+block_size ? offset+size : blockOffset+block_size;
+    if((from != blockOffset || to != blockOffset+block_size) &&
+       cfs_fillEdgeBlock(cacheFileName, dualFH, blockBuf, blockOffset) < 0)
+    {
+      block_index_remove(cacheFileName, blockOffset, block_size);//can't rebuild it, so don't keep it
+      stats_inc(STAT_INVALIDATIONS);
+      delete_block(get_thread_db(), cacheFileName, blockOffset);
+      continue;
+    }
+    memcpy(blockBuf+(from-blockOffset), buf+(from-offset), to-from);
+    cfs_cacheWrite(cacheFileName, blockBuf, block_size, blockOffset, fi);
+  }
+  free((void*)blockBuf);
+
+  //Cache copy is still valid for the blocks it holds; cfs_release records the NAS mtime this leaves
+  //so cfs_open does not discard it as older than the NAS
+  dualFH->bypassed = 1;
+}
+
 /** Write data to an open file
  *
  * Write should return exactly the number of bytes requested
@@ -625,18 +1203,21 @@ int cfs_read(const char *path, char *buf, size_t size, off_t offset,
 // documentation for the write() system call.
 int cfs_write(const char *path, const char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi) {
-  int retstat = 0;
+  struct cfs_fileNames names;
+  cfs_fileNames(&names, path);
+  return cfs_writeNamed(&names, buf, size, offset, fi);
+}
 
-  //Set lower and upper offsets as well as aligned size for the file in cache
-  //Need to be in whole block increments (ie % = zero) for block tracking purposes (either have entire block or do not)
-  off_t lowerOffset = alignLowerOffset(offset);
-  size_t alignedSize = block_size*(size/block_size);
-  if(size%block_size != 0)
-  {
-    alignedSize = alignedSize + block_size;
-    log_msg("\nWrite aligned size: %d, size %d, block size %d\n", alignedSize, size, block_size);
-  }
-  off_t upperOffset = alignUpperOffset(offset+alignedSize);
+//The same, for a caller that already has the file's names
+int cfs_writeNamed(struct cfs_fileNames *names, const char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi) {
+  const char *path = names->path;
+  if (virtual_path(path))
+    return virtual_write(buf, size, fi);
+  LATENCY_OP(LAT_WRITE, path);
+  latency_set_range(offset, size);
+
+  int retstat = 0;
 
   struct dualFileHandle *dualFH;
   dualFH = (struct dualFileHandle *)fi->fh;
@@ -647,26 +1228,103 @@ int cfs_write(const char *path, const char *buf, size_t size, off_t offset,
 
   log_fi(fi);
 
-  retstat = log_syscall("pwrite", pwrite(dualFH->nasFH, buf, size, offset), 0);//write to NAS here
+  //Held from the NAS write until the cache is updated, so a read filling these blocks from the NAS cannot slip in between
+  range_lock(path, offset, size, true);
+
+  //With the journal on, the record is made durable on the cache device and the NAS write is left in the client's page cache until the next checkpoint
+  uint64_t journalSeq = 0;
+  off_t journalPos = 0;
+  if(journal_enabled())
+  {
+    journalSeq = journal_append(path, buf, size, offset, &journalPos);
+  }
+  if(dualFH->gather)//small sequential writes are staged and go to the NAS as one large pwrite
+  {
+    uint64_t phaseStart = latency_phase_begin();
+    retstat = gather_write(dualFH->gather, buf, size, offset, journalSeq ? journalPos : -1);
+    latency_phase_end(LAT_NAS_IO, phaseStart);
+    log_retstat("Gather write", retstat);
+  }
+  else
+  {
+    uint64_t phaseStart = latency_phase_begin();
+    retstat = log_syscall("pwrite", NAS_EMU(NAS_WRITE, pwrite(dualFH->nasFH, buf, size, offset)), 0);//write to NAS here
+    latency_phase_end(LAT_NAS_IO, phaseStart);
+    if(journalSeq && retstat <= 0)//the application is told this write failed, so a replay must not apply it
+    {
+      journal_write_failed(journalPos);
+    }
+    else if(journalSeq)
+    {
+      journal_write_done(1);
+    }
+  }
+  if(journalSeq)
+  {
+    if(retstat > 0 && journal_commit(journalSeq) < 0)
+    {
+      retstat = log_error("Journal commit");
+    }
+  }
+  else if(journal_enabled() && retstat > 0)//could not journal, fall back to a synchronous NAS write
+  {
+    gather_flush(dualFH->gather);
+    log_syscall("NAS fdatasync", NAS_EMU(NAS_SYNC, fdatasync(dualFH->nasFH)), 0);
+  }
+  if(retstat <= 0)//nothing reached the NAS, so there is nothing to mirror in the cache
+  {
+    range_unlock(path, offset, size);
+    return retstat;
+  }
+  attr_cache_invalidate(path);//size and mtime moved
+  revalidate_invalidate(path);
+  trace_access(path, TRACE_WRITE, offset, retstat, TRACE_MISS);
 
   //---------------Cache Aspect of Writes---------------//
-  struct stat nasAttr;
-  cfs_getNASattr(path, &nasAttr);
-  size_t nasReadSize = alignedSize;
-  if(nasReadSize+lowerOffset > nasAttr.st_size)
+  //Cache only tracks whole blocks, so round the written range out to block boundaries
+  off_t lowerOffset = alignLowerOffset(offset);
+  off_t endOffset = offset+retstat;
+  size_t alignedSize = (size_t)(alignLowerOffset(endOffset)-lowerOffset);
+  if(endOffset%block_size != 0)
   {
-    nasReadSize = nasAttr.st_size-lowerOffset;     
+    alignedSize = alignedSize + block_size;
+  }
+  log_msg("\nWrite aligned size: %d, size %d, block size %d\n", alignedSize, retstat, block_size);
+
+  char *cacheFileName = names->cacheName;
+
+  enum writePolicy policy = cfs_writeAdmission(dualFH, offset, retstat);
+  if(policy != WRITE_ALLOCATE)
+  {
+    cfs_writeNoAllocate(cacheFileName, buf, retstat, offset, lowerOffset, alignedSize, policy, fi);
+    range_unlock(path, offset, size);
+    return retstat;
   }
 
   char* cacheBuf = malloc(alignedSize*sizeof(char));
 
-  log_msg("\nNAS Read for Cache Write(buf=0x%08x, size=%d, offset=%lld, fi=0x%08x, nasFH = 0x % 016llx)\n",
-  cacheBuf, nasReadSize, lowerOffset, fi, dualFH->nasFH);
-  log_syscall("Reading for write to cache", pread(dualFH->nasFH, cacheBuf, nasReadSize, lowerOffset), 0);//do the possibly enlarged read from the NAS
+  //Only the unaligned head and tail blocks hold bytes we did not just write; everything else comes from buf
+  ssize_t edgeStatus = 0;
+  if(offset != lowerOffset)
+  {
+    edgeStatus = cfs_fillEdgeBlock(cacheFileName, dualFH, cacheBuf, lowerOffset);
+  }
+  off_t tailOffset = lowerOffset+alignedSize-block_size;
+  if(edgeStatus >= 0 && endOffset%block_size != 0 && (tailOffset != lowerOffset || offset == lowerOffset))
+  {
+    edgeStatus = cfs_fillEdgeBlock(cacheFileName, dualFH, cacheBuf+(tailOffset-lowerOffset), tailOffset);
+  }
+  if(edgeStatus < 0)//the edges could not be read, so the cache only loses its stale copies of these blocks
+  {
+    free((void*)cacheBuf);
+    cfs_writeNoAllocate(cacheFileName, buf, retstat, offset, lowerOffset, alignedSize, WRITE_NO_ALLOCATE, fi);
+    range_unlock(path, offset, size);
+    return retstat;
+  }
+  memcpy(cacheBuf+(offset-lowerOffset), buf, retstat);
 
-  char cacheFileName[PATH_MAX];
-  cfs_pathToFileName(cacheFileName, path);
   cfs_cacheWrite(cacheFileName, cacheBuf, alignedSize, lowerOffset, fi);// write our new data to cache for future reads 
+  range_unlock(path, offset, size);
   free((void*)cacheBuf);
   return retstat;
 }
@@ -679,14 +1337,15 @@ int cfs_write(const char *path, const char *buf, size_t size, off_t offset,
  * version 2.5
  */
 int cfs_statfs(const char *path, struct statvfs *statv) {
+  LATENCY_OP(LAT_STATFS, path);
   int retstat = 0;
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_statfs(path=\"%s\", statv=0x%08x)\n", path, statv);
-  cfs_fullNasPath(nasPath, path);
+  cfs_fullNasPath(nasPath, virtual_path(path) ? "/" : path);
 
   // get stats for underlying filesystem
-  retstat = log_syscall("statvfs", statvfs(nasPath, statv), 0);
+  retstat = log_syscall("statvfs", NAS_EMU(NAS_META, statvfs(nasPath, statv)), 0);
 
   log_statvfs(statv);
 
@@ -716,13 +1375,20 @@ int cfs_statfs(const char *path, struct statvfs *statv) {
  *
  * Changed in version 2.2
  */
-// this is a no-op in CFSFS.  It just logs the call and returns success
+// pushes out any gathered writes, otherwise it just logs the call
 int cfs_flush(const char *path, struct fuse_file_info *fi) {
+  if (virtual_path(path))
+    return 0;
+  LATENCY_OP(LAT_FLUSH, path);
+
   log_msg("\ncfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
   // no need to get nasPath on this one, since I work from fi->fh not the path
   log_fi(fi);
 
-  return 0;
+  // close() is the last chance to report an error from a gathered write
+  struct dualFileHandle *dualFH;
+  dualFH = (struct dualFileHandle *)fi->fh;
+  return gather_flush(dualFH->gather);
 }
 
 /** Release an open file
@@ -740,6 +1406,18 @@ int cfs_flush(const char *path, struct fuse_file_info *fi) {
  * Changed in version 2.2
  */
 int cfs_release(const char *path, struct fuse_file_info *fi) {
+  struct cfs_fileNames names;
+  cfs_fileNames(&names, path);
+  return cfs_releaseNamed(&names, fi);
+}
+
+//The same, for a caller that already has the file's names
+int cfs_releaseNamed(struct cfs_fileNames *names, struct fuse_file_info *fi) {
+  const char *path = names->path;
+  if (virtual_path(path))
+    return virtual_release(fi);
+  LATENCY_OP(LAT_RELEASE, path);
+
   struct dualFileHandle *dualFH;
   dualFH = (struct dualFileHandle *)fi->fh;
   log_msg("\ncfs_release(path=\"%s\", fi=0x%08x, nasFH=0x%016llx, cacheFH=0x%016llx)\n", path, fi,dualFH->nasFH,dualFH->cacheFH);
@@ -749,9 +1427,8 @@ int cfs_release(const char *path, struct fuse_file_info *fi) {
   // We need to close the file.  Had we allocated any resources
   // (buffers etc) we'd need to free them here as well.
   //Closing file in cache as well
-  char cacheFileName[PATH_MAX], cachePath[PATH_MAX], fallocateCall[PATH_MAX];
-  cfs_pathToFileName(cacheFileName, path);
-  cfs_fullCachePath(cachePath, cacheFileName);
+  char *cacheFileName = names->cacheName, *cachePath = names->cachePath;
+  char fallocateCall[PATH_MAX];
 
   strcpy(fallocateCall,"fallocate -d ");
   strncat(fallocateCall, cachePath, PATH_MAX);
@@ -759,8 +1436,21 @@ int cfs_release(const char *path, struct fuse_file_info *fi) {
   log_msg("\nFallocate call: %s\n", fallocateCall);
 
   log_syscall("Cache digging", system(fallocateCall), 0);
-  log_syscall("Cache close", close(dualFH->cacheFH), 0);
-  nasClose = log_syscall("NAS close", close(dualFH->nasFH), 0);
+  log_retstat("Gather close", gather_close(dualFH->gather));
+  struct stat nasFileInfo;
+  if(dualFH->bypassed && fstat(dualFH->nasFH, &nasFileInfo) == 0)//the NAS moved past the cache file's mtime through us only
+  {
+    set_nas_mtime(get_thread_db(), cacheFileName, nasFileInfo.st_mtime);
+  }
+  log_retstat("Cache close", fd_cache_close(dualFH->cacheFH));
+  open_file_put(dualFH->openFile);
+  nasClose = 0;
+  if(dualFH->nasFH != NO_NAS_FH)//never opened if every read hit the cache
+  {
+    nasClose = fd_cache_close(dualFH->nasFH);
+    log_retstat("NAS close", nasClose);
+  }
+  pthread_mutex_destroy(&dualFH->streamLock);
   free((void *)fi->fh);
   return nasClose;
 }
@@ -773,22 +1463,39 @@ int cfs_release(const char *path, struct fuse_file_info *fi) {
  * Changed in version 2.2
  */
 int cfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  if (virtual_path(path))
+    return 0;
+  LATENCY_OP(LAT_FSYNC, path);
+
   struct dualFileHandle *dualFH;
   dualFH = (struct dualFileHandle *)fi->fh;
   log_msg("\ncfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x,  nasFH=0x%016llx, cacheFH=0x%016llx)\n", path, datasync,
           fi, dualFH->nasFH,dualFH->cacheFH);
   log_fi(fi);
 
+  int gatherError = gather_flush(dualFH->gather);
+  if (gatherError < 0)
+    return gatherError;
+
+  // a lazily opened read-only handle that never missed has nothing on the NAS to sync
+  if (dualFH->nasFH == NO_NAS_FH)
+    return log_syscall("Cache fsync", fsync(dualFH->cacheFH), 0);
+
+  // every acknowledged write is already durable in the journal, so the
+  // NAS copy can wait for the next checkpoint
+  if (journal_enabled())
+    return log_syscall("Cache fsync", fsync(dualFH->cacheFH), 0);
+
   // some unix-like systems (notably freebsd) don't have a datasync call
 #ifdef HAVE_FDATASYNC
   if (datasync)
   {
     log_syscall("Cache fdatasync", fdatasync(dualFH->cacheFH), 0);
-    return log_syscall("NAS fdatasync", fdatasync(dualFH->nasFH), 0);
+    return log_syscall("NAS fdatasync", NAS_EMU(NAS_SYNC, fdatasync(dualFH->nasFH)), 0);
   }
 #endif
   log_syscall("Cache fsync", fsync(dualFH->cacheFH), 0);
-  return log_syscall("NAS fsync", fsync(dualFH->nasFH), 0);
+  return log_syscall("NAS fsync", NAS_EMU(NAS_SYNC, fsync(dualFH->nasFH)), 0);
 }
 
 #ifdef HAVE_SYS_XATTR_H
@@ -799,31 +1506,51 @@ int cfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
     I only need to use the system-provided calls that don't follow
     them */
 
+// user.cachefs.pin never reaches the NAS, see the Pins section below
+static int cfs_setPin(const char *path, const char *value, size_t size);
+
 /** Set extended attributes */
 int cfs_setxattr(const char *path, const char *name, const char *value,
                 size_t size, int flags) {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_SETXATTR, path);
+
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_setxattr(path=\"%s\", name=\"%s\", value=\"%s\", size=%d, "
           "flags=0x%08x)\n",
           path, name, value, size, flags);
+  if (strcmp(name, PIN_XATTR) == 0)
+    return cfs_setPin(path, value, size);
   cfs_fullNasPath(nasPath, path);
 
-  return log_syscall("lsetxattr", lsetxattr(nasPath, name, value, size, flags),
+  return log_syscall("lsetxattr", NAS_EMU(NAS_META, lsetxattr(nasPath, name, value, size, flags)),
                      0);
 }
 
 /** Get extended attributes */
 int cfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+  if (virtual_path(path))
+    return -ENODATA;
+  LATENCY_OP(LAT_GETXATTR, path);
+
   int retstat = 0;
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_getxattr(path = \"%s\", name = \"%s\", value = 0x%08x, size = "
           "%d)\n",
           path, name, value, size);
+  if (strcmp(name, PIN_XATTR) == 0) {
+    if (!pin_is_pinned(path))
+      return -ENODATA;
+    if (size > 0)
+      value[0] = '1';
+    return 1;
+  }
   cfs_fullNasPath(nasPath, path);
 
-  retstat = log_syscall("lgetxattr", lgetxattr(nasPath, name, value, size), 0);
+  retstat = log_syscall("lgetxattr", NAS_EMU(NAS_META, lgetxattr(nasPath, name, value, size)), 0);
   if (retstat >= 0)
     log_msg("    value = \"%s\"\n", value);
 
@@ -832,6 +1559,10 @@ int cfs_getxattr(const char *path, const char *name, char *value, size_t size) {
 
 /** List extended attributes */
 int cfs_listxattr(const char *path, char *list, size_t size) {
+  if (virtual_path(path))
+    return 0;
+  LATENCY_OP(LAT_LISTXATTR, path);
+
   int retstat = 0;
   char nasPath[PATH_MAX];
   char *ptr;
@@ -840,7 +1571,17 @@ int cfs_listxattr(const char *path, char *list, size_t size) {
           size);
   cfs_fullNasPath(nasPath, path);
 
-  retstat = log_syscall("llistxattr", llistxattr(nasPath, list, size), 0);
+  retstat = log_syscall("llistxattr", NAS_EMU(NAS_META, llistxattr(nasPath, list, size)), 0);
+  if (retstat >= 0 && pin_is_pinned(path)) {
+    if (size == 0)
+      retstat += sizeof(PIN_XATTR);
+    else if (retstat + sizeof(PIN_XATTR) > size)
+      retstat = -ERANGE;
+    else {
+      memcpy(list + retstat, PIN_XATTR, sizeof(PIN_XATTR));
+      retstat += sizeof(PIN_XATTR);
+    }
+  }
   if (retstat >= 0) {
     log_msg("    returned attributes (length %d):\n", retstat);
     if (list != NULL)
@@ -855,12 +1596,18 @@ int cfs_listxattr(const char *path, char *list, size_t size) {
 
 /** Remove extended attributes */
 int cfs_removexattr(const char *path, const char *name) {
+  if (virtual_path(path))
+    return -EPERM;
+  LATENCY_OP(LAT_REMOVEXATTR, path);
+
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_removexattr(path=\"%s\", name=\"%s\")\n", path, name);
+  if (strcmp(name, PIN_XATTR) == 0)
+    return cfs_setPin(path, "0", 1);
   cfs_fullNasPath(nasPath, path);
 
-  return log_syscall("lremovexattr", lremovexattr(nasPath, name), 0);
+  return log_syscall("lremovexattr", NAS_EMU(NAS_META, lremovexattr(nasPath, name)), 0);
 }
 #endif
 
@@ -872,21 +1619,46 @@ int cfs_removexattr(const char *path, const char *name) {
  * Introduced in version 2.3
  */
 int cfs_opendir(const char *path, struct fuse_file_info *fi) {
-  DIR *dp;
+  if (virtual_path(path))
+    return virtual_opendir(path, fi);
+  LATENCY_OP(LAT_OPENDIR, path);
+
+  DIR *dp = NULL;
   int retstat = 0;
   char nasPath[PATH_MAX];
+  struct dirHandle *dirFH;
 
   log_msg("\ncfs_opendir(path=\"%s\", fi=0x%08x)\n", path, fi);
   cfs_fullNasPath(nasPath, path);
 
-  // since opendir returns a pointer, takes some custom handling of
-  // return status.
-  dp = opendir(nasPath);
-  log_msg("    opendir returned 0x%p\n", dp);
-  if (dp == NULL)
-    retstat = log_error("cfs_opendir opendir");
+  // the listing comes from the directory cache when it is on, so the
+  // NAS only sees an lstat now and then instead of a full readdir
+  dirFH = malloc(sizeof(struct dirHandle));
+  retstat = dir_cache_open(path, nasPath, dirFH);
+  if (retstat < 0) {
+    log_msg("    dir_cache_open returned %d\n", retstat);
+    free(dirFH);
+    return retstat;
+  }
+
+  if (dirFH->entries == NULL) {
+    // since opendir returns a pointer, takes some custom handling of
+    // return status.
+    nas_emu_begin(NAS_LIST);
+    dp = opendir(nasPath);
+    nas_emu_end(NAS_LIST, 0);
+    log_msg("    opendir returned 0x%p\n", dp);
+    if (dp == NULL) {
+      retstat = log_error("cfs_opendir opendir");
+      free(dirFH);
+      return retstat;
+    }
+  } else {
+    log_msg("    listing of %lu bytes from the directory cache\n", dirFH->size);
+  }
+  dirFH->dp = dp;
 
-  fi->fh = (intptr_t)dp;
+  fi->fh = (intptr_t)dirFH;
 
   log_fi(fi);
 
@@ -917,15 +1689,35 @@ int cfs_opendir(const char *path, struct fuse_file_info *fi) {
 
 int cfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi) {
+  if (virtual_path(path))
+    return virtual_readdir(path, buf, filler);
+  LATENCY_OP(LAT_READDIR, path);
+
   int retstat = 0;
   DIR *dp;
   struct dirent *de;
+  struct dirHandle *dirFH;
 
   log_msg("\ncfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, "
           "fi=0x%08x)\n",
           path, buf, filler, offset, fi);
   // once again, no need for fullNasPath -- but note that I need to cast fi->fh
-  dp = (DIR *)(uintptr_t)fi->fh;
+  dirFH = (struct dirHandle *)(uintptr_t)fi->fh;
+
+  if (dirFH->entries != NULL) {
+    size_t pos = 0;
+    const char *name;
+    while ((name = dir_cache_next(dirFH, &pos, NULL)) != NULL) {
+      log_msg("calling filler with name %s\n", name);
+      if (filler(buf, name, NULL, 0) != 0) {
+        log_at(LOG_ERROR, "    ERROR cfs_readdir filler:  buffer full\n");
+        return -ENOMEM;
+      }
+    }
+    log_fi(fi);
+    return retstat;
+  }
+  dp = (DIR *)dirFH->dp;
 
   // Every directory contains at least two entries: . and ..  If my
   // first call to the system readdir() returns NULL I've got an
@@ -945,7 +1737,7 @@ int cfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   do {
     log_msg("calling filler with name %s\n", de->d_name);
     if (filler(buf, de->d_name, NULL, 0) != 0) {
-      log_msg("    ERROR cfs_readdir filler:  buffer full");
+      log_at(LOG_ERROR, "    ERROR cfs_readdir filler:  buffer full\n");
       return -ENOMEM;
     }
   } while ((de = readdir(dp)) != NULL);
@@ -960,12 +1752,20 @@ int cfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  * Introduced in version 2.3
  */
 int cfs_releasedir(const char *path, struct fuse_file_info *fi) {
+  if (virtual_path(path))
+    return 0;
+  LATENCY_OP(LAT_RELEASEDIR, path);
+
   int retstat = 0;
 
   log_msg("\ncfs_releasedir(path=\"%s\", fi=0x%08x)\n", path, fi);
   log_fi(fi);
 
-  closedir((DIR *)(uintptr_t)fi->fh);
+  struct dirHandle *dirFH = (struct dirHandle *)(uintptr_t)fi->fh;
+  if (dirFH->dp)
+    closedir((DIR *)dirFH->dp);
+  free(dirFH->entries);
+  free(dirFH);
 
   return retstat;
 }
@@ -980,6 +1780,7 @@ int cfs_releasedir(const char *path, struct fuse_file_info *fi) {
 // when exactly is this called?  when a user calls fsync and it
 // happens to be a directory? ??? >>> I need to implement this...
 int cfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+  LATENCY_OP(LAT_FSYNCDIR, path);
   int retstat = 0;
 
   log_msg("\ncfs_fsyncdir(path=\"%s\", datasync=%d, fi=0x%08x)\n", path,
@@ -1012,9 +1813,516 @@ void *cfs_init(struct fuse_conn_info *conn) {
   log_conn(conn);
   log_fuse_context(fuse_get_context());
 
+  cfs_startWorkers();
+
   return CFS_DATA;
 }
 
+//Shared by both frontends
+void cfs_startWorkers(void) {
+  // started here rather than in main so the flusher and log writer threads survive fuse daemonizing
+  log_start();
+  if (control_start() < 0)
+    log_at(LOG_ERROR, "    control thread could not be started, /.cachefs/ctl is read-only\n");
+  if (gather_init(CFS_DATA->gathersize*1024, CFS_DATA->gathertimeout) < 0)
+    log_at(LOG_ERROR, "    gather flusher could not be started, writing through\n");
+}
+
+//The /.cachefs/stats virtual file: the counters plus how full the cache is
+static int cfs_renderStats(char **data, size_t *size) {
+  size_t capacity = 4096;
+  *data = malloc(capacity);
+  if (*data == NULL)
+    return -ENOMEM;
+  size_t len = stats_format(*data, capacity);
+  if (len < capacity)
+    len += snprintf(*data + len, capacity - len, "cache_used_bytes %lu\ncache_size_bytes %lu\n",
+                    get_cache_used_size(), cache_size*1024);
+  *size = len < capacity ? len : capacity - 1;
+  return 0;
+}
+
+//Any write to /.cachefs/stats starts the counters over
+static int cfs_resetStats(const char *data, size_t size) {
+  stats_reset();
+  return size;
+}
+
+//Contents of /.cachefs/metrics: the counters and the latency histograms
+//in the Prometheus text format, for a node exporter textfile or a scraper
+static int cfs_renderMetrics(char **data, size_t *size) {
+  size_t capacity = latency_format(NULL, 0) + 4096;
+  for (;;) {
+    *data = malloc(capacity);
+    if (*data == NULL)
+      return -ENOMEM;
+    size_t len = 0;
+    for (int counter = 0; counter < STAT_COUNT; counter++)
+      len += snprintf(len < capacity ? *data + len : NULL, len < capacity ? capacity - len : 0,
+                      "# TYPE cachefs_%s_total counter\ncachefs_%s_total %llu\n", stats_name(counter),
+                      stats_name(counter), (unsigned long long)stats_get(counter));
+    len += snprintf(len < capacity ? *data + len : NULL, len < capacity ? capacity - len : 0,
+                    "# TYPE cachefs_cache_used_bytes gauge\ncachefs_cache_used_bytes %lu\n", get_cache_used_size());
+    len += latency_format(len < capacity ? *data + len : NULL, len < capacity ? capacity - len : 0);
+    if (len < capacity) {
+      *size = len;
+      return 0;
+    }
+    //a histogram got its first sample while we were formatting, go again with room to spare
+    free(*data);
+    capacity = len + 4096;
+  }
+}
+
+//Contents of /.cachefs/slow, see slowlog.h
+static int cfs_renderSlowLog(char **data, size_t *size) {
+  size_t capacity = slow_log_format(NULL, 0) + 4096;
+  for (;;) {
+    *data = malloc(capacity);
+    if (*data == NULL)
+      return -ENOMEM;
+    size_t len = slow_log_format(*data, capacity);
+    if (len < capacity) {
+      *size = len;
+      return 0;
+    }
+    free(*data);
+    capacity = len + 4096;
+  }
+}
+
+//Any write to /.cachefs/slow empties it
+static int cfs_clearSlowLog(const char *data, size_t size) {
+  slow_log_clear();
+  return size;
+}
+
+/*-------------------Control Commands (/.cachefs/ctl)-------------------*/
+
+//Cached copy of a file known only by its cache file name; callers reset
+//the revalidation state of the paths involved, which is keyed by path.
+//Files that open handles are still writing to are left alone: -EBUSY.
+static int cfs_dropCacheName(const char *cacheFileName)
+{
+  char cachePath[PATH_MAX];
+
+  struct openFile *openFile = open_file_lock(cacheFileName);
+  if(openFile == NULL)
+    return -ENOMEM;
+  if(open_file_busy(openFile))
+  {
+    open_file_unlock(openFile);
+    return -EBUSY;
+  }
+  cfs_fullCachePath(cachePath, cacheFileName);
+  fd_cache_invalidate(cachePath);
+  block_index_drop(cacheFileName);
+  delete_file(get_thread_db(), (char *)cacheFileName);
+  log_syscall("Cache unlink", unlink(cachePath), 0);
+  stats_inc(STAT_EVICTIONS);
+  open_file_unlock(openFile);
+  return 0;
+}
+
+struct cfs_fileList {
+  char **names;
+  off_t *sizes;
+  size_t count, capacity;
+  uint64_t bytes;
+  const char *prefix; // list_files: only names starting with it
+  uint64_t needed;    // list_files: stop once this many bytes are listed, 0 = all
+};
+
+static int cfs_fileListAdd(struct cfs_fileList *list, const char *name, off_t size)
+{
+  if(list->count == list->capacity)
+  {
+    size_t capacity = list->capacity ? list->capacity*2 : 256;
+    char **names = realloc(list->names, capacity*sizeof(char *));
+    if(names)
+      list->names = names;
+    off_t *sizes = realloc(list->sizes, capacity*sizeof(off_t));
+    if(sizes)
+      list->sizes = sizes;
+    if(names == NULL || sizes == NULL)
+      return -ENOMEM;
+    list->capacity = capacity;
+  }
+  list->names[list->count] = strdup(name);
+  list->sizes[list->count++] = size;
+  list->bytes += size;
+  return 0;
+}
+
+static void cfs_fileListFree(struct cfs_fileList *list)
+{
+  for(size_t i = 0; i < list->count; i++)
+    free(list->names[i]);
+  free(list->names);
+  free(list->sizes);
+}
+
+static int cfs_listCached(const char *filename, size_t local_size, void *arg)
+{
+  struct cfs_fileList *list = arg;
+
+  if(list->prefix && strncmp(filename, list->prefix, strlen(list->prefix)) != 0)
+    return 0;
+  if(pin_covers_name(filename))
+    return 0;//pinned copies stay, see cfs_setPin
+  if(cfs_fileListAdd(list, filename, local_size) < 0)
+    return 1;
+  return list->needed && list->bytes >= list->needed;
+}
+
+//Regular files at or below path on the NAS, with their sizes
+static int cfs_listNas(struct cfs_fileList *list, const char *path)
+{
+  char nasPath[PATH_MAX], child[PATH_MAX];
+  struct stat statbuf;
+
+  cfs_fullNasPath(nasPath, path);
+  if(NAS_EMU(NAS_META, lstat(nasPath, &statbuf)) < 0)
+    return -errno;
+  if(S_ISREG(statbuf.st_mode))
+    return cfs_fileListAdd(list, path, statbuf.st_size);
+  if(!S_ISDIR(statbuf.st_mode))
+    return 0;
+
+  nas_emu_begin(NAS_LIST);
+  DIR *dir = opendir(nasPath);
+  nas_emu_end(NAS_LIST, 0);
+  if(dir == NULL)
+    return -errno;
+  struct dirent *de;
+  while((de = readdir(dir)) != NULL && !control_stopping())
+  {
+    if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if(snprintf(child, PATH_MAX, "%s/%s", strcmp(path, "/") == 0 ? "" : path, de->d_name) >= PATH_MAX)
+      continue;
+    cfs_listNas(list, child);
+  }
+  closedir(dir);
+  return 0;
+}
+
+//Read path start to end through the cache, returns the bytes read or -errno
+static ssize_t cfs_prefetchFile(const char *path, char *buf, size_t chunk)
+{
+  struct fuse_file_info fi;
+  ssize_t total = 0;
+
+  memset(&fi, 0, sizeof(fi));
+  fi.flags = O_RDONLY;
+  int retstat = cfs_open(path, &fi);
+  if(retstat < 0)
+    return retstat;
+  for(;;)
+  {
+    retstat = cfs_read(path, buf, chunk, total, &fi);
+    if(retstat <= 0 || control_stopping())
+      break;
+    total += retstat;
+    if(retstat < chunk)
+      break;
+  }
+  cfs_release(path, &fi);
+  return retstat < 0 ? retstat : total;
+}
+
+//"prefetch /path": pull a file, or every file below a directory, into the cache
+static int cfs_ctlPrefetch(const char *arg, struct controlJob *job)
+{
+  struct cfs_fileList list;
+  uint64_t done = 0;
+  int retstat = 0;
+
+  if(arg[0] != '/')
+    return -EINVAL;
+  memset(&list, 0, sizeof(list));
+  retstat = cfs_listNas(&list, arg);
+  control_progress(job, 0, list.bytes);
+
+  size_t chunk = block_size*(128*1024/block_size ? 128*1024/block_size : 1);
+  char *buf = malloc(chunk);
+  if(buf == NULL)
+    retstat = -ENOMEM;
+  for(size_t i = 0; buf && i < list.count && !control_stopping(); i++)
+  {
+    ssize_t bytes = cfs_prefetchFile(list.names[i], buf, chunk);
+    if(bytes < 0)
+      retstat = bytes;
+    else
+      done += bytes;
+    control_progress(job, done, list.bytes);
+  }
+  free(buf);
+  cfs_fileListFree(&list);
+  return retstat;
+}
+
+//Drop every listed cache file that is not open; -EBUSY if some were
+static int cfs_dropListed(struct cfs_fileList *list, struct controlJob *job)
+{
+  int retstat = 0;
+
+  for(size_t i = 0; i < list->count && !control_stopping(); i++)
+  {
+    int dropped = cfs_dropCacheName(list->names[i]);
+    if(dropped < 0)
+      retstat = dropped;
+    control_progress(job, i+1, list->count);
+  }
+  return retstat;
+}
+
+//"evict /path": drop the cached copy of a file or of everything below a
+//directory.  Cache file names are flattened, so a prefix match may take
+//along files whose flattened name merely starts the same way (/ab/c for
+///a/bc) -- more than asked, never less.
+static int cfs_ctlEvict(const char *arg, struct controlJob *job)
+{
+  struct cfs_fileList list;
+  char prefix[PATH_MAX];
+
+  if(arg[0] != '/')
+    return -EINVAL;
+  memset(&list, 0, sizeof(list));
+  cfs_flattenPath(prefix, arg);
+  list.prefix = prefix;
+  revalidate_invalidate_tree(arg);
+  int retstat = list_files(get_thread_db(), cfs_listCached, &list);
+  int dropped = cfs_dropListed(&list, job);
+  cfs_fileListFree(&list);
+  return retstat < 0 ? -EIO : dropped;
+}
+
+//"drop": empty the cache.  Cached copies are always clean (writes reach
+//the NAS or the journal first), so nothing is lost.
+static int cfs_ctlDrop(const char *arg, struct controlJob *job)
+{
+  struct cfs_fileList list;
+
+  memset(&list, 0, sizeof(list));
+  revalidate_invalidate_tree("/");
+  int retstat = list_files(get_thread_db(), cfs_listCached, &list);
+  int dropped = cfs_dropListed(&list, job);
+  cfs_fileListFree(&list);
+  return retstat < 0 ? -EIO : dropped;
+}
+
+//"flush": push gathered writes to the NAS and checkpoint the journal
+static int cfs_ctlFlush(const char *arg, struct controlJob *job)
+{
+  int retstat = 0;
+
+  control_progress(job, 0, 2);
+  gather_flush_all();
+  control_progress(job, 1, 2);
+  if(journal_enabled())
+    retstat = journal_checkpoint();
+  control_progress(job, 2, 2);
+  return retstat < 0 ? retstat : 0;
+}
+
+//"reclaim Kb": drop least recently filled files until the cache holds at most Kb
+static int cfs_ctlReclaim(const char *arg, struct controlJob *job)
+{
+  struct cfs_fileList list;
+  char *end;
+
+  unsigned long long target = strtoull(arg, &end, 10)*1024;
+  if(end == arg || *end != '\0')
+    return -EINVAL;
+  size_t used = get_cache_used_size();
+  if(used <= target)
+    return 0;
+
+  memset(&list, 0, sizeof(list));
+  list.needed = used-target;
+  revalidate_invalidate_tree("/");
+  int retstat = list_files(get_thread_db(), cfs_listCached, &list);
+  for(size_t i = 0; i < list.count && !control_stopping(); i++)
+  {
+    cfs_dropCacheName(list.names[i]);//open files are skipped, the next ones make up for them
+    size_t now = get_cache_used_size();
+    control_progress(job, used > now ? used-now : 0, list.needed);
+  }
+  cfs_fileListFree(&list);
+  return retstat < 0 ? -EIO : 0;
+}
+
+//"pinsize /path": charge a directory pin what is below it on the NAS now
+//(queued by cfs_setPin).  Over the budget, the pin is taken back.
+static int cfs_ctlPinSize(const char *arg, struct controlJob *job)
+{
+  struct cfs_fileList list;
+
+  if(arg[0] != '/')
+    return -EINVAL;
+  memset(&list, 0, sizeof(list));
+  int retstat = cfs_listNas(&list, arg);
+  uint64_t bytes = list.bytes;
+  cfs_fileListFree(&list);
+  control_progress(job, bytes, bytes);
+  if(retstat < 0 || control_stopping())
+    return retstat < 0 ? retstat : -EINTR;//the pin stays uncharged, setting it again retries
+
+  retstat = pin_charge(arg, bytes);
+  if(retstat == -ENODATA)
+    return 0;//unpinned meanwhile
+  if(retstat == -ENOSPC)
+  {
+    log_at(LOG_ERROR, "pin of %s takes %llu bytes, over the pin budget; unpinned\n", arg, (unsigned long long)bytes);
+    if(pin_remove(arg) == 0)
+      delete_pin(get_thread_db(), arg);
+    return retstat;
+  }
+  if(save_pin(get_thread_db(), arg, bytes) < 0)
+    log_at(LOG_ERROR, "pin of %s not saved, it will not survive a remount\n", arg);
+  return 0;
+}
+
+//The warm-up engine settings both the control command and --warmup use
+static void cfs_warmupConfig(struct warmupConfig *config, struct cfs_state *cfs_data)
+{
+  memset(config, 0, sizeof(*config));
+  config->nasdir = cfs_data->nasdir;
+  config->cachedir = cfs_data->cachedir;
+  config->blockSize = block_size;
+  config->cacheBytes = (uint64_t)cache_size*1024;
+  config->threads = cfs_data->warmupthreads;
+  config->bandwidth = (uint64_t)cfs_data->warmupbandwidth*1024;
+  config->cache_name = cfs_flattenPath;
+}
+
+static void cfs_warmupProgress(void *arg, uint64_t done, uint64_t total)
+{
+  control_progress((struct controlJob *)arg, done, total);
+}
+
+//"warmup /path": prefetch with --warmup-threads workers in the background,
+//under --warmup-bandwidth and behind foreground reads (see warmup.h)
+static int cfs_ctlWarmup(const char *arg, struct controlJob *job)
+{
+  struct warmupConfig config;
+  struct warmupResult result;
+
+  if(arg[0] != '/')
+    return -EINVAL;
+  cfs_warmupConfig(&config, CFS_DATA);
+  config.stopping = control_stopping;
+  config.progress = cfs_warmupProgress;
+  config.arg = job;
+  int retstat = warmup_run(arg, &config, &result);
+  log_at(LOG_INFO, "warmup %s: %llu files, %llu bytes fetched, %llu already cached, %llu errors\n", arg,
+         (unsigned long long)result.files, (unsigned long long)result.fetchedBytes,
+         (unsigned long long)result.cachedBytes, (unsigned long long)result.errors);
+  return retstat;
+}
+
+/*-------------------Control Commands (/.cachefs/ctl)-------------------*/
+
+/*-------------------Pins (user.cachefs.pin)-------------------*/
+
+//setfattr -n user.cachefs.pin -v 1 pins a file or directory, -v fetch
+//also queues a prefetch of it, -v 0 (or removing the attribute) unpins.
+//A file is charged its NAS size right away.  A directory is pinned
+//uncharged and a "pinsize" job charges it what cfs_listNas finds below
+//it, so setxattr does not wait for a walk of the NAS subtree.
+static int cfs_setPin(const char *path, const char *value, size_t size)
+{
+  struct stat nasStat;
+  char command[2*PATH_MAX+32];
+  int len = 0;
+
+  if(size == 1 && value[0] == '0')
+  {
+    int retstat = pin_remove(path);
+    if(retstat == 0)
+      delete_pin(get_thread_db(), path);
+    return retstat;
+  }
+  int fetch = size == 5 && strncmp(value, "fetch", 5) == 0;
+  if(!fetch && !(size == 1 && value[0] == '1'))
+    return -EINVAL;
+
+  int retstat = cfs_getNASattr(path, &nasStat);
+  if(retstat < 0)
+    return retstat;
+  int directory = S_ISDIR(nasStat.st_mode);
+  uint64_t bytes = S_ISREG(nasStat.st_mode) ? nasStat.st_size : 0;
+
+  retstat = pin_add(path, directory, bytes);
+  if(retstat < 0)
+    return retstat;
+  if(save_pin(get_thread_db(), path, bytes) < 0)
+    log_at(LOG_ERROR, "pin of %s not saved, it will not survive a remount\n", path);
+  if(directory)
+    len += snprintf(command+len, sizeof(command)-len, "pinsize %s\n", path);
+  if(fetch)
+    len += snprintf(command+len, sizeof(command)-len, "prefetch %s\n", path);
+  if(len > 0)
+  {
+    retstat = control_submit(command, len);
+    if(retstat < 0 && directory && pin_remove(path) == 0)//a pin that would never be charged
+      delete_pin(get_thread_db(), path);
+  }
+  return retstat < 0 ? retstat : 0;
+}
+
+//Pins saved by earlier mounts, already charged when they were set.  A
+//pin whose path the NAS cannot tell us about is kept as a directory pin,
+//which covers more rather than less.
+static void cfs_loadPin(const char *path, uint64_t bytes)
+{
+  struct stat nasStat;
+
+  int directory = cfs_getNASattr(path, &nasStat) < 0 || S_ISDIR(nasStat.st_mode);
+  pin_add(path, directory, bytes);
+}
+
+//cfs_rename moved a pin along with what it pins
+static void cfs_movePin(const char *from, const char *to, uint64_t bytes)
+{
+  delete_pin(get_thread_db(), from);
+  if(to && save_pin(get_thread_db(), to, bytes) < 0)
+    log_at(LOG_ERROR, "pin of %s not saved, it will not survive a remount\n", to);
+}
+
+//Read-only /.cachefs/pins: the budget and every pin with its charge
+static int cfs_renderPins(char **data, size_t *size)
+{
+  size_t capacity = pin_format(NULL, 0) + 4096;
+  for(;;)
+  {
+    *data = malloc(capacity);
+    if(*data == NULL)
+      return -ENOMEM;
+    size_t len = pin_format(*data, capacity);
+    if(len < capacity)
+    {
+      *size = len;
+      return 0;
+    }
+    free(*data);
+    capacity = len + 4096;
+  }
+}
+
+/*-------------------Pins (user.cachefs.pin)-------------------*/
+
+//Attributes saved by the last unmount come back with a fresh TTL
+static void cfs_loadAttr(const char *path, const void *attr, size_t attr_size) {
+  if (attr_size == sizeof(struct stat))
+    attr_cache_store(path, (const struct stat *)attr, 0);
+}
+
+static void cfs_saveAttr(const char *path, const struct stat *statbuf, void *arg) {
+  save_attr((sqlite3 *)arg, path, statbuf, sizeof(*statbuf));
+}
+
 /**
  * Clean up filesystem
  *
@@ -1024,6 +2332,21 @@ void *cfs_init(struct fuse_conn_info *conn) {
  */
 void cfs_destroy(void *userdata) {
   log_msg("\ncfs_destroy(userdata=0x%08x)\n", userdata);
+
+  control_shutdown();
+  gather_shutdown();
+  journal_close();
+  fd_cache_shutdown();
+
+  if (CFS_DATA->attrpersist) {
+    sqlite3 *db = get_thread_db();
+    sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+    clear_attrs(db);
+    attr_cache_foreach(cfs_saveAttr, db);
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  }
+  trace_close();
+  log_close();
 }
 
 /**
@@ -1038,13 +2361,17 @@ void cfs_destroy(void *userdata) {
  * Introduced in version 2.5
  */
 int cfs_access(const char *path, int mask) {
+  if (virtual_path(path))
+    return virtual_access(path, mask);
+  LATENCY_OP(LAT_ACCESS, path);
+
   int retstat = 0;
   char nasPath[PATH_MAX];
 
   log_msg("\ncfs_access(path=\"%s\", mask=0%o)\n", path, mask);
   cfs_fullNasPath(nasPath, path);
 
-  retstat = access(nasPath, mask);
+  retstat = NAS_EMU(NAS_META, access(nasPath, mask));
 
   if (retstat < 0)
     retstat = log_error("cfs_access access");
@@ -1080,6 +2407,11 @@ int cfs_access(const char *path, int mask) {
  * Introduced in version 2.5
  */
 int cfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
+  if (virtual_path(path))
+    return 0;
+  LATENCY_OP(LAT_FTRUNCATE, path);
+  latency_set_range(offset, 0);
+
   int retstat = 0;
 
   struct dualFileHandle *dualFH;
@@ -1088,12 +2420,22 @@ int cfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
           fi, dualFH->nasFH,dualFH->cacheFH);
   log_fi(fi);
 
+  char cacheFileName[PATH_MAX];
+  cfs_pathToFileName(cacheFileName, path);
+
+  gather_flush_path(path);
+  retstat = journal_checkpoint();//a replayed older write must not land after the truncate
+  if (retstat < 0)
+    return retstat;
+  block_index_drop(cacheFileName);
   retstat = ftruncate(dualFH->cacheFH, offset);
   if (retstat < 0)
     retstat = log_error("cfs_ftruncate Cache ftruncate");
-  retstat = ftruncate(dualFH->nasFH, offset);
+  retstat = NAS_EMU(NAS_META, ftruncate(dualFH->nasFH, offset));
   if (retstat < 0)
     retstat = log_error("cfs_ftruncate NAS ftruncate");
+  attr_cache_invalidate(path);
+  revalidate_invalidate(path);
 
   return retstat;
 }
@@ -1112,6 +2454,10 @@ int cfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi) {
  */
 int cfs_fgetattr(const char *path, struct stat *statbuf,
                 struct fuse_file_info *fi) {
+  if (virtual_path(path))
+    return virtual_getattr(path, statbuf);
+  LATENCY_OP(LAT_FGETATTR, path);
+
   int retstat = 0;
 
   log_msg("\ncfs_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n", path,
@@ -1127,7 +2473,10 @@ int cfs_fgetattr(const char *path, struct stat *statbuf,
 
   struct dualFileHandle *dualFH;
   dualFH = (struct dualFileHandle *)fi->fh;
-  retstat = fstat(dualFH->nasFH, statbuf);
+  if (dualFH->nasFH == NO_NAS_FH)//read-only handle without a NAS descriptor yet
+    return cfs_getattr(path, statbuf);
+  gather_flush_path(path);
+  retstat = NAS_EMU(NAS_META, fstat(dualFH->nasFH, statbuf));
   if (retstat < 0)
     retstat = log_error("cfs_fgetattr fstat");
 
@@ -1136,7 +2485,7 @@ int cfs_fgetattr(const char *path, struct stat *statbuf,
   return retstat;
 }
 
-struct fuse_operations cfs_oper = {.getattr = cfs_getNASattr,
+struct fuse_operations cfs_oper = {.getattr = cfs_getattr,
                                   .readlink = cfs_readlink,
                                   // no .getdir -- that's deprecated
                                   .getdir = NULL,
@@ -1178,10 +2527,158 @@ struct fuse_operations cfs_oper = {.getattr = cfs_getNASattr,
                                   .fgetattr = cfs_fgetattr};
 
 void cfs_usage() {
-  fprintf(stderr, "usage:  cachesize blocksize nasDir mountDir cacheDir\n");
+  fprintf(stderr, "usage:  [options] [fuse options] cachesize blocksize nasDir mountDir cacheDir\n");
+  fprintf(stderr, "options:\n");
+  fprintf(stderr, "    --journal-size=Kb    journal writes on the cache device, checkpoint to the NAS every Kb (default 0: write-through)\n");
+  fprintf(stderr, "    --gather-size=Kb     gather small sequential writes per open file into NAS writes of up to Kb (default 0: off)\n");
+  fprintf(stderr, "    --gather-timeout=ms  longest a gathered write waits before going to the NAS (default 30)\n");
+  fprintf(stderr, "    --write-policy=allocate|no-allocate|if-cached\n");
+  fprintf(stderr, "                         which written blocks go into the cache (default allocate)\n");
+  fprintf(stderr, "    --write-stream-threshold=Kb\n");
+  fprintf(stderr, "                         sequential writes beyond Kb on one handle bypass the cache (default 65536, 0: never)\n");
+  fprintf(stderr, "    --attr-timeout=ms    how long getattr results are cached (default 1000, 0: off)\n");
+  fprintf(stderr, "    --attr-negative-timeout=ms\n");
+  fprintf(stderr, "                         how long a missing path is remembered (default 1000, 0: off)\n");
+  fprintf(stderr, "    --attr-persist=0|1   keep cached attributes in the metadata database across mounts (default 0)\n");
+  fprintf(stderr, "    --dir-cache=0|1      serve directory listings from the metadata database (default 0)\n");
+  fprintf(stderr, "    --dir-revalidate=ms  how often a cached listing is checked against the NAS directory mtime (default 1000)\n");
+  fprintf(stderr, "    --revalidate=cto|interval|trust\n");
+  fprintf(stderr, "                         when open checks the cached copy against the NAS: every open (default),\n");
+  fprintf(stderr, "                         at most every --revalidate-interval ms, or once until changed locally\n");
+  fprintf(stderr, "    --revalidate-interval=ms\n");
+  fprintf(stderr, "                         (default 1000)\n");
+  fprintf(stderr, "    --fd-cache=n         descriptors kept open after release for reuse (default 256, 0: off)\n");
+  fprintf(stderr, "    --lowlevel=0|1       use the inode-based low-level FUSE API (default 0)\n");
+  fprintf(stderr, "    --ll-workers=n       threads serving reads/writes/fsyncs in low-level mode (default 16, 0: inline)\n");
+  fprintf(stderr, "    --log-level=error|info|debug|trace\n");
+  fprintf(stderr, "                         what goes to the binary cachefs.log, read it with tools/logdump (default debug;\n");
+  fprintf(stderr, "                         levels above the build's CFS_LOG_LEVEL are compiled out)\n");
+  fprintf(stderr, "    --trace=file         record every read and write to file for tools/cachesim (default off)\n");
+  fprintf(stderr, "    --slow-ms=ms         keep the last %d requests taking ms or longer in /.cachefs/slow (default 1000, 0: off)\n",
+          SLOW_LOG_ENTRIES);
+  fprintf(stderr, "    --pin-budget=Kb      most NAS data user.cachefs.pin may cover (default 0: unlimited)\n");
+  fprintf(stderr, "    --warmup=path        fetch path (a file or directory below the mount) into the cache\n");
+  fprintf(stderr, "                         and exit without mounting; a stopped warm-up resumes where it was\n");
+  fprintf(stderr, "    --warmup-threads=n   workers of --warmup and the warmup control command (default 4)\n");
+  fprintf(stderr, "    --warmup-bandwidth=Kb\n");
+  fprintf(stderr, "                         most NAS Kb per second a warm-up reads (default 0: unlimited)\n");
+  fprintf(stderr, "    --nas-latency=us|op:us,...\n");
+  fprintf(stderr, "                         emulate a slow NAS: delay every NAS call, or per op: meta, open, read,\n");
+  fprintf(stderr, "                         write, sync, list (default 0)\n");
+  fprintf(stderr, "    --nas-jitter=us      emulate a slow NAS: up to this much more delay, uniformly random (default 0)\n");
+  fprintf(stderr, "    --nas-bandwidth=Kb   emulate a slow NAS: Kb per second NAS reads and writes share (default 0: unlimited)\n");
+  fprintf(stderr, "    --nas-concurrency=n  emulate a slow NAS: most NAS calls in flight (default 0: unlimited)\n");
   abort();
 }
 
+//cachefs options are given as --name=value ahead of the positional arguments
+void cfs_parseOption(struct cfs_state *cfs_data, char *option) {
+  char *value = strchr(option, '=');
+  *value++ = '\0';
+
+  if (strcmp(option, "journal-size") == 0)
+    cfs_data->journalsize = str_to_num(value);
+  else if (strcmp(option, "gather-size") == 0)
+    cfs_data->gathersize = str_to_num(value);
+  else if (strcmp(option, "gather-timeout") == 0)
+    cfs_data->gathertimeout = str_to_num(value);
+  else if (strcmp(option, "write-policy") == 0) {
+    if (strcmp(value, "allocate") == 0)
+      cfs_data->writepolicy = WRITE_ALLOCATE;
+    else if (strcmp(value, "no-allocate") == 0)
+      cfs_data->writepolicy = WRITE_NO_ALLOCATE;
+    else if (strcmp(value, "if-cached") == 0)
+      cfs_data->writepolicy = WRITE_ALLOCATE_IF_CACHED;
+    else {
+      fprintf(stderr, "Unknown write policy %s\n", value);
+      cfs_usage();
+    }
+  }
+  else if (strcmp(option, "write-stream-threshold") == 0)
+    cfs_data->streamthreshold = str_to_num(value);
+  else if (strcmp(option, "attr-timeout") == 0)
+    cfs_data->attrtimeout = str_to_num(value);
+  else if (strcmp(option, "attr-negative-timeout") == 0)
+    cfs_data->attrnegativetimeout = str_to_num(value);
+  else if (strcmp(option, "attr-persist") == 0)
+    cfs_data->attrpersist = str_to_num(value);
+  else if (strcmp(option, "dir-cache") == 0)
+    cfs_data->dircache = str_to_num(value);
+  else if (strcmp(option, "dir-revalidate") == 0)
+    cfs_data->dirrevalidate = str_to_num(value);
+  else if (strcmp(option, "revalidate") == 0) {
+    if (strcmp(value, "cto") == 0)
+      cfs_data->revalidatemode = REVALIDATE_CTO;
+    else if (strcmp(value, "interval") == 0)
+      cfs_data->revalidatemode = REVALIDATE_INTERVAL;
+    else if (strcmp(value, "trust") == 0)
+      cfs_data->revalidatemode = REVALIDATE_TRUST;
+    else {
+      fprintf(stderr, "Unknown revalidation mode %s\n", value);
+      cfs_usage();
+    }
+  }
+  else if (strcmp(option, "revalidate-interval") == 0)
+    cfs_data->revalidateinterval = str_to_num(value);
+  else if (strcmp(option, "fd-cache") == 0)
+    cfs_data->fdcache = str_to_num(value);
+  else if (strcmp(option, "lowlevel") == 0)
+    cfs_data->lowlevel = str_to_num(value);
+  else if (strcmp(option, "ll-workers") == 0)
+    cfs_data->llworkers = str_to_num(value);
+  else if (strcmp(option, "log-level") == 0) {
+    if (strcmp(value, "error") == 0)
+      cfs_data->loglevel = LOG_ERROR;
+    else if (strcmp(value, "info") == 0)
+      cfs_data->loglevel = LOG_INFO;
+    else if (strcmp(value, "debug") == 0)
+      cfs_data->loglevel = LOG_DEBUG;
+    else if (strcmp(value, "trace") == 0)
+      cfs_data->loglevel = LOG_TRACE;
+    else {
+      fprintf(stderr, "Unknown log level %s\n", value);
+      cfs_usage();
+    }
+  }
+  else if (strcmp(option, "trace") == 0)
+    cfs_data->tracefile = value;
+  else if (strcmp(option, "slow-ms") == 0)
+    cfs_data->slowms = str_to_num(value);
+  else if (strcmp(option, "pin-budget") == 0)
+    cfs_data->pinbudget = str_to_num(value);
+  else if (strcmp(option, "warmup") == 0)
+    cfs_data->warmup = value;
+  else if (strcmp(option, "warmup-threads") == 0)
+    cfs_data->warmupthreads = str_to_num(value);
+  else if (strcmp(option, "warmup-bandwidth") == 0)
+    cfs_data->warmupbandwidth = str_to_num(value);
+  else if (strcmp(option, "nas-latency") == 0)
+    cfs_data->naslatency = value;
+  else if (strcmp(option, "nas-jitter") == 0)
+    cfs_data->nasjitter = str_to_num(value);
+  else if (strcmp(option, "nas-bandwidth") == 0)
+    cfs_data->nasbandwidth = str_to_num(value);
+  else if (strcmp(option, "nas-concurrency") == 0)
+    cfs_data->nasconcurrency = str_to_num(value);
+  else {
+    fprintf(stderr, "Unknown option --%s\n", option);
+    cfs_usage();
+  }
+}
+
+//Journal replay runs before fuse_main, so no CFS_DATA or log_msg in here
+static char *replayCacheDir;
+static void cfs_dropReplayedFile(const char *path) {
+  char cacheFileName[PATH_MAX], cachePath[PATH_MAX];
+
+  cfs_flattenPath(cacheFileName, path);
+  snprintf(cachePath, PATH_MAX, "%s%s", replayCacheDir, cacheFileName);
+  fprintf(stderr, "Write journal: dropping cached copy of %s\n", path);
+
+  delete_file(metaDataBase, cacheFileName);
+  unlink(cachePath);
+}
+
 int main(int argc, char *argv[]) {
   int fuse_stat;
   struct cfs_state *cfs_data;
@@ -1213,15 +2710,52 @@ int main(int argc, char *argv[]) {
   if ((argc < 6)  || (argv[argc - 3][0] == '-')|| (argv[argc - 2][0] == '-') || (argv[argc - 1][0] == '-'))
     cfs_usage();
 
-  cfs_data = malloc(sizeof(struct cfs_state));
+  cfs_data = calloc(1, sizeof(struct cfs_state));
   if (cfs_data == NULL) {
     perror("main calloc");
     abort();
   }
+  cfs_global_state = cfs_data;
+
+  // Everything ahead of the five positional arguments is either one of
+  // our --name=value options or gets passed through to fuse
+  cfs_data->gathertimeout = 30;
+  cfs_data->writepolicy = WRITE_ALLOCATE;
+  cfs_data->streamthreshold = 64*1024;
+  cfs_data->attrtimeout = 1000;
+  cfs_data->attrnegativetimeout = 1000;
+  cfs_data->dircache = 0;
+  cfs_data->dirrevalidate = 1000;
+  cfs_data->revalidatemode = REVALIDATE_CTO;
+  cfs_data->revalidateinterval = 1000;
+  cfs_data->fdcache = 256;
+  cfs_data->llworkers = 16;
+  cfs_data->loglevel = LOG_DEBUG;
+  cfs_data->slowms = 1000;
+  cfs_data->warmupthreads = 4;
+
+  char *mountdir = argv[argc - 2];
+  int fuseArgc = 1;
+  for (int i = 1; i < argc - 5; i++) {
+    if (strncmp(argv[i], "--", 2) == 0 && strchr(argv[i], '='))
+      cfs_parseOption(cfs_data, argv[i] + 2);
+    else
+      argv[fuseArgc++] = argv[i];
+  }
 
   //cache size supplied as argv[argc-5], block size supplied as argv[argc-4]
   cfs_data->nasdir = realpath(argv[argc - 3], NULL);//save our nas and cachefs directory paths early on
   cfs_data->cachedir = realpath(argv[argc - 1], NULL);
+  if (nas_emu_init(cfs_data->nasdir, cfs_data->naslatency, cfs_data->nasjitter,
+                   (uint64_t)cfs_data->nasbandwidth*1024, cfs_data->nasconcurrency) < 0)
+  {
+    fprintf(stderr, "Bad --nas-latency %s\n", cfs_data->naslatency);
+    cfs_usage();
+  }
+  if (nas_emu_enabled())
+    fprintf(stderr, "Emulating a slow NAS: latency %s us, jitter %u us, bandwidth %lu Kb/s, concurrency %u\n",
+            cfs_data->naslatency ? cfs_data->naslatency : "0", cfs_data->nasjitter,
+            cfs_data->nasbandwidth, cfs_data->nasconcurrency);
 
   //cache sizing
   size_t userSize;
@@ -1261,12 +2795,10 @@ int main(int argc, char *argv[]) {
   }
 
   sscanf(argv[argc-4], "%lu", &block_size);//set our block size
-  argv[argc - 5] = argv[argc - 2];//put mountdir in first non null argv entry
-  argv[argc - 4] = NULL;
-  argv[argc - 3] = NULL;
-  argv[argc - 2] = NULL;
-  argv[argc - 1] = NULL;
-  argc = 2;
+  for (int i = fuseArgc; i < argc; i++)//fuse gets its own options followed by mountdir
+    argv[i] = NULL;
+  argv[fuseArgc++] = mountdir;
+  argc = fuseArgc;
   fprintf(stderr, "Nas Path %s\n", cfs_data->nasdir);
   fprintf(stderr, "Cache Path %s\n", cfs_data->cachedir);
   fprintf(stderr, "New cache size (Kb): %lu\n", cache_size);
@@ -1276,6 +2808,7 @@ int main(int argc, char *argv[]) {
 
 
   cfs_data->logfile = log_open();
+  log_level = cfs_data->loglevel;
 
   /*-------------------Open Metadata Handle-------------------*/
   if (VERBOSE)
@@ -1299,6 +2832,9 @@ int main(int argc, char *argv[]) {
   if((VERBOSE)&&(ret ==-1)){
     printf("Tables probably exist already!\n");
   }
+  create_nas_mtime_column(metaDataBase);
+  // FUSE workers each open their own connection from here on
+  init_db_pool(metadata_file, metaDataBase);
 
   if(VERBOSE)
   {
@@ -1320,7 +2856,84 @@ int main(int argc, char *argv[]) {
 
   /*-------------------Open Metadata Handle-------------------*/
 
+  /*-------------------Attribute Cache-------------------*/
+  attr_cache_init(cfs_data->attrtimeout, cfs_data->attrnegativetimeout, 1024*1024);
+  if (cfs_data->attrpersist && create_attr_table(metaDataBase) == 0)
+  {
+    load_attrs(metaDataBase, cfs_loadAttr);
+  }
+  /*-------------------Attribute Cache-------------------*/
+
+  dir_cache_init(metaDataBase, cfs_data->dircache, cfs_data->dirrevalidate);
+  range_lock_init(block_size);
+  virtual_register("stats", cfs_renderStats, cfs_resetStats);
+  virtual_register("metrics", cfs_renderMetrics, NULL);
+  slow_log_init(cfs_data->slowms, SLOW_LOG_ENTRIES);
+  virtual_register("slow", cfs_renderSlowLog, cfs_clearSlowLog);
+  pin_init((uint64_t)cfs_data->pinbudget*1024, cfs_flattenPath);
+  if (create_pin_table(metaDataBase) == 0)
+    load_pins(metaDataBase, cfs_loadPin);
+  virtual_register("pins", cfs_renderPins, NULL);
+  control_register("prefetch", "bytes", cfs_ctlPrefetch);
+  control_register("evict", "files", cfs_ctlEvict);
+  control_register("drop", "files", cfs_ctlDrop);
+  control_register("flush", "steps", cfs_ctlFlush);
+  control_register("reclaim", "bytes", cfs_ctlReclaim);
+  control_register("pinsize", "bytes", cfs_ctlPinSize);
+  control_register("warmup", "bytes", cfs_ctlWarmup);
+  virtual_register("ctl", control_render, control_submit);
+  if (cfs_data->tracefile && (ret = trace_open(cfs_data->tracefile, block_size)) < 0)
+  {
+    fprintf(stderr, "Cannot record a trace to %s: %s\n", cfs_data->tracefile, strerror(-ret));
+    return 1;
+  }
+  block_index_init(block_size);
+  revalidate_init(cfs_data->revalidatemode, cfs_data->revalidateinterval, 1024*1024);
+  fd_cache_init(cfs_data->fdcache);
+
+  /*-------------------Replay Write Journal-------------------*/
+  journal_set_checkpoint_hook(gather_flush_all);//gathered writes have to be on the NAS before their records go
+  if (journal_open(cfs_data->cachedir, cfs_data->nasdir, cfs_data->journalsize*1024) == 0)
+  {
+    replayCacheDir = cfs_data->cachedir;
+    if (journal_replay(cfs_dropReplayedFile) < 0)
+    {
+      fprintf(stderr, "Write journal could not be replayed to the NAS, refusing to mount\n");
+      return 1;
+    }
+  }
+  fprintf(stderr, "Write journal size (Kb): %lu\n", cfs_data->journalsize);
+  fprintf(stderr, "Write gather size (Kb): %lu, timeout (ms): %u\n", cfs_data->gathersize, cfs_data->gathertimeout);
+  fprintf(stderr, "Write policy: %d, streaming write threshold (Kb): %lu\n", cfs_data->writepolicy, cfs_data->streamthreshold);
+  fprintf(stderr, "Open revalidation mode: %d, interval (ms): %u\n", cfs_data->revalidatemode, cfs_data->revalidateinterval);
+  /*-------------------Replay Write Journal-------------------*/
+
+  /*-------------------Offline Warm-up-------------------*/
+  if (cfs_data->warmup)
+  {
+    struct warmupConfig config;
+    struct warmupResult result;
+
+    cfs_warmupConfig(&config, cfs_data);
+    ret = warmup_run(cfs_data->warmup, &config, &result);
+    fprintf(stderr, "Warm-up of %s: %llu files, %llu bytes fetched, %llu already cached, %llu errors\n",
+            cfs_data->warmup, (unsigned long long)result.files, (unsigned long long)result.fetchedBytes,
+            (unsigned long long)result.cachedBytes, (unsigned long long)result.errors);
+    if (ret < 0)
+      fprintf(stderr, "Warm-up stopped: %s\n", strerror(-ret));
+    journal_close();
+    return ret < 0 ? 1 : 0;
+  }
+  /*-------------------Offline Warm-up-------------------*/
+
   // turn over control to fuse
+  if (cfs_data->lowlevel)
+  {
+    fprintf(stderr, "about to call cfs_ll_main\n");
+    fuse_stat = cfs_ll_main(argc, argv, cfs_data);
+    fprintf(stderr, "cfs_ll_main returned %d\n", fuse_stat);
+    return fuse_stat;
+  }
   fprintf(stderr, "about to call fuse_main\n");
   fuse_stat = fuse_main(argc, argv, &cfs_oper, cfs_data);
   fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
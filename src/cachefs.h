@@ -0,0 +1,74 @@
+/*
+  The path-based cachefs operations from cachefs.c.  The high-level
+  frontend hands them to fuse_main through cfs_oper; the low-level
+  frontend (cachefs_ll.c) calls them after turning inode numbers back
+  into paths, and calls the *Named file operations with the NAS and
+  cache names its inode table keeps.
+*/
+
+#ifndef _CACHEFS_H_
+#define _CACHEFS_H_
+
+#include "params.h"
+
+#include <fuse.h>
+#include <sys/statvfs.h>
+#include <utime.h>
+
+// every name a file goes by: its path below the mount, on the NAS and in
+// the cache
+struct cfs_fileNames {
+  char path[PATH_MAX];
+  char nasPath[PATH_MAX];
+  char cacheName[PATH_MAX];
+  char cachePath[PATH_MAX];
+};
+void cfs_nameFile(const char *path, char nasPath[PATH_MAX], char cacheName[PATH_MAX], char cachePath[PATH_MAX]);
+void cfs_fileNames(struct cfs_fileNames *names, const char *path);
+
+int cfs_getNASattr(const char *path, struct stat *statbuf);
+int cfs_getattr(const char *path, struct stat *statbuf);
+int cfs_readlink(const char *path, char *link, size_t size);
+int cfs_mknod(const char *path, mode_t mode, dev_t dev);
+int cfs_mkdir(const char *path, mode_t mode);
+int cfs_unlink(const char *path);
+int cfs_rmdir(const char *path);
+int cfs_symlink(const char *path, const char *link);
+int cfs_rename(const char *path, const char *newpath);
+int cfs_link(const char *path, const char *newpath);
+int cfs_chmod(const char *path, mode_t mode);
+int cfs_chown(const char *path, uid_t uid, gid_t gid);
+int cfs_truncate(const char *path, off_t newsize);
+int cfs_utime(const char *path, struct utimbuf *ubuf);
+int cfs_open(const char *path, struct fuse_file_info *fi);
+int cfs_openNamed(struct cfs_fileNames *names, struct fuse_file_info *fi);
+int cfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int cfs_readNamed(struct cfs_fileNames *names, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int cfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int cfs_writeNamed(struct cfs_fileNames *names, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int cfs_statfs(const char *path, struct statvfs *statv);
+int cfs_flush(const char *path, struct fuse_file_info *fi);
+int cfs_release(const char *path, struct fuse_file_info *fi);
+int cfs_releaseNamed(struct cfs_fileNames *names, struct fuse_file_info *fi);
+int cfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+#ifdef HAVE_SYS_XATTR_H
+int cfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+int cfs_getxattr(const char *path, const char *name, char *value, size_t size);
+int cfs_listxattr(const char *path, char *list, size_t size);
+int cfs_removexattr(const char *path, const char *name);
+#endif
+int cfs_opendir(const char *path, struct fuse_file_info *fi);
+int cfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+int cfs_releasedir(const char *path, struct fuse_file_info *fi);
+void cfs_destroy(void *userdata);
+int cfs_access(const char *path, int mask);
+int cfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
+
+// background threads, started by whichever frontend's init runs once
+// fuse has daemonized
+void cfs_startWorkers(void);
+
+// cachefs_ll.c: mount with the low-level API, returns the exit status
+int cfs_ll_main(int argc, char *argv[], struct cfs_state *cfs_data);
+
+#endif
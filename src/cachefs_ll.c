@@ -0,0 +1,689 @@
+/*
+  Low-level (inode based) FUSE frontend for cachefs, used with
+  --lowlevel=1.
+
+  Requests arrive with inode numbers, which inode.c turns back into
+  the paths the cfs_* operations work on (and, for file operations,
+  the NAS and cache names, worked out once per inode), so kernel
+  lookups go straight to our attribute and directory caches instead
+  of through libfuse's serialized path tree.  Reads, writes, flushes, fsyncs and
+  releases, the requests that may wait on the NAS, are queued to a
+  pool of NAS workers that reply from there, which keeps the session
+  loop threads free for requests the cache can answer.
+*/
+#include "config.h"
+#include "params.h"
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cacheHelp.h"
+#include "cachefs.h"
+#include "inode.h"
+#include "log.h"
+
+#define LL_UNKNOWN_INO 0xffffffff // what libfuse reports for readdir without use_ino
+
+//----------------------------------------------------------------
+// NAS worker pool
+
+enum llJobType {LL_READ, LL_WRITE, LL_FLUSH, LL_FSYNC, LL_RELEASE};
+
+struct llJob {
+  enum llJobType type;
+  fuse_req_t req;
+  fuse_ino_t ino;
+  struct fuse_file_info fi; // the request's copy is gone once we return
+  char *buf;
+  size_t size;
+  off_t off;
+  int datasync;
+  struct llJob *next;
+};
+
+static struct llJob *llQueueHead = NULL, *llQueueTail = NULL;
+static pthread_mutex_t llQueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t llQueueCond = PTHREAD_COND_INITIALIZER;
+static pthread_t *llWorkers = NULL;
+static unsigned llWorkerCount = 0;
+static int llStopping = 0;
+
+static void ll_run(struct llJob *job) {
+  struct cfs_fileNames names;
+  const char *path = names.path;
+  int retstat = inode_names(job->ino, names.path, names.nasPath, names.cacheName, names.cachePath);
+
+  if (retstat < 0) {
+    fuse_reply_err(job->req, -retstat);
+    return;
+  }
+
+  switch (job->type) {
+  case LL_READ:
+    job->buf = malloc(job->size);
+    if (job->buf == NULL) {
+      fuse_reply_err(job->req, ENOMEM);
+      break;
+    }
+    retstat = cfs_readNamed(&names, job->buf, job->size, job->off, &job->fi);
+    if (retstat < 0)
+      fuse_reply_err(job->req, -retstat);
+    else {
+      // cfs_read reports the block-aligned length it read, counted from
+      // the start of the block holding off
+      off_t skip = job->off - alignLowerOffset(job->off);
+      size_t len = retstat > skip ? (size_t)(retstat - skip) : 0;
+      fuse_reply_buf(job->req, job->buf, len < job->size ? len : job->size);
+    }
+    break;
+  case LL_WRITE:
+    retstat = cfs_writeNamed(&names, job->buf, job->size, job->off, &job->fi);
+    if (retstat < 0)
+      fuse_reply_err(job->req, -retstat);
+    else
+      fuse_reply_write(job->req, retstat);
+    break;
+  case LL_FLUSH:
+    fuse_reply_err(job->req, -cfs_flush(path, &job->fi));
+    break;
+  case LL_FSYNC:
+    fuse_reply_err(job->req, -cfs_fsync(path, job->datasync, &job->fi));
+    break;
+  case LL_RELEASE:
+    cfs_releaseNamed(&names, &job->fi);
+    fuse_reply_err(job->req, 0);
+    break;
+  }
+}
+
+static void *ll_worker(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&llQueueLock);
+  for (;;) {
+    while (llQueueHead == NULL && !llStopping)
+      pthread_cond_wait(&llQueueCond, &llQueueLock);
+    if (llQueueHead == NULL)
+      break;
+    struct llJob *job = llQueueHead;
+    llQueueHead = job->next;
+    if (llQueueHead == NULL)
+      llQueueTail = NULL;
+    pthread_mutex_unlock(&llQueueLock);
+
+    ll_run(job);
+    free(job->buf);
+    free(job);
+
+    pthread_mutex_lock(&llQueueLock);
+  }
+  pthread_mutex_unlock(&llQueueLock);
+
+  return NULL;
+}
+
+// hand job to the pool, or run it here when there is no pool
+static void ll_queue(struct llJob *job) {
+  if (llWorkerCount == 0) {
+    ll_run(job);
+    free(job->buf);
+    free(job);
+    return;
+  }
+
+  job->next = NULL;
+  pthread_mutex_lock(&llQueueLock);
+  if (llQueueTail)
+    llQueueTail->next = job;
+  else
+    llQueueHead = job;
+  llQueueTail = job;
+  pthread_cond_signal(&llQueueCond);
+  pthread_mutex_unlock(&llQueueLock);
+}
+
+static struct llJob *ll_job(enum llJobType type, fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct llJob *job = calloc(1, sizeof(*job));
+  job->type = type;
+  job->req = req;
+  job->ino = ino;
+  job->fi = *fi;
+  return job;
+}
+
+static void ll_start_workers(unsigned count) {
+  llWorkers = calloc(count, sizeof(pthread_t));
+  for (unsigned i = 0; i < count; i++) {
+    if (pthread_create(&llWorkers[i], NULL, ll_worker, NULL) != 0)
+      break;
+    llWorkerCount++;
+  }
+  log_at(LOG_INFO, "    %u NAS workers\n", llWorkerCount);
+}
+
+static void ll_stop_workers(void) {
+  pthread_mutex_lock(&llQueueLock);
+  llStopping = 1;
+  pthread_cond_broadcast(&llQueueCond);
+  pthread_mutex_unlock(&llQueueLock);
+
+  for (unsigned i = 0; i < llWorkerCount; i++)
+    pthread_join(llWorkers[i], NULL);
+  free(llWorkers);
+  llWorkerCount = 0;
+}
+
+//----------------------------------------------------------------
+// helpers
+
+static double ll_attr_timeout(void) {
+  return CFS_DATA->attrtimeout / 1000.0;
+}
+
+// path of name in directory parent
+static int ll_child_path(fuse_ino_t parent, const char *name, char path[PATH_MAX]) {
+  int retstat = inode_path(parent, path);
+  if (retstat < 0)
+    return retstat;
+
+  size_t len = strlen(path);
+  if (len + 1 + strlen(name) >= PATH_MAX)
+    return -ENAMETOOLONG;
+  if (len > 1)
+    path[len++] = '/';
+  strcpy(path + len, name);
+  return 0;
+}
+
+// answer a lookup (or a create) of path with its entry
+static void ll_reply_entry(fuse_req_t req, const char *path) {
+  struct fuse_entry_param entry;
+  memset(&entry, 0, sizeof(entry));
+
+  int retstat = cfs_getattr(path, &entry.attr);
+  if (retstat == -ENOENT && CFS_DATA->attrnegativetimeout) {
+    // ino 0 lets the kernel keep the negative dentry for a while too
+    entry.entry_timeout = CFS_DATA->attrnegativetimeout / 1000.0;
+    fuse_reply_entry(req, &entry);
+    return;
+  }
+  if (retstat < 0) {
+    fuse_reply_err(req, -retstat);
+    return;
+  }
+
+  entry.ino = inode_lookup(path, &entry.attr);
+  entry.attr.st_ino = entry.ino;
+  entry.attr_timeout = ll_attr_timeout();
+  entry.entry_timeout = ll_attr_timeout();
+  fuse_reply_entry(req, &entry);
+}
+
+//----------------------------------------------------------------
+// operations
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+  (void)userdata;
+  log_msg("\nll_init()\n");
+  log_conn(conn);
+
+  cfs_startWorkers();
+  ll_start_workers(CFS_DATA->llworkers);
+}
+
+static void ll_destroy(void *userdata) {
+  ll_stop_workers();
+  cfs_destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  char path[PATH_MAX];
+  int retstat = ll_child_path(parent, name, path);
+
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    ll_reply_entry(req, path);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  inode_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  char path[PATH_MAX];
+  struct stat statbuf;
+  (void)fi;
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_getattr(path, &statbuf);
+  if (retstat < 0) {
+    fuse_reply_err(req, -retstat);
+    return;
+  }
+
+  statbuf.st_ino = ino;
+  fuse_reply_attr(req, &statbuf, ll_attr_timeout());
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+  char path[PATH_MAX];
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0 && (to_set & FUSE_SET_ATTR_MODE))
+    retstat = cfs_chmod(path, attr->st_mode);
+  if (retstat == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+    retstat = cfs_chown(path, (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1,
+                        (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1);
+  if (retstat == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    retstat = fi ? cfs_ftruncate(path, attr->st_size, fi) : cfs_truncate(path, attr->st_size);
+  if (retstat == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                                 FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))) {
+    // utime sets both, so the one not being changed keeps its NAS value
+    struct stat current;
+    struct utimbuf times;
+    time_t now = time(NULL);
+
+    retstat = cfs_getNASattr(path, &current);
+    if (retstat == 0) {
+      times.actime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? now
+                   : (to_set & FUSE_SET_ATTR_ATIME) ? attr->st_atime : current.st_atime;
+      times.modtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? now
+                    : (to_set & FUSE_SET_ATTR_MTIME) ? attr->st_mtime : current.st_mtime;
+      retstat = cfs_utime(path, &times);
+    }
+  }
+
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    ll_getattr(req, ino, NULL);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  char path[PATH_MAX], link[PATH_MAX];
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_readlink(path, link, sizeof(link));
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    fuse_reply_readlink(req, link);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+  char path[PATH_MAX];
+
+  int retstat = ll_child_path(parent, name, path);
+  if (retstat == 0)
+    retstat = cfs_mknod(path, mode, rdev);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    ll_reply_entry(req, path);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  char path[PATH_MAX];
+
+  int retstat = ll_child_path(parent, name, path);
+  if (retstat == 0)
+    retstat = cfs_mkdir(path, mode);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    ll_reply_entry(req, path);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  char path[PATH_MAX];
+
+  int retstat = ll_child_path(parent, name, path);
+  if (retstat == 0)
+    retstat = cfs_unlink(path);
+  if (retstat == 0)
+    inode_unlinked(path);
+  fuse_reply_err(req, -retstat);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  char path[PATH_MAX];
+
+  int retstat = ll_child_path(parent, name, path);
+  if (retstat == 0)
+    retstat = cfs_rmdir(path);
+  if (retstat == 0)
+    inode_unlinked(path);
+  fuse_reply_err(req, -retstat);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+  char path[PATH_MAX];
+
+  int retstat = ll_child_path(parent, name, path);
+  if (retstat == 0)
+    retstat = cfs_symlink(link, path);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    ll_reply_entry(req, path);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname) {
+  char path[PATH_MAX], newpath[PATH_MAX];
+
+  int retstat = ll_child_path(parent, name, path);
+  if (retstat == 0)
+    retstat = ll_child_path(newparent, newname, newpath);
+  if (retstat == 0)
+    retstat = cfs_rename(path, newpath);
+  if (retstat == 0)
+    inode_renamed(path, newpath);
+  fuse_reply_err(req, -retstat);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+  char path[PATH_MAX], newpath[PATH_MAX];
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = ll_child_path(newparent, newname, newpath);
+  if (retstat == 0)
+    retstat = cfs_link(path, newpath);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    ll_reply_entry(req, newpath);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct cfs_fileNames names;
+
+  int retstat = inode_names(ino, names.path, names.nasPath, names.cacheName, names.cachePath);
+  if (retstat == 0)
+    retstat = cfs_openNamed(&names, fi);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+  struct llJob *job = ll_job(LL_READ, req, ino, fi);
+  job->size = size;
+  job->off = off;
+  ll_queue(job);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                     off_t off, struct fuse_file_info *fi) {
+  struct llJob *job = ll_job(LL_WRITE, req, ino, fi);
+  job->buf = malloc(size);
+  memcpy(job->buf, buf, size);
+  job->size = size;
+  job->off = off;
+  ll_queue(job);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  ll_queue(ll_job(LL_FLUSH, req, ino, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  ll_queue(ll_job(LL_RELEASE, req, ino, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  struct llJob *job = ll_job(LL_FSYNC, req, ino, fi);
+  job->datasync = datasync;
+  ll_queue(job);
+}
+
+// An open directory: the cfs_opendir handle plus the listing packed
+// for fuse_add_direntry, built on the first readdir at offset 0
+struct llDir {
+  uint64_t fh;
+  char *buf;
+  size_t size, capacity;
+  fuse_req_t req;
+};
+
+static void ll_dir_fi(struct fuse_file_info *dirfi, const struct fuse_file_info *fi, const struct llDir *dir) {
+  *dirfi = *fi;
+  dirfi->fh = dir->fh;
+}
+
+static int ll_dir_fill(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+  struct llDir *dir = buf;
+  struct stat entry;
+  (void)stbuf;
+  (void)off;
+
+  memset(&entry, 0, sizeof(entry));
+  entry.st_ino = LL_UNKNOWN_INO;
+
+  size_t need = fuse_add_direntry(dir->req, NULL, 0, name, NULL, 0);
+  if (dir->size + need > dir->capacity) {
+    while (dir->size + need > dir->capacity)
+      dir->capacity = dir->capacity ? dir->capacity * 2 : 4096;
+    dir->buf = realloc(dir->buf, dir->capacity);
+  }
+  fuse_add_direntry(dir->req, dir->buf + dir->size, need, name, &entry, dir->size + need);
+  dir->size += need;
+  return 0;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  char path[PATH_MAX];
+  struct fuse_file_info dirfi = *fi;
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_opendir(path, &dirfi);
+  if (retstat < 0) {
+    fuse_reply_err(req, -retstat);
+    return;
+  }
+
+  struct llDir *dir = calloc(1, sizeof(*dir));
+  dir->fh = dirfi.fh;
+  fi->fh = (uintptr_t)dir;
+  fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+  struct llDir *dir = (struct llDir *)(uintptr_t)fi->fh;
+  struct fuse_file_info dirfi;
+  char path[PATH_MAX];
+
+  if (off == 0 || dir->buf == NULL) {
+    int retstat = inode_path(ino, path);
+    if (retstat < 0) {
+      fuse_reply_err(req, -retstat);
+      return;
+    }
+    dir->size = 0;
+    dir->req = req;
+    ll_dir_fi(&dirfi, fi, dir);
+    retstat = cfs_readdir(path, dir, ll_dir_fill, 0, &dirfi);
+    if (retstat < 0) {
+      fuse_reply_err(req, -retstat);
+      return;
+    }
+  }
+
+  if ((size_t)off >= dir->size)
+    fuse_reply_buf(req, NULL, 0);
+  else
+    fuse_reply_buf(req, dir->buf + off, dir->size - off < size ? dir->size - off : size);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct llDir *dir = (struct llDir *)(uintptr_t)fi->fh;
+  struct fuse_file_info dirfi;
+  char path[PATH_MAX];
+
+  ll_dir_fi(&dirfi, fi, dir);
+  if (inode_path(ino, path) < 0)
+    strcpy(path, "/"); // cfs_releasedir only logs the path
+  cfs_releasedir(path, &dirfi);
+  free(dir->buf);
+  free(dir);
+  fuse_reply_err(req, 0);
+}
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  (void)ino;
+  (void)datasync;
+  (void)fi;
+  fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  char path[PATH_MAX];
+  struct statvfs statv;
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_statfs(path, &statv);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else
+    fuse_reply_statfs(req, &statv);
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                        const char *value, size_t size, int flags) {
+  char path[PATH_MAX];
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_setxattr(path, name, value, size, flags);
+  fuse_reply_err(req, retstat < 0 ? -retstat : 0);
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+  char path[PATH_MAX];
+  char *value = size ? malloc(size) : NULL;
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_getxattr(path, name, value, size);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else if (size == 0)
+    fuse_reply_xattr(req, retstat);
+  else
+    fuse_reply_buf(req, value, retstat);
+  free(value);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  char path[PATH_MAX];
+  char *list = size ? malloc(size) : NULL;
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_listxattr(path, list, size);
+  if (retstat < 0)
+    fuse_reply_err(req, -retstat);
+  else if (size == 0)
+    fuse_reply_xattr(req, retstat);
+  else
+    fuse_reply_buf(req, list, retstat);
+  free(list);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+  char path[PATH_MAX];
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_removexattr(path, name);
+  fuse_reply_err(req, retstat < 0 ? -retstat : 0);
+}
+#endif
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+  char path[PATH_MAX];
+
+  int retstat = inode_path(ino, path);
+  if (retstat == 0)
+    retstat = cfs_access(path, mask);
+  fuse_reply_err(req, retstat < 0 ? -retstat : 0);
+}
+
+static struct fuse_lowlevel_ops cfs_ll_oper = {.init = ll_init,
+                                               .destroy = ll_destroy,
+                                               .lookup = ll_lookup,
+                                               .forget = ll_forget,
+                                               .getattr = ll_getattr,
+                                               .setattr = ll_setattr,
+                                               .readlink = ll_readlink,
+                                               .mknod = ll_mknod,
+                                               .mkdir = ll_mkdir,
+                                               .unlink = ll_unlink,
+                                               .rmdir = ll_rmdir,
+                                               .symlink = ll_symlink,
+                                               .rename = ll_rename,
+                                               .link = ll_link,
+                                               .open = ll_open,
+                                               .read = ll_read,
+                                               .write = ll_write,
+                                               .flush = ll_flush,
+                                               .release = ll_release,
+                                               .fsync = ll_fsync,
+                                               .opendir = ll_opendir,
+                                               .readdir = ll_readdir,
+                                               .releasedir = ll_releasedir,
+                                               .fsyncdir = ll_fsyncdir,
+                                               .statfs = ll_statfs,
+#ifdef HAVE_SYS_XATTR_H
+                                               .setxattr = ll_setxattr,
+                                               .getxattr = ll_getxattr,
+                                               .listxattr = ll_listxattr,
+                                               .removexattr = ll_removexattr,
+#endif
+                                               .access = ll_access};
+
+int cfs_ll_main(int argc, char *argv[], struct cfs_state *cfs_data) {
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+  int err = -1;
+
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) < 0)
+    return 1;
+
+  inode_table_init(cfs_nameFile);
+  if ((ch = fuse_mount(mountpoint, &args)) != NULL) {
+    se = fuse_lowlevel_new(&args, &cfs_ll_oper, sizeof(cfs_ll_oper), cfs_data);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+        err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  fuse_opt_free_args(&args);
+  free(mountpoint);
+
+  return err ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+/*
+  Control commands.  See control.h.
+
+  Jobs live in a fixed ring of the most recent CONTROL_JOBS; only
+  finished jobs are overwritten, a submission that would push out a
+  queued or running one fails with EBUSY.  Everything is under one
+  mutex except the command itself.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "control.h"
+
+#define CONTROL_COMMANDS 16
+#define CONTROL_JOBS 32
+#define CONTROL_LINE 4096
+
+enum controlState { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED };
+
+static const char *controlStateNames[] = {"queued", "running", "done", "failed"};
+
+struct controlEntry {
+  const char *name;
+  const char *units;
+  controlCommand run;
+};
+
+struct controlJob {
+  uint64_t id;
+  const struct controlEntry *command;
+  char arg[CONTROL_LINE];
+  enum controlState state;
+  int result;
+  uint64_t done, total;
+  struct timespec started, finished;
+};
+
+static struct controlEntry controlCommands[CONTROL_COMMANDS];
+static int controlCommandCount = 0;
+
+static struct controlJob controlJobs[CONTROL_JOBS];
+static uint64_t controlNextId = 1; // id of the next job submitted
+static uint64_t controlRunId = 1;  // id of the next job to run
+static pthread_mutex_t controlLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t controlCond = PTHREAD_COND_INITIALIZER;
+static pthread_t controlThread;
+static int controlRunning = 0;
+
+void control_register(const char *name, const char *units, controlCommand run) {
+  if (controlCommandCount == CONTROL_COMMANDS)
+    return;
+  controlCommands[controlCommandCount].name = name;
+  controlCommands[controlCommandCount].units = units;
+  controlCommands[controlCommandCount].run = run;
+  controlCommandCount++;
+}
+
+static struct controlJob *control_job(uint64_t id) {
+  return &controlJobs[id % CONTROL_JOBS];
+}
+
+static void *control_worker(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&controlLock);
+  while (controlRunning) {
+    if (controlRunId == controlNextId) {
+      pthread_cond_wait(&controlCond, &controlLock);
+      continue;
+    }
+    struct controlJob *job = control_job(controlRunId++);
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    pthread_mutex_unlock(&controlLock);
+
+    int result = job->command->run(job->arg, job);
+
+    pthread_mutex_lock(&controlLock);
+    job->result = result;
+    job->state = result < 0 ? JOB_FAILED : JOB_DONE;
+    clock_gettime(CLOCK_MONOTONIC, &job->finished);
+  }
+  pthread_mutex_unlock(&controlLock);
+  return NULL;
+}
+
+int control_start(void) {
+  controlRunning = 1;
+  if (pthread_create(&controlThread, NULL, control_worker, NULL) != 0) {
+    controlRunning = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void control_shutdown(void) {
+  if (!controlRunning)
+    return;
+  pthread_mutex_lock(&controlLock);
+  controlRunning = 0;
+  pthread_cond_signal(&controlCond);
+  pthread_mutex_unlock(&controlLock);
+  pthread_join(controlThread, NULL);
+}
+
+void control_progress(struct controlJob *job, uint64_t done, uint64_t total) {
+  pthread_mutex_lock(&controlLock);
+  job->done = done;
+  job->total = total;
+  pthread_mutex_unlock(&controlLock);
+}
+
+int control_stopping(void) {
+  return !__atomic_load_n(&controlRunning, __ATOMIC_RELAXED);
+}
+
+// queue one "command [argument]" line; 0 or -errno
+static int control_submit_line(char *line) {
+  char *arg = line + strcspn(line, " \t");
+  if (*arg) {
+    *arg++ = '\0';
+    arg += strspn(arg, " \t");
+  }
+
+  for (int i = 0; i < controlCommandCount; i++) {
+    if (strcmp(controlCommands[i].name, line) != 0)
+      continue;
+    if (!controlRunning)
+      return -EAGAIN;
+    pthread_mutex_lock(&controlLock);
+    struct controlJob *job = control_job(controlNextId);
+    if (job->id != 0 && (job->state == JOB_QUEUED || job->state == JOB_RUNNING)) {
+      pthread_mutex_unlock(&controlLock);
+      return -EBUSY; // a whole ring of unfinished jobs
+    }
+    memset(job, 0, sizeof(*job));
+    job->id = controlNextId++;
+    job->command = &controlCommands[i];
+    strncpy(job->arg, arg, CONTROL_LINE - 1);
+    job->state = JOB_QUEUED;
+    pthread_cond_signal(&controlCond);
+    pthread_mutex_unlock(&controlLock);
+    return 0;
+  }
+  return -EINVAL;
+}
+
+int control_submit(const char *data, size_t size) {
+  char line[CONTROL_LINE];
+  size_t start = 0;
+
+  while (start < size) {
+    size_t end = start;
+    while (end < size && data[end] != '\n')
+      end++;
+    size_t len = end - start;
+    while (len > 0 && (data[start + len - 1] == '\r' || data[start + len - 1] == ' '))
+      len--;
+    if (len >= CONTROL_LINE)
+      return -ENAMETOOLONG;
+    memcpy(line, data + start, len);
+    line[len] = '\0';
+    if (len > 0) {
+      int retstat = control_submit_line(line);
+      if (retstat < 0)
+        return retstat;
+    }
+    start = end + 1;
+  }
+  return size;
+}
+
+static double control_seconds(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+#define CONTROL_APPEND(...) \
+  (len += snprintf(len < capacity ? *data + len : NULL, len < capacity ? capacity - len : 0, __VA_ARGS__))
+
+int control_render(char **data, size_t *size) {
+  size_t capacity = 4096;
+  struct timespec now;
+
+  for (;;) {
+    size_t len = 0;
+    *data = malloc(capacity);
+    if (*data == NULL)
+      return -ENOMEM;
+    CONTROL_APPEND("commands:");
+    for (int i = 0; i < controlCommandCount; i++)
+      CONTROL_APPEND(" %s", controlCommands[i].name);
+    CONTROL_APPEND("\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&controlLock);
+    uint64_t first = controlNextId > CONTROL_JOBS ? controlNextId - CONTROL_JOBS : 1;
+    for (uint64_t id = first; id < controlNextId; id++) {
+      const struct controlJob *job = control_job(id);
+      CONTROL_APPEND("%llu %s%s%s %s", (unsigned long long)job->id, job->command->name, job->arg[0] ? " " : "",
+                     job->arg, controlStateNames[job->state]);
+      if (job->state != JOB_QUEUED) {
+        if (job->total)
+          CONTROL_APPEND(" %llu/%llu %s", (unsigned long long)job->done, (unsigned long long)job->total,
+                         job->command->units);
+        else
+          CONTROL_APPEND(" %llu %s", (unsigned long long)job->done, job->command->units);
+        CONTROL_APPEND(" %.1fs", control_seconds(&job->started, job->state == JOB_RUNNING ? &now : &job->finished));
+      }
+      if (job->state == JOB_FAILED)
+        CONTROL_APPEND(" (%s)", strerror(-job->result));
+      CONTROL_APPEND("\n");
+    }
+    pthread_mutex_unlock(&controlLock);
+
+    if (len < capacity) {
+      *size = len;
+      return 0;
+    }
+    free(*data);
+    capacity = len + 4096;
+  }
+}
@@ -0,0 +1,37 @@
+/*
+  Control commands for cachefs, written to the /.cachefs/ctl virtual
+  file one per line ("prefetch /projects/a").  Commands are queued and
+  run one at a time on a background thread; reading the file shows the
+  recent ones with their state and progress.  The commands themselves
+  are registered by cachefs.c.
+*/
+
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct controlJob;
+
+// runs on the control thread; returns 0 or -errno
+typedef int (*controlCommand)(const char *arg, struct controlJob *job);
+
+// units names what the command counts its progress in ("bytes", "files")
+void control_register(const char *name, const char *units, controlCommand run);
+
+int control_start(void);
+// waits for the running command to notice control_stopping()
+void control_shutdown(void);
+
+// how far the command has got; total 0 while it is unknown
+void control_progress(struct controlJob *job, uint64_t done, uint64_t total);
+// long commands give up when this turns true (unmount)
+int control_stopping(void);
+
+// virtual file callbacks: queue the commands in data / render the status.
+// -EBUSY while the queue is full of commands that have not finished
+int control_submit(const char *data, size_t size);
+int control_render(char **data, size_t *size);
+
+#endif
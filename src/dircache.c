@@ -0,0 +1,336 @@
+/*
+  Directory listing cache for cachefs opendir/readdir.  See dircache.h.
+*/
+#define _GNU_SOURCE // st_mtim, clock_gettime
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "dircache.h"
+#include "metadata/meta.h"
+#include "nasemu.h"
+#include "pathtable.h"
+
+#define DIR_NAMES_BUCKETS 256
+#define DIR_NAMES_MAX 4096 // directories with a name set, all are dropped beyond this
+
+static int dirEnabled = 0;
+static unsigned dirRevalidateMs = 0;
+
+// Name sets of the directories lookups have missed in.  An entry is
+// parsed from the stored listing on the first lookup after it was
+// dropped, and dropped whenever the listing is read again or invalidated.
+struct dirNames {
+  char *path;
+  int64_t validatedMs;  // of the listing the set was built from
+  char *entries;        // that listing; NULL until a lookup loads it
+  const char **names;   // open addressing set of pointers into entries
+  size_t slots;         // power of two
+  struct dirNames *next;
+};
+
+static pthread_mutex_t dirNamesLock = PTHREAD_MUTEX_INITIALIZER;
+static struct dirNames *dirNamesTable[DIR_NAMES_BUCKETS];
+static size_t dirNamesCount = 0;
+static uint64_t dirNamesGeneration = 0; // bumped by every drop, so a load racing one is not installed
+
+static int64_t dir_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int64_t dir_mtime_ns(const struct stat *statbuf) {
+  return (int64_t)statbuf->st_mtim.tv_sec * 1000000000 + statbuf->st_mtim.tv_nsec;
+}
+
+// caller holds dirNamesLock
+static struct dirNames **dir_names_find(const char *path) {
+  struct dirNames **link = &dirNamesTable[path_hash(path) % DIR_NAMES_BUCKETS];
+  while (*link && strcmp((*link)->path, path) != 0)
+    link = &(*link)->next;
+  return link;
+}
+
+static void dir_names_unload(struct dirNames *dn) {
+  free(dn->entries);
+  free(dn->names);
+  dn->entries = NULL;
+  dn->names = NULL;
+  dn->slots = 0;
+}
+
+static void dir_names_free(struct dirNames *dn) {
+  dir_names_unload(dn);
+  free(dn->path);
+  free(dn);
+}
+
+// build the name set of a listing; takes over dh->entries
+static void dir_names_build(struct dirNames *dn, struct dirHandle *dh, int64_t validatedMs) {
+  struct dirHandle listing = *dh;
+  const char *entry;
+  size_t pos = 0, count = 0;
+
+  while (dir_cache_next(&listing, &pos, NULL) != NULL)
+    count++;
+  dn->slots = 16;
+  while (dn->slots < count * 2)
+    dn->slots *= 2;
+  dn->names = calloc(dn->slots, sizeof(*dn->names));
+  dn->entries = dh->entries;
+  dn->validatedMs = validatedMs;
+  dh->entries = NULL;
+  if (dn->names == NULL) {
+    dir_names_unload(dn);
+    return;
+  }
+  pos = 0;
+  while ((entry = dir_cache_next(&listing, &pos, NULL)) != NULL) {
+    size_t slot = path_hash(entry) & (dn->slots - 1);
+    while (dn->names[slot])
+      slot = (slot + 1) & (dn->slots - 1);
+    dn->names[slot] = entry;
+  }
+}
+
+static int dir_names_contains(const struct dirNames *dn, const char *name) {
+  size_t slot = path_hash(name) & (dn->slots - 1);
+  for (; dn->names[slot]; slot = (slot + 1) & (dn->slots - 1))
+    if (strcmp(dn->names[slot], name) == 0)
+      return 1;
+  return 0;
+}
+
+// path's listing changed or went away: forget its set (tree: and every set below it)
+static void dir_names_drop(const char *path, int tree) {
+  size_t len = strlen(path);
+
+  pthread_mutex_lock(&dirNamesLock);
+  dirNamesGeneration++;
+  if (dirNamesCount == 0) {
+    pthread_mutex_unlock(&dirNamesLock);
+    return;
+  }
+  for (size_t bucket = 0; bucket < DIR_NAMES_BUCKETS; bucket++) {
+    for (struct dirNames *dn = dirNamesTable[bucket]; dn; dn = dn->next) {
+      if (strcmp(dn->path, path) == 0 ||
+          (tree && strncmp(dn->path, path, len) == 0 && (dn->path[len] == '/' || len == 1)))
+        dir_names_unload(dn); // the next lookup reloads it, the miss history stays
+    }
+  }
+  pthread_mutex_unlock(&dirNamesLock);
+}
+
+int dir_cache_init(sqlite3 *db, int enabled, unsigned revalidateMs) {
+  dirRevalidateMs = revalidateMs;
+  dirEnabled = enabled && create_dir_table(db) == 0;
+  return dirEnabled ? 0 : -1;
+}
+
+int dir_cache_enabled(void) {
+  return dirEnabled;
+}
+
+// read the directory from the NAS into dh->entries
+static int dir_cache_read_nas(const char *nasPath, struct dirHandle *dh) {
+  size_t capacity = 4096;
+  struct dirent *de;
+
+  nas_emu_begin(NAS_LIST);
+  DIR *dp = opendir(nasPath);
+  nas_emu_end(NAS_LIST, 0);
+  if (dp == NULL)
+    return -errno;
+
+  dh->entries = malloc(capacity);
+  dh->size = 0;
+  if (dh->entries == NULL) {
+    closedir(dp);
+    return -ENOMEM;
+  }
+  while ((de = readdir(dp)) != NULL) {
+    size_t len = strlen(de->d_name) + 2;
+    if (dh->size + len > capacity) {
+      while (dh->size + len > capacity)
+        capacity *= 2;
+      char *grown = realloc(dh->entries, capacity);
+      if (grown == NULL) {
+        free(dh->entries);
+        dh->entries = NULL;
+        dh->size = 0;
+        closedir(dp);
+        return -ENOMEM;
+      }
+      dh->entries = grown;
+    }
+    dh->entries[dh->size] = de->d_type;
+    memcpy(dh->entries + dh->size + 1, de->d_name, len - 1);
+    dh->size += len;
+  }
+  closedir(dp);
+  return 0;
+}
+
+int dir_cache_open(const char *path, const char *nasPath, struct dirHandle *dh) {
+  int64_t mtime_ns = 0, validated_ms = 0;
+  int64_t now = dir_now_ms();
+  struct stat statbuf;
+
+  dh->entries = NULL;
+  dh->size = 0;
+  if (!dirEnabled)
+    return 0;
+
+  int found = get_dir_listing(get_thread_db(), path, &mtime_ns, &validated_ms, &dh->entries, &dh->size);
+  if (found == 1 && now - validated_ms < dirRevalidateMs)
+    return 0;
+
+  // stale (or missing): one lstat decides whether the listing is still good
+  if (NAS_EMU(NAS_META, lstat(nasPath, &statbuf)) < 0) {
+    int ret = -errno;
+    if (ret == -ENOENT)
+      delete_dir_listing(get_thread_db(), path, 1);
+    free(dh->entries);
+    dh->entries = NULL;
+    return ret;
+  }
+  if (!S_ISDIR(statbuf.st_mode)) {
+    free(dh->entries);
+    dh->entries = NULL;
+    return -ENOTDIR;
+  }
+  if (found == 1 && mtime_ns == dir_mtime_ns(&statbuf)) {
+    touch_dir_listing(get_thread_db(), path, now);
+    dir_names_drop(path, 0); // rebuilt with the new validation time on the next lookup
+    return 0;
+  }
+
+  free(dh->entries);
+  dh->entries = NULL;
+  int ret = dir_cache_read_nas(nasPath, dh);
+  if (ret < 0)
+    return ret;
+
+  // A change landing in the same mtime tick as our read would go unseen,
+  // so a directory modified just now gets an mtime that never matches.
+  // "Just now" compares our clock with the NAS's mtime, so this assumes
+  // the two clocks agree to within the second (see dircache.h).
+  mtime_ns = dir_mtime_ns(&statbuf);
+  if (now - mtime_ns / 1000000 < 1000)
+    mtime_ns = -1;
+  save_dir_listing(get_thread_db(), path, mtime_ns, now, dh->entries, dh->size);
+  dir_names_drop(path, 0);
+  return 0;
+}
+
+int dir_cache_lookup(const char *path, const char *name) {
+  int64_t mtime_ns = 0, validated_ms = 0;
+  struct dirHandle dh = {NULL, NULL, 0};
+  struct dirNames *dn;
+  int found = -1;
+
+  if (!dirEnabled)
+    return -1;
+
+  pthread_mutex_lock(&dirNamesLock);
+  dn = *dir_names_find(path);
+  if (dn == NULL) { // nothing has missed here, positive lookups should not pay for the listing
+    pthread_mutex_unlock(&dirNamesLock);
+    return -1;
+  }
+  if (dn->entries) {
+    if (dir_now_ms() - dn->validatedMs < dirRevalidateMs)
+      found = dir_names_contains(dn, name);
+    pthread_mutex_unlock(&dirNamesLock);
+    return found;
+  }
+  uint64_t generation = dirNamesGeneration;
+  pthread_mutex_unlock(&dirNamesLock);
+
+  // first lookup since the set was dropped: parse the stored listing once
+  if (get_dir_listing(get_thread_db(), path, &mtime_ns, &validated_ms, &dh.entries, &dh.size) != 1)
+    return -1;
+  if (dir_now_ms() - validated_ms >= dirRevalidateMs) {
+    free(dh.entries);
+    return -1;
+  }
+  struct dirNames loaded = {NULL};
+  dir_names_build(&loaded, &dh, validated_ms);
+  if (loaded.entries == NULL)
+    return -1;
+  found = dir_names_contains(&loaded, name);
+
+  pthread_mutex_lock(&dirNamesLock);
+  dn = *dir_names_find(path);
+  if (dn && dn->entries == NULL && generation == dirNamesGeneration) {
+    dn->entries = loaded.entries;
+    dn->names = loaded.names;
+    dn->slots = loaded.slots;
+    dn->validatedMs = loaded.validatedMs;
+  } else {
+    dir_names_unload(&loaded); // dropped or loaded by someone else meanwhile
+  }
+  pthread_mutex_unlock(&dirNamesLock);
+  return found;
+}
+
+void dir_cache_note_missing(const char *path) {
+  if (!dirEnabled)
+    return;
+
+  pthread_mutex_lock(&dirNamesLock);
+  struct dirNames **link = dir_names_find(path);
+  if (*link == NULL) {
+    if (dirNamesCount >= DIR_NAMES_MAX) {
+      for (size_t bucket = 0; bucket < DIR_NAMES_BUCKETS; bucket++) {
+        while (dirNamesTable[bucket]) {
+          struct dirNames *dn = dirNamesTable[bucket];
+          dirNamesTable[bucket] = dn->next;
+          dir_names_free(dn);
+        }
+      }
+      dirNamesCount = 0;
+      link = dir_names_find(path);
+    }
+    struct dirNames *dn = calloc(1, sizeof(*dn));
+    if (dn && (dn->path = strdup(path)) != NULL) {
+      *link = dn;
+      dirNamesCount++;
+    } else {
+      free(dn);
+    }
+  }
+  pthread_mutex_unlock(&dirNamesLock);
+}
+
+void dir_cache_invalidate(const char *path) {
+  if (dirEnabled) {
+    delete_dir_listing(get_thread_db(), path, 0);
+    dir_names_drop(path, 0);
+  }
+}
+
+void dir_cache_invalidate_tree(const char *path) {
+  if (dirEnabled) {
+    delete_dir_listing(get_thread_db(), path, 1);
+    dir_names_drop(path, 1);
+  }
+}
+
+const char *dir_cache_next(const struct dirHandle *dh, size_t *pos, unsigned char *type) {
+  if (*pos >= dh->size)
+    return NULL;
+
+  const char *name = dh->entries + *pos + 1;
+  if (type)
+    *type = dh->entries[*pos];
+  *pos += strlen(name) + 2;
+  return name;
+}
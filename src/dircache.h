@@ -0,0 +1,57 @@
+/*
+  Directory listing cache for cachefs opendir/readdir.
+
+  Listings are kept in the Directories table of the metadata database,
+  keyed by directory path, together with the NAS directory mtime they
+  were read at.  A listing is served as is for revalidateMs after it
+  was last checked; after that one NAS lstat tells us whether it is
+  still good or has to be read again.
+
+  Off unless --dir-cache=1.  The mtime check cannot see a second change
+  made within the NAS's mtime granularity of the read, so a listing read
+  less than a second after the directory's mtime is never trusted.  That
+  second is measured with the client clock against the NAS mtime: if the
+  NAS clock runs ahead of the client's by more than that, listings of
+  directories changed just before they were read can be served stale.
+*/
+
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+
+#include <sqlite3.h>
+#include <stddef.h>
+
+// One open directory.  With the cache on, entries holds the listing
+// packed as <d_type byte><name>\0 ...; otherwise dp is the NAS DIR.
+struct dirHandle {
+  void *dp;
+  char *entries;
+  size_t size;
+};
+
+// enabled 0 turns the cache off, dir_cache_open then leaves entries NULL
+int dir_cache_init(sqlite3 *db, int enabled, unsigned revalidateMs);
+int dir_cache_enabled(void);
+
+// fill dh->entries for path (nasPath is the same directory on the NAS)
+// returns 0 or -errno
+int dir_cache_open(const char *path, const char *nasPath, struct dirHandle *dh);
+
+// is name listed in directory path?  Answered only for a directory
+// where a lookup has already missed on the NAS (see
+// dir_cache_note_missing), from a listing that is still inside its
+// revalidation interval: 1 = listed, 0 = not listed, -1 = no answer
+// (ask the NAS).  The listing is parsed into an in-memory name set once
+// per version, so each lookup costs a hash probe.
+int dir_cache_lookup(const char *path, const char *name);
+// a name in directory path turned out to be missing on the NAS: worth
+// answering later lookups in it from the listing
+void dir_cache_note_missing(const char *path);
+
+void dir_cache_invalidate(const char *path);
+void dir_cache_invalidate_tree(const char *path);
+
+// walk a packed listing: returns the next entry's name (and d_type), NULL at the end
+const char *dir_cache_next(const struct dirHandle *dh, size_t *pos, unsigned char *type);
+
+#endif
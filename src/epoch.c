@@ -0,0 +1,124 @@
+/*
+  Epoch-based reclamation.  See epoch.h.
+
+  Every thread that has ever read owns a slot holding the global epoch
+  it entered at, shifted left, with the low bit set while it is inside.
+  The global epoch only moves on once every active reader has seen it,
+  so something retired at epoch e is unreachable by the time the epoch
+  is e + 2.  Slots are never freed: a thread that exits leaves its slot
+  for the next new thread.
+*/
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+
+struct epochSlot {
+  uint64_t state; // (epoch << 1) | active
+  int inUse;
+  struct epochSlot *next;
+};
+
+struct epochGarbage {
+  void *ptr;
+  void (*release)(void *);
+  uint64_t epoch;
+  struct epochGarbage *next;
+};
+
+static struct epochSlot *epochSlots = NULL; // push-only
+static uint64_t epochGlobal = 0;
+static __thread struct epochSlot *epochSelf = NULL;
+static pthread_key_t epochKey;
+static pthread_once_t epochKeyOnce = PTHREAD_ONCE_INIT;
+
+static struct epochGarbage *epochLimbo = NULL;
+static pthread_mutex_t epochLimboLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void epoch_thread_exit(void *slot) {
+  struct epochSlot *self = slot;
+  __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&self->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_make_key(void) {
+  pthread_key_create(&epochKey, epoch_thread_exit);
+}
+
+// first read on this thread: take a free slot or add one
+static struct epochSlot *epoch_register(void) {
+  struct epochSlot *slot;
+
+  pthread_once(&epochKeyOnce, epoch_make_key);
+  for (slot = __atomic_load_n(&epochSlots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&slot->inUse, &free, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+  if (slot == NULL) {
+    slot = calloc(1, sizeof(*slot));
+    slot->inUse = 1;
+    slot->next = __atomic_load_n(&epochSlots, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&epochSlots, &slot->next, slot, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  pthread_setspecific(epochKey, slot);
+  epochSelf = slot;
+  return slot;
+}
+
+void epoch_enter(void) {
+  struct epochSlot *self = epochSelf ? epochSelf : epoch_register();
+  uint64_t epoch = __atomic_load_n(&epochGlobal, __ATOMIC_ACQUIRE);
+
+  __atomic_store_n(&self->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+  // the slot must be visible before anything the traversal loads
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void) {
+  __atomic_store_n(&epochSelf->state, 0, __ATOMIC_RELEASE);
+}
+
+// with epochLimboLock held: move the epoch on if every reader has seen
+// it, then release what nobody can reach any more
+static void epoch_collect(void) {
+  uint64_t epoch = __atomic_load_n(&epochGlobal, __ATOMIC_ACQUIRE);
+  int behind = 0;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (struct epochSlot *slot = __atomic_load_n(&epochSlots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+    uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if ((state & 1) && (state >> 1) != epoch) {
+      behind = 1;
+      break;
+    }
+  }
+  if (!behind)
+    epoch = __atomic_add_fetch(&epochGlobal, 1, __ATOMIC_ACQ_REL);
+
+  for (struct epochGarbage **link = &epochLimbo; *link;) {
+    struct epochGarbage *garbage = *link;
+    if (garbage->epoch + 2 <= epoch) {
+      *link = garbage->next;
+      garbage->release(garbage->ptr);
+      free(garbage);
+    } else {
+      link = &garbage->next;
+    }
+  }
+}
+
+void epoch_retire(void *ptr, void (*release)(void *)) {
+  struct epochGarbage *garbage = malloc(sizeof(*garbage));
+
+  garbage->ptr = ptr;
+  garbage->release = release;
+  pthread_mutex_lock(&epochLimboLock);
+  garbage->epoch = __atomic_load_n(&epochGlobal, __ATOMIC_ACQUIRE);
+  garbage->next = epochLimbo;
+  epochLimbo = garbage;
+  epoch_collect();
+  pthread_mutex_unlock(&epochLimboLock);
+}
@@ -0,0 +1,19 @@
+/*
+  Epoch-based reclamation for cachefs's lock-free indexes.
+
+  Readers bracket every traversal with epoch_enter/epoch_exit and take
+  no lock.  A writer that has unlinked an object (with an atomic
+  store, so no new reader can reach it) hands it to epoch_retire; it is
+  released only once every reader that could still hold it has left.
+*/
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+// release(ptr) once no reader can be inside a traversal that saw ptr
+void epoch_retire(void *ptr, void (*release)(void *));
+
+#endif
@@ -0,0 +1,279 @@
+/*
+  Descriptor cache for cachefs.  See fdcache.h.
+
+  Entries are hashed by path and access mode and also indexed by
+  descriptor number so fd_cache_close can find them.  Unreferenced
+  entries sit on an LRU list, most recently released first.  One mutex
+  covers everything; the critical sections are a few pointer updates.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "nasemu.h"
+#include "pathtable.h"
+
+#define FD_BUCKETS 1024
+
+// flags whose descriptors must not be handed to another handle
+#define FD_UNSHARED_FLAGS (O_APPEND | O_CREAT | O_EXCL | O_TRUNC | O_SYNC | O_DSYNC)
+
+struct fdEntry {
+  char *path;
+  int accmode;
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  int refs;
+  int dead; // invalidated while in use, closed by the last fd_cache_close
+  struct fdEntry *next;
+  struct fdEntry *lruPrev, *lruNext;
+};
+
+static struct fdEntry *fdBuckets[FD_BUCKETS];
+static struct fdEntry **fdByDescriptor = NULL;
+static int fdTableSize = 0;
+static struct fdEntry *fdLruHead = NULL, *fdLruTail = NULL;
+static size_t fdIdle = 0, fdMaxIdle = 0;
+static pthread_mutex_t fdLock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t fd_hash(const char *path, int accmode) {
+  return path_hash_bytes(PATH_HASH_SEED ^ (unsigned)accmode, path, strlen(path)) % FD_BUCKETS;
+}
+
+static void fd_lru_remove(struct fdEntry *entry) {
+  if (entry->lruPrev)
+    entry->lruPrev->lruNext = entry->lruNext;
+  else
+    fdLruHead = entry->lruNext;
+  if (entry->lruNext)
+    entry->lruNext->lruPrev = entry->lruPrev;
+  else
+    fdLruTail = entry->lruPrev;
+  entry->lruPrev = entry->lruNext = NULL;
+  fdIdle--;
+}
+
+static void fd_lru_push(struct fdEntry *entry) {
+  entry->lruPrev = NULL;
+  entry->lruNext = fdLruHead;
+  if (fdLruHead)
+    fdLruHead->lruPrev = entry;
+  fdLruHead = entry;
+  if (fdLruTail == NULL)
+    fdLruTail = entry;
+  fdIdle++;
+}
+
+static void fd_unhash(struct fdEntry *entry) {
+  size_t bucket = fd_hash(entry->path, entry->accmode);
+  for (struct fdEntry **link = &fdBuckets[bucket]; *link; link = &(*link)->next)
+    if (*link == entry) {
+      *link = entry->next;
+      return;
+    }
+}
+
+// entry is out of the hash table and unreferenced: close it
+static void fd_destroy(struct fdEntry *entry) {
+  fdByDescriptor[entry->fd] = NULL;
+  close(entry->fd);
+  free(entry->path);
+  free(entry);
+}
+
+// no new handle may get entry; close it now if nobody is using it
+static void fd_invalidate_entry(struct fdEntry *entry) {
+  fd_unhash(entry);
+  if (entry->refs == 0) {
+    fd_lru_remove(entry);
+    fd_destroy(entry);
+  } else {
+    entry->dead = 1;
+  }
+}
+
+// close least recently released descriptors until at most keep are idle
+static void fd_evict(size_t keep) {
+  while (fdIdle > keep) {
+    struct fdEntry *victim = fdLruTail;
+    fd_lru_remove(victim);
+    fd_unhash(victim);
+    fd_destroy(victim);
+  }
+}
+
+void fd_cache_init(size_t maxIdle) {
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+    limit.rlim_cur = 1024;
+  // leave most of the descriptor budget to open handles
+  if (maxIdle > limit.rlim_cur / 4)
+    maxIdle = limit.rlim_cur / 4;
+
+  fdTableSize = limit.rlim_cur;
+  fdByDescriptor = calloc(fdTableSize, sizeof(struct fdEntry *));
+  fdMaxIdle = fdByDescriptor ? maxIdle : 0;
+}
+
+void fd_cache_shutdown(void) {
+  fd_cache_trim(0);
+}
+
+int fd_cache_open(const char *path, int flags) {
+  int accmode = flags & O_ACCMODE;
+  size_t bucket = fd_hash(path, accmode);
+  struct fdEntry *entry;
+  struct stat statbuf;
+
+  if (fdMaxIdle == 0 || (flags & FD_UNSHARED_FLAGS)) {
+    int fd = NAS_EMU(nas_emu_path_op(path, NAS_OPEN), open(path, flags));
+    return fd < 0 ? -errno : fd;
+  }
+
+  pthread_mutex_lock(&fdLock);
+  for (entry = fdBuckets[bucket]; entry; entry = entry->next)
+    if (entry->accmode == accmode && strcmp(entry->path, path) == 0) {
+      if (entry->refs++ == 0)
+        fd_lru_remove(entry);
+      pthread_mutex_unlock(&fdLock);
+      return entry->fd;
+    }
+  pthread_mutex_unlock(&fdLock);
+
+  int fd = NAS_EMU(nas_emu_path_op(path, NAS_OPEN), open(path, flags));
+  if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+    // out of descriptors: the idle ones are the first to go
+    fd_cache_trim(0);
+    fd = NAS_EMU(nas_emu_path_op(path, NAS_OPEN), open(path, flags));
+  }
+  if (fd < 0)
+    return -errno;
+  if (fd >= fdTableSize || fstat(fd, &statbuf) < 0)
+    return fd; // not cached, fd_cache_close just closes it
+
+  pthread_mutex_lock(&fdLock);
+  for (entry = fdBuckets[bucket]; entry; entry = entry->next)
+    if (entry->accmode == accmode && strcmp(entry->path, path) == 0) {
+      // somebody opened it while we were: share theirs
+      if (entry->refs++ == 0)
+        fd_lru_remove(entry);
+      pthread_mutex_unlock(&fdLock);
+      close(fd);
+      return entry->fd;
+    }
+
+  entry = calloc(1, sizeof(*entry));
+  if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+    // no memory to remember it: hand it out uncached, like a descriptor past the table
+    pthread_mutex_unlock(&fdLock);
+    free(entry);
+    return fd;
+  }
+  entry->accmode = accmode;
+  entry->fd = fd;
+  entry->dev = statbuf.st_dev;
+  entry->ino = statbuf.st_ino;
+  entry->refs = 1;
+  entry->next = fdBuckets[bucket];
+  fdBuckets[bucket] = entry;
+  fdByDescriptor[fd] = entry;
+  pthread_mutex_unlock(&fdLock);
+
+  return fd;
+}
+
+int fd_cache_close(int fd) {
+  struct fdEntry *entry = NULL;
+
+  if (fd < 0)
+    return 0;
+
+  pthread_mutex_lock(&fdLock);
+  if (fd < fdTableSize && fdByDescriptor)
+    entry = fdByDescriptor[fd];
+  if (entry == NULL) {
+    pthread_mutex_unlock(&fdLock);
+    return close(fd) < 0 ? -errno : 0;
+  }
+
+  if (--entry->refs == 0) {
+    if (entry->dead) {
+      fd_destroy(entry);
+    } else {
+      fd_lru_push(entry);
+      fd_evict(fdMaxIdle);
+    }
+  }
+  pthread_mutex_unlock(&fdLock);
+
+  return 0;
+}
+
+void fd_cache_invalidate(const char *path) {
+  if (fdMaxIdle == 0)
+    return;
+
+  pthread_mutex_lock(&fdLock);
+  for (int accmode = O_RDONLY; accmode <= O_RDWR; accmode++) {
+    struct fdEntry *entry = fdBuckets[fd_hash(path, accmode)];
+    while (entry) {
+      struct fdEntry *next = entry->next;
+      if (entry->accmode == accmode && strcmp(entry->path, path) == 0)
+        fd_invalidate_entry(entry);
+      entry = next;
+    }
+  }
+  pthread_mutex_unlock(&fdLock);
+}
+
+void fd_cache_invalidate_tree(const char *path) {
+  size_t len = strlen(path);
+
+  if (fdMaxIdle == 0)
+    return;
+
+  pthread_mutex_lock(&fdLock);
+  for (size_t bucket = 0; bucket < FD_BUCKETS; bucket++) {
+    struct fdEntry *entry = fdBuckets[bucket];
+    while (entry) {
+      struct fdEntry *next = entry->next;
+      if (strncmp(entry->path, path, len) == 0 &&
+          (entry->path[len] == '/' || entry->path[len] == '\0'))
+        fd_invalidate_entry(entry);
+      entry = next;
+    }
+  }
+  pthread_mutex_unlock(&fdLock);
+}
+
+void fd_cache_revalidate(const char *path, const struct stat *statbuf) {
+  if (fdMaxIdle == 0)
+    return;
+
+  pthread_mutex_lock(&fdLock);
+  for (int accmode = O_RDONLY; accmode <= O_RDWR; accmode++) {
+    struct fdEntry *entry = fdBuckets[fd_hash(path, accmode)];
+    while (entry) {
+      struct fdEntry *next = entry->next;
+      if (entry->accmode == accmode && strcmp(entry->path, path) == 0 &&
+          (entry->dev != statbuf->st_dev || entry->ino != statbuf->st_ino))
+        fd_invalidate_entry(entry);
+      entry = next;
+    }
+  }
+  pthread_mutex_unlock(&fdLock);
+}
+
+void fd_cache_trim(size_t keep) {
+  pthread_mutex_lock(&fdLock);
+  fd_evict(keep);
+  pthread_mutex_unlock(&fdLock);
+}
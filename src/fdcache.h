@@ -0,0 +1,42 @@
+/*
+  Descriptor cache for cachefs.
+
+  Short-lived opens of the same files would otherwise cost an open and
+  a close on the NAS and in the cache directory every time.  Descriptors
+  opened through fd_cache_open are shared by every handle on the same
+  path and access mode, reference counted, and kept open on an LRU list
+  for a while after their last handle is released.
+
+  Only plain descriptors are shared (no O_APPEND, O_SYNC, O_DIRECT,
+  O_TRUNC...); since cachefs does all its I/O with pread/pwrite the
+  shared file offset does not matter.
+*/
+
+#ifndef _FDCACHE_H_
+#define _FDCACHE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// keep at most maxIdle unreferenced descriptors open, 0 turns the cache off
+void fd_cache_init(size_t maxIdle);
+// close every idle descriptor
+void fd_cache_shutdown(void);
+
+// open(path, flags) through the cache, returns a descriptor or -errno
+int fd_cache_open(const char *path, int flags);
+// give back a descriptor from fd_cache_open (anything else is just closed)
+int fd_cache_close(int fd);
+
+// path was unlinked, renamed or replaced: no new handle may get the old
+// descriptor.  Descriptors still in use stay valid until closed.
+void fd_cache_invalidate(const char *path);
+// path and everything below it, for renames of directories
+void fd_cache_invalidate_tree(const char *path);
+// drop path's descriptors if they are no longer for the file statbuf describes
+void fd_cache_revalidate(const char *path, const struct stat *statbuf);
+
+// close idle descriptors to get below keep, e.g. when open() hit EMFILE
+void fd_cache_trim(size_t keep);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+  Small-write gathering for cachefs.  See gather.h for the overview.
+
+  Lock order: gatherListLock, then a buffer's lock, then the journal.
+*/
+#define _GNU_SOURCE // pwrite, clock_gettime
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gather.h"
+#include "journal.h"
+#include "nasemu.h"
+
+struct gatherBuffer {
+  char *path;
+  int nasFD;
+  pthread_mutex_t lock;
+  char *data;
+  size_t used;
+  off_t offset;              // file offset of data[0]
+  struct timespec firstWrite; // when the oldest staged byte arrived
+  int journaled;             // journal records waiting on this data
+  int error;                 // deferred NAS write error, reported on the next call
+  int *staged;               // the file's count of buffers holding data, or NULL
+  struct gatherBuffer *next;
+};
+
+static size_t gatherCapacity = 0;
+static unsigned gatherTimeoutMs = 0;
+
+static pthread_mutex_t gatherListLock = PTHREAD_MUTEX_INITIALIZER;
+static struct gatherBuffer *gatherList = NULL;
+static int gatherStaged = 0; // buffers holding data, lets readers skip the list walk
+static int gatherUnowned = 0; // of those, the ones opened without a per-file counter
+
+static pthread_t flusherThread;
+static int flusherRunning = 0;
+static pthread_cond_t flusherCond = PTHREAD_COND_INITIALIZER;
+
+static long gather_age_ms(struct gatherBuffer *gb) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - gb->firstWrite.tv_sec) * 1000 +
+         (now.tv_nsec - gb->firstWrite.tv_nsec) / 1000000;
+}
+
+// gb started or stopped holding data
+static void gather_mark_staged(struct gatherBuffer *gb, int delta) {
+  __sync_fetch_and_add(&gatherStaged, delta);
+  __sync_fetch_and_add(gb->staged ? gb->staged : &gatherUnowned, delta);
+}
+
+// caller holds gb->lock.  On a NAS error what was not written stays
+// staged, with its journal records, for the next flush to retry.
+static int gather_flush_locked(struct gatherBuffer *gb) {
+  size_t done = 0;
+
+  while (done < gb->used) {
+    ssize_t ret = NAS_EMU(NAS_WRITE, pwrite(gb->nasFD, gb->data + done, gb->used - done, gb->offset + done));
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      gb->error = ret < 0 ? -errno : -EIO; // 0 would never make progress
+      break;
+    }
+    done += ret;
+  }
+
+  if (done < gb->used) {
+    memmove(gb->data, gb->data + done, gb->used - done);
+    gb->used -= done;
+    gb->offset += done;
+    return gb->error;
+  }
+  if (gb->used) {
+    gather_mark_staged(gb, -1);
+    if (gb->journaled)
+      journal_write_done(gb->journaled);
+  }
+  gb->used = 0;
+  gb->journaled = 0;
+  return gb->error;
+}
+
+// the write at journalPos is answered with an error, not staged
+static void gather_write_failed(off_t journalPos) {
+  if (journalPos >= 0)
+    journal_write_failed(journalPos);
+}
+
+static int gather_take_error(struct gatherBuffer *gb) {
+  int error = gb->error;
+  gb->error = 0;
+  return error;
+}
+
+// a write through one handle must not be overtaken by older data staged on another
+static void gather_flush_others(struct gatherBuffer *gb) {
+  if (gatherStaged == 0)
+    return;
+
+  pthread_mutex_lock(&gatherListLock);
+  for (struct gatherBuffer *other = gatherList; other; other = other->next) {
+    if (other == gb || strcmp(other->path, gb->path) != 0)
+      continue;
+    pthread_mutex_lock(&other->lock);
+    gather_flush_locked(other);
+    pthread_mutex_unlock(&other->lock);
+  }
+  pthread_mutex_unlock(&gatherListLock);
+}
+
+static void *gather_flusher(void *arg) {
+  struct timespec wake;
+  (void)arg;
+
+  pthread_mutex_lock(&gatherListLock);
+  while (flusherRunning) {
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_nsec += (long)(gatherTimeoutMs / 2 + 1) * 1000000;
+    wake.tv_sec += wake.tv_nsec / 1000000000;
+    wake.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&flusherCond, &gatherListLock, &wake);
+
+    for (struct gatherBuffer *gb = gatherList; gb; gb = gb->next) {
+      if (pthread_mutex_trylock(&gb->lock) != 0)
+        continue; // a writer has it, it'll be looked at next round
+      if (gb->used && gather_age_ms(gb) >= gatherTimeoutMs)
+        gather_flush_locked(gb);
+      pthread_mutex_unlock(&gb->lock);
+    }
+  }
+  pthread_mutex_unlock(&gatherListLock);
+  return NULL;
+}
+
+int gather_init(size_t capacity, unsigned timeoutMs) {
+  gatherCapacity = capacity;
+  gatherTimeoutMs = timeoutMs;
+  if (capacity == 0)
+    return 0;
+
+  flusherRunning = 1;
+  if (pthread_create(&flusherThread, NULL, gather_flusher, NULL) != 0) {
+    flusherRunning = 0;
+    gatherCapacity = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void gather_shutdown(void) {
+  if (!flusherRunning)
+    return;
+  gather_flush_all();
+
+  pthread_mutex_lock(&gatherListLock);
+  flusherRunning = 0;
+  pthread_cond_signal(&flusherCond);
+  pthread_mutex_unlock(&gatherListLock);
+  pthread_join(flusherThread, NULL);
+}
+
+struct gatherBuffer *gather_open(const char *path, int nasFD, int *staged) {
+  if (gatherCapacity == 0)
+    return NULL;
+
+  struct gatherBuffer *gb = calloc(1, sizeof(*gb));
+  gb->data = malloc(gatherCapacity);
+  if (gb->data == NULL) {
+    free(gb);
+    return NULL; // fall back to writing through
+  }
+  gb->path = strdup(path);
+  gb->nasFD = nasFD;
+  gb->staged = staged;
+  pthread_mutex_init(&gb->lock, NULL);
+
+  pthread_mutex_lock(&gatherListLock);
+  gb->next = gatherList;
+  gatherList = gb;
+  pthread_mutex_unlock(&gatherListLock);
+
+  return gb;
+}
+
+int gather_close(struct gatherBuffer *gb) {
+  if (gb == NULL)
+    return 0;
+
+  pthread_mutex_lock(&gatherListLock);
+  for (struct gatherBuffer **link = &gatherList; *link; link = &(*link)->next) {
+    if (*link == gb) {
+      *link = gb->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&gatherListLock);
+
+  pthread_mutex_lock(&gb->lock);
+  gather_flush_locked(gb);
+  int error = gather_take_error(gb);
+  if (gb->used) {
+    // acknowledged writes the NAS would not take: the journal keeps them for the next mount's replay
+    gather_mark_staged(gb, -1);
+    if (gb->journaled)
+      journal_write_lost(gb->journaled);
+    if (error == 0)
+      error = -EIO;
+  }
+  pthread_mutex_unlock(&gb->lock);
+
+  pthread_mutex_destroy(&gb->lock);
+  free(gb->data);
+  free(gb->path);
+  free(gb);
+  return error;
+}
+
+ssize_t gather_write(struct gatherBuffer *gb, const char *buf, size_t size, off_t offset, off_t journalPos) {
+  ssize_t retstat;
+
+  gather_flush_others(gb);
+
+  pthread_mutex_lock(&gb->lock);
+  // only a write that carries on where the staged data ends can join it
+  if (gb->used && (offset != gb->offset + (off_t)gb->used || gb->used + size > gatherCapacity))
+    gather_flush_locked(gb);
+
+  if ((retstat = gather_take_error(gb)) < 0 || (gb->used && offset != gb->offset + (off_t)gb->used)) {
+    // an earlier write failed, or its data is still stuck in the buffer ahead of this one
+    pthread_mutex_unlock(&gb->lock);
+    gather_write_failed(journalPos);
+    return retstat < 0 ? retstat : -EIO;
+  }
+
+  if (size >= gatherCapacity) {
+    // already large, nothing to gain from staging it
+    retstat = NAS_EMU(NAS_WRITE, pwrite(gb->nasFD, buf, size, offset));
+    if (retstat < 0)
+      retstat = -errno;
+    pthread_mutex_unlock(&gb->lock);
+    if (retstat <= 0)
+      gather_write_failed(journalPos);
+    else if (journalPos >= 0)
+      journal_write_done(1);
+    return retstat;
+  }
+
+  if (gb->used == 0) {
+    gb->offset = offset;
+    clock_gettime(CLOCK_MONOTONIC, &gb->firstWrite);
+    gather_mark_staged(gb, 1);
+  }
+  memcpy(gb->data + gb->used, buf, size);
+  gb->used += size;
+  gb->journaled += journalPos >= 0;
+
+  if (gb->used == gatherCapacity)
+    gather_flush_locked(gb);
+  pthread_mutex_unlock(&gb->lock);
+
+  return size;
+}
+
+int gather_flush(struct gatherBuffer *gb) {
+  if (gb == NULL)
+    return 0;
+
+  pthread_mutex_lock(&gb->lock);
+  gather_flush_locked(gb);
+  int error = gather_take_error(gb);
+  pthread_mutex_unlock(&gb->lock);
+  return error;
+}
+
+int gather_flush_path(const char *path) {
+  int error = 0;
+
+  if (gatherStaged == 0)
+    return 0;
+
+  pthread_mutex_lock(&gatherListLock);
+  for (struct gatherBuffer *gb = gatherList; gb; gb = gb->next) {
+    if (strcmp(gb->path, path) != 0)
+      continue;
+    pthread_mutex_lock(&gb->lock);
+    if (gather_flush_locked(gb) < 0)
+      error = gb->error;
+    pthread_mutex_unlock(&gb->lock);
+  }
+  pthread_mutex_unlock(&gatherListLock);
+  return error;
+}
+
+int gather_flush_file(const char *path, const int *staged) {
+  if (staged && *staged == 0 && gatherUnowned == 0)
+    return 0;
+  return gather_flush_path(path);
+}
+
+void gather_rename(const char *path, const char *newpath) {
+  size_t len = strlen(path);
+
+  pthread_mutex_lock(&gatherListLock);
+  for (struct gatherBuffer *gb = gatherList; gb; gb = gb->next) {
+    if (strncmp(gb->path, path, len) != 0 || (gb->path[len] != '/' && gb->path[len] != '\0'))
+      continue;
+    char *renamed = malloc(strlen(newpath) + strlen(gb->path + len) + 1);
+    if (renamed == NULL)
+      continue;
+    strcpy(renamed, newpath);
+    strcat(renamed, gb->path + len);
+    pthread_mutex_lock(&gb->lock);
+    free(gb->path);
+    gb->path = renamed;
+    pthread_mutex_unlock(&gb->lock);
+  }
+  pthread_mutex_unlock(&gatherListLock);
+}
+
+void gather_flush_all(void) {
+  if (gatherStaged == 0)
+    return;
+
+  pthread_mutex_lock(&gatherListLock);
+  for (struct gatherBuffer *gb = gatherList; gb; gb = gb->next) {
+    pthread_mutex_lock(&gb->lock);
+    gather_flush_locked(gb);
+    pthread_mutex_unlock(&gb->lock);
+  }
+  pthread_mutex_unlock(&gatherListLock);
+}
@@ -0,0 +1,49 @@
+/*
+  Small-write gathering for cachefs.
+
+  Each open file handle gets a gather buffer.  Writes that continue
+  where the previous one ended are staged there and reach the NAS as
+  one large pwrite when the buffer fills, on flush/fsync/release,
+  before anything reads the file through the mount, or once the oldest
+  staged byte is older than the gather timeout.
+
+  Staged writes have already been acknowledged.  If their NAS write
+  fails they stay staged (and their journal records stay in the
+  journal), every later flush retries them, and the error is reported
+  on the handle's next write, flush, fsync or release.
+*/
+
+#ifndef _GATHER_H_
+#define _GATHER_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct gatherBuffer;
+
+// capacity 0 turns gathering off (gather_open then returns NULL)
+int gather_init(size_t capacity, unsigned timeoutMs);
+void gather_shutdown(void);
+
+// staged, if not NULL, is the file's counter of buffers holding data
+// (open_file_staged) and must outlive the buffer
+struct gatherBuffer *gather_open(const char *path, int nasFD, int *staged);
+// flushes, then frees the buffer; returns any deferred write error
+int gather_close(struct gatherBuffer *gb);
+
+// stage (or write through) one write.  journalPos is where the write's
+// journal record starts (see journal_append), -1 if it has none.
+ssize_t gather_write(struct gatherBuffer *gb, const char *buf, size_t size, off_t offset, off_t journalPos);
+int gather_flush(struct gatherBuffer *gb);
+
+// read-your-writes: push out staged data of every handle on path
+int gather_flush_path(const char *path);
+// the same for a reader holding the file's staged counter: nothing to do,
+// and no lock taken, unless some buffer on the file (or one opened
+// without a counter) holds data
+int gather_flush_file(const char *path, const int *staged);
+void gather_flush_all(void);
+// path (a file or a whole directory) was renamed to newpath
+void gather_rename(const char *path, const char *newpath);
+
+#endif
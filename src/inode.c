@@ -0,0 +1,214 @@
+/*
+  Inode table for the cachefs low-level frontend.  See inode.h.
+
+  Every inode is hashed by number and, while its path still resolves
+  to it, by path.  Lookups by number (every request) take the lock
+  shared; lookup, forget, unlink and rename take it exclusive.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inode.h"
+#include "pathtable.h"
+
+#define INODE_BUCKETS 16384
+#define INODE_ROOT 1 // FUSE_ROOT_ID
+
+struct inodeEntry {
+  uint64_t ino;
+  char *path;
+  char *nasPath, *cacheName, *cachePath; // from inodeNamer, follow path
+  dev_t nasDev;
+  ino_t nasIno;
+  uint64_t nlookup;
+  int linked; // in the path hash
+  struct inodeEntry *inoNext, *pathNext;
+};
+
+static struct inodeEntry *inodeByIno[INODE_BUCKETS];
+static struct inodeEntry *inodeByPath[INODE_BUCKETS];
+static pthread_rwlock_t inodeLock = PTHREAD_RWLOCK_INITIALIZER;
+static uint64_t inodeNext = INODE_ROOT + 1;
+static inode_namer inodeNamer;
+
+static size_t inode_path_hash(const char *path) {
+  return path_hash(path) % INODE_BUCKETS;
+}
+
+static struct inodeEntry *inode_find(uint64_t ino) {
+  struct inodeEntry *entry = inodeByIno[ino % INODE_BUCKETS];
+  while (entry && entry->ino != ino)
+    entry = entry->inoNext;
+  return entry;
+}
+
+static struct inodeEntry *inode_find_path(const char *path) {
+  struct inodeEntry *entry = inodeByPath[inode_path_hash(path)];
+  while (entry && strcmp(entry->path, path) != 0)
+    entry = entry->pathNext;
+  return entry;
+}
+
+static void inode_link_path(struct inodeEntry *entry) {
+  size_t bucket = inode_path_hash(entry->path);
+  entry->pathNext = inodeByPath[bucket];
+  inodeByPath[bucket] = entry;
+  entry->linked = 1;
+}
+
+static void inode_unlink_path(struct inodeEntry *entry) {
+  if (!entry->linked)
+    return;
+  for (struct inodeEntry **link = &inodeByPath[inode_path_hash(entry->path)]; *link; link = &(*link)->pathNext)
+    if (*link == entry) {
+      *link = entry->pathNext;
+      break;
+    }
+  entry->linked = 0;
+}
+
+static void inode_free_names(struct inodeEntry *entry) {
+  free(entry->path);
+  free(entry->nasPath);
+  free(entry->cacheName);
+  free(entry->cachePath);
+}
+
+static void inode_set_path(struct inodeEntry *entry, const char *path) {
+  char nasPath[PATH_MAX], cacheName[PATH_MAX], cachePath[PATH_MAX];
+
+  inodeNamer(path, nasPath, cacheName, cachePath);
+  entry->path = strdup(path);
+  entry->nasPath = strdup(nasPath);
+  entry->cacheName = strdup(cacheName);
+  entry->cachePath = strdup(cachePath);
+}
+
+static struct inodeEntry *inode_new(uint64_t ino, const char *path, const struct stat *statbuf) {
+  struct inodeEntry *entry = calloc(1, sizeof(*entry));
+  entry->ino = ino;
+  inode_set_path(entry, path);
+  if (statbuf) {
+    entry->nasDev = statbuf->st_dev;
+    entry->nasIno = statbuf->st_ino;
+  }
+  entry->inoNext = inodeByIno[ino % INODE_BUCKETS];
+  inodeByIno[ino % INODE_BUCKETS] = entry;
+  inode_link_path(entry);
+  return entry;
+}
+
+void inode_table_init(inode_namer namer) {
+  inodeNamer = namer;
+  // the root is never looked up or forgotten
+  inode_new(INODE_ROOT, "/", NULL)->nlookup = 1;
+}
+
+uint64_t inode_lookup(const char *path, const struct stat *statbuf) {
+  uint64_t ino;
+
+  if (strcmp(path, "/") == 0)
+    return INODE_ROOT;
+
+  pthread_rwlock_wrlock(&inodeLock);
+  struct inodeEntry *entry = inode_find_path(path);
+  if (entry && (entry->nasDev != statbuf->st_dev || entry->nasIno != statbuf->st_ino)) {
+    // replaced behind our back: the old number stays with the old file
+    inode_unlink_path(entry);
+    entry = NULL;
+  }
+  if (entry == NULL)
+    entry = inode_new(inodeNext++, path, statbuf);
+  entry->nlookup++;
+  ino = entry->ino;
+  pthread_rwlock_unlock(&inodeLock);
+
+  return ino;
+}
+
+void inode_forget(uint64_t ino, uint64_t nlookup) {
+  if (ino == INODE_ROOT)
+    return;
+
+  pthread_rwlock_wrlock(&inodeLock);
+  struct inodeEntry *entry = inode_find(ino);
+  if (entry && (entry->nlookup -= nlookup) == 0) {
+    inode_unlink_path(entry);
+    for (struct inodeEntry **link = &inodeByIno[ino % INODE_BUCKETS]; *link; link = &(*link)->inoNext)
+      if (*link == entry) {
+        *link = entry->inoNext;
+        break;
+      }
+    inode_free_names(entry);
+    free(entry);
+  }
+  pthread_rwlock_unlock(&inodeLock);
+}
+
+int inode_path(uint64_t ino, char path[PATH_MAX]) {
+  int retstat = -ESTALE;
+
+  pthread_rwlock_rdlock(&inodeLock);
+  struct inodeEntry *entry = inode_find(ino);
+  if (entry) {
+    // an unlinked inode still has open handles working on its old path
+    strcpy(path, entry->path);
+    retstat = 0;
+  }
+  pthread_rwlock_unlock(&inodeLock);
+
+  return retstat;
+}
+
+int inode_names(uint64_t ino, char path[PATH_MAX], char nasPath[PATH_MAX],
+                char cacheName[PATH_MAX], char cachePath[PATH_MAX]) {
+  int retstat = -ESTALE;
+
+  pthread_rwlock_rdlock(&inodeLock);
+  struct inodeEntry *entry = inode_find(ino);
+  if (entry) {
+    strcpy(path, entry->path);
+    strcpy(nasPath, entry->nasPath);
+    strcpy(cacheName, entry->cacheName);
+    strcpy(cachePath, entry->cachePath);
+    retstat = 0;
+  }
+  pthread_rwlock_unlock(&inodeLock);
+
+  return retstat;
+}
+
+void inode_unlinked(const char *path) {
+  pthread_rwlock_wrlock(&inodeLock);
+  struct inodeEntry *entry = inode_find_path(path);
+  if (entry)
+    inode_unlink_path(entry);
+  pthread_rwlock_unlock(&inodeLock);
+}
+
+void inode_renamed(const char *path, const char *newpath) {
+  size_t len = strlen(path);
+  char moved[PATH_MAX];
+
+  pthread_rwlock_wrlock(&inodeLock);
+  struct inodeEntry *target = inode_find_path(newpath);
+  if (target)
+    inode_unlink_path(target); // replaced by the rename
+
+  for (size_t bucket = 0; bucket < INODE_BUCKETS; bucket++)
+    for (struct inodeEntry *entry = inodeByIno[bucket]; entry; entry = entry->inoNext) {
+      if (!entry->linked || strncmp(entry->path, path, len) != 0 ||
+          (entry->path[len] != '\0' && entry->path[len] != '/'))
+        continue;
+      if (snprintf(moved, PATH_MAX, "%s%s", newpath, entry->path + len) >= PATH_MAX)
+        continue;
+      inode_unlink_path(entry);
+      inode_free_names(entry);
+      inode_set_path(entry, moved);
+      inode_link_path(entry);
+    }
+  pthread_rwlock_unlock(&inodeLock);
+}
@@ -0,0 +1,41 @@
+/*
+  Inode table for the cachefs low-level frontend (cachefs_ll.c).
+
+  Maps the inode numbers we hand to the kernel to the path below the
+  mount, the NAS path, cache file name and cache path that go with it,
+  and the NAS file identity (st_dev/st_ino) the number was issued for.
+  An inode lives until the kernel has forgotten every lookup of it.
+*/
+
+#ifndef _INODE_H_
+#define _INODE_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// works out the NAS path, cache file name and cache path of path
+typedef void (*inode_namer)(const char *path, char nasPath[PATH_MAX],
+                            char cacheName[PATH_MAX], char cachePath[PATH_MAX]);
+
+void inode_table_init(inode_namer namer);
+
+// one more kernel reference to the file at path, whose NAS attributes
+// are statbuf.  Returns its inode number (a new one if path now names a
+// different NAS file).
+uint64_t inode_lookup(const char *path, const struct stat *statbuf);
+// the kernel dropped nlookup references to ino
+void inode_forget(uint64_t ino, uint64_t nlookup);
+
+// path of ino; 0 or -ESTALE
+int inode_path(uint64_t ino, char path[PATH_MAX]);
+// path of ino and the names that go with it; 0 or -ESTALE
+int inode_names(uint64_t ino, char path[PATH_MAX], char nasPath[PATH_MAX],
+                char cacheName[PATH_MAX], char cachePath[PATH_MAX]);
+
+// path was unlinked or removed: it no longer resolves to its inode
+void inode_unlinked(const char *path);
+// path and everything below it now live under newpath
+void inode_renamed(const char *path, const char *newpath);
+
+#endif
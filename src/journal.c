@@ -0,0 +1,401 @@
+/*
+  Write journal for cachefs.  See journal.h for the overview.
+
+  On-disk format: a sequence of records, each a journal_record header
+  followed by the path (no terminating null) and the data.  The
+  checksum covers the path, data and header (with checksum = 0), so a
+  torn record at the tail of the journal is detected and ignored on
+  replay.  A record whose NAS write failed has its magic overwritten
+  with JOURNAL_CANCELLED; replay steps over it.
+*/
+#define _GNU_SOURCE // pwritev
+#include "config.h"
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "log.h"
+#include "nasemu.h"
+#include "pathtable.h"
+#include "stats.h"
+
+#define JOURNAL_MAGIC 0x4a534643 // "CFSJ"
+#define JOURNAL_CANCELLED 0x58534643 // "CFSX"
+#define JOURNAL_MAX_RECORD (64 * 1024 * 1024)
+
+struct journal_record {
+  uint32_t magic;
+  uint32_t pathLen;
+  uint64_t seq;
+  int64_t offset;
+  uint64_t dataLen;
+  uint64_t checksum;
+};
+
+static int journalFD = -1;
+static size_t journalMaxBytes = 0;
+static char journalNasDir[PATH_MAX];
+
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journalCond = PTHREAD_COND_INITIALIZER;
+static off_t journalBytes = 0;     // end of the last appended record
+static uint64_t appendedSeq = 0;   // last record appended
+static uint64_t durableSeq = 0;    // last record known to be on disk
+static int syncing = 0;            // a writer is running the group fdatasync
+static int inflight = 0;           // appended records whose NAS pwrite is still running
+static int stranded = 0;           // acknowledged records that never reached the NAS
+static void (*checkpointHook)(void) = NULL;
+
+// NAS files touched since the last checkpoint
+static char **dirtyPaths = NULL;
+static size_t dirtyCount = 0, dirtyCapacity = 0;
+
+// FNV-1a, cheap enough to run over every journaled byte.
+// path and data first so writers can hash their payload before taking the lock
+static uint64_t journal_payload_checksum(struct journal_record *rec, const char *path, const char *data) {
+  uint64_t hash = path_hash_bytes(PATH_HASH_SEED, path, rec->pathLen);
+  return path_hash_bytes(hash, data, rec->dataLen);
+}
+
+static uint64_t journal_header_checksum(uint64_t hash, struct journal_record *rec) {
+  struct journal_record hdr = *rec;
+  hdr.checksum = 0;
+  return path_hash_bytes(hash, &hdr, sizeof(hdr));
+}
+
+// caller holds journalLock
+static void journal_mark_dirty(const char *path) {
+  for (size_t i = dirtyCount; i > 0; i--) // newest first, usually the same file again
+    if (strcmp(dirtyPaths[i - 1], path) == 0)
+      return;
+
+  if (dirtyCount == dirtyCapacity) {
+    dirtyCapacity = dirtyCapacity ? dirtyCapacity * 2 : 16;
+    dirtyPaths = realloc(dirtyPaths, dirtyCapacity * sizeof(*dirtyPaths));
+  }
+  dirtyPaths[dirtyCount++] = strdup(path);
+}
+
+static void journal_clear_dirty(void) {
+  for (size_t i = 0; i < dirtyCount; i++)
+    free(dirtyPaths[i]);
+  dirtyCount = 0;
+}
+
+static int journal_sync_nas_file(const char *path) {
+  char nasPath[PATH_MAX];
+  if (snprintf(nasPath, PATH_MAX, "%s%s", journalNasDir, path) >= PATH_MAX)
+    return 0; // no NAS file has this name, so no write to it can have landed
+
+  int fd = NAS_EMU(NAS_OPEN, open(nasPath, O_WRONLY));
+  if (fd < 0)
+    return errno == ENOENT ? 0 : -errno; // unlinked since, nothing to keep
+  int ret = NAS_EMU(NAS_SYNC, fsync(fd)) < 0 ? -errno : 0;
+  close(fd);
+  return ret;
+}
+
+int journal_open(const char *cachedir, const char *nasdir, size_t maxBytes) {
+  char journalPath[PATH_MAX];
+
+  journalMaxBytes = maxBytes;
+  if (maxBytes == 0)
+    return 0;
+
+  strncpy(journalNasDir, nasdir, PATH_MAX - 1);
+  snprintf(journalPath, PATH_MAX, "%s%s", cachedir, JOURNAL_FILE_NAME);
+
+  journalFD = open(journalPath, O_RDWR | O_CREAT, 0600);
+  if (journalFD < 0) {
+    fprintf(stderr, "Cannot open write journal %s: %s\n", journalPath, strerror(errno));
+    journalMaxBytes = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void journal_close(void) {
+  if (journalFD < 0)
+    return;
+  journal_checkpoint();
+  close(journalFD);
+  journalFD = -1;
+  journal_clear_dirty();
+  free(dirtyPaths);
+  dirtyPaths = NULL;
+  dirtyCapacity = 0;
+}
+
+int journal_enabled(void) {
+  return journalFD >= 0;
+}
+
+// write every live record to the NAS again, in journal order, marking
+// the files dirty.  Runs before any writer at mount time, or with
+// journalLock held and nothing in flight.  Returns the records applied;
+// *failed counts the ones whose NAS write failed.
+static ssize_t journal_apply(ssize_t *failed) {
+  struct journal_record rec;
+  char path[PATH_MAX], nasPath[PATH_MAX];
+  char *data = NULL;
+  off_t pos = 0;
+  ssize_t applied = 0;
+
+  *failed = 0;
+  while (pread(journalFD, &rec, sizeof(rec), pos) == sizeof(rec)) {
+    if ((rec.magic != JOURNAL_MAGIC && rec.magic != JOURNAL_CANCELLED) || rec.pathLen == 0 ||
+        rec.pathLen >= PATH_MAX || rec.dataLen > JOURNAL_MAX_RECORD)
+      break;
+    if (rec.magic == JOURNAL_CANCELLED) { // the application saw this write fail
+      pos += sizeof(rec) + rec.pathLen + rec.dataLen;
+      continue;
+    }
+
+    char *grown = realloc(data, rec.dataLen ? rec.dataLen : 1);
+    if (grown == NULL) {
+      (*failed)++;
+      break;
+    }
+    data = grown;
+    if (pread(journalFD, path, rec.pathLen, pos + sizeof(rec)) != rec.pathLen ||
+        pread(journalFD, data, rec.dataLen, pos + sizeof(rec) + rec.pathLen) != (ssize_t)rec.dataLen)
+      break;
+    path[rec.pathLen] = '\0';
+
+    if (journal_header_checksum(journal_payload_checksum(&rec, path, data), &rec) != rec.checksum) {
+      log_at(LOG_ERROR, "    journal_apply: torn record at %lld, stopping\n", (long long)pos);
+      break;
+    }
+
+    int fd = -1;
+    if (snprintf(nasPath, PATH_MAX, "%s%s", journalNasDir, path) >= PATH_MAX)
+      errno = ENAMETOOLONG;
+    else
+      fd = NAS_EMU(NAS_OPEN, open(nasPath, O_WRONLY));
+    if (fd >= 0) {
+      if (NAS_EMU(NAS_WRITE, pwrite(fd, data, rec.dataLen, rec.offset)) != (ssize_t)rec.dataLen) {
+        log_at(LOG_ERROR, "    journal_apply: write to %s failed: %s\n", nasPath, strerror(errno));
+        (*failed)++;
+      } else {
+        applied++;
+      }
+      close(fd);
+      journal_mark_dirty(path);
+    } else if (errno == ENOENT || errno == ENAMETOOLONG) { // unlinked since, nothing to keep
+      log_at(LOG_INFO, "    journal_apply: skipping %s: %s\n", nasPath, strerror(errno));
+    } else {
+      log_at(LOG_ERROR, "    journal_apply: cannot open %s: %s\n", nasPath, strerror(errno));
+      (*failed)++;
+    }
+    pos += sizeof(rec) + rec.pathLen + rec.dataLen;
+  }
+  free(data);
+  return applied;
+}
+
+ssize_t journal_replay(void (*replayed)(const char *path)) {
+  ssize_t failed;
+
+  if (journalFD < 0)
+    return 0;
+
+  ssize_t applied = journal_apply(&failed);
+  if (failed) // dropped, as replay always has: refusing the mount would not get them written either
+    fprintf(stderr, "Write journal: %ld records could not be written to the NAS (see cachefs.log)\n", (long)failed);
+
+  for (size_t i = 0; i < dirtyCount; i++) {
+    if (journal_sync_nas_file(dirtyPaths[i]) < 0) {
+      fprintf(stderr, "Write journal: cannot sync %s, keeping journal\n", dirtyPaths[i]);
+      journal_clear_dirty();
+      return -1;
+    }
+    if (replayed)
+      replayed(dirtyPaths[i]);
+  }
+  journal_clear_dirty();
+
+  if (ftruncate(journalFD, 0) < 0 || fsync(journalFD) < 0)
+    return -1;
+  journalBytes = 0;
+
+  fprintf(stderr, "Write journal: replayed %ld records\n", (long)applied);
+  return applied;
+}
+
+uint64_t journal_append(const char *path, const char *buf, size_t size, off_t offset, off_t *recordPos) {
+  struct journal_record rec;
+  struct iovec iov[3];
+  uint64_t seq;
+
+  rec.magic = JOURNAL_MAGIC;
+  rec.pathLen = strlen(path);
+  rec.offset = offset;
+  rec.dataLen = size;
+
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = (void *)path;
+  iov[1].iov_len = rec.pathLen;
+  iov[2].iov_base = (void *)buf;
+  iov[2].iov_len = size;
+  uint64_t hash = journal_payload_checksum(&rec, path, buf);
+
+  pthread_mutex_lock(&journalLock);
+  rec.seq = seq = appendedSeq + 1;
+  rec.checksum = journal_header_checksum(hash, &rec);
+
+  ssize_t len = sizeof(rec) + rec.pathLen + size;
+  if (pwritev(journalFD, iov, 3, journalBytes) != len) {
+    log_at(LOG_ERROR, "    journal_append: pwritev failed: %s\n", strerror(errno));
+    pthread_mutex_unlock(&journalLock);
+    return 0;
+  }
+  *recordPos = journalBytes;
+  journalBytes += len;
+  appendedSeq = seq;
+  inflight++;
+  journal_mark_dirty(path);
+  pthread_mutex_unlock(&journalLock);
+
+  return seq;
+}
+
+void journal_write_done(int records) {
+  pthread_mutex_lock(&journalLock);
+  inflight -= records;
+  if (inflight == 0)
+    pthread_cond_broadcast(&journalCond);
+  pthread_mutex_unlock(&journalLock);
+}
+
+void journal_write_failed(off_t recordPos) {
+  uint32_t cancelled = JOURNAL_CANCELLED;
+
+  // still in flight, so no checkpoint can have emptied the journal under us
+  if (pwrite(journalFD, &cancelled, sizeof(cancelled), recordPos) != sizeof(cancelled) ||
+#ifdef HAVE_FDATASYNC
+      fdatasync(journalFD) < 0)
+#else
+      fsync(journalFD) < 0)
+#endif
+    log_at(LOG_ERROR, "    journal_write_failed: cannot cancel record at %lld: %s\n", (long long)recordPos,
+           strerror(errno));
+  journal_write_done(1);
+}
+
+void journal_write_lost(int records) {
+  pthread_mutex_lock(&journalLock);
+  stranded += records;
+  pthread_mutex_unlock(&journalLock);
+  stats_add(STAT_JOURNAL_STRANDED, records);
+  log_at(LOG_ERROR, "    journal_write_lost: %d records kept for replay\n", records);
+  journal_write_done(records);
+}
+
+int journal_commit(uint64_t seq) {
+  int ret = 0;
+
+  pthread_mutex_lock(&journalLock);
+  while (durableSeq < seq) {
+    if (syncing) {
+      // someone else's fdatasync may already cover us
+      pthread_cond_wait(&journalCond, &journalLock);
+      continue;
+    }
+    // lead a group commit for everything appended so far
+    uint64_t target = appendedSeq;
+    syncing = 1;
+    pthread_mutex_unlock(&journalLock);
+#ifdef HAVE_FDATASYNC
+    ret = fdatasync(journalFD);
+#else
+    ret = fsync(journalFD);
+#endif
+    pthread_mutex_lock(&journalLock);
+    syncing = 0;
+    if (ret < 0) {
+      ret = -errno;
+      pthread_cond_broadcast(&journalCond);
+      break;
+    }
+    durableSeq = target;
+    pthread_cond_broadcast(&journalCond);
+  }
+  int full = (size_t)journalBytes >= journalMaxBytes;
+  pthread_mutex_unlock(&journalLock);
+
+  if (ret == 0 && full)
+    ret = journal_checkpoint();
+  return ret;
+}
+
+void journal_set_checkpoint_hook(void (*hook)(void)) {
+  checkpointHook = hook;
+}
+
+int journal_checkpoint(void) {
+  int ret = 0;
+
+  if (journalFD < 0)
+    return 0;
+
+  if (checkpointHook)
+    checkpointHook();
+
+  pthread_mutex_lock(&journalLock);
+  // every journaled write must have reached the NAS before its record is dropped
+  while (syncing || inflight > 0)
+    pthread_cond_wait(&journalCond, &journalLock);
+
+  if (journalBytes == 0) {
+    pthread_mutex_unlock(&journalLock);
+    return 0;
+  }
+  if (stranded) {
+    // emptying the journal would lose writes the NAS never took: write
+    // everything in it again (in order, so later writes still win) and
+    // keep the journal until the NAS takes all of it
+    ssize_t failed;
+    journal_apply(&failed);
+    if (failed) {
+      log_at(LOG_ERROR, "    journal_checkpoint: %d stranded records, %ld still refused by the NAS, keeping %lld bytes\n",
+             stranded, (long)failed, (long long)journalBytes);
+      pthread_mutex_unlock(&journalLock);
+      return -EIO;
+    }
+    log_at(LOG_INFO, "    journal_checkpoint: %d stranded records written to the NAS\n", stranded);
+    stranded = 0;
+  }
+
+  log_at(LOG_INFO, "    journal_checkpoint: %lld bytes, %lu files\n", (long long)journalBytes, dirtyCount);
+  for (size_t i = 0; i < dirtyCount; i++) {
+    ret = journal_sync_nas_file(dirtyPaths[i]);
+    if (ret < 0) {
+      log_at(LOG_ERROR, "    journal_checkpoint: NAS fsync of %s failed: %s\n", dirtyPaths[i], strerror(-ret));
+      pthread_mutex_unlock(&journalLock);
+      return ret;
+    }
+  }
+  journal_clear_dirty();
+
+  if (ftruncate(journalFD, 0) < 0 || fsync(journalFD) < 0)
+    ret = -errno;
+  else
+    journalBytes = 0;
+  durableSeq = appendedSeq;
+  pthread_mutex_unlock(&journalLock);
+
+  return ret;
+}
@@ -0,0 +1,56 @@
+/*
+  Write journal for cachefs.
+
+  Every write is appended to Write-Journal.dat in the cache directory
+  and made durable there (one fdatasync shared by every writer that
+  arrives while the previous sync is running) before it is
+  acknowledged.  The NAS copy is only fsync'ed at checkpoints, so an
+  fsync-heavy application waits on the cache device instead of the
+  network.  Records left over after a crash are re-applied to the NAS
+  by journal_replay() on the next mount.
+*/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JOURNAL_FILE_NAME "/Write-Journal.dat"
+
+// open (creating if needed) the journal in cachedir.  maxBytes is the
+// size at which the journal is checkpointed; 0 leaves the journal off.
+int journal_open(const char *cachedir, const char *nasdir, size_t maxBytes);
+void journal_close(void);
+int journal_enabled(void);
+
+// Re-apply any records left in the journal to the NAS, then empty it.
+// replayed() is called once per distinct path so the caller can drop
+// its (possibly stale) cached copy.  Returns the number of records
+// applied or -1 on error.
+ssize_t journal_replay(void (*replayed)(const char *path));
+
+// append one write record, returns its sequence number (0 on failure)
+// and where the record starts in *recordPos
+uint64_t journal_append(const char *path, const char *buf, size_t size, off_t offset, off_t *recordPos);
+// the NAS pwrites belonging to this many appended records have finished
+void journal_write_done(int records);
+// the NAS pwrite of the record at recordPos failed and the caller was
+// told so: the record is cancelled, replay must not apply it
+void journal_write_failed(off_t recordPos);
+// this many records were acknowledged but their NAS writes could not
+// be completed: checkpoints keep the journal from now on, so the next
+// mount replays them
+void journal_write_lost(int records);
+// block until record seq is on disk, group committing with other writers
+int journal_commit(uint64_t seq);
+// fsync every NAS file with journaled writes and empty the journal.
+// With stranded records (journal_write_lost) every record is first
+// written to the NAS again; while the NAS refuses any of them the
+// journal is kept and this returns -EIO.
+int journal_checkpoint(void);
+// called at the start of every checkpoint to push out NAS writes that
+// are still held back in memory (see gather.h)
+void journal_set_checkpoint_hook(void (*hook)(void));
+
+#endif
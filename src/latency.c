@@ -0,0 +1,239 @@
+/*
+  Latency histograms.  See latency.h.
+
+  Values under 16ns have a bucket each; above that every power of two
+  is split into 16 buckets.  As in stats.c, a request that ends adds
+  to the histograms of the shard of the CPU it runs on (atomically, for
+  threads that migrate in between), and latency_format sums the shards.
+  Shards only take memory for the pages that were ever recorded into.
+  The request in flight on a thread is kept in thread-local storage and
+  only touches the histograms when it ends.
+*/
+#define _GNU_SOURCE // sched_getcpu
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+#include "slowlog.h"
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB)
+#define LAT_SHARDS 16
+
+struct latencyHistogram {
+  uint64_t count;
+  uint64_t sumNs;
+  uint64_t buckets[LAT_BUCKETS];
+};
+
+struct latencyRequest {
+  int depth;
+  enum latencyOp op;
+  const char *path;
+  off_t offset;
+  size_t size;
+  size_t blocksHit, blocksMissed;
+  uint64_t start;
+  uint64_t phaseNs[LAT_PHASES];
+  int phaseSeen[LAT_PHASES];
+};
+
+struct latencyShard {
+  struct latencyHistogram histograms[LAT_OPS][LAT_PHASES];
+} __attribute__((aligned(64)));
+
+static struct latencyShard latencyShards[LAT_SHARDS];
+static __thread struct latencyRequest latencyCurrent;
+
+static const char *latencyOpNames[LAT_OPS] = {
+  "getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir",
+  "symlink", "rename", "link", "chmod", "chown", "truncate",
+  "utime", "open",
+  "read_hit", "read_partial", "read_miss",
+  "write", "statfs", "flush", "release", "fsync",
+  "setxattr", "getxattr", "listxattr", "removexattr",
+  "opendir", "readdir", "releasedir", "fsyncdir", "access",
+  "ftruncate", "fgetattr",
+};
+
+static const char *latencyPhaseNames[LAT_PHASES] = {
+  "total", "metadata", "cache_io", "nas_io", "fill", "evict_wait",
+};
+
+uint64_t latency_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static size_t latency_bucket(uint64_t ns) {
+  if (ns < LAT_SUB)
+    return ns;
+  int exponent = 63 - __builtin_clzll(ns);
+  return (exponent - LAT_SUB_BITS + 1) * LAT_SUB + ((ns >> (exponent - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+// largest value that lands in bucket
+static uint64_t latency_bucket_limit(size_t bucket) {
+  if (bucket < LAT_SUB)
+    return bucket;
+  int exponent = bucket / LAT_SUB + LAT_SUB_BITS - 1;
+  uint64_t width = 1ULL << (exponent - LAT_SUB_BITS);
+  return ((LAT_SUB + bucket % LAT_SUB) << (exponent - LAT_SUB_BITS)) + width - 1;
+}
+
+static void latency_record(enum latencyOp op, enum latencyPhase phase, uint64_t ns) {
+  int cpu = sched_getcpu();
+  struct latencyShard *shard = &latencyShards[cpu < 0 ? 0 : cpu % LAT_SHARDS];
+  struct latencyHistogram *histogram = &shard->histograms[op][phase];
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sumNs, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->buckets[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+const char *latency_op_name(enum latencyOp op) {
+  return latencyOpNames[op];
+}
+
+const char *latency_phase_name(enum latencyPhase phase) {
+  return latencyPhaseNames[phase];
+}
+
+int latency_begin(enum latencyOp op, const char *path) {
+  struct latencyRequest *request = &latencyCurrent;
+
+  if (request->depth++ == 0) {
+    request->op = op;
+    request->path = path;
+    request->offset = -1;
+    request->size = 0;
+    request->blocksHit = request->blocksMissed = 0;
+    for (int phase = 0; phase < LAT_PHASES; phase++) {
+      request->phaseNs[phase] = 0;
+      request->phaseSeen[phase] = 0;
+    }
+    request->start = latency_now();
+  }
+  return op;
+}
+
+// request was slow: copy it into the slow log
+static void latency_slow(const struct latencyRequest *request, uint64_t totalNs) {
+  struct slowRequest slow;
+
+  clock_gettime(CLOCK_REALTIME, &slow.when);
+  slow.op = request->op;
+  strncpy(slow.path, request->path ? request->path : "", PATH_MAX - 1);
+  slow.path[PATH_MAX - 1] = '\0';
+  slow.offset = request->offset;
+  slow.size = request->size;
+  slow.blocksHit = request->blocksHit;
+  slow.blocksMissed = request->blocksMissed;
+  slow.totalNs = totalNs;
+  for (int phase = 0; phase < LAT_PHASES; phase++)
+    slow.phaseNs[phase] = request->phaseNs[phase];
+  slow_log_add(&slow);
+}
+
+void latency_end(int *scope) {
+  struct latencyRequest *request = &latencyCurrent;
+
+  if (--request->depth > 0)
+    return;
+  uint64_t totalNs = latency_now() - request->start;
+  latency_record(request->op, LAT_TOTAL, totalNs);
+  for (int phase = LAT_TOTAL + 1; phase < LAT_PHASES; phase++)
+    if (request->phaseSeen[phase])
+      latency_record(request->op, phase, request->phaseNs[phase]);
+  if (slow_log_wants(totalNs))
+    latency_slow(request, totalNs);
+}
+
+void latency_set_op(enum latencyOp op) {
+  if (latencyCurrent.depth > 0)
+    latencyCurrent.op = op;
+}
+
+void latency_set_range(off_t offset, size_t size) {
+  latencyCurrent.offset = offset;
+  latencyCurrent.size = size;
+}
+
+void latency_set_blocks(size_t hit, size_t missed) {
+  latencyCurrent.blocksHit = hit;
+  latencyCurrent.blocksMissed = missed;
+}
+
+uint64_t latency_phase_begin(void) {
+  if (latencyCurrent.depth == 0)
+    return 0;
+  return latency_now();
+}
+
+void latency_phase_end(enum latencyPhase phase, uint64_t start) {
+  struct latencyRequest *request = &latencyCurrent;
+
+  if (start == 0)
+    return;
+  request->phaseNs[phase] += latency_now() - start;
+  request->phaseSeen[phase] = 1;
+}
+
+// add up the shards of one histogram
+static void latency_sum(enum latencyOp op, enum latencyPhase phase, struct latencyHistogram *sum) {
+  memset(sum, 0, sizeof(*sum));
+  for (int shard = 0; shard < LAT_SHARDS; shard++) {
+    const struct latencyHistogram *histogram = &latencyShards[shard].histograms[op][phase];
+    if (__atomic_load_n(&histogram->count, __ATOMIC_RELAXED) == 0)
+      continue;
+    sum->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    sum->sumNs += __atomic_load_n(&histogram->sumNs, __ATOMIC_RELAXED);
+    for (size_t bucket = 0; bucket < LAT_BUCKETS; bucket++)
+      sum->buckets[bucket] += __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+  }
+}
+
+// upper bound of the bucket holding quantile q of histogram, in ns
+static uint64_t latency_quantile(const struct latencyHistogram *histogram, double q) {
+  uint64_t rank = (uint64_t)(q * histogram->count);
+  uint64_t seen = 0;
+
+  if (rank >= histogram->count)
+    rank = histogram->count - 1;
+  for (size_t bucket = 0; bucket < LAT_BUCKETS; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen > rank)
+      return latency_bucket_limit(bucket);
+  }
+  return latency_bucket_limit(LAT_BUCKETS - 1);
+}
+
+#define LAT_APPEND(...) \
+  (len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, __VA_ARGS__))
+
+size_t latency_format(char *buf, size_t size) {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  struct latencyHistogram histogram;
+  size_t len = 0;
+
+  LAT_APPEND("# HELP cachefs_op_latency_seconds Time spent in each cachefs operation, total and by phase.\n");
+  LAT_APPEND("# TYPE cachefs_op_latency_seconds summary\n");
+  for (int op = 0; op < LAT_OPS; op++)
+    for (int phase = 0; phase < LAT_PHASES; phase++) {
+      latency_sum(op, phase, &histogram);
+      if (histogram.count == 0)
+        continue;
+      for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        LAT_APPEND("cachefs_op_latency_seconds{op=\"%s\",phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                   latencyOpNames[op], latencyPhaseNames[phase], quantiles[q],
+                   latency_quantile(&histogram, quantiles[q]) / 1e9);
+      LAT_APPEND("cachefs_op_latency_seconds_sum{op=\"%s\",phase=\"%s\"} %.9f\n", latencyOpNames[op],
+                 latencyPhaseNames[phase], histogram.sumNs / 1e9);
+      LAT_APPEND("cachefs_op_latency_seconds_count{op=\"%s\",phase=\"%s\"} %llu\n", latencyOpNames[op],
+                 latencyPhaseNames[phase], (unsigned long long)histogram.count);
+    }
+  return len;
+}
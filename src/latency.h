@@ -0,0 +1,69 @@
+/*
+  Per-operation latency histograms for cachefs.
+
+  Every cfs_* operation opens a request scope with LATENCY_OP; its
+  total time, and the time it spent in each phase, go into log-linear
+  (HDR style) histograms with about 6% resolution from a nanosecond to
+  centuries.  A scope opened inside another one (cfs_getattr calling
+  cfs_getNASattr) belongs to the outer request.  latency_format renders
+  everything in the Prometheus text format for /.cachefs/metrics;
+  requests over the slow-log threshold also go to slowlog.h.
+*/
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum latencyOp {
+  LAT_GETATTR, LAT_READLINK, LAT_MKNOD, LAT_MKDIR, LAT_UNLINK, LAT_RMDIR,
+  LAT_SYMLINK, LAT_RENAME, LAT_LINK, LAT_CHMOD, LAT_CHOWN, LAT_TRUNCATE,
+  LAT_UTIME, LAT_OPEN,
+  LAT_READ_HIT, LAT_READ_PARTIAL, LAT_READ_MISS, // cfs_read, by how much was cached
+  LAT_WRITE, LAT_STATFS, LAT_FLUSH, LAT_RELEASE, LAT_FSYNC,
+  LAT_SETXATTR, LAT_GETXATTR, LAT_LISTXATTR, LAT_REMOVEXATTR,
+  LAT_OPENDIR, LAT_READDIR, LAT_RELEASEDIR, LAT_FSYNCDIR, LAT_ACCESS,
+  LAT_FTRUNCATE, LAT_FGETATTR,
+  LAT_OPS
+};
+
+enum latencyPhase {
+  LAT_TOTAL,
+  LAT_METADATA, // metadata database
+  LAT_CACHE_IO, // reads and writes of cache files
+  LAT_NAS_IO,   // NAS opens, reads, writes and lstats
+  LAT_FILL,     // copying a block read from the NAS into the cache
+  LAT_EVICT,    // waiting for the cache to make room
+  LAT_PHASES
+};
+
+uint64_t latency_now(void); // monotonic ns
+
+// path has to stay valid until the request ends
+int latency_begin(enum latencyOp op, const char *path);
+void latency_end(int *scope);
+// the current request turned out to be op (a read found its blocks cached)
+void latency_set_op(enum latencyOp op);
+// byte range and block hit/miss mix of the current request, for the slow log
+void latency_set_range(off_t offset, size_t size);
+void latency_set_blocks(size_t hit, size_t missed);
+
+#define LATENCY_OP(op, path) \
+  int latencyScope __attribute__((cleanup(latency_end), unused)) = latency_begin(op, path)
+
+// time from latency_phase_begin to latency_phase_end goes to phase.
+// Phases may nest and each counts in full: a fill's metadata update and
+// cache write are metadata and cache_io time as well as fill time.
+uint64_t latency_phase_begin(void);
+void latency_phase_end(enum latencyPhase phase, uint64_t start);
+
+const char *latency_op_name(enum latencyOp op);
+const char *latency_phase_name(enum latencyPhase phase);
+
+// Prometheus text exposition of every histogram with samples, as
+// snprintf; returns the length it needed
+size_t latency_format(char *buf, size_t size);
+
+#endif
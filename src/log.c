@@ -10,20 +10,63 @@
   accomplish this.
 */
 
+#define _GNU_SOURCE // syscall(SYS_gettid)
 #include "params.h"
 
 #include <errno.h>
 #include <fuse.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "log.h"
+#include "logformat.h"
+
+/*
+  Every thread that logs owns a ring buffer it alone writes; the
+  writer thread alone consumes.  head and tail count bytes and only
+  grow, so head - tail is the space in use.  Records start on 8 byte
+  boundaries; one that would not fit before the end of the ring is
+  preceded by a zero size marker and starts over at the beginning.  A
+  full ring drops the message rather than making the request wait.
+*/
+#define LOG_RING_SIZE (256 * 1024)
+#define LOG_DRAIN_MS 20
+
+struct logRing {
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  uint32_t tid;
+  int inUse;
+  int ownerGone; // thread exited, reusable once drained
+  struct logRing *next;
+  char data[LOG_RING_SIZE];
+};
+
+int log_level = LOG_DEBUG;
+
+static struct logRing *logRings = NULL; // push-only
+static __thread struct logRing *logSelf = NULL;
+static pthread_key_t logKey;
+static pthread_once_t logKeyOnce = PTHREAD_ONCE_INIT;
+
+static FILE *logFile = NULL;
+static pthread_t logWriter;
+static int logRunning = 0, logStopping = 0;
+
+// format ids the file already has a definition for (open addressing)
+static uint64_t *logFormats = NULL;
+static size_t logFormatSlots = 0, logFormatCount = 0;
 
 FILE *log_open() {
   FILE *logfile;
@@ -36,31 +79,320 @@ FILE *log_open() {
     exit(EXIT_FAILURE);
   }
 
-  // set logfile to line buffering
-  setvbuf(logfile, NULL, _IOLBF, 0);
+  // records are small and the writer flushes after every drain
+  setvbuf(logfile, NULL, _IOFBF, 64 * 1024);
+  fwrite(LOG_FILE_MAGIC, 1, strlen(LOG_FILE_MAGIC), logfile);
+  logFile = logfile;
 
   return logfile;
 }
 
-void log_msg(const char *format, ...) {
+static void log_thread_exit(void *ring) {
+  __atomic_store_n(&((struct logRing *)ring)->ownerGone, 1, __ATOMIC_RELEASE);
+}
+
+static void log_make_key(void) {
+  pthread_key_create(&logKey, log_thread_exit);
+}
+
+// first message from this thread: take a drained ring or add one
+static struct logRing *log_register(void) {
+  struct logRing *ring;
+
+  pthread_once(&logKeyOnce, log_make_key);
+  for (ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&ring->inUse, &free, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+      return NULL;
+    ring->inUse = 1;
+    ring->next = __atomic_load_n(&logRings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&logRings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  ring->tid = syscall(SYS_gettid);
+  pthread_setspecific(logKey, ring);
+  logSelf = ring;
+  return ring;
+}
+
+static char *log_put(char *out, char *end, const void *value, size_t size) {
+  if (out + size > end)
+    return NULL;
+  memcpy(out, value, size);
+  return out + size;
+}
+
+// append the arguments of format to out, as logformat.h describes;
+// returns the end of what was written or NULL if it did not fit
+static char *log_encode(char *out, char *end, const char *format, va_list ap) {
+  for (const char *f = format; out && *f; f++) {
+    if (*f != '%')
+      continue;
+    f++;
+    while (*f && strchr("-+ #0'", *f))
+      f++;
+    for (int part = 0; part < 2; part++) { // width, then precision
+      if (part == 1) {
+        if (*f != '.')
+          break;
+        f++;
+      }
+      if (*f == '*') {
+        int64_t value = va_arg(ap, int);
+        out = log_put(out, end, &value, sizeof(value));
+        f++;
+      }
+      while (*f >= '0' && *f <= '9')
+        f++;
+    }
+
+    int longs = 0, shorts = 0, wide = 0;
+    for (; *f && strchr("hlLqjzt", *f); f++) {
+      if (*f == 'h')
+        shorts++;
+      else if (*f == 'l' || *f == 'q')
+        longs++;
+      else if (*f == 'L')
+        wide = 1;
+      else // j, z, t: all 64 bits here
+        longs = 2;
+    }
+
+    int64_t value;
+    double real;
+    switch (*f) {
+    case 'd': case 'i':
+      value = longs >= 2 ? va_arg(ap, long long) : longs ? va_arg(ap, long) : va_arg(ap, int);
+      if (shorts == 1)
+        value = (short)value;
+      else if (shorts >= 2)
+        value = (signed char)value;
+      out = log_put(out, end, &value, sizeof(value));
+      break;
+    case 'u': case 'o': case 'x': case 'X':
+      value = longs >= 2 ? va_arg(ap, unsigned long long) : longs ? va_arg(ap, unsigned long) : va_arg(ap, unsigned);
+      if (shorts == 1)
+        value = (unsigned short)value;
+      else if (shorts >= 2)
+        value = (unsigned char)value;
+      out = log_put(out, end, &value, sizeof(value));
+      break;
+    case 'c':
+      value = va_arg(ap, int);
+      out = log_put(out, end, &value, sizeof(value));
+      break;
+    case 'p':
+      value = (intptr_t)va_arg(ap, void *);
+      out = log_put(out, end, &value, sizeof(value));
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      real = wide ? (double)va_arg(ap, long double) : va_arg(ap, double);
+      out = log_put(out, end, &real, sizeof(real));
+      break;
+    case 's': {
+      const char *str = va_arg(ap, const char *);
+      if (str == NULL)
+        str = "(null)";
+      size_t len = strlen(str);
+      // leave room for whatever comes after in a long message
+      if (len > (LOG_RECORD_MAX / 2))
+        len = LOG_RECORD_MAX / 2;
+      uint16_t len16 = len;
+      out = log_put(out, end, &len16, sizeof(len16));
+      if (out)
+        out = log_put(out, end, str, len);
+      break;
+    }
+    case 'n':
+      va_arg(ap, void *);
+      break;
+    case '\0':
+      return out;
+    default: // %%
+      break;
+    }
+  }
+  return out;
+}
+
+void log_write(int level, const char *format, ...) {
+  char record[LOG_RECORD_MAX];
+  struct logRecord *header = (struct logRecord *)record;
+  struct logRing *ring = logSelf ? logSelf : log_register();
+  struct timespec now;
   va_list ap;
+
+  if (ring == NULL)
+    return;
+
   va_start(ap, format);
+  char *end = log_encode(record + sizeof(*header), record + sizeof(record), format, ap);
+  va_end(ap);
+  if (end == NULL) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
 
-  vfprintf(CFS_DATA->logfile, format, ap);
+  clock_gettime(CLOCK_REALTIME, &now);
+  header->size = end - record;
+  header->level = level;
+  header->pad = 0;
+  header->tid = ring->tid;
+  header->nsec = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  header->format = (uintptr_t)format;
+
+  size_t need = (header->size + 7) & ~7;
+  uint64_t head = ring->head;
+  size_t pos = head % LOG_RING_SIZE;
+  size_t skip = LOG_RING_SIZE - pos < need ? LOG_RING_SIZE - pos : 0;
+  if (head + skip + need - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (skip) {
+    *(uint16_t *)(ring->data + pos) = 0;
+    pos = 0;
+  }
+  memcpy(ring->data + pos, record, header->size);
+  __atomic_store_n(&ring->head, head + skip + need, __ATOMIC_RELEASE);
+}
+
+// writer thread: emit the definition of format the first time it is used
+static void log_define_format(uint64_t format) {
+  if (logFormatCount * 2 >= logFormatSlots) {
+    size_t slots = logFormatSlots ? logFormatSlots * 2 : 1024;
+    uint64_t *grown = calloc(slots, sizeof(uint64_t));
+    for (size_t i = 0; i < logFormatSlots; i++)
+      if (logFormats[i])
+        for (size_t j = logFormats[i] % slots;; j = (j + 1) % slots)
+          if (grown[j] == 0) {
+            grown[j] = logFormats[i];
+            break;
+          }
+    free(logFormats);
+    logFormats = grown;
+    logFormatSlots = slots;
+  }
+
+  size_t slot = format % logFormatSlots;
+  for (; logFormats[slot]; slot = (slot + 1) % logFormatSlots)
+    if (logFormats[slot] == format)
+      return;
+  logFormats[slot] = format;
+  logFormatCount++;
+
+  const char *text = (const char *)(uintptr_t)format;
+  uint16_t len = strlen(text);
+  fputc(LOG_FILE_FORMAT, logFile);
+  fwrite(&format, sizeof(format), 1, logFile);
+  fwrite(&len, sizeof(len), 1, logFile);
+  fwrite(text, 1, len, logFile);
+}
+
+static void log_emit(const struct logRecord *header) {
+  log_define_format(header->format);
+  fputc(LOG_FILE_MESSAGE, logFile);
+  fwrite(header, 1, header->size, logFile);
+}
+
+// writer thread: copy out everything the producers have published,
+// returns whether there was anything
+static int log_drain(void) {
+  int drained = 0;
+
+  static const char droppedFormat[] = "    log: %llu messages dropped\n";
+
+  for (struct logRing *ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    int gone = __atomic_load_n(&ring->ownerGone, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+
+    while (tail < head) {
+      size_t pos = tail % LOG_RING_SIZE;
+      struct logRecord *header = (struct logRecord *)(ring->data + pos);
+      if (header->size == 0) { // wrapped
+        tail += LOG_RING_SIZE - pos;
+        continue;
+      }
+      log_emit(header);
+      tail += (header->size + 7) & ~7;
+      drained = 1;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+      struct {
+        struct logRecord header;
+        int64_t count;
+      } note; // no padding: the header is 24 bytes
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      note.header.size = sizeof(note);
+      note.header.level = LOG_ERROR;
+      note.header.pad = 0;
+      note.header.tid = ring->tid;
+      note.header.nsec = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+      note.header.format = (uintptr_t)droppedFormat;
+      note.count = dropped;
+      log_emit(&note.header);
+    }
+
+    if (gone) { // everything it wrote is out: hand the ring to the next new thread
+      __atomic_store_n(&ring->ownerGone, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&ring->inUse, 0, __ATOMIC_RELEASE);
+    }
+  }
+  fflush(logFile);
+  return drained;
+}
+
+static void *log_writer(void *arg) {
+  struct timespec busy = {0, 1000000}, idle = {0, LOG_DRAIN_MS * 1000000};
+
+  // come back sooner while messages keep arriving, so rings do not fill
+  while (!__atomic_load_n(&logStopping, __ATOMIC_ACQUIRE))
+    nanosleep(log_drain() ? &busy : &idle, NULL);
+  log_drain();
+  return NULL;
+}
+
+// after fuse has daemonized: the writer would not survive the fork
+void log_start(void) {
+  if (logFile && !logRunning && pthread_create(&logWriter, NULL, log_writer, NULL) == 0)
+    logRunning = 1;
+}
+
+void log_close(void) {
+  if (logRunning) {
+    __atomic_store_n(&logStopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logWriter, NULL);
+    logRunning = 0;
+  } else if (logFile) {
+    log_drain();
+  }
 }
 
 // Report errors to logfile and give -errno to caller
 int log_error(char *func) {
   int ret = -errno;
 
-  log_msg("    ERROR %s: %s\n", func, strerror(errno));
+  log_at(LOG_ERROR, "    ERROR %s: %s\n", func, strerror(errno));
 
   return ret;
 }
 
 // fuse context
 void log_fuse_context(struct fuse_context *context) {
-  log_msg("    context:\n");
+  if (!log_enabled(LOG_TRACE))
+    return;
+
+  log_at(LOG_TRACE, "    context:\n");
 
   /** Pointer to the fuse object */
   //	struct fuse *fuse;
@@ -93,7 +425,10 @@ void log_fuse_context(struct fuse_context *context) {
 // connection being used.  I don't actually use any of this
 // information in cachefs
 void log_conn(struct fuse_conn_info *conn) {
-  log_msg("    conn:\n");
+  if (!log_enabled(LOG_TRACE))
+    return;
+
+  log_at(LOG_TRACE, "    conn:\n");
 
   /** Major version of the protocol (read-only) */
   // unsigned proto_major;
@@ -140,7 +475,10 @@ void log_conn(struct fuse_conn_info *conn) {
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
 void log_fi(struct fuse_file_info *fi) {
-  log_msg("    fi:\n");
+  if (!log_enabled(LOG_TRACE))
+    return;
+
+  log_at(LOG_TRACE, "    fi:\n");
 
   /** Open flags.  Available in open() and release() */
   //	int flags;
@@ -180,7 +518,7 @@ void log_fi(struct fuse_file_info *fi) {
 
 void log_retstat(char *func, int retstat) {
   int errsave = errno;
-  log_msg("    %s returned %d\n", func, retstat);
+  log_at(LOG_TRACE, "    %s returned %d\n", func, retstat);
   errno = errsave;
 }
 
@@ -200,7 +538,10 @@ int log_syscall(char *func, int retstat, int min_ret) {
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
 void log_stat(struct stat *si) {
-  log_msg("    si:\n");
+  if (!log_enabled(LOG_TRACE))
+    return;
+
+  log_at(LOG_TRACE, "    si:\n");
 
   //  dev_t     st_dev;     /* ID of device containing file */
   log_struct(si, st_dev, % lld, );
@@ -243,7 +584,10 @@ void log_stat(struct stat *si) {
 }
 
 void log_statvfs(struct statvfs *sv) {
-  log_msg("    sv:\n");
+  if (!log_enabled(LOG_TRACE))
+    return;
+
+  log_at(LOG_TRACE, "    sv:\n");
 
   //  unsigned long  f_bsize;    /* file system block size */
   log_struct(sv, f_bsize, % ld, );
@@ -280,7 +624,10 @@ void log_statvfs(struct statvfs *sv) {
 }
 
 void log_utime(struct utimbuf *buf) {
-  log_msg("    buf:\n");
+  if (!log_enabled(LOG_TRACE))
+    return;
+
+  log_at(LOG_TRACE, "    buf:\n");
 
   //    time_t actime;
   log_struct(buf, actime, 0x % 08lx, );
@@ -9,12 +9,42 @@
 #define _LOG_H_
 #include <stdio.h>
 
+// Levels, most important first.  Messages above CFS_LOG_LEVEL are
+// compiled out; the rest are filtered at run time by log_level
+// (--log-level).
+#define LOG_ERROR 0
+#define LOG_INFO  1
+#define LOG_DEBUG 2
+#define LOG_TRACE 3
+
+#ifndef CFS_LOG_LEVEL
+#define CFS_LOG_LEVEL LOG_DEBUG
+#endif
+
+extern int log_level;
+
+#define log_enabled(level) ((level) <= CFS_LOG_LEVEL && (level) <= log_level)
+
+#define log_at(level, ...) \
+  do { \
+    if (log_enabled(level)) \
+      log_write(level, __VA_ARGS__); \
+  } while (0)
+
+// operation traces
+#define log_msg(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
-  log_msg("    " #field " = " #format "\n", typecast st->field)
+  log_at(LOG_TRACE, "    " #field " = " #format "\n", typecast st->field)
 
+// messages go to a per-thread ring buffer in binary (see logformat.h);
+// the writer thread started by log_start drains them to the file
 FILE *log_open(void);
-void log_msg(const char *format, ...);
+void log_start(void);
+void log_close(void);
+void log_write(int level, const char *format, ...);
+
 void log_conn(struct fuse_conn_info *conn);
 int log_error(char *func);
 void log_fi(struct fuse_file_info *fi);
@@ -0,0 +1,39 @@
+/*
+  Binary log layout, shared by log.c and tools/logdump.c.
+
+  The log file starts with LOG_FILE_MAGIC, followed by records that each
+  begin with a type byte:
+
+    LOG_FILE_FORMAT   uint64_t id, uint16_t length, the format string
+                      (written once, before the first message using it)
+    LOG_FILE_MESSAGE  struct logRecord, then the arguments
+
+  Arguments follow the conversions of the format in order: every
+  integer, '*' width or precision, character and pointer as an int64_t,
+  every floating point value as a double, and every string as a
+  uint16_t length and its bytes.  %n stores nothing.  All values are in
+  host byte order.
+*/
+
+#ifndef _LOGFORMAT_H_
+#define _LOGFORMAT_H_
+
+#include <stdint.h>
+
+#define LOG_FILE_MAGIC "CFSLOG01"
+#define LOG_FILE_FORMAT 1
+#define LOG_FILE_MESSAGE 2
+
+// longest record, header included; longer strings are cut short
+#define LOG_RECORD_MAX 8192
+
+struct logRecord {
+  uint16_t size; // header and arguments
+  uint8_t level;
+  uint8_t pad;
+  uint32_t tid;
+  uint64_t nsec; // CLOCK_REALTIME
+  uint64_t format;
+};
+
+#endif
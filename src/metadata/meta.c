@@ -1,136 +1,12 @@
 #include <sqlite3.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "meta.h"
 
-/*
-int main(void) {
-  // printf("%s\n", sqlite3_libversion());
-
-  sqlite3 *db;
-
-  // open database - either in memory or from file
-  open_db("Metadata-File.db", &db);
-  // check if tables exist
-  // else create the tables
-  int ret = create_tables(db);
-  if(ret == -1){
-    fprintf(stdout, "Tables probably exist already!\n");
-  }
-  
-  // printf("Initializing LRU block...\n");
-  // init_lru_blk();
-
-  set_block_size(1024);
-
-  // function to init cache_used_size 
-  printf("\n");
-  init_cache_used_size(db);
-
-  print_cache_used_size();
-
-  // insert new file into metadata
-  create_file(db, "newdir/hello/Hello.txt", 1234);
-  create_file(db, "newdir/hello/Test2.txt", 1234);
-  // function to create datablock entry
-  printf("Calling insert block...\n");
-  insert_block(db, "newdir/hello/Hello.txt", 1234);
-  insert_block(db, "newdir/hello/Hello.txt", 1578);
-
-  insert_block(db, "newdir/hello/Test2.txt", 1234);
-  insert_block(db, "newdir/hello/Test2.txt", 1578);
-
-  // insert blocks
-  size_t *blk_arr = (size_t*)malloc(sizeof(*blk_arr)*4);
-  memcpy(blk_arr, (size_t[4]) {1024, 1948, 0000, 2134}, sizeof(blk_arr[0])*4);
-  insert_blocks(db, "newdir/hello/Hello.txt", 4, blk_arr);
-  free(blk_arr);
-
-  // function to delete file (and relevant data-blocks) - using FK cascade
-  delete_file(db, "newdir/hello/Test2.txt");
-  delete_block(db, "newdir/hello/Hello.txt", 2134);
-
-  print_cache_used_size();
-
-  // function to update remote file size- call on close() &|or open()
-
-  printf("Finished insertions and deletions. "
-         "You should now check the db before I call write_blks...\n");
-  sleep(5);
-  // write blocks - insert or update
-  // function to update block timestamp
-  blk_arr = (size_t*)malloc(sizeof(*blk_arr)*4);
-  memcpy(blk_arr, (size_t[4]) {1024, 1948, 0000, 2134}, sizeof(blk_arr[0])*4);
-  write_blks(db, "newdir/hello/Hello.txt", 4, blk_arr);
-  free(blk_arr);  
-
-  // check file in cache
-  printf("%d\n", is_file_in_cache(db, "newdir/hello/Hello.txt"));
-  printf("%d\n", is_file_in_cache(db, "newdir/hello/Test2.txt"));
-
-  // check block in cache
-  printf("%d\n", is_blk_in_cache(db, "newdir/hello/Hello.txt", 1234));
-  printf("%d\n", is_blk_in_cache(db, "newdir/hello/Hello.txt", 1024));
-  printf("%d\n", is_blk_in_cache(db, "newdir/hello/Test2.txt", 1234));
-
-  // check blocks in cache
-  blk_arr = (size_t*)malloc(sizeof(*blk_arr)*4);
-  int *bool_arr = (int*)malloc(sizeof(*bool_arr)*4);
-  memcpy(blk_arr, (size_t[4]) {1024, 1948, 0000, 2134}, sizeof(blk_arr[0])*4);
-  are_blocks_in_cache(db, "newdir/hello/Hello.txt", 4, blk_arr, bool_arr);
-  for (int i = 0; i < 4; ++i){
-    printf("%lu:%d\n", blk_arr[i], bool_arr[i]);
-  }
-  free(blk_arr);
-  free(bool_arr);
-
-  evict a certain nunber of blocks
-  char **filenames;
-  size_t *blocks;
-  int *file_ids;
-  size_t num_blks = 4;
-
-  filenames = (char **)malloc(sizeof(*filenames)*num_blks);
-  memset(filenames, 0, sizeof(*filenames)*num_blks);
-
-  printf("Before block eviction\n");
-  for (int i = 0; i < num_blks; ++i){
-    if(filenames[i]){
-      printf("Filename[%d]: %s\n", i, filenames[i]);
-    }
-  }
-
-  blocks = (size_t *)malloc(sizeof(*blocks)*num_blks);
-  memset(blocks, 0, sizeof(*blocks)*num_blks);
-
-  file_ids = (int*)malloc(sizeof(*file_ids)*num_blks);
-  memset(file_ids, 0, sizeof(*file_ids)*num_blks);
-
-  evict_blocks(db, num_blks, file_ids, filenames, blocks);
-  printf("Evicted Blocks...\n");
-
-  for (int i = 0; i < num_blks; ++i){
-    if(filenames[i]){
-      printf("Filename[%d]: %s\n", i, filenames[i]);
-      free(filenames[i]);
-    }
-  }
-  printf("Freed each filename.\n");
-  free(filenames);
-  printf("Freed filenames.\n");
-  free(blocks);  
-  printf("Freed blocks.\n");
-  free(file_ids);
-  printf("Freed file_ids.\n");
-
-  // close database
-  sqlite3_close(db);
-
-  return EXIT_SUCCESS;
-}
-*/
+// tools/metabench.c drives this API standalone (ops/sec per call)
 
 // LRU_block* init_lru_blk(){
 //   LRU_block *lru_block = malloc(sizeof(LRU_block));
@@ -139,11 +15,15 @@ int main(void) {
 //   return lru_block;
 // }
 
+// shared by every FUSE worker: only touched with __sync atomics
+static size_t meta_block_size = 0; // num of bytes
+static size_t cache_used_size = 0; // num of bytes
+
 void print_cache_used_size(){
-  printf("Cache Usage: %lu\n", cache_used_size);
+  printf("Cache Usage: %lu\n", get_cache_used_size());
 }
 size_t get_cache_used_size(){
-  return cache_used_size;
+  return __sync_add_and_fetch(&cache_used_size, 0);
 }
 
 void set_block_size(size_t blk_size){
@@ -201,7 +81,8 @@ static int callback(void *NotUsed, int argc, char **argv, char **ColName) {
     // if yes, set cache_used_size
     if (strcmp(ColName[0], "SUM(local_size)") == 0)
     {
-      cache_used_size = (argv[0] ? str_to_num(argv[0]) : cache_used_size);
+      if (argv[0])
+        __sync_lock_test_and_set(&cache_used_size, str_to_num(argv[0]));
       return 0;
     }
   }
@@ -243,6 +124,71 @@ int open_db(char * db_name, sqlite3 ** db){
   return 0;
 }
 
+/*-----------Per-thread connections------------*/
+static char *pool_db_name = NULL;
+static sqlite3 *pool_fallback_db = NULL;
+static pthread_key_t pool_key;
+
+static void close_thread_db(void *db){
+  sqlite3_close((sqlite3*)db);
+}
+
+// open and configure a pool connection (quietly: FUSE workers have no tty)
+static sqlite3 *open_thread_db(){
+  sqlite3 *db;
+  // the connection never leaves its thread, so sqlite's own mutexes are not needed
+  int ret = sqlite3_open_v2(pool_db_name, &db,
+      SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL);
+  if (ret == SQLITE_OK)
+    ret = sqlite3_busy_timeout(db, 5000);
+  if (ret == SQLITE_OK)
+    ret = sqlite3_exec(db, "PRAGMA foreign_keys=ON", NULL, 0, NULL);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Open Thread DB: SQL error: %s\n", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+int init_db_pool(char * db_name, sqlite3 * db){
+  char *ErrMsg = 0;
+
+  // WAL lets readers on other connections run while one of them writes
+  int ret = sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, 0, &ErrMsg);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Init DB Pool: WAL Pragma: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+  }
+  // writers queue up behind each other instead of failing with SQLITE_BUSY
+  sqlite3_busy_timeout(db, 5000);
+
+  pool_db_name = strdup(db_name);
+  pool_fallback_db = db;
+  if (pthread_key_create(&pool_key, close_thread_db) != 0){
+    fprintf(stderr, "Init DB Pool: cannot create thread key\n");
+    return -1;
+  }
+  // the calling thread keeps the connection it already has
+  pthread_setspecific(pool_key, db);
+  return 0;
+}
+
+sqlite3 *get_thread_db(){
+  if (pool_db_name == NULL)
+    return pool_fallback_db;
+
+  sqlite3 *db = pthread_getspecific(pool_key);
+  if (db == NULL){
+    db = open_thread_db();
+    if (db == NULL)
+      return pool_fallback_db; // serialized by sqlite, just slower
+    pthread_setspecific(pool_key, db);
+  }
+  return db;
+}
+
+
 // create the FILES and DATABLOCKS tables
 int create_tables(sqlite3 * db){
   char *sql;
@@ -286,6 +232,30 @@ int create_tables(sqlite3 * db){
 
 }
 
+int begin_transaction(sqlite3 *db){
+  char *ErrMsg = 0;
+
+  int ret = sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, 0, &ErrMsg);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Begin Transaction: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+    return -1;
+  }
+  return 0;
+}
+
+int commit_transaction(sqlite3 *db){
+  char *ErrMsg = 0;
+
+  int ret = sqlite3_exec(db, "COMMIT;", NULL, 0, &ErrMsg);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Commit Transaction: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+    return -1;
+  }
+  return 0;
+}
+
 // insert file entry into database
 // ips: filename, remote_size
 int create_file(sqlite3* db, char * filename, size_t remote_size){
@@ -391,7 +361,7 @@ int insert_block(sqlite3* db, char * filename, size_t blk_offset){
   /*-----------Update local_size in Files------------*/
 
   /*-------------Update cache_used_size--------------*/
-  cache_used_size += meta_block_size;
+  __sync_fetch_and_add(&cache_used_size, meta_block_size);
   /*-------------Update cache_used_size--------------*/
 
   if (VERBOSE) {
@@ -432,7 +402,7 @@ int delete_file(sqlite3* db, char * filename){
   sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
   // STEP
   int ret = sqlite3_step(stmt); 
-  cache_used_size -= sqlite3_column_int64(stmt, 0);
+  __sync_fetch_and_sub(&cache_used_size, sqlite3_column_int64(stmt, 0));
   if (VERBOSE){
     print_cache_used_size();
   }
@@ -529,7 +499,7 @@ int delete_block(sqlite3* db, char * filename, size_t blk_offset){
 
   /*---------Reduce local_size in Files----------*/
   // If block deletion successful, reduce used space count
-  cache_used_size -= meta_block_size;
+  __sync_fetch_and_sub(&cache_used_size, meta_block_size);
   if (VERBOSE){
     print_cache_used_size();
   }
@@ -770,8 +740,8 @@ ssize_t evict_blocks(sqlite3 *db, size_t num_blks, int *file_ids, char **filenam
       if(col == 0) blk_offsets[row] = sqlite3_column_int64(stmt, col);
       if(col == 1) file_ids[row] = sqlite3_column_int(stmt, col);
     }
-    if(filenames[file_ids[row]]){
-      printf("Filename queried: %s\n", filenames[file_ids[row]]);
+    if(filenames[row]){
+      printf("Filename queried: %s\n", filenames[row]);
     }
     else{
       get_filename_from_fileid(db, file_ids[row], (char **)&filenames[row]);
@@ -817,7 +787,7 @@ int get_filename_from_fileid(sqlite3 *db, int file_id, char **filename){
   if(ret == SQLITE_ROW){
     const char * filename_on_stack = (char *)sqlite3_column_text(stmt, 0);
     printf("Filename[%d]:%s\n", file_id, sqlite3_column_text(stmt, 0));
-    *filename = (char *)malloc(sizeof(filename_on_stack));
+    *filename = (char *)malloc(strlen(filename_on_stack) + 1);
     strcpy(*filename, filename_on_stack);
     printf("Filename variable after assigning sql column text: %s\n", *filename);
   }
@@ -838,6 +808,452 @@ int get_filename_from_fileid(sqlite3 *db, int file_id, char **filename){
   return 0;
 }
 
+// create the Attributes table, unlike create_tables this is fine to
+// call on an existing database
+int create_attr_table(sqlite3 *db){
+  char *sql;
+  char *ErrMsg = 0;
+
+  sql = "CREATE TABLE IF NOT EXISTS Attributes ("
+       "relative_path  TEXT  PRIMARY KEY,"
+       "attr  BLOB  NOT NULL"
+  ");";
+
+  int ret = sqlite3_exec(db, sql, callback, 0, &ErrMsg);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Create Attribute Table: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+    return -1;
+  }
+  return 0;
+}
+
+int clear_attrs(sqlite3 *db){
+  char *ErrMsg = 0;
+
+  int ret = sqlite3_exec(db, "DELETE FROM Attributes;", callback, 0, &ErrMsg);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Clear Attributes: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+    return -1;
+  }
+  return 0;
+}
+
+int save_attr(sqlite3 *db, const char *path, const void *attr, size_t attr_size){
+  char *sql;
+  sqlite3_stmt *stmt;
+
+  /*-----------Insert or replace in Attributes------------*/
+  sql = "INSERT OR REPLACE INTO Attributes (relative_path, attr) VALUES (?1, ?2);";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, attr, attr_size, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE) {
+    printf("Save Attr: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Save Attr: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------Insert or replace in Attributes------------*/
+  return 0;
+}
+
+int load_attrs(sqlite3 *db,
+  void (*loaded)(const char *path, const void *attr, size_t attr_size)){
+  char *sql;
+  sqlite3_stmt *stmt;
+  int rows = 0;
+
+  /*-----------Read back every saved attribute------------*/
+  sql = "SELECT relative_path, attr FROM Attributes;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // STEP
+  int ret;
+  while(SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+    loaded((const char *)sqlite3_column_text(stmt, 0),
+      sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1));
+    rows++;
+  }
+  if (ret != SQLITE_DONE) {
+    printf("Load Attrs: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Load Attrs: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------Read back every saved attribute------------*/
+
+  if (VERBOSE) {
+    fprintf(stdout, "Loaded %d attributes\n", rows);
+  }
+  return rows;
+}
+
+// create the Pins table, fine to call on an existing database
+int create_pin_table(sqlite3 *db){
+  char *sql;
+  char *ErrMsg = 0;
+
+  sql = "CREATE TABLE IF NOT EXISTS Pins ("
+       "relative_path  TEXT  PRIMARY KEY,"
+       "bytes  INTEGER NOT NULL"
+  ");";
+
+  int ret = sqlite3_exec(db, sql, callback, 0, &ErrMsg);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Create Pin Table: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+    return -1;
+  }
+  return 0;
+}
+
+int save_pin(sqlite3 *db, const char *path, uint64_t bytes){
+  char *sql;
+  sqlite3_stmt *stmt;
+
+  /*-----------Insert or replace in Pins------------*/
+  sql = "INSERT OR REPLACE INTO Pins (relative_path, bytes) VALUES (?1, ?2);";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, bytes);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE) {
+    printf("Save Pin: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Save Pin: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------Insert or replace in Pins------------*/
+  return 0;
+}
+
+int delete_pin(sqlite3 *db, const char *path){
+  char *sql;
+  sqlite3_stmt *stmt;
+
+  /*-----------Delete from Pins------------*/
+  sql = "DELETE FROM Pins WHERE relative_path=?1;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE) {
+    printf("Delete Pin: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Delete Pin: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------Delete from Pins------------*/
+  return 0;
+}
+
+int load_pins(sqlite3 *db, void (*loaded)(const char *path, uint64_t bytes)){
+  char *sql;
+  sqlite3_stmt *stmt;
+  int rows = 0;
+
+  /*-----------Read back every pin------------*/
+  sql = "SELECT relative_path, bytes FROM Pins;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // STEP
+  int ret;
+  while(SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+    loaded((const char *)sqlite3_column_text(stmt, 0), sqlite3_column_int64(stmt, 1));
+    rows++;
+  }
+  if (ret != SQLITE_DONE) {
+    printf("Load Pins: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Load Pins: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------Read back every pin------------*/
+  return rows;
+}
+
+int list_files(sqlite3 *db,
+  int (*listed)(const char *filename, size_t local_size, void *arg), void *arg){
+  char *sql;
+  sqlite3_stmt *stmt;
+  int rows = 0;
+
+  /*-----------List files, oldest first------------*/
+  sql = "SELECT Files.relative_path, Files.local_size FROM Files "
+        "LEFT JOIN Datablocks ON Datablocks.file_id = Files.file_id "
+        "GROUP BY Files.file_id ORDER BY MAX(Datablocks.timestamp) ASC;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // STEP
+  int ret;
+  while(SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+    rows++;
+    if (listed((const char *)sqlite3_column_text(stmt, 0),
+        sqlite3_column_int64(stmt, 1), arg)) {
+      ret = SQLITE_DONE;
+      break;
+    }
+  }
+  if (ret != SQLITE_DONE) {
+    printf("List Files: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "List Files: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------List files, oldest first------------*/
+  return rows;
+}
+
+int create_dir_table(sqlite3 *db){
+  char *sql;
+  char *ErrMsg = 0;
+
+  sql = "CREATE TABLE IF NOT EXISTS Directories ("
+       "relative_path  TEXT  PRIMARY KEY,"
+       "mtime_ns  INTEGER NOT NULL,"
+       "validated_ms  INTEGER NOT NULL,"
+       "entries  BLOB  NOT NULL"
+  ");";
+
+  int ret = sqlite3_exec(db, sql, callback, 0, &ErrMsg);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Create Directory Table: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+    return -1;
+  }
+  return 0;
+}
+
+int get_dir_listing(sqlite3 *db, const char *path, int64_t *mtime_ns,
+  int64_t *validated_ms, char **entries, size_t *entries_size){
+  char *sql;
+  sqlite3_stmt *stmt;
+  int found = 0;
+
+  /*-----------Get listing from Directories------------*/
+  sql = "SELECT mtime_ns, validated_ms, entries FROM Directories "
+        "WHERE relative_path=?1;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW) {
+    *mtime_ns = sqlite3_column_int64(stmt, 0);
+    *validated_ms = sqlite3_column_int64(stmt, 1);
+    *entries_size = sqlite3_column_bytes(stmt, 2);
+    *entries = (char *)malloc(*entries_size ? *entries_size : 1);
+    memcpy(*entries, sqlite3_column_blob(stmt, 2), *entries_size);
+    found = 1;
+    ret = sqlite3_step(stmt);
+  }
+  if (ret != SQLITE_DONE) {
+    printf("Get Dir Listing: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    if (found) free(*entries);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Get Dir Listing: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    if (found) free(*entries);
+    return -1;
+  }
+  /*-----------Get listing from Directories------------*/
+  return found;
+}
+
+int save_dir_listing(sqlite3 *db, const char *path, int64_t mtime_ns,
+  int64_t validated_ms, const char *entries, size_t entries_size){
+  char *sql;
+  sqlite3_stmt *stmt;
+
+  /*-----------Insert or replace in Directories------------*/
+  sql = "INSERT OR REPLACE INTO Directories "
+        "(relative_path, mtime_ns, validated_ms, entries) VALUES (?1, ?2, ?3, ?4);";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, mtime_ns);
+  sqlite3_bind_int64(stmt, 3, validated_ms);
+  sqlite3_bind_blob(stmt, 4, entries, entries_size, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE) {
+    printf("Save Dir Listing: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Save Dir Listing: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------Insert or replace in Directories------------*/
+  return 0;
+}
+
+int touch_dir_listing(sqlite3 *db, const char *path, int64_t validated_ms){
+  char *sql;
+  sqlite3_stmt *stmt;
+
+  sql = "UPDATE Directories SET validated_ms=?1 WHERE relative_path=?2;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_int64(stmt, 1, validated_ms);
+  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE) {
+    printf("Touch Dir Listing: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Touch Dir Listing: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  return 0;
+}
+
+int delete_dir_listing(sqlite3 *db, const char *path, int subtree){
+  char *sql;
+  sqlite3_stmt *stmt;
+
+  /*-----------Delete from Directories------------*/
+  if (subtree) {
+    sql = "DELETE FROM Directories WHERE relative_path=?1 OR "
+          "substr(relative_path, 1, length(?1)+1) = ?1 || '/';";
+  } else {
+    sql = "DELETE FROM Directories WHERE relative_path=?1;";
+  }
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE) {
+    printf("Delete Dir Listing: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Delete Dir Listing: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  /*-----------Delete from Directories------------*/
+  return 0;
+}
+
+int create_nas_mtime_column(sqlite3 *db){
+  char *ErrMsg = 0;
+
+  int ret = sqlite3_exec(db, "ALTER TABLE Files ADD COLUMN nas_mtime INTEGER NOT NULL DEFAULT 0;",
+    callback, 0, &ErrMsg);
+  if (ret != SQLITE_OK && strstr(ErrMsg, "duplicate column") == NULL){
+    fprintf(stderr, "Create NAS Mtime Column: SQL error: %s\n", ErrMsg);
+    sqlite3_free(ErrMsg);
+    return -1;
+  }
+  sqlite3_free(ErrMsg);
+  return 0;
+}
+
+int set_nas_mtime(sqlite3 *db, char *filename, int64_t nas_mtime){
+  char *sql;
+  sqlite3_stmt *stmt;
+
+  sql = "UPDATE Files SET nas_mtime=?1 WHERE relative_path=?2;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_int64(stmt, 1, nas_mtime);
+  sqlite3_bind_text(stmt, 2, filename, -1, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret != SQLITE_DONE) {
+    printf("Set NAS Mtime: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Set NAS Mtime: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  return 0;
+}
+
+int64_t get_nas_mtime(sqlite3 *db, char *filename){
+  char *sql;
+  sqlite3_stmt *stmt;
+  int64_t nas_mtime = 0;
+
+  sql = "SELECT nas_mtime FROM Files WHERE relative_path=?1;";
+  // Prepare stmt
+  sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  // Bind
+  sqlite3_bind_text(stmt, 1, filename, -1, SQLITE_STATIC);
+  // STEP
+  int ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW){
+    nas_mtime = sqlite3_column_int64(stmt, 0);
+    ret = sqlite3_step(stmt);
+  }
+  if (ret != SQLITE_DONE) {
+    printf("Get NAS Mtime: SQL Error: %s\n", sqlite3_errmsg(db));
+    sqlite3_finalize(stmt);
+    return -1;
+  }
+  ret = sqlite3_finalize(stmt);
+  if (ret != SQLITE_OK){
+    fprintf(stderr, "Get NAS Mtime: Finalize: SQL error: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+  return nas_mtime;
+}
+
 // for(int col=0; col<sqlite3_column_count(stmt); col++) {
 //     // Note that by using sqlite3_column_text, sqlite will coerce the value into a string
 //     printf("\tColumn %s(%i): '%s'\n",
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 
 #define VERBOSE 1
 #define UNUSED(x) (void)(x)
@@ -14,9 +15,6 @@
 //   int blk_offset;
 // } typedef LRU_block;
 
-static size_t meta_block_size = 0; // num of bytes
-static size_t cache_used_size = 0; // num of bytes
-
 void set_block_size(size_t blk_size);
 void init_cache_used_size(sqlite3 *db);
 void print_cache_used_size();
@@ -30,9 +28,20 @@ size_t str_to_num(const char *str);
 static int callback(void *NotUsed, int argc, char **argv, char **azColName);
 // FUSE: open database, populates the db pointer with the opened database
 int open_db(char * db_name, sqlite3 ** db);
+// FUSE: per-thread connections.  Every FUSE worker gets its own connection
+// to db_name the first time it calls get_thread_db(), closed when the
+// thread exits.  db (from open_db) is handed out if a thread's open fails.
+int init_db_pool(char * db_name, sqlite3 * db);
+sqlite3 *get_thread_db();
 // FUSE: create the FILES and DATABLOCKS database tables
 int create_tables(sqlite3 * db);
 
+// Bulk updates (cache warm-up): every statement on db between the two
+// calls is one transaction.  BEGIN IMMEDIATE takes the write lock up
+// front, so the busy timeout applies instead of a deadlock on upgrade.
+int begin_transaction(sqlite3 *db);
+int commit_transaction(sqlite3 *db);
+
 // FUSE: inserts a new file into the database
 int create_file(sqlite3* db, char * filename, size_t remote_size);
 // FUSE: remove deleted file
@@ -97,4 +106,63 @@ Alternately to evict LRU file
 */
 int evict_file(sqlite3 *db, char **filename);
 
+/*
+Attribute cache persistence: the getattr cache is saved here at unmount
+and loaded back at mount.
+* attr: opaque blob (a struct stat), stored as is
+*/
+int create_attr_table(sqlite3 *db);
+int clear_attrs(sqlite3 *db);
+int save_attr(sqlite3 *db, const char *path, const void *attr, size_t attr_size);
+// calls loaded() for every saved row, returns the number of rows or -1
+int load_attrs(sqlite3 *db,
+  void (*loaded)(const char *path, const void *attr, size_t attr_size));
+
+/*
+Pinned paths (see pin.h)
+* bytes: what the pin was charged against the pin budget
+*/
+int create_pin_table(sqlite3 *db);
+int save_pin(sqlite3 *db, const char *path, uint64_t bytes);
+int delete_pin(sqlite3 *db, const char *path);
+// calls loaded() for every pin, returns the number of pins or -1
+int load_pins(sqlite3 *db, void (*loaded)(const char *path, uint64_t bytes));
+
+/*
+Every cached file, least recently filled or written first (by the newest
+timestamp among its blocks; files without blocks come first).
+* listed: called per file, returning non-zero stops the listing
+return value: number of files listed or -1
+*/
+int list_files(sqlite3 *db,
+  int (*listed)(const char *filename, size_t local_size, void *arg), void *arg);
+
+/*
+Directory listing cache (see dircache.h)
+* mtime_ns: NAS directory mtime the listing was read at
+* validated_ms: wall clock time the listing was last checked against the NAS
+* entries: packed listing, MALLOCED by get_dir_listing, caller frees
+*/
+int create_dir_table(sqlite3 *db);
+// 1 = found, 0 = no listing, -1 = error
+int get_dir_listing(sqlite3 *db, const char *path, int64_t *mtime_ns,
+  int64_t *validated_ms, char **entries, size_t *entries_size);
+int save_dir_listing(sqlite3 *db, const char *path, int64_t mtime_ns,
+  int64_t validated_ms, const char *entries, size_t entries_size);
+int touch_dir_listing(sqlite3 *db, const char *path, int64_t validated_ms);
+// subtree: also every directory below path
+int delete_dir_listing(sqlite3 *db, const char *path, int subtree);
+
+/*
+NAS mtime a cached file is known to be current with, for writes that
+changed the NAS copy without touching the cache file (see
+cfs_writeNoAllocate).  Kept in the Files row, so it goes with the file.
+* nas_mtime: seconds, like the cache file mtime it stands in for; 0 = never recorded
+*/
+// adds the column to a Files table made before it existed
+int create_nas_mtime_column(sqlite3 *db);
+int set_nas_mtime(sqlite3 *db, char *filename, int64_t nas_mtime);
+// the recorded mtime, 0 if none or -1 on error
+int64_t get_nas_mtime(sqlite3 *db, char *filename);
+
 #endif // __META_H_ 
\ No newline at end of file
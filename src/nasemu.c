@@ -0,0 +1,155 @@
+/*
+  Slow-NAS emulation.  See nasemu.h.
+
+  Concurrency is a counting semaphore built from a mutex and condition
+  variable.  Bandwidth is a pacing clock: each transfer books the link
+  from whenever the previous booking ends and sleeps until its own
+  booking ends, so concurrent calls queue for the link as they would
+  on a wire.
+*/
+#define _GNU_SOURCE // clock_nanosleep, rand_r
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nasemu.h"
+
+static const char *nasOpNames[NAS_OPS] = {
+  "none", "meta", "open", "read", "write", "sync", "list",
+};
+
+static int emuEnabled = 0;
+static const char *emuNasDir = "";
+static size_t emuNasDirLen = 0;
+static uint64_t emuLatencyNs[NAS_OPS];
+static uint64_t emuJitterNs = 0;
+static uint64_t emuBandwidth = 0;
+static unsigned emuConcurrency = 0;
+
+static pthread_mutex_t emuLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t emuSlotFree = PTHREAD_COND_INITIALIZER;
+static unsigned emuInFlight = 0;
+static uint64_t emuLinkFree = 0; // when the link has sent everything booked so far
+
+static __thread unsigned emuSeed = 0;
+
+static uint64_t nas_emu_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void nas_emu_sleep_until(uint64_t when) {
+  struct timespec wake = {when / 1000000000ULL, when % 1000000000ULL};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+    ;
+}
+
+static int nas_emu_parse_latency(const char *spec) {
+  char *end;
+
+  if (spec == NULL || *spec == '\0')
+    return 0;
+  unsigned long us = strtoul(spec, &end, 10);
+  if (end != spec && *end == '\0') {
+    for (int op = NAS_META; op < NAS_OPS; op++)
+      emuLatencyNs[op] = us * 1000ULL;
+    return 0;
+  }
+
+  while (*spec) {
+    const char *colon = strchr(spec, ':');
+    if (colon == NULL)
+      return -EINVAL;
+    int op;
+    for (op = NAS_META; op < NAS_OPS; op++)
+      if (strlen(nasOpNames[op]) == (size_t)(colon - spec) && strncmp(spec, nasOpNames[op], colon - spec) == 0)
+        break;
+    if (op == NAS_OPS)
+      return -EINVAL;
+    us = strtoul(colon + 1, &end, 10);
+    if (end == colon + 1 || (*end != ',' && *end != '\0'))
+      return -EINVAL;
+    emuLatencyNs[op] = us * 1000ULL;
+    spec = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+int nas_emu_init(const char *nasdir, const char *latencySpec, unsigned jitterUs,
+                 uint64_t bandwidth, unsigned concurrency) {
+  memset(emuLatencyNs, 0, sizeof(emuLatencyNs));
+  if (nas_emu_parse_latency(latencySpec) < 0)
+    return -EINVAL;
+  emuNasDir = nasdir ? nasdir : "";
+  emuNasDirLen = strlen(emuNasDir);
+  emuJitterNs = jitterUs * 1000ULL;
+  emuBandwidth = bandwidth;
+  emuConcurrency = concurrency;
+
+  emuEnabled = emuJitterNs || emuBandwidth || emuConcurrency;
+  for (int op = NAS_META; op < NAS_OPS; op++)
+    emuEnabled |= emuLatencyNs[op] != 0;
+  return 0;
+}
+
+int nas_emu_enabled(void) {
+  return emuEnabled;
+}
+
+void nas_emu_begin(enum nasOp op) {
+  if (!emuEnabled || op == NAS_NONE)
+    return;
+
+  if (emuConcurrency) {
+    pthread_mutex_lock(&emuLock);
+    while (emuInFlight >= emuConcurrency)
+      pthread_cond_wait(&emuSlotFree, &emuLock);
+    emuInFlight++;
+    pthread_mutex_unlock(&emuLock);
+  }
+
+  uint64_t delay = emuLatencyNs[op];
+  if (emuJitterNs) {
+    if (emuSeed == 0)
+      emuSeed = (unsigned)nas_emu_now() | 1;
+    delay += (uint64_t)rand_r(&emuSeed) % (emuJitterNs + 1);
+  }
+  if (delay)
+    nas_emu_sleep_until(nas_emu_now() + delay);
+}
+
+ssize_t nas_emu_end(enum nasOp op, ssize_t ret) {
+  if (!emuEnabled || op == NAS_NONE)
+    return ret;
+  int saved = errno;
+
+  if (emuBandwidth && ret > 0 && (op == NAS_READ || op == NAS_WRITE)) {
+    pthread_mutex_lock(&emuLock);
+    uint64_t now = nas_emu_now();
+    uint64_t start = emuLinkFree > now ? emuLinkFree : now;
+    emuLinkFree = start + (uint64_t)ret * 1000000000ULL / emuBandwidth;
+    uint64_t done = emuLinkFree;
+    pthread_mutex_unlock(&emuLock);
+    nas_emu_sleep_until(done);
+  }
+
+  if (emuConcurrency) {
+    pthread_mutex_lock(&emuLock);
+    emuInFlight--;
+    pthread_cond_signal(&emuSlotFree);
+    pthread_mutex_unlock(&emuLock);
+  }
+
+  errno = saved;
+  return ret;
+}
+
+enum nasOp nas_emu_path_op(const char *path, enum nasOp op) {
+  if (!emuEnabled || emuNasDirLen == 0 || strncmp(path, emuNasDir, emuNasDirLen) != 0 ||
+      (path[emuNasDirLen] != '/' && path[emuNasDirLen] != '\0'))
+    return NAS_NONE;
+  return op;
+}
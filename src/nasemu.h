@@ -0,0 +1,51 @@
+/*
+  Slow-NAS emulation for cachefs benchmarking.
+
+  With any of the --nas-* options set, every call cachefs makes on the
+  NAS directory is held back as if the NAS sat behind a network: each
+  call waits for one of --nas-concurrency slots, then sleeps its op's
+  latency plus up to --nas-jitter, and a read or write also waits for
+  its bytes to cross a link of --nas-bandwidth shared by every call.
+  The NAS directory itself stays a local passthrough, so a "slow NAS"
+  needs no server or network setup.  With no option set the wrappers
+  cost one branch.
+*/
+
+#ifndef _NASEMU_H_
+#define _NASEMU_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+enum nasOp {
+  NAS_NONE,  // not a NAS call (see nas_emu_path_op)
+  NAS_META,  // lstat, mkdir, unlink, rename, chmod, xattrs...
+  NAS_OPEN,
+  NAS_READ,
+  NAS_WRITE,
+  NAS_SYNC,  // fsync, fdatasync
+  NAS_LIST,  // opendir plus the readdirs that follow
+  NAS_OPS
+};
+
+// latencySpec: "us" for every op, or "op:us,..." with op one of meta,
+// open, read, write, sync, list (others 0).  bandwidth in bytes per
+// second, concurrency in calls; 0 = unlimited.  Returns 0 or -EINVAL.
+int nas_emu_init(const char *nasdir, const char *latencySpec, unsigned jitterUs,
+                 uint64_t bandwidth, unsigned concurrency);
+int nas_emu_enabled(void);
+
+void nas_emu_begin(enum nasOp op);
+// ret is the call's result: a positive ret of a read or write is the
+// bytes to transfer.  Returns ret with errno as the call left it.
+ssize_t nas_emu_end(enum nasOp op, ssize_t ret);
+
+// op if path lies in the NAS directory, else NAS_NONE (for code such
+// as the fd cache that opens cache and NAS files alike)
+enum nasOp nas_emu_path_op(const char *path, enum nasOp op);
+
+// wrap one NAS call returning an int or ssize_t:
+//   retstat = NAS_EMU(NAS_META, lstat(nasPath, &statbuf));
+#define NAS_EMU(op, call) nas_emu_end((op), (nas_emu_begin(op), (call)))
+
+#endif
@@ -0,0 +1,139 @@
+/*
+  Cache files in use by open handles.  See openfile.h.
+
+  One hash table under one mutex; the critical sections are a lookup
+  and a counter update.  The per-file mutexes are only taken with the
+  table mutex released, so a slow cfs_open of one file never holds up
+  another file.
+*/
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openfile.h"
+#include "pathtable.h"
+
+#define OPEN_BUCKETS 1024
+
+struct openFile {
+  char *name;
+  int users;   // lock holders and waiters
+  int handles; // open_file_get without open_file_put
+  int linked;  // in the table; a file displaced by a rename is not
+  int staged;  // gather buffers with staged data, see gather.h
+  pthread_mutex_t lock;
+  struct openFile *next;
+};
+
+static struct openFile *openBuckets[OPEN_BUCKETS];
+static pthread_mutex_t openLock = PTHREAD_MUTEX_INITIALIZER;
+
+// caller holds openLock
+static struct openFile **open_file_find(const char *name) {
+  struct openFile **link = &openBuckets[path_hash(name) % OPEN_BUCKETS];
+  while (*link && strcmp((*link)->name, name) != 0)
+    link = &(*link)->next;
+  return link;
+}
+
+// caller holds openLock
+static void open_file_unhash(struct openFile *file) {
+  struct openFile **link = open_file_find(file->name);
+  if (*link == file)
+    *link = file->next;
+  file->linked = 0;
+}
+
+// caller holds openLock: free the file once nobody needs it
+static void open_file_release(struct openFile *file) {
+  if (file->users > 0 || file->handles > 0)
+    return;
+  if (file->linked)
+    open_file_unhash(file);
+  pthread_mutex_destroy(&file->lock);
+  free(file->name);
+  free(file);
+}
+
+struct openFile *open_file_lock(const char *name) {
+  pthread_mutex_lock(&openLock);
+  struct openFile **link = open_file_find(name);
+  struct openFile *file = *link;
+  if (file == NULL) {
+    file = calloc(1, sizeof(*file));
+    if (file == NULL || (file->name = strdup(name)) == NULL) {
+      free(file);
+      pthread_mutex_unlock(&openLock);
+      return NULL;
+    }
+    pthread_mutex_init(&file->lock, NULL);
+    file->linked = 1;
+    *link = file;
+  }
+  file->users++;
+  pthread_mutex_unlock(&openLock);
+
+  pthread_mutex_lock(&file->lock);
+  return file;
+}
+
+void open_file_unlock(struct openFile *file) {
+  pthread_mutex_unlock(&file->lock);
+
+  pthread_mutex_lock(&openLock);
+  file->users--;
+  open_file_release(file);
+  pthread_mutex_unlock(&openLock);
+}
+
+void open_file_get(struct openFile *file) {
+  pthread_mutex_lock(&openLock);
+  file->handles++;
+  pthread_mutex_unlock(&openLock);
+}
+
+int open_file_busy(const struct openFile *file) {
+  pthread_mutex_lock(&openLock);
+  int busy = file->handles > 0;
+  pthread_mutex_unlock(&openLock);
+  return busy;
+}
+
+void open_file_put(struct openFile *file) {
+  if (file == NULL)
+    return;
+
+  pthread_mutex_lock(&openLock);
+  file->handles--;
+  open_file_release(file);
+  pthread_mutex_unlock(&openLock);
+}
+
+int *open_file_staged(struct openFile *file) {
+  return &file->staged;
+}
+
+void open_file_rename(const char *name, const char *newName) {
+  char *copy = strdup(newName);
+
+  if (copy == NULL)
+    return;
+
+  pthread_mutex_lock(&openLock);
+  struct openFile *file = *open_file_find(name);
+  if (file) {
+    struct openFile *replaced = *open_file_find(newName);
+    if (replaced)
+      open_file_unhash(replaced); // its handles keep the replaced, now nameless, file
+    open_file_unhash(file);
+    free(file->name);
+    file->name = copy;
+    copy = NULL;
+    struct openFile **link = open_file_find(newName);
+    file->next = *link;
+    *link = file;
+    file->linked = 1;
+  }
+  pthread_mutex_unlock(&openLock);
+  free(copy);
+}
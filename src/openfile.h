@@ -0,0 +1,41 @@
+/*
+  Cache files in use by open handles, for cachefs.
+
+  A handle writes through its own descriptor to the cache file and adds
+  what it wrote to the block index under the file's cache name.  If the
+  file were unlinked under it, those blocks would be claimed for the
+  next copy of the file while their data went to the old one, so
+  whoever wants to drop a cached copy (control commands, warm-up) first
+  checks here that no handle has it open.  The check and the drop
+  happen under a per-file mutex that cfs_open also holds while it
+  inspects and creates the cached copy, so a file cannot be opened
+  halfway through being dropped.
+
+  Files are keyed by cache file name; an entry lives as long as a
+  handle has it open or somebody holds its mutex.
+*/
+
+#ifndef _OPENFILE_H_
+#define _OPENFILE_H_
+
+struct openFile;
+
+// take name's mutex; NULL when out of memory
+struct openFile *open_file_lock(const char *name);
+void open_file_unlock(struct openFile *file);
+
+// with the mutex held: a handle opened the file / does any handle have it?
+void open_file_get(struct openFile *file);
+int open_file_busy(const struct openFile *file);
+// the handle from open_file_get was released
+void open_file_put(struct openFile *file);
+
+// counter of the file's gather buffers holding staged writes (see
+// gather_open), so a read can tell without a lock that it has nothing to
+// flush.  Valid while the caller has a handle from open_file_get.
+int *open_file_staged(struct openFile *file);
+
+// the cache file name was renamed to newName, handles on it follow
+void open_file_rename(const char *name, const char *newName);
+
+#endif
@@ -27,7 +27,36 @@ struct cfs_state {
     FILE *logfile;
     char *nasdir;
     char *cachedir;
+    size_t journalsize; // write journal checkpoint size in Kb, 0 = write-through
+    size_t gathersize; // per-handle write gather buffer in Kb, 0 = off
+    unsigned gathertimeout; // ms a gathered write may wait for the NAS
+    int writepolicy; // enum writePolicy, see cacheHelp.h
+    size_t streamthreshold; // Kb of sequential writes on a handle before they bypass the cache, 0 = never
+    unsigned attrtimeout; // ms getattr results stay cached, 0 = off
+    unsigned attrnegativetimeout; // ms an ENOENT stays cached, 0 = off
+    int attrpersist; // save the attribute cache in the metadata db at unmount
+    int dircache; // serve directory listings from the metadata db
+    unsigned dirrevalidate; // ms before a cached listing is checked against the NAS
+    int revalidatemode; // enum revalidateMode, see revalidate.h
+    unsigned revalidateinterval; // ms between open-time checks in REVALIDATE_INTERVAL
+    size_t fdcache; // idle NAS/cache descriptors kept open for reuse, 0 = off
+    int lowlevel; // serve requests through the low-level API (cachefs_ll.c)
+    unsigned llworkers; // NAS worker threads in low-level mode, 0 = reply inline
+    int loglevel; // LOG_ERROR..LOG_TRACE, see log.h
+    char *tracefile; // --trace output, NULL = off
+    unsigned slowms; // requests taking this many ms go to the slow log, 0 = off
+    size_t pinbudget; // Kb of NAS data pins may cover, 0 = unlimited
+    char *warmup; // --warmup path: fill the cache and exit instead of mounting
+    unsigned warmupthreads; // warm-up workers
+    size_t warmupbandwidth; // Kb/s a warm-up may read from the NAS, 0 = unlimited
+    char *naslatency; // --nas-latency spec, see nasemu.h
+    unsigned nasjitter; // us
+    size_t nasbandwidth; // Kb/s
+    unsigned nasconcurrency; // NAS calls in flight
 };
-#define CFS_DATA ((struct cfs_state *) fuse_get_context()->private_data)
+// The same state fuse hands back as private_data, kept in a global so
+// the low-level frontend (which has no fuse_get_context) can reach it
+extern struct cfs_state *cfs_global_state;
+#define CFS_DATA cfs_global_state
 
 #endif
@@ -0,0 +1,123 @@
+/*
+  Path hashing and a path-keyed hash table for cachefs.  See pathtable.h.
+*/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathtable.h"
+
+uint64_t path_hash_bytes(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+uint64_t path_hash(const char *path) {
+  uint64_t hash = PATH_HASH_SEED;
+  for (; *path; path++) {
+    hash ^= (unsigned char)*path;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+int path_table_init(struct pathTable *table, size_t nbuckets, size_t nstripes, size_t maxEntries) {
+  table->buckets = calloc(nbuckets, sizeof(*table->buckets));
+  table->locks = calloc(nstripes, sizeof(*table->locks));
+  if (table->buckets == NULL || table->locks == NULL) {
+    free(table->buckets);
+    free(table->locks);
+    table->buckets = NULL;
+    table->locks = NULL;
+    return -ENOMEM;
+  }
+  for (size_t i = 0; i < nstripes; i++)
+    pthread_mutex_init(&table->locks[i], NULL);
+  table->nbuckets = nbuckets;
+  table->nstripes = nstripes;
+  table->maxEntries = maxEntries;
+  table->count = 0;
+  return 0;
+}
+
+size_t path_table_bucket(const struct pathTable *table, const char *path) {
+  return path_hash(path) % table->nbuckets;
+}
+
+void path_table_lock(struct pathTable *table, size_t bucket) {
+  pthread_mutex_lock(&table->locks[bucket % table->nstripes]);
+}
+
+void path_table_unlock(struct pathTable *table, size_t bucket) {
+  pthread_mutex_unlock(&table->locks[bucket % table->nstripes]);
+}
+
+struct pathEntry **path_table_find(struct pathTable *table, size_t bucket, const char *path) {
+  struct pathEntry **link = &table->buckets[bucket];
+  while (*link && strcmp((*link)->path, path) != 0)
+    link = &(*link)->next;
+  return link;
+}
+
+struct pathEntry *path_table_insert(struct pathTable *table, size_t bucket, const char *path, size_t entrySize) {
+  if (table->maxEntries && table->count >= table->maxEntries)
+    return NULL;
+
+  struct pathEntry *entry = calloc(1, entrySize);
+  if (entry == NULL)
+    return NULL;
+  entry->path = strdup(path);
+  if (entry->path == NULL) {
+    free(entry);
+    return NULL;
+  }
+  entry->next = table->buckets[bucket];
+  table->buckets[bucket] = entry;
+  __sync_fetch_and_add(&table->count, 1);
+  return entry;
+}
+
+void path_table_unlink(struct pathTable *table, struct pathEntry **link) {
+  struct pathEntry *entry = *link;
+  *link = entry->next;
+  free(entry->path);
+  free(entry);
+  __sync_fetch_and_sub(&table->count, 1);
+}
+
+void path_table_remove(struct pathTable *table, const char *path) {
+  if (table->buckets == NULL)
+    return;
+
+  size_t bucket = path_table_bucket(table, path);
+
+  path_table_lock(table, bucket);
+  struct pathEntry **link = path_table_find(table, bucket, path);
+  if (*link)
+    path_table_unlink(table, link);
+  path_table_unlock(table, bucket);
+}
+
+void path_table_remove_tree(struct pathTable *table, const char *path) {
+  size_t len = strlen(path);
+
+  if (table->buckets == NULL || table->count == 0)
+    return;
+
+  for (size_t bucket = 0; bucket < table->nbuckets; bucket++) {
+    path_table_lock(table, bucket);
+    for (struct pathEntry **link = &table->buckets[bucket]; *link;) {
+      struct pathEntry *entry = *link;
+      if (strncmp(entry->path, path, len) == 0 &&
+          (entry->path[len] == '\0' || entry->path[len] == '/'))
+        path_table_unlink(table, link);
+      else
+        link = &entry->next;
+    }
+    path_table_unlock(table, bucket);
+  }
+}
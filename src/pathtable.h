@@ -0,0 +1,63 @@
+/*
+  Path hashing and a path-keyed hash table for cachefs.
+
+  path_hash is the FNV-1a hash every in-memory index keys paths with
+  (and the journal checksums its records with, so it must not change).
+
+  A pathTable is a fixed array of chained buckets guarded by striped
+  mutexes, for the caches that remember something per path for a while
+  (attributes, open-time revalidation).  Entries embed a struct
+  pathEntry as their first member; lookups and updates happen with the
+  bucket's stripe held, which is what lets each cache keep its own
+  expiry and update rules.
+*/
+
+#ifndef _PATHTABLE_H_
+#define _PATHTABLE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PATH_HASH_SEED 0xcbf29ce484222325ULL
+
+// continue an FNV-1a hash over len bytes of data
+uint64_t path_hash_bytes(uint64_t hash, const void *data, size_t len);
+// FNV-1a of a NUL terminated path, seed PATH_HASH_SEED
+uint64_t path_hash(const char *path);
+
+struct pathEntry {
+  char *path;
+  struct pathEntry *next;
+};
+
+struct pathTable {
+  struct pathEntry **buckets;
+  pthread_mutex_t *locks;
+  size_t nbuckets, nstripes;
+  size_t maxEntries; // 0 = unbounded
+  size_t count;
+};
+
+int path_table_init(struct pathTable *table, size_t nbuckets, size_t nstripes, size_t maxEntries);
+
+size_t path_table_bucket(const struct pathTable *table, const char *path);
+void path_table_lock(struct pathTable *table, size_t bucket);
+void path_table_unlock(struct pathTable *table, size_t bucket);
+
+// the following need the bucket's stripe held
+
+// link pointing at path's entry, or at the NULL ending the chain
+struct pathEntry **path_table_find(struct pathTable *table, size_t bucket, const char *path);
+// add a zeroed entry of entrySize bytes for path (which must not be in
+// the table); NULL when the table is full or out of memory
+struct pathEntry *path_table_insert(struct pathTable *table, size_t bucket, const char *path, size_t entrySize);
+// unlink and free the entry *link points at
+void path_table_unlink(struct pathTable *table, struct pathEntry **link);
+
+// these take the stripes themselves
+void path_table_remove(struct pathTable *table, const char *path);
+// everything at or below path, for renames of directories
+void path_table_remove_tree(struct pathTable *table, const char *path);
+
+#endif
@@ -0,0 +1,198 @@
+/*
+  Pinned paths.  See pin.h.
+
+  Pins are few (a handful of toolchains and data sets), so they are a
+  plain list under a rwlock and every check is a walk over it.
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pin.h"
+
+struct pinEntry {
+  char *path;
+  char *cacheName;
+  int directory; // cacheName is a prefix
+  uint64_t bytes;
+  struct pinEntry *next;
+};
+
+static struct pinEntry *pinList = NULL;
+static void (*pinCacheName)(char name[PATH_MAX], const char *path);
+static uint64_t pinBudget = 0;
+static uint64_t pinCharged = 0;
+static pthread_rwlock_t pinLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct pinEntry *pin_find(const char *path) {
+  struct pinEntry *entry = pinList;
+  while (entry && strcmp(entry->path, path) != 0)
+    entry = entry->next;
+  return entry;
+}
+
+static void pin_free(struct pinEntry *entry) {
+  free(entry->path);
+  free(entry->cacheName);
+  free(entry);
+}
+
+// with pinLock held: unlink and free path's pin, 0 or -ENODATA
+static int pin_unlink(const char *path) {
+  for (struct pinEntry **link = &pinList; *link; link = &(*link)->next) {
+    struct pinEntry *entry = *link;
+    if (strcmp(entry->path, path) != 0)
+      continue;
+    *link = entry->next;
+    pinCharged -= entry->bytes;
+    pin_free(entry);
+    return 0;
+  }
+  return -ENODATA;
+}
+
+void pin_init(uint64_t budget, void (*cache_name)(char name[PATH_MAX], const char *path)) {
+  pinBudget = budget;
+  pinCacheName = cache_name;
+}
+
+int pin_add(const char *path, int directory, uint64_t bytes) {
+  char cacheName[PATH_MAX];
+  int retstat = 0;
+
+  pinCacheName(cacheName, path);
+
+  pthread_rwlock_wrlock(&pinLock);
+  struct pinEntry *entry = pin_find(path);
+  uint64_t charged = pinCharged - (entry ? entry->bytes : 0) + bytes;
+  if (pinBudget && charged > pinBudget) {
+    retstat = -ENOSPC;
+  } else if (entry) {
+    entry->directory = directory;
+    entry->bytes = bytes;
+    pinCharged = charged;
+  } else if ((entry = calloc(1, sizeof(*entry))) == NULL ||
+             (entry->path = strdup(path)) == NULL || (entry->cacheName = strdup(cacheName)) == NULL) {
+    if (entry)
+      pin_free(entry);
+    retstat = -ENOMEM;
+  } else {
+    entry->directory = directory;
+    entry->bytes = bytes;
+    entry->next = pinList;
+    pinList = entry;
+    pinCharged = charged;
+  }
+  pthread_rwlock_unlock(&pinLock);
+
+  return retstat;
+}
+
+int pin_charge(const char *path, uint64_t bytes) {
+  int retstat = 0;
+
+  pthread_rwlock_wrlock(&pinLock);
+  struct pinEntry *entry = pin_find(path);
+  if (entry == NULL) {
+    retstat = -ENODATA;
+  } else if (pinBudget && pinCharged - entry->bytes + bytes > pinBudget) {
+    retstat = -ENOSPC;
+  } else {
+    pinCharged = pinCharged - entry->bytes + bytes;
+    entry->bytes = bytes;
+  }
+  pthread_rwlock_unlock(&pinLock);
+
+  return retstat;
+}
+
+int pin_remove(const char *path) {
+  pthread_rwlock_wrlock(&pinLock);
+  int retstat = pin_unlink(path);
+  pthread_rwlock_unlock(&pinLock);
+
+  return retstat;
+}
+
+void pin_rename(const char *path, const char *newpath,
+                void (*moved)(const char *from, const char *to, uint64_t bytes)) {
+  size_t len = strlen(path);
+  char to[PATH_MAX], cacheName[PATH_MAX];
+
+  pthread_rwlock_wrlock(&pinLock);
+  struct pinEntry *movedList = NULL;
+  for (struct pinEntry **link = &pinList; *link;) {
+    struct pinEntry *entry = *link;
+    if (strncmp(entry->path, path, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/')) {
+      *link = entry->next;
+      entry->next = movedList;
+      movedList = entry;
+    } else {
+      link = &entry->next;
+    }
+  }
+  while (movedList) {
+    struct pinEntry *entry = movedList;
+    movedList = entry->next;
+    char *newPath = NULL, *newName = NULL;
+    if (snprintf(to, PATH_MAX, "%s%s", newpath, entry->path + len) < PATH_MAX) {
+      pinCacheName(cacheName, to);
+      newPath = strdup(to);
+      newName = strdup(cacheName);
+    }
+    if (newPath == NULL || newName == NULL) { // the new name is too long, or no memory: the pin is lost
+      free(newPath);
+      free(newName);
+      moved(entry->path, NULL, 0);
+      pinCharged -= entry->bytes;
+      pin_free(entry);
+      continue;
+    }
+    pin_unlink(to); // the renamed file or directory replaced what was pinned there
+    moved(entry->path, to, entry->bytes);
+    free(entry->path);
+    free(entry->cacheName);
+    entry->path = newPath;
+    entry->cacheName = newName;
+    entry->next = pinList;
+    pinList = entry;
+  }
+  pthread_rwlock_unlock(&pinLock);
+}
+
+int pin_is_pinned(const char *path) {
+  pthread_rwlock_rdlock(&pinLock);
+  int pinned = pin_find(path) != NULL;
+  pthread_rwlock_unlock(&pinLock);
+  return pinned;
+}
+
+int pin_covers_name(const char *cacheName) {
+  int covered = 0;
+
+  pthread_rwlock_rdlock(&pinLock);
+  for (struct pinEntry *entry = pinList; entry && !covered; entry = entry->next)
+    covered = entry->directory ? strncmp(cacheName, entry->cacheName, strlen(entry->cacheName)) == 0
+                               : strcmp(cacheName, entry->cacheName) == 0;
+  pthread_rwlock_unlock(&pinLock);
+
+  return covered;
+}
+
+#define PIN_APPEND(...) \
+  (len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, __VA_ARGS__))
+
+size_t pin_format(char *buf, size_t size) {
+  size_t len = 0;
+
+  pthread_rwlock_rdlock(&pinLock);
+  PIN_APPEND("budget_bytes %llu\ncharged_bytes %llu\n", (unsigned long long)pinBudget,
+             (unsigned long long)pinCharged);
+  for (struct pinEntry *entry = pinList; entry; entry = entry->next)
+    PIN_APPEND("%s %llu\n", entry->path, (unsigned long long)entry->bytes);
+  pthread_rwlock_unlock(&pinLock);
+
+  return len;
+}
@@ -0,0 +1,49 @@
+/*
+  Pinned paths for cachefs.
+
+  Setting the user.cachefs.pin extended attribute on a file or
+  directory (see cfs_setxattr) pins it: the control commands that drop
+  cached data (evict, drop, reclaim) leave its cached copy, and for a
+  directory everything below it, alone.  A file pin covers exactly its
+  cache file; a directory pin every cache file name starting with the
+  directory's, which, names being flattened, may take along a few
+  neighbours (/ab/c for /a/bc).  Pins are kept in the metadata database
+  across mounts and follow renames.  Every pin is charged the NAS size
+  of what it covers, and the total must stay within the pin budget.
+*/
+
+#ifndef _PIN_H_
+#define _PIN_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIN_XATTR "user.cachefs.pin"
+
+// budget in bytes, 0 = unlimited; cache_name gives the cache file name
+// of a path (or, for a directory, the prefix of the names below it)
+void pin_init(uint64_t budget, void (*cache_name)(char name[PATH_MAX], const char *path));
+
+// pin path.  Re-pinning updates the type and charge.
+// 0 or -ENOSPC when the budget would be exceeded.
+int pin_add(const char *path, int directory, uint64_t bytes);
+// change what an existing pin is charged: 0, -ENODATA if path is not
+// pinned (any more), -ENOSPC when the budget would be exceeded
+int pin_charge(const char *path, uint64_t bytes);
+// 0 or -ENODATA if path was not pinned
+int pin_remove(const char *path);
+// path was renamed to newpath: pins at or below it move along, replacing
+// pins already at their new path.  moved is called for each, with the
+// pin lock held; to is NULL for a pin that could not be moved and is gone.
+void pin_rename(const char *path, const char *newpath,
+                void (*moved)(const char *from, const char *to, uint64_t bytes));
+
+int pin_is_pinned(const char *path);
+// is the cache file cacheName covered by a pin
+int pin_covers_name(const char *cacheName);
+
+// "path bytes" per pin and the budget, as snprintf
+size_t pin_format(char *buf, size_t size);
+
+#endif
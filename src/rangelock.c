@@ -0,0 +1,65 @@
+/*
+  Striped per-file range locks for cachefs.  See rangelock.h.
+
+  A range maps to a set of stripes, which are always taken in
+  ascending order so two ranges sharing stripes cannot deadlock.  A
+  range longer than the stripe count simply takes every stripe.
+*/
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pathtable.h"
+#include "rangelock.h"
+
+#define RANGE_STRIPES 1024
+
+static pthread_rwlock_t rangeLocks[RANGE_STRIPES];
+static size_t rangeBlockSize = 4096;
+
+// mark the stripes of every block in [offset, offset+size)
+static void range_stripes(const char *path, off_t offset, size_t size, uint8_t stripes[RANGE_STRIPES / 8]) {
+  uint64_t hash = path_hash(path);
+  uint64_t first = offset / rangeBlockSize;
+  uint64_t last = size ? (offset + size - 1) / rangeBlockSize : first;
+
+  if (last - first >= RANGE_STRIPES) {
+    memset(stripes, 0xff, RANGE_STRIPES / 8);
+    return;
+  }
+  memset(stripes, 0, RANGE_STRIPES / 8);
+  for (uint64_t block = first; block <= last; block++) {
+    size_t stripe = (hash ^ (block * 0x9e3779b97f4a7c15ULL)) % RANGE_STRIPES;
+    stripes[stripe / 8] |= 1 << (stripe % 8);
+  }
+}
+
+void range_lock_init(size_t blockSize) {
+  for (size_t stripe = 0; stripe < RANGE_STRIPES; stripe++)
+    pthread_rwlock_init(&rangeLocks[stripe], NULL);
+  if (blockSize)
+    rangeBlockSize = blockSize;
+}
+
+void range_lock(const char *path, off_t offset, size_t size, int exclusive) {
+  uint8_t stripes[RANGE_STRIPES / 8];
+
+  range_stripes(path, offset, size, stripes);
+  for (size_t stripe = 0; stripe < RANGE_STRIPES; stripe++) {
+    if (!(stripes[stripe / 8] & (1 << (stripe % 8))))
+      continue;
+    if (exclusive)
+      pthread_rwlock_wrlock(&rangeLocks[stripe]);
+    else
+      pthread_rwlock_rdlock(&rangeLocks[stripe]);
+  }
+}
+
+void range_unlock(const char *path, off_t offset, size_t size) {
+  uint8_t stripes[RANGE_STRIPES / 8];
+
+  range_stripes(path, offset, size, stripes);
+  for (size_t stripe = 0; stripe < RANGE_STRIPES; stripe++)
+    if (stripes[stripe / 8] & (1 << (stripe % 8)))
+      pthread_rwlock_unlock(&rangeLocks[stripe]);
+}
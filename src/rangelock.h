@@ -0,0 +1,25 @@
+/*
+  Striped per-file range locks for cachefs.
+
+  A read that finds its blocks in the cache only needs them not to
+  change under it; a read that fills blocks from the NAS and a write
+  both change the cached copy and must not interleave with each other,
+  or a fill could copy NAS data from before a write into the cache
+  after it.  Blocks are hashed by (path, block index) onto a fixed set
+  of rwlocks, so requests on different files or different parts of one
+  file rarely meet.
+*/
+
+#ifndef _RANGELOCK_H_
+#define _RANGELOCK_H_
+
+#include <sys/types.h>
+
+void range_lock_init(size_t blockSize);
+
+// lock the blocks covering [offset, offset+size) of path: shared for
+// reading the cached copy, exclusive for changing it
+void range_lock(const char *path, off_t offset, size_t size, int exclusive);
+void range_unlock(const char *path, off_t offset, size_t size);
+
+#endif
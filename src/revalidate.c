@@ -0,0 +1,83 @@
+/*
+  Open-time revalidation state for cachefs.  See revalidate.h.
+
+  A pathTable like the attribute cache's, entries hold the NAS
+  attributes of the last check that passed.
+*/
+#define _GNU_SOURCE // clock_gettime
+#include <stdint.h>
+#include <time.h>
+
+#include "pathtable.h"
+#include "revalidate.h"
+
+#define REVALIDATE_BUCKETS 4096
+#define REVALIDATE_STRIPES 32
+
+struct revalidateEntry {
+  struct pathEntry entry;
+  struct stat nasStat; // NAS attributes at the last passed check
+  uint64_t checked;    // monotonic ms of that check
+};
+
+static struct pathTable revalidateTable;
+static enum revalidateMode revalidateMode = REVALIDATE_CTO;
+static unsigned revalidateInterval = 0;
+
+static uint64_t revalidate_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void revalidate_init(enum revalidateMode mode, unsigned intervalMs, size_t maxEntries) {
+  if (path_table_init(&revalidateTable, REVALIDATE_BUCKETS, REVALIDATE_STRIPES, maxEntries) != 0)
+    return; // every open checks
+  revalidateMode = mode;
+  revalidateInterval = intervalMs;
+}
+
+int revalidate_fresh(const char *path, struct stat *nasStat) {
+  int fresh = 0;
+
+  if (revalidateMode == REVALIDATE_CTO)
+    return 0;
+
+  size_t bucket = path_table_bucket(&revalidateTable, path);
+  uint64_t now = revalidate_now_ms();
+
+  path_table_lock(&revalidateTable, bucket);
+  struct revalidateEntry *entry = (struct revalidateEntry *)*path_table_find(&revalidateTable, bucket, path);
+  if (entry && (revalidateMode == REVALIDATE_TRUST || now - entry->checked < revalidateInterval)) {
+    *nasStat = entry->nasStat;
+    fresh = 1;
+  }
+  path_table_unlock(&revalidateTable, bucket);
+
+  return fresh;
+}
+
+void revalidate_mark(const char *path, const struct stat *nasStat) {
+  if (revalidateMode == REVALIDATE_CTO)
+    return;
+
+  size_t bucket = path_table_bucket(&revalidateTable, path);
+
+  path_table_lock(&revalidateTable, bucket);
+  struct revalidateEntry *entry = (struct revalidateEntry *)*path_table_find(&revalidateTable, bucket, path);
+  if (entry == NULL)
+    entry = (struct revalidateEntry *)path_table_insert(&revalidateTable, bucket, path, sizeof(*entry));
+  if (entry) {
+    entry->nasStat = *nasStat;
+    entry->checked = revalidate_now_ms();
+  }
+  path_table_unlock(&revalidateTable, bucket);
+}
+
+void revalidate_invalidate(const char *path) {
+  path_table_remove(&revalidateTable, path);
+}
+
+void revalidate_invalidate_tree(const char *path) {
+  path_table_remove_tree(&revalidateTable, path);
+}
@@ -0,0 +1,35 @@
+/*
+  Open-time revalidation state for cachefs.
+
+  cfs_open checks the cached copy of a file against the NAS (lstat of
+  both copies plus a metadata lookup).  This module remembers, per
+  path and shared by every handle, when that check last passed and
+  what the NAS said, so repeated opens of the same file can skip it:
+
+    REVALIDATE_CTO       check on every open (close-to-open)
+    REVALIDATE_INTERVAL  check at most every intervalMs
+    REVALIDATE_TRUST     check once, then trust the cache until a local
+                         operation invalidates the file
+*/
+
+#ifndef _REVALIDATE_H_
+#define _REVALIDATE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+enum revalidateMode {REVALIDATE_CTO, REVALIDATE_INTERVAL, REVALIDATE_TRUST};
+
+void revalidate_init(enum revalidateMode mode, unsigned intervalMs, size_t maxEntries);
+
+// 1 = the cached copy of path passed a check recently enough that this
+// open may skip it (nasStat filled with what the NAS said then), 0 = check
+int revalidate_fresh(const char *path, struct stat *nasStat);
+// a full check of path just passed against nasStat
+void revalidate_mark(const char *path, const struct stat *nasStat);
+
+void revalidate_invalidate(const char *path);
+// everything at or below path, for renames of directories
+void revalidate_invalidate_tree(const char *path);
+
+#endif
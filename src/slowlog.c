@@ -0,0 +1,78 @@
+/*
+  Slow-request log.  See slowlog.h.
+
+  Slow requests are rare by definition, so the ring is a plain array
+  under a mutex; the fast path is the threshold compare.
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slowlog.h"
+
+static uint64_t slowThresholdNs = 0;
+static struct slowRequest *slowRing = NULL;
+static size_t slowEntries = 0;
+static size_t slowNext = 0;  // slot the next request goes into
+static size_t slowCount = 0; // slots in use
+static pthread_mutex_t slowLock = PTHREAD_MUTEX_INITIALIZER;
+
+void slow_log_init(unsigned thresholdMs, size_t entries) {
+  if (thresholdMs == 0 || entries == 0)
+    return;
+  slowRing = calloc(entries, sizeof(struct slowRequest));
+  if (slowRing == NULL)
+    return;
+  slowEntries = entries;
+  slowThresholdNs = (uint64_t)thresholdMs * 1000000;
+}
+
+int slow_log_wants(uint64_t ns) {
+  return slowThresholdNs && ns >= slowThresholdNs;
+}
+
+void slow_log_add(const struct slowRequest *request) {
+  pthread_mutex_lock(&slowLock);
+  slowRing[slowNext] = *request;
+  slowNext = (slowNext + 1) % slowEntries;
+  if (slowCount < slowEntries)
+    slowCount++;
+  pthread_mutex_unlock(&slowLock);
+}
+
+void slow_log_clear(void) {
+  pthread_mutex_lock(&slowLock);
+  slowNext = slowCount = 0;
+  pthread_mutex_unlock(&slowLock);
+}
+
+#define SLOW_APPEND(...) \
+  (len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, __VA_ARGS__))
+
+size_t slow_log_format(char *buf, size_t size) {
+  size_t len = 0;
+  char when[32];
+  struct tm tm;
+
+  if (size > 0)
+    buf[0] = '\0';
+  pthread_mutex_lock(&slowLock);
+  for (size_t i = 0; i < slowCount; i++) {
+    const struct slowRequest *request = &slowRing[(slowNext + slowEntries - slowCount + i) % slowEntries];
+    localtime_r(&request->when.tv_sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    SLOW_APPEND("%s.%03ld %s %.6fs path=\"%s\"", when, request->when.tv_nsec / 1000000,
+                latency_op_name(request->op), request->totalNs / 1e9, request->path);
+    if (request->offset >= 0)
+      SLOW_APPEND(" offset=%lld size=%zu", (long long)request->offset, request->size);
+    if (request->blocksHit || request->blocksMissed)
+      SLOW_APPEND(" hit=%zu miss=%zu", request->blocksHit, request->blocksMissed);
+    for (int phase = LAT_TOTAL + 1; phase < LAT_PHASES; phase++)
+      if (request->phaseNs[phase])
+        SLOW_APPEND(" %s=%.6fs", latency_phase_name(phase), request->phaseNs[phase] / 1e9);
+    SLOW_APPEND("\n");
+  }
+  pthread_mutex_unlock(&slowLock);
+  return len;
+}
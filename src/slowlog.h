@@ -0,0 +1,45 @@
+/*
+  Slow-request log for cachefs.
+
+  A request whose total time (see latency.h) reaches the threshold is
+  copied, with its path, range, block hit/miss mix and per-phase times,
+  into a fixed ring of the most recent ones.  Read the ring from
+  /.cachefs/slow; writing anything to that file empties it.
+*/
+
+#ifndef _SLOWLOG_H_
+#define _SLOWLOG_H_
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "latency.h"
+
+struct slowRequest {
+  struct timespec when; // wall clock when the request finished
+  enum latencyOp op;
+  char path[PATH_MAX];
+  off_t offset; // read/write/truncate range, -1 if none
+  size_t size;
+  size_t blocksHit, blocksMissed;
+  uint64_t totalNs;
+  uint64_t phaseNs[LAT_PHASES];
+};
+
+#define SLOW_LOG_ENTRIES 256
+
+// thresholdMs 0 turns the log off
+void slow_log_init(unsigned thresholdMs, size_t entries);
+
+// is a request taking ns slow enough to keep
+int slow_log_wants(uint64_t ns);
+void slow_log_add(const struct slowRequest *request);
+
+void slow_log_clear(void);
+// one line per kept request, oldest first, as snprintf
+size_t slow_log_format(char *buf, size_t size);
+
+#endif
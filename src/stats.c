@@ -0,0 +1,57 @@
+/*
+  Cache statistics.  See stats.h.
+
+  A thread adds to the slot of the CPU it runs on; a thread that
+  migrates between sched_getcpu and the add merely shares a slot for a
+  moment, which the atomic add makes harmless.
+*/
+#define _GNU_SOURCE // sched_getcpu
+#include <sched.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+#define STATS_SLOTS 64
+
+struct statSlot {
+  uint64_t counts[STAT_COUNT];
+} __attribute__((aligned(64)));
+
+static struct statSlot statSlots[STATS_SLOTS];
+
+static const char *statNames[STAT_COUNT] = {
+  "hits", "misses", "partial_hits", "cache_bytes", "nas_bytes",
+  "fills", "evictions", "revalidations", "invalidations", "journal_stranded",
+};
+
+void stats_add(enum statCounter counter, uint64_t amount) {
+  int cpu = sched_getcpu();
+  struct statSlot *slot = &statSlots[cpu < 0 ? 0 : cpu % STATS_SLOTS];
+  __atomic_fetch_add(&slot->counts[counter], amount, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get(enum statCounter counter) {
+  uint64_t total = 0;
+  for (int slot = 0; slot < STATS_SLOTS; slot++)
+    total += __atomic_load_n(&statSlots[slot].counts[counter], __ATOMIC_RELAXED);
+  return total;
+}
+
+const char *stats_name(enum statCounter counter) {
+  return statNames[counter];
+}
+
+void stats_reset(void) {
+  for (int slot = 0; slot < STATS_SLOTS; slot++)
+    for (int counter = 0; counter < STAT_COUNT; counter++)
+      __atomic_store_n(&statSlots[slot].counts[counter], 0, __ATOMIC_RELAXED);
+}
+
+size_t stats_format(char *buf, size_t size) {
+  size_t len = 0;
+  for (int counter = 0; counter < STAT_COUNT; counter++) {
+    len += snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, "%s %llu\n",
+                    statNames[counter], (unsigned long long)stats_get(counter));
+  }
+  return len;
+}
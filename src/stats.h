@@ -0,0 +1,40 @@
+/*
+  Cache statistics for cachefs, read from the /.cachefs/stats virtual
+  file (see virtual.h).
+
+  Counters are kept per CPU so the request path never shares a cache
+  line with another core; readers add the slots up.
+*/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum statCounter {
+  STAT_HITS,          // reads served entirely from the cache
+  STAT_MISSES,        // reads with no block in the cache
+  STAT_PARTIAL_HITS,  // reads with some blocks cached
+  STAT_CACHE_BYTES,   // block bytes read from the cache
+  STAT_NAS_BYTES,     // block bytes read from the NAS
+  STAT_FILLS,         // blocks copied from the NAS into the cache by reads
+  STAT_EVICTIONS,     // cached files dropped by the reclaim, evict and drop control commands
+  STAT_REVALIDATIONS, // opens that checked the cached copy against the NAS
+  STAT_INVALIDATIONS, // cached files dropped as stale or removed, and blocks dropped by writes
+  STAT_JOURNAL_STRANDED, // acknowledged writes the NAS refused, kept in the journal until it takes them
+  STAT_COUNT
+};
+
+void stats_add(enum statCounter counter, uint64_t amount);
+#define stats_inc(counter) stats_add(counter, 1)
+
+uint64_t stats_get(enum statCounter counter);
+const char *stats_name(enum statCounter counter);
+void stats_reset(void);
+
+// "name value\n" for every counter into buf, returns the length written
+// (as snprintf, so possibly more than size)
+size_t stats_format(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+  cachesim: replay a cachefs access trace (--trace) against another
+  cache configuration and report how it would have done.
+
+    cachesim [-c cacheKb] [-b blockBytes] [-p fifo|lru]
+             [-w allocate|no-allocate|if-cached] trace
+
+  The cache size defaults to unlimited and the block size to the one
+  the trace was recorded with.  -p picks the eviction order: fifo
+  evicts the block filled or written longest ago, which is the order
+  the metadata database keeps (write_blks stamps a block, reads do
+  not); lru also moves a block up on every read hit.  -w is the
+  daemon's --write-policy.  The report is one "name value" line per
+  figure.  See ../traceformat.h for the trace layout.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "traceformat.h"
+
+#define SIM_BUCKETS (1 << 20)
+
+enum policy { POLICY_FIFO, POLICY_LRU };
+enum writePolicy { WRITE_ALLOCATE, WRITE_NO_ALLOCATE, WRITE_ALLOCATE_IF_CACHED };
+
+struct block {
+  uint64_t file;
+  uint64_t index;
+  struct block *hashNext;
+  struct block *prev, *next; // eviction order, newest first
+};
+
+static struct block *buckets[SIM_BUCKETS];
+static struct block *newest = NULL, *oldest = NULL;
+static uint64_t cached = 0, capacity = UINT64_MAX;
+
+struct report {
+  uint64_t reads, readHits, readPartials, readMisses;
+  uint64_t readBlocks, blockHits, nasReadBytes;
+  uint64_t writes, writeBytes;
+  uint64_t fills, evictions;
+  uint64_t recordedReadHits; // by the mount that recorded the trace
+};
+
+static size_t block_hash(uint64_t file, uint64_t index) {
+  uint64_t hash = file ^ (index * 0x9e3779b97f4a7c15ULL);
+  return (hash ^ (hash >> 29)) % SIM_BUCKETS;
+}
+
+static struct block *block_find(uint64_t file, uint64_t index) {
+  struct block *entry = buckets[block_hash(file, index)];
+  while (entry && (entry->file != file || entry->index != index))
+    entry = entry->hashNext;
+  return entry;
+}
+
+static void order_remove(struct block *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    newest = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    oldest = entry->prev;
+}
+
+static void order_push(struct block *entry) {
+  entry->prev = NULL;
+  entry->next = newest;
+  if (newest)
+    newest->prev = entry;
+  newest = entry;
+  if (oldest == NULL)
+    oldest = entry;
+}
+
+static void block_drop(struct block *entry) {
+  for (struct block **link = &buckets[block_hash(entry->file, entry->index)]; *link; link = &(*link)->hashNext)
+    if (*link == entry) {
+      *link = entry->hashNext;
+      break;
+    }
+  order_remove(entry);
+  free(entry);
+  cached--;
+}
+
+static void block_touch(struct block *entry) {
+  order_remove(entry);
+  order_push(entry);
+}
+
+static void block_insert(uint64_t file, uint64_t index, struct report *report) {
+  if (capacity == 0)
+    return;
+  while (cached >= capacity) {
+    block_drop(oldest);
+    report->evictions++;
+  }
+  struct block *entry = malloc(sizeof(*entry));
+  if (entry == NULL) {
+    perror("cachesim");
+    exit(EXIT_FAILURE);
+  }
+  entry->file = file;
+  entry->index = index;
+  size_t bucket = block_hash(file, index);
+  entry->hashNext = buckets[bucket];
+  buckets[bucket] = entry;
+  order_push(entry);
+  cached++;
+}
+
+static void replay_read(const struct traceRecord *record, uint64_t blockSize, enum policy policy,
+                        struct report *report) {
+  uint64_t first = record->offset / blockSize;
+  uint64_t last = (record->offset + (record->size ? record->size : 1) - 1) / blockSize;
+  uint64_t hits = 0;
+
+  for (uint64_t index = first; index <= last; index++) {
+    struct block *entry = block_find(record->file, index);
+    if (entry) {
+      hits++;
+      if (policy == POLICY_LRU)
+        block_touch(entry);
+    } else {
+      report->nasReadBytes += blockSize;
+      report->fills++;
+      block_insert(record->file, index, report);
+    }
+  }
+  report->reads++;
+  report->readBlocks += last - first + 1;
+  report->blockHits += hits;
+  if (hits == last - first + 1)
+    report->readHits++;
+  else if (hits)
+    report->readPartials++;
+  else
+    report->readMisses++;
+  if (record->result == TRACE_HIT)
+    report->recordedReadHits++;
+}
+
+static void replay_write(const struct traceRecord *record, uint64_t blockSize, enum writePolicy writePolicy,
+                         struct report *report) {
+  report->writes++;
+  report->writeBytes += record->size;
+  if (record->size == 0)
+    return;
+  uint64_t first = record->offset / blockSize;
+  uint64_t last = (record->offset + record->size - 1) / blockSize;
+
+  for (uint64_t index = first; index <= last; index++) {
+    struct block *entry = block_find(record->file, index);
+    if (writePolicy == WRITE_NO_ALLOCATE) {
+      if (entry)
+        block_drop(entry);
+    } else if (entry) {
+      block_touch(entry); // write_blks restamps a block it rewrites
+    } else if (writePolicy == WRITE_ALLOCATE) {
+      block_insert(record->file, index, report);
+    }
+  }
+}
+
+// the daemon writes records in per-thread batches: replay them by time
+static int record_order(const void *a, const void *b) {
+  uint64_t x = ((const struct traceRecord *)a)->nsec, y = ((const struct traceRecord *)b)->nsec;
+  return x < y ? -1 : x > y;
+}
+
+static double ratio(uint64_t part, uint64_t whole) {
+  return whole ? (double)part / whole : 0;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: cachesim [-c cacheKb] [-b blockBytes] [-p fifo|lru] "
+                  "[-w allocate|no-allocate|if-cached] trace\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  enum policy policy = POLICY_FIFO;
+  enum writePolicy writePolicy = WRITE_ALLOCATE;
+  uint64_t cacheKb = 0, blockSize = 0;
+  struct traceHeader header;
+  struct traceRecord record, *records = NULL;
+  size_t recordCount = 0, recordSlots = 0;
+  struct report report;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:b:p:w:")) != -1) {
+    if (opt == 'c') {
+      cacheKb = strtoull(optarg, NULL, 10);
+    } else if (opt == 'b') {
+      blockSize = strtoull(optarg, NULL, 10);
+      if (blockSize == 0)
+        usage();
+    } else if (opt == 'p') {
+      if (strcmp(optarg, "fifo") == 0)
+        policy = POLICY_FIFO;
+      else if (strcmp(optarg, "lru") == 0)
+        policy = POLICY_LRU;
+      else
+        usage();
+    } else if (opt == 'w') {
+      if (strcmp(optarg, "allocate") == 0)
+        writePolicy = WRITE_ALLOCATE;
+      else if (strcmp(optarg, "no-allocate") == 0)
+        writePolicy = WRITE_NO_ALLOCATE;
+      else if (strcmp(optarg, "if-cached") == 0)
+        writePolicy = WRITE_ALLOCATE_IF_CACHED;
+      else
+        usage();
+    } else {
+      usage();
+    }
+  }
+  if (optind != argc - 1)
+    usage();
+
+  FILE *in = fopen(argv[optind], "r");
+  if (in == NULL) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "cachesim: not a cachefs trace\n");
+    return EXIT_FAILURE;
+  }
+  if (blockSize == 0)
+    blockSize = header.blockSize ? header.blockSize : 4096;
+  if (cacheKb)
+    capacity = cacheKb * 1024 / blockSize;
+
+  while (fread(&record, sizeof(record), 1, in) == 1) {
+    if (recordCount == recordSlots) {
+      recordSlots = recordSlots ? recordSlots * 2 : 65536;
+      struct traceRecord *grown = realloc(records, recordSlots * sizeof(*records));
+      if (grown == NULL) {
+        fprintf(stderr, "cachesim: out of memory\n");
+        return EXIT_FAILURE;
+      }
+      records = grown;
+    }
+    records[recordCount++] = record;
+  }
+  fclose(in);
+  qsort(records, recordCount, sizeof(*records), record_order);
+
+  memset(&report, 0, sizeof(report));
+  uint64_t firstNsec = recordCount ? records[0].nsec : 0;
+  uint64_t lastNsec = recordCount ? records[recordCount - 1].nsec : 0;
+  for (size_t i = 0; i < recordCount; i++) {
+    if (records[i].op == TRACE_READ)
+      replay_read(&records[i], blockSize, policy, &report);
+    else if (records[i].op == TRACE_WRITE)
+      replay_write(&records[i], blockSize, writePolicy, &report);
+  }
+  free(records);
+
+  printf("cache_kb %llu\n", (unsigned long long)cacheKb);
+  printf("block_size %llu\n", (unsigned long long)blockSize);
+  printf("policy %s\n", policy == POLICY_LRU ? "lru" : "fifo");
+  printf("write_policy %s\n", writePolicy == WRITE_ALLOCATE ? "allocate"
+                              : writePolicy == WRITE_NO_ALLOCATE ? "no-allocate" : "if-cached");
+  printf("trace_seconds %.3f\n", (lastNsec - firstNsec) / 1e9);
+  printf("reads %llu\n", (unsigned long long)report.reads);
+  printf("read_hits %llu\n", (unsigned long long)report.readHits);
+  printf("read_partial_hits %llu\n", (unsigned long long)report.readPartials);
+  printf("read_misses %llu\n", (unsigned long long)report.readMisses);
+  printf("read_hit_ratio %.4f\n", ratio(report.readHits, report.reads));
+  printf("block_hit_ratio %.4f\n", ratio(report.blockHits, report.readBlocks));
+  printf("recorded_read_hit_ratio %.4f\n", ratio(report.recordedReadHits, report.reads));
+  printf("nas_read_bytes %llu\n", (unsigned long long)report.nasReadBytes);
+  printf("writes %llu\n", (unsigned long long)report.writes);
+  printf("nas_write_bytes %llu\n", (unsigned long long)report.writeBytes);
+  printf("fills %llu\n", (unsigned long long)report.fills);
+  printf("evictions %llu\n", (unsigned long long)report.evictions);
+  printf("cached_blocks %llu\n", (unsigned long long)cached);
+  return EXIT_SUCCESS;
+}
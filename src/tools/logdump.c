@@ -0,0 +1,219 @@
+/*
+  logdump: print a binary cachefs.log as text.
+
+    logdump [-l error|info|debug|trace] [-v] [cachefs.log]
+
+  -l drops messages above the given level, -v prefixes each message
+  with its time, thread id and level.  Reads standard input without a
+  file name.  Messages come out grouped by thread as the writer drained
+  them; the -v timestamps give the order between threads.  See
+  ../logformat.h for the layout.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logformat.h"
+
+static const char *levelNames[] = {"error", "info", "debug", "trace"};
+
+struct format {
+  uint64_t id;
+  char *text;
+  struct format *next;
+};
+
+#define FORMAT_BUCKETS 4096
+static struct format *formats[FORMAT_BUCKETS];
+
+static const char *find_format(uint64_t id) {
+  for (struct format *f = formats[id % FORMAT_BUCKETS]; f; f = f->next)
+    if (f->id == id)
+      return f->text;
+  return NULL;
+}
+
+static int read_exact(FILE *in, void *buf, size_t size) {
+  return fread(buf, 1, size, in) == size ? 0 : -1;
+}
+
+// take size bytes of arguments, NULL if the record is short
+static const char *take(const char **args, const char *end, size_t size) {
+  const char *at = *args;
+  if (at + size > end)
+    return NULL;
+  *args = at + size;
+  return at;
+}
+
+// print format with the arguments encoded by log.c's log_encode
+static void print_message(const char *format, const char *args, const char *end) {
+  char spec[64];
+
+  for (const char *f = format; *f; f++) {
+    if (*f != '%') {
+      putchar(*f);
+      continue;
+    }
+
+    size_t len = 0;
+    const char *at;
+    int64_t value;
+    spec[len++] = *f++;
+    while (*f && strchr("-+ #0'", *f) && len < 32)
+      spec[len++] = *f++;
+    for (int part = 0; part < 2; part++) {
+      if (part == 1) {
+        if (*f != '.')
+          break;
+        spec[len++] = *f++;
+      }
+      if (*f == '*') {
+        if ((at = take(&args, end, sizeof(value))) == NULL)
+          return;
+        memcpy(&value, at, sizeof(value));
+        len += snprintf(spec + len, 24, "%d", (int)value);
+        f++;
+      }
+      while (*f >= '0' && *f <= '9' && len < 48)
+        spec[len++] = *f++;
+    }
+    while (*f && strchr("hlLqjzt", *f))
+      f++; // the values below carry their own width
+
+    char conversion = *f;
+    if (conversion == '\0')
+      return;
+    switch (conversion) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+      if ((at = take(&args, end, sizeof(value))) == NULL)
+        return;
+      memcpy(&value, at, sizeof(value));
+      spec[len++] = 'l';
+      spec[len++] = 'l';
+      spec[len++] = conversion;
+      spec[len] = '\0';
+      printf(spec, (long long)value);
+      break;
+    case 'c': case 'p':
+      if ((at = take(&args, end, sizeof(value))) == NULL)
+        return;
+      memcpy(&value, at, sizeof(value));
+      spec[len++] = conversion;
+      spec[len] = '\0';
+      if (conversion == 'c')
+        printf(spec, (int)value);
+      else
+        printf(spec, (void *)(uintptr_t)value);
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+      double real;
+      if ((at = take(&args, end, sizeof(real))) == NULL)
+        return;
+      memcpy(&real, at, sizeof(real));
+      spec[len++] = conversion;
+      spec[len] = '\0';
+      printf(spec, real);
+      break;
+    }
+    case 's': {
+      uint16_t strLen;
+      if ((at = take(&args, end, sizeof(strLen))) == NULL)
+        return;
+      memcpy(&strLen, at, sizeof(strLen));
+      if ((at = take(&args, end, strLen)) == NULL)
+        return;
+      char *str = strndup(at, strLen);
+      spec[len++] = 's';
+      spec[len] = '\0';
+      printf(spec, str);
+      free(str);
+      break;
+    }
+    case 'n':
+      break;
+    default: // %%
+      putchar(conversion);
+      break;
+    }
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: logdump [-l error|info|debug|trace] [-v] [cachefs.log]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  int maxLevel = 3, verbose = 0, opt;
+  FILE *in = stdin;
+
+  while ((opt = getopt(argc, argv, "l:v")) != -1) {
+    if (opt == 'l') {
+      for (maxLevel = 0; maxLevel < 4 && strcmp(optarg, levelNames[maxLevel]) != 0; maxLevel++)
+        ;
+      if (maxLevel == 4)
+        usage();
+    } else if (opt == 'v') {
+      verbose = 1;
+    } else {
+      usage();
+    }
+  }
+  if (optind < argc && (in = fopen(argv[optind], "r")) == NULL) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  char magic[sizeof(LOG_FILE_MAGIC) - 1];
+  if (read_exact(in, magic, sizeof(magic)) < 0 || memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "logdump: not a cachefs binary log\n");
+    return EXIT_FAILURE;
+  }
+
+  char record[LOG_RECORD_MAX];
+  int type;
+  while ((type = fgetc(in)) != EOF) {
+    if (type == LOG_FILE_FORMAT) {
+      uint64_t id;
+      uint16_t len;
+      if (read_exact(in, &id, sizeof(id)) < 0 || read_exact(in, &len, sizeof(len)) < 0)
+        break;
+      struct format *f = malloc(sizeof(*f));
+      f->id = id;
+      f->text = calloc(1, len + 1);
+      if (read_exact(in, f->text, len) < 0)
+        break;
+      f->next = formats[id % FORMAT_BUCKETS];
+      formats[id % FORMAT_BUCKETS] = f;
+    } else if (type == LOG_FILE_MESSAGE) {
+      struct logRecord *header = (struct logRecord *)record;
+      if (read_exact(in, header, sizeof(*header)) < 0 || header->size < sizeof(*header) ||
+          read_exact(in, record + sizeof(*header), header->size - sizeof(*header)) < 0)
+        break;
+      if (header->level > maxLevel)
+        continue;
+      const char *format = find_format(header->format);
+      if (format == NULL) {
+        fprintf(stderr, "logdump: message with an undefined format\n");
+        continue;
+      }
+      if (verbose) {
+        time_t sec = header->nsec / 1000000000;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+        printf("[%s.%06lu %u %s] ", when, (unsigned long)(header->nsec % 1000000000 / 1000), header->tid,
+               header->level < 4 ? levelNames[header->level] : "?");
+      }
+      print_message(format, record + sizeof(*header), record + header->size);
+    } else {
+      fprintf(stderr, "logdump: corrupt record\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,463 @@
+/*
+  logreplay: re-issue the opens, reads, writes and releases recorded in
+  a text cachefs log against a mounted cachefs, and report throughput
+  and latency.
+
+    logreplay [-t threads] [-s speed | -f] mountdir [cachefs.log]
+
+  The log is the text that log_msg writes: the historical text logs, or
+  a binary log turned back into text with logdump (use logdump -v, its
+  timestamps are what the original timing comes from).  Reads standard
+  input without a file name.
+
+  Every file is replayed by one thread (chosen by hashing its path), so
+  the requests on a file keep their order while different files run
+  concurrently.  With timestamps each request waits for its original
+  time, scaled by -s (2 = twice as fast); -f, or a log without
+  timestamps, replays as fast as possible.  Writes carry a fixed byte
+  pattern.  The report is one "name value" line per figure.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPLAY_MAX_THREADS 256
+#define REPLAY_SUB_BITS 4
+#define REPLAY_SUB (1 << REPLAY_SUB_BITS)
+#define REPLAY_BUCKETS (64 * REPLAY_SUB)
+#define REPLAY_PATHS 64 // open files per thread before the table grows
+
+enum replayOp { OP_OPEN, OP_READ, OP_WRITE, OP_RELEASE, OP_COUNT };
+
+static const char *opNames[OP_COUNT] = {"open", "read", "write", "release"};
+
+struct event {
+  enum replayOp op;
+  char *path;
+  int flags;       // open
+  size_t size;     // read, write
+  off_t offset;    // read, write
+  uint64_t nsec;   // from the logdump -v prefix, 0 if none
+  size_t line;     // position in the log
+};
+
+struct histogram {
+  uint64_t count, sumNs, maxNs;
+  uint64_t buckets[REPLAY_BUCKETS];
+};
+
+struct openFile {
+  char *path;
+  int fd;
+  int refs;
+};
+
+struct worker {
+  pthread_t thread;
+  struct event **events;
+  size_t count, capacity;
+  struct openFile *files;
+  size_t fileCount, fileCapacity;
+  struct histogram latency[OP_COUNT];
+  uint64_t bytes[OP_COUNT];
+  uint64_t errors;
+};
+
+static struct worker workers[REPLAY_MAX_THREADS];
+static int threadCount = 8;
+static double speed = 1;
+static int timed = 1;
+static const char *mountDir;
+static uint64_t firstNsec = 0;
+static uint64_t startNs;
+static char *pattern;
+static size_t patternSize = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// the same log-linear buckets as ../latency.c
+static size_t bucket_of(uint64_t ns) {
+  if (ns < REPLAY_SUB)
+    return ns;
+  int exponent = 63 - __builtin_clzll(ns);
+  return (exponent - REPLAY_SUB_BITS + 1) * REPLAY_SUB + ((ns >> (exponent - REPLAY_SUB_BITS)) & (REPLAY_SUB - 1));
+}
+
+static uint64_t bucket_limit(size_t bucket) {
+  if (bucket < REPLAY_SUB)
+    return bucket;
+  int exponent = bucket / REPLAY_SUB + REPLAY_SUB_BITS - 1;
+  uint64_t width = 1ULL << (exponent - REPLAY_SUB_BITS);
+  return ((REPLAY_SUB + bucket % REPLAY_SUB) << (exponent - REPLAY_SUB_BITS)) + width - 1;
+}
+
+static void histogram_add(struct histogram *histogram, uint64_t ns) {
+  histogram->count++;
+  histogram->sumNs += ns;
+  if (ns > histogram->maxNs)
+    histogram->maxNs = ns;
+  histogram->buckets[bucket_of(ns)]++;
+}
+
+static uint64_t histogram_quantile(const struct histogram *histogram, double q) {
+  uint64_t rank = (uint64_t)(q * histogram->count), seen = 0;
+  if (rank >= histogram->count)
+    rank = histogram->count - 1;
+  for (size_t bucket = 0; bucket < REPLAY_BUCKETS; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen > rank)
+      return bucket_limit(bucket) < histogram->maxNs ? bucket_limit(bucket) : histogram->maxNs;
+  }
+  return histogram->maxNs;
+}
+
+static size_t path_hash(const char *path) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (; *path; path++) {
+    hash ^= (unsigned char)*path;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void *grow(void *array, size_t *capacity, size_t size) {
+  *capacity = *capacity ? *capacity * 2 : REPLAY_PATHS;
+  array = realloc(array, *capacity * size);
+  if (array == NULL) {
+    perror("logreplay");
+    exit(EXIT_FAILURE);
+  }
+  return array;
+}
+
+/*-------------------Parsing-------------------*/
+
+// "[2019-11-24 10:00:00.123456 1234 debug] " from logdump -v
+static int parse_prefix(const char *line, uint64_t *nsec) {
+  struct tm tm;
+  unsigned long usec;
+
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_isdst = -1;
+  if (sscanf(line, "[%d-%d-%d %d:%d:%d.%lu", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+             &tm.tm_sec, &usec) != 7)
+    return -1;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  *nsec = (uint64_t)mktime(&tm) * 1000000000 + usec * 1000;
+  return 0;
+}
+
+// the quoted path after path=, NULL if there is none
+static char *parse_path(const char *line) {
+  const char *start = strstr(line, "path=\"");
+  if (start == NULL)
+    return NULL;
+  start += strlen("path=\"");
+  const char *end = strstr(start, "\", ");
+  if (end == NULL)
+    end = strstr(start, "\")");
+  if (end == NULL)
+    return NULL;
+  return strndup(start, end - start);
+}
+
+static int parse_number(const char *line, const char *name, unsigned long long *value) {
+  const char *at = strstr(line, name);
+  if (at == NULL)
+    return -1;
+  *value = strtoull(at + strlen(name), NULL, 10);
+  return 0;
+}
+
+static void queue_event(struct event *event) {
+  struct worker *worker = &workers[path_hash(event->path) % threadCount];
+  if (worker->count == worker->capacity)
+    worker->events = grow(worker->events, &worker->capacity, sizeof(struct event *));
+  worker->events[worker->count++] = event;
+  if (firstNsec == 0 || (event->nsec && event->nsec < firstNsec))
+    firstNsec = event->nsec;
+}
+
+static size_t parse_log(FILE *in) {
+  char line[8192];
+  uint64_t nsec = 0;
+  struct event *pendingOpen = NULL; // its flags come on the next line
+  size_t events = 0;
+
+  while (fgets(line, sizeof(line), in)) {
+    char *text = line;
+    if (line[0] == '[' && parse_prefix(line, &nsec) == 0) {
+      text = strstr(line, "] ");
+      text = text ? text + 2 : line;
+    }
+    if (pendingOpen && strncmp(text, ", flags= ", 9) == 0) {
+      pendingOpen->flags = atoi(text + 9);
+      pendingOpen = NULL;
+      continue;
+    }
+    pendingOpen = NULL;
+
+    enum replayOp op;
+    if (strncmp(text, "cfs_open(path=", 14) == 0)
+      op = OP_OPEN;
+    else if (strncmp(text, "cfs_read original(", 18) == 0)
+      op = OP_READ;
+    else if (strncmp(text, "cfs_write original(", 19) == 0)
+      op = OP_WRITE;
+    else if (strncmp(text, "cfs_release(", 12) == 0)
+      op = OP_RELEASE;
+    else
+      continue;
+
+    struct event *event = calloc(1, sizeof(*event));
+    unsigned long long size = 0, offset = 0;
+    event->op = op;
+    event->nsec = nsec;
+    event->line = events;
+    event->path = parse_path(text);
+    if (event->path == NULL ||
+        ((op == OP_READ || op == OP_WRITE) &&
+         (parse_number(text, "size=", &size) < 0 || parse_number(text, "offset=", &offset) < 0))) {
+      free(event->path);
+      free(event);
+      continue;
+    }
+    event->size = size;
+    event->offset = offset;
+    if (size > patternSize)
+      patternSize = size;
+    if (op == OP_OPEN)
+      pendingOpen = event;
+    queue_event(event);
+    events++;
+  }
+  return events;
+}
+
+// logdump prints each thread's messages in a batch, so a thread's queue
+// is put back into time order (log order between equal times)
+static int event_order(const void *a, const void *b) {
+  const struct event *left = *(const struct event **)a, *right = *(const struct event **)b;
+  if (left->nsec != right->nsec)
+    return left->nsec < right->nsec ? -1 : 1;
+  return left->line < right->line ? -1 : left->line > right->line;
+}
+
+/*-------------------Replay-------------------*/
+
+static struct openFile *find_file(struct worker *worker, const char *path) {
+  for (size_t i = 0; i < worker->fileCount; i++)
+    if (strcmp(worker->files[i].path, path) == 0)
+      return &worker->files[i];
+  return NULL;
+}
+
+static int open_path(const char *path, int flags) {
+  char fullPath[PATH_MAX];
+  snprintf(fullPath, sizeof(fullPath), "%s%s", mountDir, path);
+  // cachefs itself turns write-only opens into read-write ones
+  int accmode = (flags & O_ACCMODE) == O_RDONLY ? O_RDONLY : O_RDWR;
+  int fd = open(fullPath, accmode | (flags & O_APPEND));
+  if (fd < 0 && errno == ENOENT && accmode != O_RDONLY)
+    fd = open(fullPath, accmode | O_CREAT, 0644); // created through mknod, which we do not replay
+  return fd;
+}
+
+// the descriptor a read or write on path goes to, opened on the fly when
+// the log starts in the middle of its file's life
+static int file_fd(struct worker *worker, const struct event *event) {
+  struct openFile *file = find_file(worker, event->path);
+  if (file)
+    return file->fd;
+  int fd = open_path(event->path, event->op == OP_WRITE ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (worker->fileCount == worker->fileCapacity)
+    worker->files = grow(worker->files, &worker->fileCapacity, sizeof(struct openFile));
+  file = &worker->files[worker->fileCount++];
+  file->path = event->path;
+  file->fd = fd;
+  file->refs = 1;
+  return fd;
+}
+
+static void replay_event(struct worker *worker, const struct event *event) {
+  struct openFile *file;
+  ssize_t done = 0;
+  int fd;
+
+  uint64_t begin = now_ns();
+  switch (event->op) {
+  case OP_OPEN:
+    if ((file = find_file(worker, event->path))) {
+      file->refs++; // one descriptor per path is enough to keep the request order
+      break;
+    }
+    fd = open_path(event->path, event->flags);
+    if (fd < 0) {
+      done = -1;
+      break;
+    }
+    if (worker->fileCount == worker->fileCapacity)
+      worker->files = grow(worker->files, &worker->fileCapacity, sizeof(struct openFile));
+    file = &worker->files[worker->fileCount++];
+    file->path = event->path;
+    file->fd = fd;
+    file->refs = 1;
+    break;
+  case OP_READ:
+  case OP_WRITE: {
+    char *buf = event->op == OP_READ ? malloc(event->size + 1) : pattern;
+    fd = file_fd(worker, event);
+    begin = now_ns();
+    if (fd < 0 || buf == NULL)
+      done = -1;
+    else if (event->op == OP_READ)
+      done = pread(fd, buf, event->size, event->offset);
+    else
+      done = pwrite(fd, buf, event->size, event->offset);
+    if (event->op == OP_READ)
+      free(buf);
+    if (done > 0)
+      worker->bytes[event->op] += done;
+    break;
+  }
+  case OP_RELEASE:
+    if ((file = find_file(worker, event->path)) == NULL || --file->refs > 0)
+      break;
+    done = close(file->fd);
+    *file = worker->files[--worker->fileCount];
+    break;
+  default:
+    break;
+  }
+  if (done < 0)
+    worker->errors++;
+  else
+    histogram_add(&worker->latency[event->op], now_ns() - begin);
+}
+
+static void *replay_thread(void *arg) {
+  struct worker *worker = arg;
+
+  for (size_t i = 0; i < worker->count; i++) {
+    const struct event *event = worker->events[i];
+    if (timed && event->nsec) {
+      uint64_t due = startNs + (uint64_t)((event->nsec - firstNsec) / speed);
+      uint64_t now = now_ns();
+      if (due > now) {
+        struct timespec wait = {(due - now) / 1000000000, (due - now) % 1000000000};
+        nanosleep(&wait, NULL);
+      }
+    }
+    replay_event(worker, event);
+  }
+  for (size_t i = 0; i < worker->fileCount; i++)
+    close(worker->files[i].fd);
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: logreplay [-t threads] [-s speed | -f] mountdir [cachefs.log]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  FILE *in = stdin;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:s:f")) != -1) {
+    if (opt == 't') {
+      threadCount = atoi(optarg);
+      if (threadCount < 1 || threadCount > REPLAY_MAX_THREADS)
+        usage();
+    } else if (opt == 's') {
+      speed = atof(optarg);
+      if (speed <= 0)
+        usage();
+    } else if (opt == 'f') {
+      timed = 0;
+    } else {
+      usage();
+    }
+  }
+  if (optind >= argc || argc - optind > 2)
+    usage();
+  mountDir = argv[optind];
+  if (argc - optind == 2 && (in = fopen(argv[optind + 1], "r")) == NULL) {
+    perror(argv[optind + 1]);
+    return EXIT_FAILURE;
+  }
+
+  size_t events = parse_log(in);
+  if (in != stdin)
+    fclose(in);
+  for (int i = 0; i < threadCount; i++)
+    qsort(workers[i].events, workers[i].count, sizeof(struct event *), event_order);
+  if ((pattern = malloc(patternSize + 1)) == NULL) {
+    perror("logreplay");
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < patternSize; i++)
+    pattern[i] = 'a' + i % 26;
+
+  startNs = now_ns();
+  for (int i = 0; i < threadCount; i++)
+    pthread_create(&workers[i].thread, NULL, replay_thread, &workers[i]);
+  for (int i = 0; i < threadCount; i++)
+    pthread_join(workers[i].thread, NULL);
+  double seconds = (now_ns() - startNs) / 1e9;
+
+  // merge the threads' figures into the first one
+  struct worker *total = &workers[0];
+  for (int i = 1; i < threadCount; i++) {
+    for (int op = 0; op < OP_COUNT; op++) {
+      struct histogram *from = &workers[i].latency[op], *to = &total->latency[op];
+      to->count += from->count;
+      to->sumNs += from->sumNs;
+      if (from->maxNs > to->maxNs)
+        to->maxNs = from->maxNs;
+      for (size_t bucket = 0; bucket < REPLAY_BUCKETS; bucket++)
+        to->buckets[bucket] += from->buckets[bucket];
+      total->bytes[op] += workers[i].bytes[op];
+    }
+    total->errors += workers[i].errors;
+  }
+
+  uint64_t ops = 0;
+  for (int op = 0; op < OP_COUNT; op++)
+    ops += total->latency[op].count;
+  printf("events %zu\n", events);
+  printf("threads %d\n", threadCount);
+  printf("timing %s\n", timed && firstNsec ? "original" : "fast");
+  printf("seconds %.3f\n", seconds);
+  printf("ops_per_second %.1f\n", ops / seconds);
+  printf("read_mb_per_second %.2f\n", total->bytes[OP_READ] / seconds / (1024 * 1024));
+  printf("write_mb_per_second %.2f\n", total->bytes[OP_WRITE] / seconds / (1024 * 1024));
+  printf("errors %llu\n", (unsigned long long)total->errors);
+  for (int op = 0; op < OP_COUNT; op++) {
+    const struct histogram *histogram = &total->latency[op];
+    printf("%s_count %llu\n", opNames[op], (unsigned long long)histogram->count);
+    if (histogram->count == 0)
+      continue;
+    printf("%s_mean_us %.1f\n", opNames[op], histogram->sumNs / 1e3 / histogram->count);
+    printf("%s_p50_us %.1f\n", opNames[op], histogram_quantile(histogram, 0.5) / 1e3);
+    printf("%s_p90_us %.1f\n", opNames[op], histogram_quantile(histogram, 0.9) / 1e3);
+    printf("%s_p99_us %.1f\n", opNames[op], histogram_quantile(histogram, 0.99) / 1e3);
+    printf("%s_p999_us %.1f\n", opNames[op], histogram_quantile(histogram, 0.999) / 1e3);
+    printf("%s_max_us %.1f\n", opNames[op], histogram->maxNs / 1e3);
+  }
+  return total->errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,329 @@
+/*
+  metabench: measure the metadata database calls cachefs makes, in
+  operations per second, against databases of growing size.
+
+    metabench [-n blocks,...] [-t threads,...] [-o ops] [-s seconds]
+              [-f blocksPerFile] [-b blockBytes] [-d dir]
+
+  For every size in -n (default 10000,1000000,10000000) a fresh
+  database is made in dir (default the current directory, where the
+  daemon keeps its own) and filled with synthetic files of -f blocks
+  (default 1024).  Then, for every thread count in -t (default 1,4),
+  each call is timed over -o operations (default 10000) shared by the
+  threads, or for -s seconds (default 10) if that comes first, each
+  thread on its own pooled connection as FUSE workers are:
+
+    create_file          a new, empty file
+    write_blks           one new block appended to the thread's file
+    are_blocks_in_cache  one cached block of a random file
+    update_blk_time      one cached block of a random file
+    evict_blocks         the 64 oldest blocks (-o / 100 calls)
+    delete_file          one of the files create_file made
+
+  The database stays the -n size from one call to the next.  The
+  report is one row per call, size and thread count, with a "#" header
+  naming the columns; ops is what got done in the time, errors counts
+  calls that returned failure.
+  meta.c's own chatter on standard output is discarded.
+*/
+#define _GNU_SOURCE // rand_r
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metadata/meta.h"
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_THREADS 256
+#define BENCH_EVICT_BLOCKS 64 // blocks per evict_blocks call, a small eviction batch
+
+enum benchOp { OP_CREATE, OP_WRITE, OP_LOOKUP, OP_TOUCH, OP_EVICT, OP_DELETE, OP_COUNT };
+
+static const char *opNames[OP_COUNT] = {
+  "create_file", "write_blks", "are_blocks_in_cache", "update_blk_time", "evict_blocks", "delete_file",
+};
+
+struct worker {
+  pthread_t thread;
+  unsigned id;
+  unsigned seed;
+  enum benchOp op;
+  size_t ops;
+  size_t done;
+  size_t errors;
+};
+
+static size_t blockBytes = 4096;
+static size_t blocksPerFile = 1024;
+static size_t opsPerRun = 10000;
+static double secondsPerRun = 10;
+
+static size_t fileCount;  // populated files, named /bench/f<n>
+static size_t blockCount; // populated blocks
+static unsigned benchRound; // names files apart between thread counts
+static size_t created[BENCH_MAX_THREADS]; // files each thread made this round
+static double deadline;
+static pthread_barrier_t startLine;
+
+static double now_sec(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// fill db with blockCount blocks in files of blocksPerFile, in one transaction
+static int populate(sqlite3 *db) {
+  sqlite3_stmt *fileStmt, *blockStmt;
+  char name[64];
+  int ret = SQLITE_OK;
+
+  if (begin_transaction(db) < 0)
+    return -1;
+  sqlite3_prepare_v2(db, "INSERT INTO Files(file_id, relative_path, remote_size, local_size)"
+                         " VALUES (?1, ?2, ?3, ?3);", -1, &fileStmt, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO Datablocks(blk_start_offset, file_id) VALUES (?1, ?2);",
+                     -1, &blockStmt, NULL);
+  for (size_t f = 0; f < fileCount && ret == SQLITE_OK; f++) {
+    size_t blocks = blockCount - f * blocksPerFile;
+    if (blocks > blocksPerFile)
+      blocks = blocksPerFile;
+    snprintf(name, sizeof(name), "/bench/f%zu", f);
+    sqlite3_bind_int64(fileStmt, 1, f + 1);
+    sqlite3_bind_text(fileStmt, 2, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(fileStmt, 3, blocks * blockBytes);
+    if ((ret = sqlite3_step(fileStmt)) == SQLITE_DONE)
+      ret = sqlite3_reset(fileStmt);
+    for (size_t b = 0; b < blocks && ret == SQLITE_OK; b++) {
+      sqlite3_bind_int64(blockStmt, 1, b * blockBytes);
+      sqlite3_bind_int64(blockStmt, 2, f + 1);
+      if ((ret = sqlite3_step(blockStmt)) == SQLITE_DONE)
+        ret = sqlite3_reset(blockStmt);
+    }
+  }
+  if (ret != SQLITE_OK)
+    fprintf(stderr, "metabench: populate: %s\n", sqlite3_errmsg(db));
+  sqlite3_finalize(fileStmt);
+  sqlite3_finalize(blockStmt);
+  if (commit_transaction(db) < 0 || ret != SQLITE_OK)
+    return -1;
+  return 0;
+}
+
+// a cached block: file name and offset
+static void random_block(struct worker *w, char *name, size_t nameSize, size_t *offset) {
+  size_t f = rand_r(&w->seed) % fileCount;
+  size_t blocks = blockCount - f * blocksPerFile;
+  if (blocks > blocksPerFile)
+    blocks = blocksPerFile;
+  snprintf(name, nameSize, "/bench/f%zu", f);
+  *offset = (rand_r(&w->seed) % blocks) * blockBytes;
+}
+
+static int run_op(sqlite3 *db, struct worker *w, size_t i) {
+  char name[64];
+  size_t offset;
+  int found;
+
+  switch (w->op) {
+  case OP_CREATE:
+    snprintf(name, sizeof(name), "/bench/c%u-%u-%zu", benchRound, w->id, i);
+    created[w->id] = i + 1;
+    return create_file(db, name, 0);
+  case OP_WRITE:
+    snprintf(name, sizeof(name), "/bench/w%u", w->id);
+    offset = i * blockBytes;
+    return write_blks(db, name, 1, &offset);
+  case OP_LOOKUP:
+    random_block(w, name, sizeof(name), &offset);
+    are_blocks_in_cache(db, name, 1, &offset, &found);
+    return found ? 0 : -1;
+  case OP_TOUCH:
+    random_block(w, name, sizeof(name), &offset);
+    return update_blk_time(db, name, offset);
+  case OP_EVICT: {
+    char *filenames[BENCH_EVICT_BLOCKS] = {NULL};
+    int fileIds[BENCH_EVICT_BLOCKS];
+    size_t offsets[BENCH_EVICT_BLOCKS];
+    int ret = evict_blocks(db, BENCH_EVICT_BLOCKS, fileIds, filenames, offsets) < 0 ? -1 : 0;
+    for (int b = 0; b < BENCH_EVICT_BLOCKS; b++)
+      free(filenames[b]);
+    return ret;
+  }
+  case OP_DELETE:
+    snprintf(name, sizeof(name), "/bench/c%u-%u-%zu", benchRound, w->id, i);
+    return delete_file(db, name);
+  default:
+    return -1;
+  }
+}
+
+static void *bench_thread(void *arg) {
+  struct worker *w = arg;
+  sqlite3 *db = get_thread_db(); // opened before the clock starts
+
+  pthread_barrier_wait(&startLine); // ready
+  pthread_barrier_wait(&startLine); // deadline set
+  for (w->done = 0; w->done < w->ops && now_sec() < deadline; w->done++)
+    if (run_op(db, w, w->done) != 0)
+      w->errors++;
+  pthread_barrier_wait(&startLine);
+  return NULL;
+}
+
+// time op on threads workers; prints its report row
+static void bench_op(FILE *out, enum benchOp op, unsigned threads) {
+  static struct worker workers[BENCH_MAX_THREADS];
+  size_t ops = op == OP_EVICT ? opsPerRun / 100 : opsPerRun;
+  size_t done = 0, errors = 0;
+
+  if (ops < threads)
+    ops = threads;
+  pthread_barrier_init(&startLine, NULL, threads + 1);
+  for (unsigned t = 0; t < threads; t++) {
+    workers[t] = (struct worker){.id = t, .seed = t + 1, .op = op, .ops = ops / threads};
+    if (op == OP_DELETE && workers[t].ops > created[t])
+      workers[t].ops = created[t];
+    pthread_create(&workers[t].thread, NULL, bench_thread, &workers[t]);
+  }
+  pthread_barrier_wait(&startLine);
+  double start = now_sec();
+  deadline = start + secondsPerRun;
+  pthread_barrier_wait(&startLine);
+  pthread_barrier_wait(&startLine);
+  double seconds = now_sec() - start;
+  for (unsigned t = 0; t < threads; t++) {
+    pthread_join(workers[t].thread, NULL);
+    done += workers[t].done;
+    errors += workers[t].errors;
+  }
+  pthread_barrier_destroy(&startLine);
+
+  fprintf(out, "%s %zu %u %zu %.3f %.0f %zu\n", opNames[op], blockCount, threads, done, seconds,
+          seconds > 0 ? done / seconds : 0, errors);
+  fflush(out);
+}
+
+// the per-thread files write_blks appends to, made before and dropped after its run
+static void write_files(sqlite3 *db, unsigned threads, int create) {
+  char name[64];
+
+  for (unsigned t = 0; t < threads; t++) {
+    snprintf(name, sizeof(name), "/bench/w%u", t);
+    if (create)
+      create_file(db, name, 0);
+    else
+      delete_file(db, name);
+  }
+}
+
+static int parse_list(char *arg, size_t *values, int max) {
+  int n = 0;
+
+  for (char *item = strtok(arg, ","); item; item = strtok(NULL, ",")) {
+    if (n == max || (values[n] = strtoull(item, NULL, 10)) == 0)
+      return -1;
+    n++;
+  }
+  return n;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: metabench [-n blocks,...] [-t threads,...] [-o ops] [-s seconds] "
+                  "[-f blocksPerFile] [-b blockBytes] [-d dir]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  size_t sizes[BENCH_MAX_SIZES] = {10000, 1000000, 10000000};
+  size_t threadCounts[BENCH_MAX_SIZES] = {1, 4};
+  int sizeCount = 3, threadCountCount = 2;
+  const char *dir = ".";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:t:o:s:f:b:d:")) != -1) {
+    if (opt == 'n') {
+      if ((sizeCount = parse_list(optarg, sizes, BENCH_MAX_SIZES)) <= 0)
+        usage();
+    } else if (opt == 't') {
+      if ((threadCountCount = parse_list(optarg, threadCounts, BENCH_MAX_SIZES)) <= 0)
+        usage();
+      for (int i = 0; i < threadCountCount; i++)
+        if (threadCounts[i] > BENCH_MAX_THREADS)
+          usage();
+    } else if (opt == 'o') {
+      if ((opsPerRun = strtoull(optarg, NULL, 10)) == 0)
+        usage();
+    } else if (opt == 's') {
+      if ((secondsPerRun = atof(optarg)) <= 0)
+        usage();
+    } else if (opt == 'f') {
+      if ((blocksPerFile = strtoull(optarg, NULL, 10)) == 0)
+        usage();
+    } else if (opt == 'b') {
+      if ((blockBytes = strtoull(optarg, NULL, 10)) == 0)
+        usage();
+    } else if (opt == 'd') {
+      dir = optarg;
+    } else {
+      usage();
+    }
+  }
+  if (optind != argc)
+    usage();
+
+  // the report keeps standard output; meta.c's printfs go to /dev/null
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+    perror("metabench");
+    return EXIT_FAILURE;
+  }
+  fprintf(out, "# api blocks threads ops seconds ops_per_sec errors\n");
+
+  set_block_size(blockBytes);
+  for (int s = 0; s < sizeCount; s++) {
+    char path[4096], wal[4200], shm[4200];
+    sqlite3 *db;
+
+    snprintf(path, sizeof(path), "%s/metabench-%d.db", dir, (int)getpid());
+    snprintf(wal, sizeof(wal), "%s-wal", path);
+    snprintf(shm, sizeof(shm), "%s-shm", path);
+    unlink(path);
+    open_db(path, &db);
+    if (create_tables(db) < 0 || init_db_pool(path, db) < 0)
+      return EXIT_FAILURE;
+
+    blockCount = sizes[s];
+    fileCount = (blockCount + blocksPerFile - 1) / blocksPerFile;
+    fprintf(stderr, "metabench: %zu blocks in %zu files\n", blockCount, fileCount);
+    double start = now_sec();
+    if (populate(db) < 0)
+      return EXIT_FAILURE;
+    fprintf(stderr, "metabench: populated in %.1fs\n", now_sec() - start);
+
+    for (int t = 0; t < threadCountCount; t++) {
+      unsigned threads = threadCounts[t];
+
+      benchRound = t;
+
+      bench_op(out, OP_CREATE, threads);
+      write_files(db, threads, 1);
+      bench_op(out, OP_WRITE, threads);
+      write_files(db, threads, 0);
+      bench_op(out, OP_LOOKUP, threads);
+      bench_op(out, OP_TOUCH, threads);
+      bench_op(out, OP_EVICT, threads);
+      bench_op(out, OP_DELETE, threads);
+    }
+
+    sqlite3_close(db);
+    unlink(path);
+    unlink(wal);
+    unlink(shm);
+  }
+  fclose(out);
+  return EXIT_SUCCESS;
+}
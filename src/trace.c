@@ -0,0 +1,161 @@
+/*
+  Access trace recorder.  See trace.h.
+
+  Every thread that records owns a buffer, so a request only takes its
+  own thread's mutex (which trace_close is the only other user of).  A
+  full buffer is written out under the file mutex: a record is 32
+  bytes, so that is one write(2) per 256 requests of a thread.  The
+  file therefore holds per-thread batches, each in time order;
+  cachesim sorts them back by time.  A crash loses at most the last
+  batch of every thread.  Buffers of exited threads are written out
+  and reused, as log.c does with its rings.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pathtable.h"
+#include "trace.h"
+#include "traceformat.h"
+
+#define TRACE_THREAD_RECORDS 256
+
+struct traceThread {
+  pthread_mutex_t lock; // the owning thread's, and trace_close's
+  size_t used;
+  int inUse;
+  struct traceThread *next;
+  struct traceRecord records[TRACE_THREAD_RECORDS];
+};
+
+static int traceFd = -1;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // the file; taken after a thread's lock
+static struct traceThread *traceThreads = NULL; // push-only
+static __thread struct traceThread *traceSelf = NULL;
+static pthread_key_t traceKey;
+static pthread_once_t traceKeyOnce = PTHREAD_ONCE_INIT;
+
+static int trace_write_all(const void *buf, size_t size) {
+  const char *at = buf;
+  while (size > 0) {
+    ssize_t written = write(traceFd, at, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    at += written;
+    size -= written;
+  }
+  return 0;
+}
+
+// with thread->lock held: write the thread's batch to the file
+static void trace_flush(struct traceThread *thread) {
+  pthread_mutex_lock(&traceLock);
+  if (traceFd >= 0 && thread->used > 0 &&
+      trace_write_all(thread->records, thread->used * sizeof(struct traceRecord)) < 0) {
+    close(traceFd); // full disk: stop recording rather than leave a torn trace
+    traceFd = -1;
+  }
+  pthread_mutex_unlock(&traceLock);
+  thread->used = 0;
+}
+
+static void trace_thread_exit(void *arg) {
+  struct traceThread *thread = arg;
+
+  pthread_mutex_lock(&thread->lock);
+  trace_flush(thread);
+  pthread_mutex_unlock(&thread->lock);
+  __atomic_store_n(&thread->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_make_key(void) {
+  pthread_key_create(&traceKey, trace_thread_exit);
+}
+
+// first record from this thread: take a free buffer or add one
+static struct traceThread *trace_register(void) {
+  struct traceThread *thread;
+
+  pthread_once(&traceKeyOnce, trace_make_key);
+  for (thread = __atomic_load_n(&traceThreads, __ATOMIC_ACQUIRE); thread; thread = thread->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&thread->inUse, &free, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+  if (thread == NULL) {
+    thread = calloc(1, sizeof(*thread));
+    if (thread == NULL)
+      return NULL;
+    pthread_mutex_init(&thread->lock, NULL);
+    thread->inUse = 1;
+    thread->next = __atomic_load_n(&traceThreads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&traceThreads, &thread->next, thread, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  pthread_setspecific(traceKey, thread);
+  traceSelf = thread;
+  return thread;
+}
+
+int trace_open(const char *path, size_t blockSize) {
+  struct traceHeader header;
+
+  traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (traceFd < 0)
+    return -errno;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+  header.blockSize = blockSize;
+  int retstat = trace_write_all(&header, sizeof(header));
+  if (retstat < 0) {
+    close(traceFd);
+    traceFd = -1;
+  }
+  return retstat;
+}
+
+void trace_close(void) {
+  for (struct traceThread *thread = __atomic_load_n(&traceThreads, __ATOMIC_ACQUIRE); thread; thread = thread->next) {
+    pthread_mutex_lock(&thread->lock);
+    trace_flush(thread);
+    pthread_mutex_unlock(&thread->lock);
+  }
+  pthread_mutex_lock(&traceLock);
+  if (traceFd >= 0)
+    close(traceFd);
+  traceFd = -1;
+  pthread_mutex_unlock(&traceLock);
+}
+
+void trace_access(const char *path, int op, off_t offset, size_t size, int result) {
+  struct traceRecord record;
+  struct timespec now;
+
+  if (traceFd < 0)
+    return;
+  clock_gettime(CLOCK_REALTIME, &now);
+  memset(&record, 0, sizeof(record));
+  record.nsec = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  record.file = path_hash(path);
+  record.offset = offset;
+  record.size = size;
+  record.op = op;
+  record.result = result;
+
+  struct traceThread *thread = traceSelf ? traceSelf : trace_register();
+  if (thread == NULL)
+    return;
+  pthread_mutex_lock(&thread->lock);
+  thread->records[thread->used++] = record;
+  if (thread->used == TRACE_THREAD_RECORDS)
+    trace_flush(thread);
+  pthread_mutex_unlock(&thread->lock);
+}
@@ -0,0 +1,22 @@
+/*
+  Access trace recorder for cachefs (--trace=file).
+
+  Every read and write is appended to the trace file in the compact
+  binary form of traceformat.h.  tools/cachesim replays a trace against
+  other cache sizes, block sizes and policies.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// start recording to path; 0 or -errno
+int trace_open(const char *path, size_t blockSize);
+void trace_close(void);
+
+// op and result are the TRACE_ constants of traceformat.h
+void trace_access(const char *path, int op, off_t offset, size_t size, int result);
+
+#endif
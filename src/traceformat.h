@@ -0,0 +1,43 @@
+/*
+  Access trace layout, shared by trace.c and tools/cachesim.c.
+
+  A trace file is a struct traceHeader followed by one struct
+  traceRecord per cfs_read and cfs_write.  Records come in per-thread
+  batches; sorted by nsec they are in the order the requests finished.
+  Ranges are in bytes, as the application asked for them, so a trace
+  can be replayed with a different block size.  All values are in host
+  byte order.
+*/
+
+#ifndef _TRACEFORMAT_H_
+#define _TRACEFORMAT_H_
+
+#include <stdint.h>
+
+#define TRACE_FILE_MAGIC "CFSTRC01"
+
+#define TRACE_READ 1
+#define TRACE_WRITE 2
+
+// how a recorded read was served
+#define TRACE_MISS 0
+#define TRACE_PARTIAL 1
+#define TRACE_HIT 2
+
+struct traceHeader {
+  char magic[8];
+  uint32_t blockSize; // of the mount that recorded it
+  uint32_t pad;
+};
+
+struct traceRecord {
+  uint64_t nsec;   // CLOCK_REALTIME when the request finished
+  uint64_t file;   // FNV-1a hash of the path below the mount
+  uint64_t offset;
+  uint32_t size;
+  uint8_t op;      // TRACE_READ or TRACE_WRITE
+  uint8_t result;  // reads: TRACE_MISS, TRACE_PARTIAL or TRACE_HIT
+  uint16_t pad;
+};
+
+#endif
@@ -0,0 +1,168 @@
+/*
+  Virtual files under /.cachefs.  See virtual.h.
+
+  The table is filled in by main before fuse starts and read-only
+  afterwards, so lookups take no lock.  An open handle holds the
+  contents rendered at open time; reads are served from that snapshot
+  and the file is opened direct_io, so neither the size reported by
+  getattr nor the kernel page cache gets in the way.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "virtual.h"
+
+#define VIRTUAL_MAX_FILES 16
+// inode numbers well clear of anything a NAS hands out for its root
+#define VIRTUAL_INO_BASE 0xcfcf000000000000ULL
+
+struct virtualFile {
+  const char *name;
+  virtualRender render;
+  virtualStore store;
+};
+
+struct virtualHandle {
+  const struct virtualFile *file;
+  char *data;
+  size_t size;
+};
+
+static struct virtualFile virtualFiles[VIRTUAL_MAX_FILES];
+static int virtualCount = 0;
+
+void virtual_register(const char *name, virtualRender render, virtualStore store) {
+  if (virtualCount == VIRTUAL_MAX_FILES)
+    return;
+  virtualFiles[virtualCount].name = name;
+  virtualFiles[virtualCount].render = render;
+  virtualFiles[virtualCount].store = store;
+  virtualCount++;
+}
+
+int virtual_path(const char *path) {
+  size_t len = strlen(VIRTUAL_DIR);
+  return strncmp(path, VIRTUAL_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// NULL for the directory itself, or if there is no such file
+static const struct virtualFile *virtual_find(const char *path) {
+  const char *name = path + strlen(VIRTUAL_DIR);
+  if (*name++ != '/')
+    return NULL;
+  for (int i = 0; i < virtualCount; i++)
+    if (strcmp(virtualFiles[i].name, name) == 0)
+      return &virtualFiles[i];
+  return NULL;
+}
+
+static int virtual_is_dir(const char *path) {
+  return path[strlen(VIRTUAL_DIR)] == '\0';
+}
+
+int virtual_getattr(const char *path, struct stat *statbuf) {
+  const struct virtualFile *file = virtual_find(path);
+
+  memset(statbuf, 0, sizeof(*statbuf));
+  statbuf->st_uid = getuid();
+  statbuf->st_gid = getgid();
+  statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+  statbuf->st_blksize = 4096;
+
+  if (virtual_is_dir(path)) {
+    statbuf->st_mode = S_IFDIR | 0555;
+    statbuf->st_nlink = 2;
+    statbuf->st_ino = VIRTUAL_INO_BASE;
+    return 0;
+  }
+  if (file == NULL)
+    return -ENOENT;
+
+  char *data = NULL;
+  size_t size = 0;
+  if (file->render(&data, &size) == 0)
+    free(data);
+  statbuf->st_mode = S_IFREG | (file->store ? 0644 : 0444);
+  statbuf->st_nlink = 1;
+  statbuf->st_size = size;
+  statbuf->st_ino = VIRTUAL_INO_BASE + 1 + (file - virtualFiles);
+  return 0;
+}
+
+int virtual_access(const char *path, int mask) {
+  const struct virtualFile *file = virtual_find(path);
+
+  if (!virtual_is_dir(path) && file == NULL)
+    return -ENOENT;
+  if ((mask & W_OK) && (virtual_is_dir(path) || file->store == NULL))
+    return -EACCES;
+  return 0;
+}
+
+int virtual_open(const char *path, struct fuse_file_info *fi) {
+  const struct virtualFile *file = virtual_find(path);
+  struct virtualHandle *handle;
+
+  if (file == NULL)
+    return virtual_is_dir(path) ? -EISDIR : -ENOENT;
+  if ((fi->flags & O_ACCMODE) != O_RDONLY && file->store == NULL)
+    return -EACCES;
+
+  handle = calloc(1, sizeof(*handle));
+  if (handle == NULL)
+    return -ENOMEM;
+  handle->file = file;
+  if ((fi->flags & O_ACCMODE) != O_WRONLY) {
+    int retstat = file->render(&handle->data, &handle->size);
+    if (retstat < 0) {
+      free(handle);
+      return retstat;
+    }
+  }
+  fi->direct_io = 1;
+  fi->fh = (uintptr_t)handle;
+  return 0;
+}
+
+int virtual_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  struct virtualHandle *handle = (struct virtualHandle *)(uintptr_t)fi->fh;
+
+  if (offset >= handle->size)
+    return 0;
+  if (size > handle->size - offset)
+    size = handle->size - offset;
+  memcpy(buf, handle->data + offset, size);
+  return size;
+}
+
+int virtual_write(const char *buf, size_t size, struct fuse_file_info *fi) {
+  struct virtualHandle *handle = (struct virtualHandle *)(uintptr_t)fi->fh;
+  return handle->file->store(buf, size);
+}
+
+int virtual_release(struct fuse_file_info *fi) {
+  struct virtualHandle *handle = (struct virtualHandle *)(uintptr_t)fi->fh;
+  free(handle->data);
+  free(handle);
+  return 0;
+}
+
+int virtual_opendir(const char *path, struct fuse_file_info *fi) {
+  if (!virtual_is_dir(path))
+    return virtual_find(path) ? -ENOTDIR : -ENOENT;
+  fi->fh = 0;
+  return 0;
+}
+
+int virtual_readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  for (int i = 0; i < virtualCount; i++)
+    if (filler(buf, virtualFiles[i].name, NULL, 0) != 0)
+      return -ENOMEM;
+  return 0;
+}
@@ -0,0 +1,45 @@
+/*
+  Virtual files under the hidden /.cachefs directory of the mount.
+
+  They never touch the NAS: a file's contents are rendered by its
+  module when it is opened (and for getattr, to report a size), and
+  each write() to it is handed to the module as one command.  The
+  directory does not show up in listings of the root.
+
+  cachefs.c routes any path for which virtual_path() is true here
+  before doing anything else.
+*/
+
+#ifndef _VIRTUAL_H_
+#define _VIRTUAL_H_
+
+#include "params.h"
+
+#include <fuse.h>
+#include <sys/stat.h>
+
+#define VIRTUAL_DIR "/.cachefs"
+
+// fill *data (malloced, freed by the caller) and *size with the current
+// contents; 0 or -errno
+typedef int (*virtualRender)(char **data, size_t *size);
+// act on one write; returns the bytes consumed or -errno
+typedef int (*virtualStore)(const char *data, size_t size);
+
+// before the mount: name is a file directly under VIRTUAL_DIR,
+// store may be NULL for a read-only file
+void virtual_register(const char *name, virtualRender render, virtualStore store);
+
+// 1 = path is VIRTUAL_DIR or below it
+int virtual_path(const char *path);
+
+int virtual_getattr(const char *path, struct stat *statbuf);
+int virtual_access(const char *path, int mask);
+int virtual_open(const char *path, struct fuse_file_info *fi);
+int virtual_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int virtual_write(const char *buf, size_t size, struct fuse_file_info *fi);
+int virtual_release(struct fuse_file_info *fi);
+int virtual_opendir(const char *path, struct fuse_file_info *fi);
+int virtual_readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+
+#endif
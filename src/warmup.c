@@ -0,0 +1,358 @@
+/*
+  Cache warm-up for cachefs.  See warmup.h for the overview.
+
+  Nothing in here may use log_msg or CFS_DATA: an offline warm-up runs
+  before (instead of) fuse_main.  The range lock, block index, fd cache
+  and revalidation calls are what keep a live mount's readers coherent
+  with the worker filling the same file; offline they cost nothing.
+*/
+#define _GNU_SOURCE // pread, pwrite, clock_nanosleep
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blockindex.h"
+#include "fdcache.h"
+#include "gather.h"
+#include "metadata/meta.h"
+#include "nasemu.h"
+#include "openfile.h"
+#include "rangelock.h"
+#include "revalidate.h"
+#include "warmup.h"
+
+#define WARMUP_YIELD_NS (2*1000*1000) // poll interval while foreground reads miss
+
+struct warmupItem {
+  char *path;
+  struct stat statbuf; // NAS attributes
+  struct warmupItem *next;
+};
+
+struct warmupRun {
+  const struct warmupConfig *config;
+  size_t chunk;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct warmupItem *queue; // LIFO: depth first keeps the queue short
+  unsigned busy;            // workers holding an item
+  int error;                // first error, -ENOSPC stops everyone
+  uint64_t nextSlot;        // bandwidth cap: when the next chunk may start
+  uint64_t totalBytes;
+  struct warmupResult result;
+};
+
+static int foregroundReads = 0;
+
+void warmup_foreground_begin(void) {
+  __atomic_add_fetch(&foregroundReads, 1, __ATOMIC_RELAXED);
+}
+
+void warmup_foreground_end(void) {
+  __atomic_sub_fetch(&foregroundReads, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t warmup_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int warmup_stopped(struct warmupRun *run) {
+  if (run->config->stopping && run->config->stopping())
+    return 1;
+  return __atomic_load_n(&run->error, __ATOMIC_RELAXED) == -ENOSPC;
+}
+
+static void warmup_fail(struct warmupRun *run, int error) {
+  pthread_mutex_lock(&run->lock);
+  if (run->error == 0 || error == -ENOSPC)
+    run->error = error;
+  run->result.errors++;
+  pthread_cond_broadcast(&run->cond);
+  pthread_mutex_unlock(&run->lock);
+}
+
+// caller holds run->lock
+static void warmup_push(struct warmupRun *run, const char *path, const struct stat *statbuf) {
+  struct warmupItem *item = malloc(sizeof(*item));
+  if (item == NULL || (item->path = strdup(path)) == NULL) {
+    free(item);
+    run->error = run->error ? run->error : -ENOMEM;
+    run->result.errors++;
+    return;
+  }
+  item->statbuf = *statbuf;
+  item->next = run->queue;
+  run->queue = item;
+  if (S_ISREG(statbuf->st_mode)) {
+    run->result.files++;
+    run->totalBytes += statbuf->st_size;
+  }
+  pthread_cond_signal(&run->cond);
+}
+
+static void warmup_report(struct warmupRun *run, uint64_t fetched, uint64_t cached) {
+  pthread_mutex_lock(&run->lock);
+  run->result.fetchedBytes += fetched;
+  run->result.cachedBytes += cached;
+  uint64_t done = run->result.fetchedBytes + run->result.cachedBytes;
+  uint64_t total = run->totalBytes;
+  pthread_mutex_unlock(&run->lock);
+
+  if (run->config->progress)
+    run->config->progress(run->config->arg, done, total);
+}
+
+// stay out of the way of reads someone is waiting for
+static void warmup_yield(struct warmupRun *run) {
+  struct timespec pause = {0, WARMUP_YIELD_NS};
+
+  while (__atomic_load_n(&foregroundReads, __ATOMIC_RELAXED) > 0 && !warmup_stopped(run))
+    nanosleep(&pause, NULL);
+}
+
+// pace chunks so the workers together stay under the bandwidth cap
+static void warmup_throttle(struct warmupRun *run, size_t bytes) {
+  if (run->config->bandwidth == 0)
+    return;
+
+  pthread_mutex_lock(&run->lock);
+  uint64_t now = warmup_now();
+  uint64_t start = run->nextSlot > now ? run->nextSlot : now;
+  run->nextSlot = start + bytes * 1000000000ULL / run->config->bandwidth;
+  pthread_mutex_unlock(&run->lock);
+
+  struct timespec wake = {start / 1000000000ULL, start % 1000000000ULL};
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+    ;
+}
+
+static void warmup_dir(struct warmupRun *run, const char *path) {
+  char nasPath[PATH_MAX], child[PATH_MAX], childNas[PATH_MAX];
+  struct stat statbuf;
+
+  snprintf(nasPath, PATH_MAX, "%s%s", run->config->nasdir, path);
+  nas_emu_begin(NAS_LIST);
+  DIR *dir = opendir(nasPath);
+  nas_emu_end(NAS_LIST, 0);
+  if (dir == NULL) {
+    warmup_fail(run, -errno);
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL && !warmup_stopped(run)) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if (snprintf(child, PATH_MAX, "%s/%s", strcmp(path, "/") == 0 ? "" : path, de->d_name) >= PATH_MAX ||
+        snprintf(childNas, PATH_MAX, "%s%s", run->config->nasdir, child) >= PATH_MAX)
+      continue;
+    if (NAS_EMU(NAS_META, lstat(childNas, &statbuf)) < 0 || !(S_ISREG(statbuf.st_mode) || S_ISDIR(statbuf.st_mode)))
+      continue;
+    pthread_mutex_lock(&run->lock);
+    warmup_push(run, child, &statbuf);
+    pthread_mutex_unlock(&run->lock);
+  }
+  closedir(dir);
+}
+
+// the cached copy predates the NAS file: start over, as cfs_open would
+static void warmup_drop(const char *path, const char *name, const char *cachePath) {
+  revalidate_invalidate(path);
+  fd_cache_invalidate(cachePath);
+  block_index_drop(name);
+  delete_file(get_thread_db(), (char *)name);
+  unlink(cachePath);
+}
+
+static int warmup_file(struct warmupRun *run, const char *path, const struct stat *nasStat, char *buf) {
+  const struct warmupConfig *config = run->config;
+  char name[PATH_MAX], cachePath[PATH_MAX], nasPath[PATH_MAX];
+  size_t blocks = run->chunk / config->blockSize;
+  size_t offsets[blocks];
+  int hits[blocks];
+  struct stat cacheStat;
+  int retstat = 0;
+  int nasFD = -1;
+
+  config->cache_name(name, path);
+  snprintf(cachePath, PATH_MAX, "%s%s", config->cachedir, name);
+  snprintf(nasPath, PATH_MAX, "%s%s", config->nasdir, path);
+  gather_flush_path(path); // staged writes have to be on the NAS before we copy it
+
+  sqlite3 *db = get_thread_db();
+  struct openFile *openFile = open_file_lock(name); // against cfs_open and the control commands, see openfile.h
+  if (openFile == NULL)
+    return -ENOMEM;
+  int present = is_file_in_cache(db, name);
+  if (present && (stat(cachePath, &cacheStat) < 0 ||
+                  (cacheStat.st_mtime < nasStat->st_mtime && get_nas_mtime(db, name) < nasStat->st_mtime))) {
+    if (open_file_busy(openFile)) { // handles are still writing to the old copy
+      open_file_unlock(openFile);
+      return -EBUSY;
+    }
+    warmup_drop(path, name, cachePath);
+    present = 0;
+  }
+  if (!present) {
+    block_index_drop(name);
+    create_file(db, name, nasStat->st_size);
+  }
+  int cacheFD = open(cachePath, O_RDWR | O_CREAT, nasStat->st_mode & 07777);
+  if (cacheFD < 0) {
+    retstat = -errno;
+    open_file_unlock(openFile);
+    return retstat;
+  }
+  open_file_get(openFile); // we write to it like a handle would
+  open_file_unlock(openFile);
+
+  for (off_t offset = 0; offset < nasStat->st_size && !warmup_stopped(run); offset += run->chunk) {
+    size_t want = nasStat->st_size - offset < run->chunk ? nasStat->st_size - offset : run->chunk;
+    size_t count = (want + config->blockSize - 1) / config->blockSize;
+    size_t size = count * config->blockSize;
+    for (size_t i = 0; i < count; i++)
+      offsets[i] = offset + i * config->blockSize;
+
+    // an earlier run (or a reader) got here first
+    if (present && are_blocks_in_cache(db, name, count, offsets, hits) == 1) {
+      warmup_report(run, 0, want);
+      continue;
+    }
+    if (get_cache_used_size() + size > config->cacheBytes) {
+      retstat = -ENOSPC;
+      break;
+    }
+    warmup_yield(run);
+    warmup_throttle(run, size);
+    if (nasFD < 0 && (nasFD = NAS_EMU(NAS_OPEN, open(nasPath, O_RDONLY))) < 0) {
+      retstat = -errno;
+      break;
+    }
+
+    range_lock(path, offset, size, 1);
+    size_t got = 0;
+    while (got < want) {
+      ssize_t ret = NAS_EMU(NAS_READ, pread(nasFD, buf + got, want - got, offset + got));
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        break;
+      got += ret;
+    }
+    memset(buf + got, 0, size - got); // past EOF reads as zeroes, see cfs_fillEdgeBlock
+    if (got < want || pwrite(cacheFD, buf, size, offset) != (ssize_t)size) {
+      range_unlock(path, offset, size);
+      retstat = -EIO;
+      break;
+    }
+    begin_transaction(db);
+    write_blks(db, name, count, offsets);
+    commit_transaction(db);
+    block_index_add(name, offset, size);
+    range_unlock(path, offset, size);
+    warmup_report(run, got, 0);
+  }
+
+  if (nasFD >= 0)
+    close(nasFD);
+  close(cacheFD);
+  open_file_put(openFile);
+  return retstat;
+}
+
+static void *warmup_worker(void *arg) {
+  struct warmupRun *run = arg;
+  char *buf = malloc(run->chunk);
+
+  if (buf == NULL) {
+    warmup_fail(run, -ENOMEM);
+    return NULL;
+  }
+  pthread_mutex_lock(&run->lock);
+  for (;;) {
+    while (run->queue == NULL && run->busy > 0 && !warmup_stopped(run))
+      pthread_cond_wait(&run->cond, &run->lock);
+    if (run->queue == NULL || warmup_stopped(run))
+      break;
+    struct warmupItem *item = run->queue;
+    run->queue = item->next;
+    run->busy++;
+    pthread_mutex_unlock(&run->lock);
+
+    if (S_ISDIR(item->statbuf.st_mode)) {
+      warmup_dir(run, item->path);
+    } else {
+      int retstat = warmup_file(run, item->path, &item->statbuf, buf);
+      if (retstat < 0)
+        warmup_fail(run, retstat);
+    }
+    free(item->path);
+    free(item);
+
+    pthread_mutex_lock(&run->lock);
+    run->busy--;
+    if (run->queue == NULL && run->busy == 0)
+      pthread_cond_broadcast(&run->cond);
+  }
+  pthread_cond_broadcast(&run->cond); // wake the others to stop too
+  pthread_mutex_unlock(&run->lock);
+  free(buf);
+  return NULL;
+}
+
+int warmup_run(const char *root, const struct warmupConfig *config, struct warmupResult *result) {
+  struct warmupRun run;
+  char nasPath[PATH_MAX];
+  struct stat statbuf;
+
+  memset(&run, 0, sizeof(run));
+  memset(result, 0, sizeof(*result));
+  if (config->blockSize == 0 || root[0] != '/')
+    return -EINVAL;
+  run.config = config;
+  run.chunk = WARMUP_CHUNK / config->blockSize * config->blockSize;
+  if (run.chunk == 0)
+    run.chunk = config->blockSize;
+  pthread_mutex_init(&run.lock, NULL);
+  pthread_cond_init(&run.cond, NULL);
+
+  if (snprintf(nasPath, PATH_MAX, "%s%s", config->nasdir, root) >= PATH_MAX)
+    return -ENAMETOOLONG;
+  if (lstat(nasPath, &statbuf) < 0)
+    return -errno;
+  if (!(S_ISREG(statbuf.st_mode) || S_ISDIR(statbuf.st_mode)))
+    return -EINVAL;
+  warmup_push(&run, root, &statbuf);
+
+  unsigned threads = config->threads ? config->threads : 1;
+  pthread_t workers[threads];
+  unsigned started = 0;
+  while (started < threads && pthread_create(&workers[started], NULL, warmup_worker, &run) == 0)
+    started++;
+  if (started == 0)
+    warmup_worker(&run);
+  for (unsigned i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  while (run.queue) { // left behind by a stop
+    struct warmupItem *item = run.queue;
+    run.queue = item->next;
+    free(item->path);
+    free(item);
+  }
+  pthread_cond_destroy(&run.cond);
+  pthread_mutex_destroy(&run.lock);
+
+  *result = run.result;
+  if (run.error == 0 && config->stopping && config->stopping())
+    return -EINTR;
+  return run.error;
+}
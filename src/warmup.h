@@ -0,0 +1,58 @@
+/*
+  Cache warm-up for cachefs: pulls a NAS subtree into the cache before
+  a job needs it.
+
+  A pool of workers shares one queue of paths.  Directories are listed
+  and their entries queued; regular files are fetched WARMUP_CHUNK at a
+  time, each chunk written to the cache file and its blocks recorded in
+  a single metadata transaction.  Workers back off while foreground
+  reads are missing (warmup_foreground_begin/end), share an optional
+  bandwidth cap, and skip chunks that are already cached, so a run that
+  was interrupted picks up where it stopped.
+
+  The same engine runs against an unmounted cache directory (cachefs
+  --warmup=path) and as the "warmup" control command on a live mount.
+*/
+
+#ifndef _WARMUP_H_
+#define _WARMUP_H_
+
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define WARMUP_CHUNK (1024*1024) // rounded down to whole blocks
+
+struct warmupConfig {
+  const char *nasdir;
+  const char *cachedir;
+  size_t blockSize;
+  uint64_t cacheBytes; // cache capacity, the warm-up stops short of it
+  unsigned threads;
+  uint64_t bandwidth; // NAS bytes per second over all workers, 0 = unlimited
+  // cache file name of a path below the mount
+  void (*cache_name)(char name[PATH_MAX], const char *path);
+  // NULL: never stop early
+  int (*stopping)(void);
+  // bytes fetched or found cached so far, and bytes found so far; may be NULL
+  void (*progress)(void *arg, uint64_t done, uint64_t total);
+  void *arg;
+};
+
+struct warmupResult {
+  uint64_t files;        // regular files found
+  uint64_t fetchedBytes; // read from the NAS into the cache
+  uint64_t cachedBytes;  // already cached when the warm-up got to them
+  uint64_t errors;       // files or directories that could not be warmed
+};
+
+// warm root (a file or directory, relative to the mount).  Returns 0,
+// -ENOSPC once the cache is full, -EINTR if stopped, or the first
+// error met on a file.
+int warmup_run(const char *root, const struct warmupConfig *config, struct warmupResult *result);
+
+// a foreground read is going to the NAS; workers wait until it is done
+void warmup_foreground_begin(void);
+void warmup_foreground_end(void);
+
+#endif